@@ -0,0 +1,151 @@
+#include "benchmark.h"
+#include "scene.h"
+#include "camera.h"
+#include "render.h"
+#include "loader.h"
+#include "util.h"
+
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+
+namespace
+{
+
+struct Backend
+{
+	const char* name;
+	Renderer* (*create)(const Scene* scene);
+};
+
+// same defaults as the viewer
+void SetDefaults(Camera& camera, Options& options)
+{
+	options.width = 512;
+	options.height = 256;
+	options.filter = Filter(eFilterGaussian, 0.75f, 1.0f);
+	options.mode = ePathTrace;
+	options.exposure = 1.0f;
+	options.limit = 1.5f;
+	options.clamp = FLT_MAX;
+	options.maxDepth = 4;
+	options.rouletteDepth = 3;
+	options.maxSamples = INT_MAX;
+	options.sampler = eSamplerSobol;
+	options.adaptiveThreshold = 0.0f;
+	options.adaptiveMinSamples = 16;
+	options.features = false;
+	options.reorderPaths = false;
+	options.sampleOffset = 0;
+	options.compressMeshes = false;
+
+	camera.position = Vec3(0.0f, 1.0f, 5.0f);
+	camera.rotation = Quat();
+	camera.fov = DegToRad(35.0f);
+}
+
+double MraysPerSecond(unsigned long long rays, double seconds)
+{
+	return seconds > 0.0 ? double(rays)/seconds*1.e-6 : 0.0;
+}
+
+} // anonymous namespace
+
+void RunBenchmark(const BenchmarkScene* scenes, int numScenes, int spp, int width, int height)
+{
+	const Backend backends[] =
+	{
+		{ "cpu", CreateCpuRenderer },
+		{ "wavefront", CreateCpuWavefrontRenderer },
+#if _WIN32
+		{ "gpu", CreateGpuRenderer },
+		{ "multigpu", CreateMultiGpuRenderer },
+#endif
+	};
+
+	const int numBackends = sizeof(backends)/sizeof(backends[0]);
+
+	for (int s=0; s < numScenes; ++s)
+	{
+		Scene scene;
+		Camera camera;
+		Options options;
+
+		SetDefaults(camera, options);
+
+		// mesh BVHs are built (or mapped from a .bin) on import so they count towards load time
+		const double loadStart = GetSeconds();
+
+		if (scenes[s].file)
+		{
+			if (!LoadTin(scenes[s].file, &scene, &camera, &options))
+			{
+				printf("Couldn't open %s for reading.\n", scenes[s].file);
+				continue;
+			}
+		}
+		else
+		{
+			scenes[s].build(&scene, &camera, &options);
+		}
+
+		const double buildStart = GetSeconds();
+
+		scene.Build();
+
+		const double buildEnd = GetSeconds();
+
+		// the scene's own resolution and sample count are replaced so runs are comparable
+		options.width = width;
+		options.height = height;
+		options.maxSamples = spp;
+
+		Color* output = new Color[width*height];
+
+		for (int b=0; b < numBackends; ++b)
+		{
+			std::fill(output, output+width*height, Color(0.0f));
+
+			// a fresh renderer starts from the same seed every run
+			Renderer* renderer = backends[b].create(&scene);
+			renderer->Init(width, height);
+
+			const double renderStart = GetSeconds();
+
+			renderer->RenderSamples(camera, options, output, spp);
+			renderer->Flush(output);
+
+			const double renderEnd = GetSeconds();
+
+			RayStats stats;
+			const bool counted = renderer->GetRayStats(stats);
+
+			delete renderer;
+
+			const double seconds = renderEnd-renderStart;
+			const unsigned long long total = stats.primary + stats.secondary + stats.shadow;
+
+			printf("{\"scene\": \"%s\", \"backend\": \"%s\", \"spp\": %d, \"width\": %d, \"height\": %d, "
+				"\"load_ms\": %.3f, \"build_ms\": %.3f, \"render_ms\": %.3f, ",
+				scenes[s].name, backends[b].name, spp, width, height,
+				(buildStart-loadStart)*1000.0, (buildEnd-buildStart)*1000.0, seconds*1000.0);
+
+			if (counted)
+			{
+				printf("\"primary_mrays\": %.3f, \"secondary_mrays\": %.3f, \"shadow_mrays\": %.3f, \"total_mrays\": %.3f, ",
+					MraysPerSecond(stats.primary, seconds),
+					MraysPerSecond(stats.secondary, seconds),
+					MraysPerSecond(stats.shadow, seconds),
+					MraysPerSecond(total, seconds));
+			}
+
+			// peak over the whole process, so it only grows from one run to the next
+			printf("\"peak_mb\": %.1f}\n", double(GetPeakMemory())/(1024.0*1024.0));
+			fflush(stdout);
+		}
+
+		delete[] output;
+
+		scene.Destroy();
+	}
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+struct Scene;
+struct Camera;
+struct Options;
+
+// a scene is either loaded from a file or built in code when file is NULL
+struct BenchmarkScene
+{
+	const char* name;
+	const char* file;
+	void (*build)(Scene* scene, Camera* camera, Options* options);
+};
+
+// renders every scene with each available backend for a fixed number of samples from the same seed,
+// prints one JSON object per run and line to stdout so results can be compared between builds
+void RunBenchmark(const BenchmarkScene* scenes, int numScenes, int spp, int width, int height);
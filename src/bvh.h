@@ -1,11 +1,24 @@
 #pragma once
 
 #include "maths.h"
+#include "parallel.h"
 
 #include <vector>
 #include <algorithm>
+#include <atomic>
 #include <cassert>
 
+// collapse binary trees into 4-wide trees for CPU traversal
+#define USE_WIDE_BVH 1
+
+// walk binary trees on the GPU through parent links instead of a per-ray stack, this frees
+// the stack's local memory and registers and removes its depth limit
+#define USE_STACKLESS_BVH 1
+
+// store mesh wide node child bounds as 8-bit offsets on a per-node grid, a node
+// then fits in a single cache line instead of spanning two
+#define USE_QUANTIZED_BVH 1
+
 struct BVHNode
 {
 	Bounds bounds;
@@ -19,60 +32,140 @@ struct BVHNode
 
 static_assert(sizeof(BVHNode) == 32, "Error BVHNode size larger than expected");
 
+// parent and sibling of a binary node so a traversal can climb back up the tree without a
+// stack, children are visited in a fixed order per ray, lower child along the parent's split
+// axis first for rays going up that axis, so each node knows whether its sibling is still to come
+struct BVHLink
+{
+	unsigned int parent : 29;
+	unsigned int lower : 1;			// this node is the lower child of its parent
+	unsigned int axis : 2;			// split axis of this node's children
+
+	unsigned int sibling : 29;
+	unsigned int leftLower : 1;		// this node's left child is its lower child
+	unsigned int parentAxis : 2;
+};
+
+static_assert(sizeof(BVHLink) == 8, "Error BVHLink size larger than expected");
+
 struct BVH
 {
-	BVH() : nodes(NULL), numNodes(0) {}
+	BVH() : nodes(NULL), links(NULL), numNodes(0) {}
 
 	BVHNode* nodes;
+
+	// only built for trees traversed on the GPU, NULL otherwise
+	BVHLink* links;
+
 	int numNodes;
 };
 
+// split heuristics available to the builder
+enum BVHPartition
+{
+	eBVHMidPoint,		// split the longest axis at its center
+	eBVHMedian,			// split the longest axis at the median item
+	eBVHSAH,			// full sweep of the sorted longest axis
+	eBVHBinnedSAH		// sweep of centroid bins over all three axes
+};
+
 struct BVHBuilder
 {
-	BVHBuilder(int maxItemsPerLeaf=1) : maxItemsPerLeaf(maxItemsPerLeaf) {}
+	BVHBuilder(int maxItemsPerLeaf=1, BVHPartition partition=eBVHBinnedSAH) : maxItemsPerLeaf(maxItemsPerLeaf), partition(partition) {}
 
-	BVH Build(const Bounds* items, int n)
+	BVH Build(const Bounds* bounds, int n)
 	{
 		nodes.resize(2*n);
 		usedNodes = 0;
 	
-		bounds.assign(items, items+n);
-
-		// create indices array
-		indices.resize(n);
+		// create items array, partitioning moves the items themselves
+		// so that each level streams through contiguous memory
+		items.resize(n);
 		for (int i=0; i < n; ++i)
-			indices[i] = i;
+		{
+			items[i].bounds = bounds[i];
+			items[i].center = bounds[i].GetCenter();
+			items[i].index = i;
+		}
 
 		BuildRecursive(0, n);
 
+		const int numNodes = usedNodes;
+
 		// copy nodes to a new array and return
-		BVHNode* nodesCopy = new BVHNode[usedNodes];
-		memcpy(nodesCopy, &nodes[0], usedNodes*sizeof(BVHNode));
+		BVHNode* nodesCopy = new BVHNode[numNodes];
+		memcpy(nodesCopy, &nodes[0], numNodes*sizeof(BVHNode));
 
 		BVH bvh;
 		bvh.nodes = nodesCopy;
-		bvh.numNodes = usedNodes;
+		bvh.numNodes = numNodes;
 
 		return bvh;
 	}
 
+	struct Item
+	{
+		Bounds bounds;
+		Vec3 center;
+		int index;
+	};
 
 	std::vector<BVHNode> nodes;
-	int usedNodes;
 
-	std::vector<Bounds> bounds;
-	std::vector<int> indices;
+	// subtrees are built concurrently, each node reserves its slot atomically
+	std::atomic<int> usedNodes;
+
+	std::vector<Item> items;
 
 	int maxItemsPerLeaf;
+	BVHPartition partition;
 
 private:
 
-	Bounds CalcBounds(const int* indices, int n)
+	// ranges with at least this many items build their children as separate tasks
+	enum { kTaskThreshold = 4096 };
+
+	// ranges larger than this split their per-node passes over multiple workers
+	enum { kParallelChunk = 1<<15 };
+
+	// union of the item bounds (or centers) in [start, end)
+	Bounds CalcBounds(int start, int end, bool centers=false)
 	{
+		const int n = end-start;
+		const int numChunks = (n + kParallelChunk - 1)/kParallelChunk;
+
+		if (numChunks <= 1)
+			return CalcBoundsSerial(start, end, centers);
+
+		std::vector<Bounds> partial(numChunks);
+
+		ParallelFor(numChunks, [&](int chunk, int worker)
+		{
+			partial[chunk] = CalcBoundsSerial(start + chunk*kParallelChunk, Min(start + (chunk+1)*int(kParallelChunk), end), centers);
+		});
+
 		Bounds u;
 
-		for (int i=0; i < n; ++i)
-			u = Union(u, bounds[indices[i]]);
+		for (int i=0; i < numChunks; ++i)
+			u = Union(u, partial[i]);
+
+		return u;
+	}
+
+	Bounds CalcBoundsSerial(int start, int end, bool centers)
+	{
+		Bounds u;
+
+		if (centers)
+		{
+			for (int i=start; i < end; ++i)
+				u.AddPoint(items[i].center);
+		}
+		else
+		{
+			for (int i=start; i < end; ++i)
+				u = Union(u, items[i].bounds);
+		}
 
 		return u;
 	}
@@ -89,14 +182,13 @@ private:
 		
 	struct PartitionMidPointPredictate
 	{
-		PartitionMidPointPredictate(const Bounds* bounds, int a, Real m) : bounds(bounds), axis(a), mid(m) {}
+		PartitionMidPointPredictate(int a, Real m) : axis(a), mid(m) {}
 
-		bool operator()(int index) const 
+		bool operator()(const Item& item) const 
 		{
-			return bounds[index].GetCenter()[axis] <= mid;
+			return item.center[axis] <= mid;
 		}
 
-		const Bounds* bounds;
 		int axis;
 		Real mid;
 	};
@@ -114,23 +206,22 @@ private:
 		Real mid = center[longestAxis];
 
 	
-		int* upper = std::partition(&indices[0]+start, &indices[0]+end, PartitionMidPointPredictate(&bounds[0], longestAxis, mid));
+		Item* upper = std::partition(&items[0]+start, &items[0]+end, PartitionMidPointPredictate(longestAxis, mid));
 
-		int k = upper-&indices[0];
+		int k = upper-&items[0];
 
 		return k;
 	}
 
 	struct PartitionMedianPredicate
 		{
-			PartitionMedianPredicate(const Bounds* bounds, int a) : bounds(bounds), axis(a) {}
+			PartitionMedianPredicate(int a) : axis(a) {}
 
-			bool operator()(int a, int b) const
+			bool operator()(const Item& a, const Item& b) const
 			{
-				return bounds[a].GetCenter()[axis] < bounds[b].GetCenter()[axis];
+				return a.center[axis] < b.center[axis];
 			}
 
-			const Bounds* bounds;
 			int axis;
 		};
 
@@ -144,7 +235,7 @@ private:
 
 		const int k = (start+end)/2;
 
-		std::nth_element(&indices[0]+start, &indices[0]+k, &indices[0]+end, PartitionMedianPredicate(&bounds[0], longestAxis));
+		std::nth_element(&items[0]+start, &items[0]+k, &items[0]+end, PartitionMedianPredicate(longestAxis));
 
 		return k;
 	}	
@@ -167,7 +258,7 @@ private:
 		int longestAxis = LongestAxis(edges);
 
 		// sort along longest axis
-		std::sort(&indices[0]+start, &indices[0]+end, PartitionMedianPredicate(&bounds[0], longestAxis));
+		std::sort(&items[0]+start, &items[0]+end, PartitionMedianPredicate(longestAxis));
 
 		// total area for range from [0, split]
 		std::vector<float> leftAreas(n);
@@ -180,8 +271,8 @@ private:
 		// build cumulative bounds and area from left and right
 		for (int i=0; i < n; ++i)
 		{
-			left = Union(left, bounds[indices[start+i]]);
-			right = Union(right, bounds[indices[end-i-1]]);
+			left = Union(left, items[start+i].bounds);
+			right = Union(right, items[end-i-1].bounds);
 
 			leftAreas[i] = Area(left);
 			rightAreas[n-i-1] = Area(right);
@@ -210,12 +301,183 @@ private:
 		return start + minSplit + 1;
 	}	
 
+	// number of centroid bins per axis used by PartitionObjectsBinnedSAH
+	enum { kNumBins = 32 };
+
+	struct Bin
+	{
+		Bounds bounds;
+		int count;
+	};
+
+	struct BinSet
+	{
+		Bin bins[3][kNumBins];
+	};
+
+	static int BinIndex(Real c, Real lower, Real scale, int numBins)
+	{
+		return Min(int((c-lower)*scale), numBins-1);
+	}
+
+	struct PartitionBinPredicate
+	{
+		PartitionBinPredicate(int a, Real lower, Real scale, int numBins, int s) : axis(a), lower(lower), scale(scale), numBins(numBins), split(s) {}
+
+		bool operator()(const Item& item) const
+		{
+			return BinIndex(item.center[axis], lower, scale, numBins) < split;
+		}
+
+		int axis;
+		Real lower;
+		Real scale;
+		int numBins;
+		int split;
+	};
+
+	// bins item centers along each axis and evaluates the SAH at bin boundaries,
+	// scratch is kept on the stack so no allocations are made per node
+	int PartitionObjectsBinnedSAH(int start, int end, Bounds rangeBounds)
+	{
+		assert(end-start >= 2);
+
+		// any split of two items is optimal
+		if (end-start == 2)
+			return start+1;
+
+		// bounds of the item centers, bins are distributed over this range
+		const Bounds centerBounds = CalcBounds(start, end, true);
+		const Vec3 centerEdges = centerBounds.GetEdges();
+
+		// small ranges don't need more bins than items
+		const int numBins = Min(int(kNumBins), end-start);
+
+		Real scale[3];
+
+		for (int a=0; a < 3; ++a)
+			scale[a] = centerEdges[a] > 0.0f ? Real(numBins)/centerEdges[a] : 0.0f;
+
+		BinSet set;
+
+		const int numChunks = (end - start + kParallelChunk - 1)/kParallelChunk;
+
+		if (numChunks <= 1)
+		{
+			BinItems(start, end, centerBounds, scale, numBins, set);
+		}
+		else
+		{
+			// bin chunks separately and merge in a fixed order
+			std::vector<BinSet> partial(numChunks);
+
+			ParallelFor(numChunks, [&](int chunk, int worker)
+			{
+				BinItems(start + chunk*kParallelChunk, Min(start + (chunk+1)*int(kParallelChunk), end), centerBounds, scale, numBins, partial[chunk]);
+			});
+
+			set = partial[0];
+
+			for (int c=1; c < numChunks; ++c)
+			{
+				for (int a=0; a < 3; ++a)
+				{
+					for (int b=0; b < numBins; ++b)
+					{
+						set.bins[a][b].bounds = Union(set.bins[a][b].bounds, partial[c].bins[a][b].bounds);
+						set.bins[a][b].count += partial[c].bins[a][b].count;
+					}
+				}
+			}
+		}
+
+		const Bin (&bins)[3][kNumBins] = set.bins;
+
+		int bestAxis = -1;
+		int bestSplit = 0;
+		float bestCost = FLT_MAX;
+
+		for (int a=0; a < 3; ++a)
+		{
+			// all centers coincide on this axis
+			if (scale[a] == 0.0f)
+				continue;
+
+			// cost of everything right of boundary b, i.e.: bins [b, numBins)
+			float rightCost[kNumBins];
+
+			Bounds right;
+			int rightCount = 0;
+
+			for (int b=numBins-1; b > 0; --b)
+			{
+				right = Union(right, bins[a][b].bounds);
+				rightCount += bins[a][b].count;
+
+				rightCost[b] = rightCount ? Area(right)*rightCount : 0.0f;
+			}
+
+			Bounds left;
+			int leftCount = 0;
+
+			for (int b=1; b < numBins; ++b)
+			{
+				left = Union(left, bins[a][b-1].bounds);
+				leftCount += bins[a][b-1].count;
+
+				if (leftCount == 0 || leftCount == end-start)
+					continue;
+
+				const float cost = Area(left)*leftCount + rightCost[b];
+
+				if (cost < bestCost)
+				{
+					bestCost = cost;
+					bestAxis = a;
+					bestSplit = b;
+				}
+			}
+		}
+
+		// all centers in the same place, let the caller split down the middle
+		if (bestAxis == -1)
+			return start;
+
+		Item* upper = std::partition(&items[0]+start, &items[0]+end, PartitionBinPredicate(bestAxis, centerBounds.lower[bestAxis], scale[bestAxis], numBins, bestSplit));
+
+		return upper-&items[0];
+	}
+
+	void BinItems(int start, int end, const Bounds& centerBounds, const Real* scale, int numBins, BinSet& set)
+	{
+		for (int a=0; a < 3; ++a)
+		{
+			for (int b=0; b < numBins; ++b)
+			{
+				set.bins[a][b].bounds = Bounds();
+				set.bins[a][b].count = 0;
+			}
+		}
+
+		for (int i=start; i < end; ++i)
+		{
+			const Item& item = items[i];
+
+			for (int a=0; a < 3; ++a)
+			{
+				Bin& bin = set.bins[a][BinIndex(item.center[a], centerBounds.lower[a], scale[a], numBins)];
+
+				bin.bounds = Union(bin.bounds, item.bounds);
+				bin.count++;
+			}
+		}
+	}
+
 	int AddNode()
 	{
-		assert(usedNodes < nodes.size());
+		int index = usedNodes++;
 
-		int index = usedNodes;
-		++usedNodes;
+		assert(index < int(nodes.size()));
 
 		return index;
 	}
@@ -229,18 +491,32 @@ private:
 		const int nodeIndex = AddNode();
 
 		BVHNode node;
-		node.bounds = CalcBounds(&indices[start], end-start);
+		node.bounds = CalcBounds(start, end);
 		
 		if (n <= maxItemsPerLeaf)
 		{
 			node.leaf = true;
-			node.leftIndex = indices[start];			
+			node.leftIndex = items[start].index;			
 		}
 		else
 		{
-			//const int split = PartitionObjectsMidPoint(start, end, node.bounds);
-			//int split = PartitionObjectsMedian(start, end, node.bounds);
-			int split = PartitionObjectsSAH(start, end, node.bounds);
+			int split;
+
+			switch (partition)
+			{
+				case eBVHMidPoint:
+					split = PartitionObjectsMidPoint(start, end, node.bounds);
+					break;
+				case eBVHMedian:
+					split = PartitionObjectsMedian(start, end, node.bounds);
+					break;
+				case eBVHSAH:
+					split = PartitionObjectsSAH(start, end, node.bounds);
+					break;
+				default:
+					split = PartitionObjectsBinnedSAH(start, end, node.bounds);
+					break;
+			}
 
 			if (split == start || split == end)
 			{
@@ -249,8 +525,26 @@ private:
 			}
 
 			node.leaf = false;
-			node.leftIndex = BuildRecursive(start, split);
-			node.rightIndex = BuildRecursive(split, end);
+
+			if (n >= kTaskThreshold)
+			{
+				// children of large ranges are built as separate tasks, the
+				// node slots they reserve may interleave but every index is unique
+				int children[2];
+
+				ParallelFor(2, [&](int child, int worker)
+				{
+					children[child] = child == 0 ? BuildRecursive(start, split) : BuildRecursive(split, end);
+				});
+
+				node.leftIndex = children[0];
+				node.rightIndex = children[1];
+			}
+			else
+			{
+				node.leftIndex = BuildRecursive(start, split);
+				node.rightIndex = BuildRecursive(split, end);
+			}
 		}
 
 		// output node
@@ -262,3 +556,415 @@ private:
 
 };
 
+// recomputes the node bounds bottom-up from new item bounds keeping the topology, e.g.:
+// after the vertices of a mesh moved, leaves are updated in parallel and the inner nodes
+// in one reverse linear pass, which sees children first as they are created after their parent
+inline void RefitBVH(BVH& bvh, const Bounds* itemBounds)
+{
+	const int kChunkSize = 1<<14;
+	const int numChunks = (bvh.numNodes + kChunkSize - 1)/kChunkSize;
+
+	BVHNode* nodes = bvh.nodes;
+
+	ParallelFor(numChunks, [&](int chunk, int worker)
+	{
+		const int end = Min(bvh.numNodes, (chunk+1)*kChunkSize);
+
+		for (int i=chunk*kChunkSize; i < end; ++i)
+		{
+			if (nodes[i].leaf)
+				nodes[i].bounds = itemBounds[nodes[i].leftIndex];
+		}
+	});
+
+	for (int i=bvh.numNodes-1; i >= 0; --i)
+	{
+		BVHNode& node = nodes[i];
+
+		if (!node.leaf)
+			node.bounds = Union(nodes[node.leftIndex].bounds, nodes[node.rightIndex].bounds);
+	}
+}
+
+// fills one link per node, the split axis of an inner node is the one its child centers are
+// furthest apart on, the root links to itself
+inline void BuildBVHLinks(const BVHNode* nodes, int numNodes, BVHLink* links)
+{
+	if (numNodes == 0)
+		return;
+
+	memset(links, 0, sizeof(BVHLink)*numNodes);
+
+	for (int i=0; i < numNodes; ++i)
+	{
+		const BVHNode& node = nodes[i];
+
+		if (node.leaf)
+			continue;
+
+		const Vec3 delta = nodes[node.rightIndex].bounds.GetCenter() - nodes[node.leftIndex].bounds.GetCenter();
+
+		int axis = 0;
+		if (Abs(delta.y) > Abs(delta[axis]))
+			axis = 1;
+		if (Abs(delta.z) > Abs(delta[axis]))
+			axis = 2;
+
+		const bool leftLower = delta[axis] >= 0.0f;
+
+		links[i].axis = axis;
+		links[i].leftLower = leftLower;
+
+		BVHLink& left = links[node.leftIndex];
+		BVHLink& right = links[node.rightIndex];
+
+		left.parent = i;
+		left.sibling = node.rightIndex;
+		left.lower = leftLower;
+		left.parentAxis = axis;
+
+		right.parent = i;
+		right.sibling = node.leftIndex;
+		right.lower = !leftLower;
+		right.parentAxis = axis;
+	}
+}
+
+// surface area heuristic cost of a tree relative to the area of its root, i.e.: the expected
+// number of node visits and item tests for a random ray hitting the root, refitted trees
+// get more expensive as their bounds start to overlap
+inline float BVHCost(const BVH& bvh, float traversalCost=1.0f, float itemCost=1.0f)
+{
+	if (bvh.numNodes == 0)
+		return 0.0f;
+
+	auto area = [](const Bounds& b)
+	{
+		Vec3 e = Max(b.GetEdges(), Vec3(0.0f));
+		return e.x*e.y + e.x*e.z + e.y*e.z;
+	};
+
+	double cost = 0.0;
+
+	for (int i=0; i < bvh.numNodes; ++i)
+	{
+		const BVHNode& node = bvh.nodes[i];
+		cost += area(node.bounds)*(node.leaf ? itemCost : traversalCost);
+	}
+
+	const float rootArea = area(bvh.nodes[0].bounds);
+
+	return rootArea > 0.0f ? float(cost/rootArea) : 0.0f;
+}
+
+// number of children per wide node, matches the SSE register width
+#define kWideBVHWidth 4
+
+// 4-wide node, child bounds are stored as structure-of-arrays so that all
+// children can be tested against a ray with a single SIMD instruction sequence
+struct WideBVHNode
+{
+	float lowerX[kWideBVHWidth];
+	float upperX[kWideBVHWidth];
+	float lowerY[kWideBVHWidth];
+	float upperY[kWideBVHWidth];
+	float lowerZ[kWideBVHWidth];
+	float upperZ[kWideBVHWidth];
+
+	// >= 0 indexes an inner node, leaves store ~item (or ~group when collapsed
+	// with leaf groups), unused slots store kWideBVHEmpty
+	int children[kWideBVHWidth];
+};
+
+static_assert(sizeof(WideBVHNode) == 112, "Error WideBVHNode size larger than expected");
+
+// 4-wide node, child bounds are stored as structure-of-arrays of 8-bit cells on a grid
+// with origin at the node's lower corner and a short mantissa spacing per axis, so a
+// cell decodes with a single rounding in origin + q*scale, lower bounds are rounded
+// down and upper bounds up so decoded boxes always contain the original child boxes
+struct QuantizedWideBVHNode
+{
+	float origin[3];
+	float scale[3];
+
+	unsigned char lowerX[kWideBVHWidth];
+	unsigned char upperX[kWideBVHWidth];
+	unsigned char lowerY[kWideBVHWidth];
+	unsigned char upperY[kWideBVHWidth];
+	unsigned char lowerZ[kWideBVHWidth];
+	unsigned char upperZ[kWideBVHWidth];
+
+	// >= 0 indexes an inner node, leaves store ~item (or ~group when collapsed
+	// with leaf groups), unused slots store kWideBVHEmpty
+	int children[kWideBVHWidth];
+
+	CUDA_CALLABLE inline Vec3 GetLower(int i) const
+	{
+		return Vec3(origin[0] + float(lowerX[i])*scale[0], origin[1] + float(lowerY[i])*scale[1], origin[2] + float(lowerZ[i])*scale[2]);
+	}
+
+	CUDA_CALLABLE inline Vec3 GetUpper(int i) const
+	{
+		return Vec3(origin[0] + float(upperX[i])*scale[0], origin[1] + float(upperY[i])*scale[1], origin[2] + float(upperZ[i])*scale[2]);
+	}
+};
+
+static_assert(sizeof(QuantizedWideBVHNode) == 64, "Error QuantizedWideBVHNode size larger than expected");
+
+// the top level scene tree holds few children of very different sizes (infinite planes next
+// to small meshes) which quantize poorly, so only mesh trees use the quantized layout
+#if USE_QUANTIZED_BVH
+typedef QuantizedWideBVHNode MeshWideBVHNode;
+#else
+typedef WideBVHNode MeshWideBVHNode;
+#endif
+
+#define kWideBVHEmpty int(0x80000000)
+
+template <typename Node>
+struct WideBVHTree
+{
+	WideBVHTree() : nodes(NULL), numNodes(0) {}
+
+	Node* nodes;
+	int numNodes;
+};
+
+typedef WideBVHTree<WideBVHNode> WideBVH;
+typedef WideBVHTree<MeshWideBVHNode> MeshWideBVH;
+
+// writes the bounds of the first numChildren slots of a node, the remaining slots get
+// inverted bounds, traversal masks them out by their kWideBVHEmpty child index
+inline void SetWideNodeBounds(WideBVHNode& node, const Bounds* bounds, int numChildren)
+{
+	for (int i=0; i < kWideBVHWidth; ++i)
+	{
+		const Bounds b = i < numChildren ? bounds[i] : Bounds(Vec3(FLT_MAX), Vec3(-FLT_MAX));
+
+		node.lowerX[i] = b.lower.x;
+		node.lowerY[i] = b.lower.y;
+		node.lowerZ[i] = b.lower.z;
+		node.upperX[i] = b.upper.x;
+		node.upperY[i] = b.upper.y;
+		node.upperZ[i] = b.upper.z;
+	}
+}
+
+inline void SetWideNodeBounds(QuantizedWideBVHNode& node, const Bounds* bounds, int numChildren)
+{
+	Bounds total;
+	for (int i=0; i < numChildren; ++i)
+		total = Union(total, bounds[i]);
+
+	unsigned char* lower[3] = { node.lowerX, node.lowerY, node.lowerZ };
+	unsigned char* upper[3] = { node.upperX, node.upperY, node.upperZ };
+
+	for (int a=0; a < 3; ++a)
+	{
+		const float origin = numChildren ? total.lower[a] : 0.0f;
+		const float extent = numChildren ? total.upper[a]-origin : 0.0f;
+
+		// cell size that spans the extent in 255 cells rounded up to 4 mantissa bits, the
+		// product with an 8-bit cell is then exact so the decode only rounds in the add
+		int exponent;
+		const float mantissa = frexpf(extent/255.0f, &exponent);
+
+		float scale = extent > 0.0f ? ldexpf(ceilf(mantissa*16.0f)/16.0f, exponent) : 1.0f;
+		while (origin + 255.0f*scale < total.upper[a] && numChildren)
+			scale *= 2.0f;
+
+		node.origin[a] = origin;
+		node.scale[a] = scale;
+
+		for (int i=0; i < kWideBVHWidth; ++i)
+		{
+			if (i < numChildren)
+			{
+				// round outwards, then step until the decoded value is conservative
+				int ql = Clamp(int(floorf((bounds[i].lower[a]-origin)/scale)), 0, 255);
+				int qu = Clamp(int(ceilf((bounds[i].upper[a]-origin)/scale)), 0, 255);
+
+				while (ql > 0 && origin + float(ql)*scale > bounds[i].lower[a])
+					--ql;
+				while (qu < 255 && origin + float(qu)*scale < bounds[i].upper[a])
+					++qu;
+
+				lower[a][i] = (unsigned char)ql;
+				upper[a][i] = (unsigned char)qu;
+			}
+			else
+			{
+				lower[a][i] = 255;
+				upper[a][i] = 0;
+			}
+		}
+	}
+}
+
+// builds a wide tree from a binary one, each wide node adopts up to four descendants
+// of a binary node by repeatedly opening the inner child with the largest surface area
+//
+// if leafGroups is given, subtrees with at most kWideBVHWidth items become a single
+// leaf whose items are appended to leafGroups as kWideBVHWidth entries padded with -1
+template <typename Node>
+inline WideBVHTree<Node> CollapseBVH(const BVH& bvh, std::vector<int>* leafGroups=NULL)
+{
+	WideBVHTree<Node> wide;
+
+	if (bvh.numNodes == 0)
+		return wide;
+
+	// items below each binary node, children are always created after their parent
+	std::vector<int> counts;
+
+	if (leafGroups)
+	{
+		counts.resize(bvh.numNodes);
+
+		for (int i=bvh.numNodes-1; i >= 0; --i)
+		{
+			const BVHNode& node = bvh.nodes[i];
+			counts[i] = node.leaf ? 1 : counts[node.leftIndex] + counts[node.rightIndex];
+		}
+	}
+
+	auto isLeaf = [&](int index)
+	{
+		return bvh.nodes[index].leaf || (leafGroups && counts[index] <= kWideBVHWidth);
+	};
+
+	// half surface area, only used for comparisons
+	auto area = [](const Bounds& b)
+	{
+		Vec3 e = b.GetEdges();
+		return e.x*e.y + e.x*e.z + e.y*e.z;
+	};
+
+	std::vector<Node> nodes;
+	nodes.reserve(bvh.numNodes/2 + 1);
+	nodes.resize(1);
+
+	// pairs of (binary node, wide node) left to fill
+	std::vector<std::pair<int, int> > stack;
+	stack.push_back(std::make_pair(0, 0));
+
+	while (stack.size())
+	{
+		const int binaryIndex = stack.back().first;
+		const int wideIndex = stack.back().second;
+
+		stack.pop_back();
+
+		int children[kWideBVHWidth];
+		int numChildren = 0;
+
+		const BVHNode& parent = bvh.nodes[binaryIndex];
+
+		if (isLeaf(binaryIndex))
+		{
+			// single leaf tree
+			children[numChildren++] = binaryIndex;
+		}
+		else
+		{
+			children[numChildren++] = parent.leftIndex;
+			children[numChildren++] = parent.rightIndex;
+
+			while (numChildren < kWideBVHWidth)
+			{
+				int best = -1;
+				float bestArea = -1.0f;
+
+				for (int i=0; i < numChildren; ++i)
+				{
+					const BVHNode& child = bvh.nodes[children[i]];
+					
+					if (!isLeaf(children[i]) && area(child.bounds) > bestArea)
+					{
+						best = i;
+						bestArea = area(child.bounds);
+					}
+				}
+
+				if (best == -1)
+					break;
+
+				// replace the child with its two children
+				const BVHNode& open = bvh.nodes[children[best]];
+
+				children[best] = open.leftIndex;
+				children[numChildren++] = open.rightIndex;
+			}
+		}
+
+		Node node;
+
+		Bounds bounds[kWideBVHWidth];
+		for (int i=0; i < numChildren; ++i)
+			bounds[i] = bvh.nodes[children[i]].bounds;
+
+		SetWideNodeBounds(node, bounds, numChildren);
+
+		for (int i=0; i < kWideBVHWidth; ++i)
+		{
+			if (i < numChildren)
+			{
+				const BVHNode& child = bvh.nodes[children[i]];
+
+				if (leafGroups && isLeaf(children[i]))
+				{
+					node.children[i] = ~int(leafGroups->size()/kWideBVHWidth);
+
+					// gather the items of the subtree
+					int subtree[kWideBVHWidth];
+					subtree[0] = children[i];
+
+					int numItems = 0;
+
+					for (int n=1; n > 0;)
+					{
+						const BVHNode& s = bvh.nodes[subtree[--n]];
+
+						if (s.leaf)
+						{
+							leafGroups->push_back(s.leftIndex);
+							numItems++;
+						}
+						else
+						{
+							subtree[n++] = s.rightIndex;
+							subtree[n++] = s.leftIndex;
+						}
+					}
+
+					for (; numItems < kWideBVHWidth; ++numItems)
+						leafGroups->push_back(-1);
+				}
+				else if (child.leaf)
+				{
+					node.children[i] = ~int(child.leftIndex);
+				}
+				else
+				{
+					node.children[i] = int(nodes.size());
+					
+					nodes.resize(nodes.size()+1);
+					stack.push_back(std::make_pair(children[i], node.children[i]));
+				}
+			}
+			else
+			{
+				node.children[i] = kWideBVHEmpty;
+			}
+		}
+
+		nodes[wideIndex] = node;
+	}
+
+	wide.nodes = new Node[nodes.size()];
+	wide.numNodes = int(nodes.size());
+
+	memcpy(wide.nodes, &nodes[0], nodes.size()*sizeof(Node));
+
+	return wide;
+}
@@ -20,6 +20,7 @@
 
 #include "maths.h"
 #include "pfm.h"
+#include "sampler.h"
 
 #define USE_UNIFORM_SAMPLING 0
 #define USE_SIMPLE_BSDF 0
@@ -106,15 +107,26 @@ CUDA_CALLABLE inline float BSDFPdf(const Material& mat, float etaI, float etaO,
 		return kInv2Pi;
 }
 
-CUDA_CALLABLE inline void BSDFSample(const Material& mat, float etaI, float etaO, const Vec3& P, const Vec3& U, const Vec3& V, const Vec3& N, const Vec3& view, Vec3& light, float& pdf, BSDFType& type, Random& rand)
+CUDA_CALLABLE inline void BSDFSample(const Material& mat, float etaI, float etaO, const Vec3& P, const Vec3& U, const Vec3& V, const Vec3& N, const Vec3& view, Vec3& light, Vec3& f, float& pdf, BSDFType& type, Sampler& rand)
 {
-	Vec3 d =  UniformSampleHemisphere(rand);
+	float r1, r2;
+	Sample2D(rand, r1, r2);
+
+	Vec3 d =  UniformSampleHemisphere(r1, r2);
 
 	light = U*d.x + V*d.y + N*d.z;
+	f = kInvPi*mat.color;
 	pdf = kInv2Pi;
 	type = eReflected;
 }
 
+CUDA_CALLABLE inline Vec3 BSDFEvalPdf(const Material& mat, float etaI, float etaO, const Vec3& P, const Vec3& N, const Vec3& V, const Vec3& L, float& pdf)
+{
+	pdf = BSDFPdf(mat, etaI, etaO, P, N, V, L);
+
+	return kInvPi*mat.color;
+}
+
 CUDA_CALLABLE inline Vec3 BSDFEval(const Material& mat, float etaI, float etaO, const Vec3& P, const Vec3& N, const Vec3& V, const Vec3& L)
 {
 	return kInvPi*mat.color;
@@ -122,52 +134,196 @@ CUDA_CALLABLE inline Vec3 BSDFEval(const Material& mat, float etaI, float etaO,
 
 #else
 
-CUDA_CALLABLE inline float BSDFPdf(const Material& mat, float etaI, float etaO, const Vec3& P, const Vec3& n, const Vec3& V, const Vec3& L)
-{  
-#if USE_UNIFORM_SAMPLING
-	
-	return kInv2Pi*0.5f;
+// evaluates the BSDF for light arriving from L together with the pdf of BSDFSample() generating L,
+// the half vector, microfacet and Fresnel terms shared by the two are only computed once, lobes
+// missing from Lobes are compiled out while eLobeAll checks the material's weights at runtime
+template <int Lobes>
+CUDA_CALLABLE inline Vec3 BSDFEvalPdf(const Material& mat, float etaI, float etaO, const Vec3& P, const Vec3& N, const Vec3& V, const Vec3& L, float& pdf)
+{
+    float NDotL = Dot(N,L);
+    float NDotV = Dot(N,V);
+    
+    Vec3 H = SafeNormalize(L+V);
 
-#endif
+    float NDotH = Dot(N,H);
+    float LDotH = Dot(L,H);
 
-	if (Dot(L, n) <= 0.0f)
-	{
+    const float a = Max(0.001f, mat.roughness);
 
+    // transmission Fresnel, the dielectric lobes are the only users
+    const float F = (Lobes & eLobeTransmission) ? Fr(NDotV, etaI, etaO) : 0.0f;
+
+    float Ds = 0.0f;
+    float Gs = 0.0f;
+
+    if (NDotL <= 0.0f)
+    {
 		float bsdfPdf = 0.0f;
 		float brdfPdf = kInv2Pi*mat.subsurface*0.5f;
 
-		return Lerp(brdfPdf, bsdfPdf, mat.transmission);
+		pdf = Lerp(brdfPdf, bsdfPdf, mat.transmission);
     }
     else
     {
-		float F = Fr(Dot(n,V), etaI, etaO);
+        Ds = GTR2(NDotH, a);
+        Gs = SmithGGX(NDotV, a)*SmithGGX(NDotL, a);
 
-        const float a = Max(0.001f, mat.roughness);
-
-    	const Vec3 half = SafeNormalize(L+V);
-
-    	const float cosThetaHalf = Abs(Dot(half, n));
-        const float pdfHalf = GTR2(cosThetaHalf, a)*cosThetaHalf;
+        const float cosThetaHalf = Abs(NDotH);
+        const float pdfHalf = Ds*cosThetaHalf;
 
         // calculate pdf for each method given outgoing light vector
-        float pdfSpec = 0.25f*pdfHalf/Max(1.e-6f, Dot (L, half));
+        float pdfSpec = 0.25f*pdfHalf/Max(1.e-6f, LDotH);
         assert(isfinite(pdfSpec));
 
-		float pdfDiff = Abs(Dot(L, n))*kInvPi*(1.0f-mat.subsurface);
+		float pdfDiff = Abs(NDotL)*kInvPi*(1.0f-mat.subsurface);
         assert(isfinite(pdfDiff));
 
 		float bsdfPdf = pdfSpec*F;
 		float brdfPdf = Lerp(pdfDiff, pdfSpec, 0.5f);
 
         // weight pdfs equally
-        return Lerp(brdfPdf, bsdfPdf, mat.transmission);
+        pdf = Lerp(brdfPdf, bsdfPdf, mat.transmission);
+    }
+
+#if USE_UNIFORM_SAMPLING
+	pdf = kInv2Pi*0.5f;
+#endif
+
+    Vec3 Cdlin = Vec3(mat.color);
+    float Cdlum = .3*Cdlin[0] + .6*Cdlin[1]  + .1*Cdlin[2]; // luminance approx.
+
+    Vec3 Ctint = Cdlum > 0.0f ? Cdlin/Cdlum : Vec3(1.0f); // normalize lum. to isolate hue+sat
+    Vec3 Cspec0 = Lerp(mat.specular*.08*Lerp(Vec3(1.0f), Ctint, mat.specularTint), Cdlin, mat.metallic);
+   // Vec3 Csheen = Lerp(Vec3(1), Ctint, mat.sheenTint);
+
+	Vec3 bsdf = 0.0f;
+	Vec3 brdf = 0.0f;
+
+	if ((Lobes & eLobeTransmission) && mat.transmission > 0.0f)
+	{
+		// evaluate BSDF
+		if (NDotL <= 0)
+		{
+			bsdf = mat.transmission*(1.0f-F)/Abs(NDotL)*(1.0f-mat.metallic);
+		}
+		else
+		{
+			// specular lobe, Fresnel term with the microfacet normal
+			float FH = Fr(LDotH, etaI, etaO);
+
+			Vec3 Fs = Lerp(Cspec0, Vec3(1.0f), FH);
 
+			bsdf = Gs*Fs*Ds;
+		}
+	}
+
+	if ((Lobes & eLobeReflection) && mat.transmission < 1.0f)
+	{
+		// evaluate BRDF
+		if (NDotL <= 0)
+		{
+			if ((Lobes & eLobeSubsurface) && mat.subsurface > 0.0f)
+			{
+				// take sqrt to account for entry/exit of the ray through the medium
+				// this ensures transmitted light corresponds to the diffuse model
+				Vec3 s = Vec3(sqrtf(mat.color.x), sqrtf(mat.color.y), sqrtf(mat.color.z));
+			
+				float FL = SchlickFresnel(Abs(NDotL)), FV = SchlickFresnel(NDotV);
+    			float Fd = (1.0f-0.5f*FL)*(1.0f-0.5f*FV);
+
+				brdf = kInvPi*s*mat.subsurface*Fd*(1.0f-mat.metallic);
+			}						
+		}
+		else
+		{
+			// specular, Fresnel term with the microfacet normal
+			float FH = SchlickFresnel(LDotH);
+
+			Vec3 Fs = Lerp(Cspec0, Vec3(1), FH);
+
+			Vec3 diffuse = 0.0f;
+			Vec3 clearcoat = 0.0f;
+
+			if (Lobes & eLobeDiffuse)
+			{
+				// Diffuse fresnel - go from 1 at normal incidence to .5 at grazing
+				// and mix in diffuse retro-reflection based on roughness
+				float FL = SchlickFresnel(NDotL), FV = SchlickFresnel(NDotV);
+				float Fd90 = 0.5 + 2.0f * LDotH*LDotH * mat.roughness;
+				float Fd = Lerp(1.0f, Fd90, FL) * Lerp(1.0f, Fd90, FV);		
+
+				diffuse = kInvPi*Fd*Cdlin*(1.0f-mat.metallic)*(1.0f-mat.subsurface);
+			}
+
+			// Based on Hanrahan-Krueger BSDF approximation of isotrokPic bssrdf
+			// 1.25 scale is used to (roughly) preserve albedo
+			// Fss90 used to "flatten" retroreflection based on roughness
+			//float Fss90 = LDotH*LDotH*mat.roughness;
+			//float Fss = Lerp(1.0f, Fss90, FL) * Lerp(1.0f, Fss90, FV);
+			//float ss = 1.25 * (Fss * (1.0f / (NDotL + NDotV) - .5) + .5);
+
+			if (Lobes & eLobeClearcoat)
+			{
+				// clearcoat (ior = 1.5 -> F0 = 0.04)
+				float Dr = GTR1(NDotH, Lerp(.1,.001, mat.clearcoatGloss));
+				float Fc = Lerp(.04f, 1.0f, FH);
+				float Gr = SmithGGX(NDotL, .25) * SmithGGX(NDotV, .25);
+
+				clearcoat = mat.clearcoat*Gr*Fc*Dr;
+			}
+
+			/*
+			// sheen
+			Vec3 Fsheen = FH * mat.sheen * Csheen;
+
+			Vec3 out = ((1/kPi) * Lerp(Fd, ss, mat.subsurface)*Cdlin + Fsheen)
+				* (1-mat.metallic)*(1.0f-mat.transmission)
+				+ Gs*Fs*Ds + .25*mat.clearcoat*Gr*Fr*Dr;
+			*/
+	
+			brdf = diffuse + Gs*Fs*Ds + clearcoat;
+		}
     }
+
+	return Lerp(brdf, bsdf, mat.transmission);
+}
+
+// picks the specialization for the material's lobes, see Material::GetLobes()
+CUDA_CALLABLE inline Vec3 BSDFEvalPdf(const Material& mat, float etaI, float etaO, const Vec3& P, const Vec3& N, const Vec3& V, const Vec3& L, float& pdf)
+{
+	switch (mat.lobes)
+	{
+		// metals
+		case eLobeReflection:
+			return BSDFEvalPdf<eLobeReflection>(mat, etaI, etaO, P, N, V, L, pdf);
+		// diffuse and plastics
+		case eLobeReflection|eLobeDiffuse:
+			return BSDFEvalPdf<eLobeReflection|eLobeDiffuse>(mat, etaI, etaO, P, N, V, L, pdf);
+		// glass
+		case eLobeTransmission:
+			return BSDFEvalPdf<eLobeTransmission>(mat, etaI, etaO, P, N, V, L, pdf);
+		default:
+			return BSDFEvalPdf<eLobeAll>(mat, etaI, etaO, P, N, V, L, pdf);
+	}
+}
+
+CUDA_CALLABLE inline float BSDFPdf(const Material& mat, float etaI, float etaO, const Vec3& P, const Vec3& n, const Vec3& V, const Vec3& L)
+{  
+	float pdf;
+	BSDFEvalPdf(mat, etaI, etaO, P, n, V, L, pdf);
+
+	return pdf;
+}
+
+CUDA_CALLABLE inline Vec3 BSDFEval(const Material& mat, float etaI, float etaO, const Vec3& P, const Vec3& N, const Vec3& V, const Vec3& L)
+{
+	float pdf;
+	return BSDFEvalPdf(mat, etaI, etaO, P, N, V, L, pdf);
 }
 
 
 // generate an importance sampled BSDF direction
-CUDA_CALLABLE inline void BSDFSample(const Material& mat, float etaI, float etaO, const Vec3& P, const Vec3& U, const Vec3& V, const Vec3& N, const Vec3& view, Vec3& light, float& pdf, BSDFType& type, Random& rand)
+CUDA_CALLABLE inline void BSDFSample(const Material& mat, float etaI, float etaO, const Vec3& P, const Vec3& U, const Vec3& V, const Vec3& N, const Vec3& view, Vec3& light, Vec3& f, float& pdf, BSDFType& type, Sampler& rand)
 {
     if (rand.Randf() < mat.transmission)
     {
@@ -214,12 +370,14 @@ CUDA_CALLABLE inline void BSDFSample(const Material& mat, float etaI, float etaO
 			if (Refract(view, N, eta, light))
 			{   
 				type = eSpecular;
+				f = BSDFEval(mat, etaI, etaO, P, N, view, light);
 				pdf = (1.0f-F)*mat.transmission;
 				return;
 			}
 			else
 			{
 				//assert(0);
+				f = 0.0f;
 				pdf = 0.0f;
 				return;
 			}
@@ -231,6 +389,7 @@ CUDA_CALLABLE inline void BSDFSample(const Material& mat, float etaI, float etaO
 #if USE_UNIFORM_SAMPLING
 		
 		light = UniformSampleSphere(rand.Randf(), rand.Randf());
+		f = BSDFEval(mat, etaI, etaO, P, N, view, light);
 		pdf = kInv2Pi*0.5f;
 
 		return;
@@ -245,7 +404,10 @@ CUDA_CALLABLE inline void BSDFSample(const Material& mat, float etaI, float etaO
             // sample diffuse	
 			if (rand.Randf() < mat.subsurface)
 			{
-				const Vec3 d = UniformSampleHemisphere(rand);
+				float s1, s2;
+				Sample2D(rand, s1, s2);
+
+				const Vec3 d = UniformSampleHemisphere(s1, s2);
 				
                 // negate z coordinate to sample inside the surface
 				light = U*d.x + V*d.y - N*d.z;
@@ -288,121 +450,11 @@ CUDA_CALLABLE inline void BSDFSample(const Material& mat, float etaI, float etaO
 #endif
     }
 
-    pdf = BSDFPdf(mat, etaI, etaO, P, N, view, light);		
+    f = BSDFEvalPdf(mat, etaI, etaO, P, N, view, light, pdf);
 
 }
 
 
-CUDA_CALLABLE inline Vec3 BSDFEval(const Material& mat, float etaI, float etaO, const Vec3& P, const Vec3& N, const Vec3& V, const Vec3& L)
-{
-    float NDotL = Dot(N,L);
-    float NDotV = Dot(N,V);
-    
-    Vec3 H = Normalize(L+V);
-
-    float NDotH = Dot(N,H);
-    float LDotH = Dot(L,H);
-
-    Vec3 Cdlin = Vec3(mat.color);
-    float Cdlum = .3*Cdlin[0] + .6*Cdlin[1]  + .1*Cdlin[2]; // luminance approx.
-
-    Vec3 Ctint = Cdlum > 0.0f ? Cdlin/Cdlum : Vec3(1.0f); // normalize lum. to isolate hue+sat
-    Vec3 Cspec0 = Lerp(mat.specular*.08*Lerp(Vec3(1.0f), Ctint, mat.specularTint), Cdlin, mat.metallic);
-   // Vec3 Csheen = Lerp(Vec3(1), Ctint, mat.sheenTint);
-
-	Vec3 bsdf = 0.0f;
-	Vec3 brdf = 0.0f;
-
-	if (mat.transmission > 0.0f)
-	{
-		// evaluate BSDF
-		if (NDotL <= 0)
-		{
-			// transmission Fresnel
-			float F = Fr(NDotV, etaI, etaO);
-
-			bsdf = mat.transmission*(1.0f-F)/Abs(NDotL)*(1.0f-mat.metallic);
-		}
-		else
-		{
-			// specular lobe
-		    float a = Max(0.001f, mat.roughness);
-			float Ds = GTR2(NDotH, a);
-
-			// Fresnel term with the microfacet normal
-			float FH = Fr(LDotH, etaI, etaO);
-
-			Vec3 Fs = Lerp(Cspec0, Vec3(1.0f), FH);
-			float roughg = a;
-			float Gs = SmithGGX(NDotV, roughg)*SmithGGX(NDotL, roughg);
-
-			bsdf = Gs*Fs*Ds;
-		}
-	}
-
-	if (mat.transmission < 1.0f)
-	{
-		// evaluate BRDF
-		if (NDotL <= 0)
-		{
-			if (mat.subsurface > 0.0f)
-			{
-				// take sqrt to account for entry/exit of the ray through the medium
-				// this ensures transmitted light corresponds to the diffuse model
-				Vec3 s = Vec3(sqrtf(mat.color.x), sqrtf(mat.color.y), sqrtf(mat.color.z));
-			
-				float FL = SchlickFresnel(Abs(NDotL)), FV = SchlickFresnel(NDotV);
-    			float Fd = (1.0f-0.5f*FL)*(1.0f-0.5f*FV);
-
-				brdf = kInvPi*s*mat.subsurface*Fd*(1.0f-mat.metallic);
-			}						
-		}
-		else
-		{
-			// specular
-			float a = Max(0.001f, mat.roughness);
-			float Ds = GTR2(NDotH, a);
-
-			// Fresnel term with the microfacet normal
-			float FH = SchlickFresnel(LDotH);
-
-			Vec3 Fs = Lerp(Cspec0, Vec3(1), FH);
-			float roughg = a;
-			float Gs = SmithGGX(NDotV, roughg)*SmithGGX(NDotL, roughg);
-
-			// Diffuse fresnel - go from 1 at normal incidence to .5 at grazing
-			// and mix in diffuse retro-reflection based on roughness
-			float FL = SchlickFresnel(NDotL), FV = SchlickFresnel(NDotV);
-			float Fd90 = 0.5 + 2.0f * LDotH*LDotH * mat.roughness;
-			float Fd = Lerp(1.0f, Fd90, FL) * Lerp(1.0f, Fd90, FV);		
-
-			// Based on Hanrahan-Krueger BSDF approximation of isotrokPic bssrdf
-			// 1.25 scale is used to (roughly) preserve albedo
-			// Fss90 used to "flatten" retroreflection based on roughness
-			//float Fss90 = LDotH*LDotH*mat.roughness;
-			//float Fss = Lerp(1.0f, Fss90, FL) * Lerp(1.0f, Fss90, FV);
-			//float ss = 1.25 * (Fss * (1.0f / (NDotL + NDotV) - .5) + .5);
-
-			// clearcoat (ior = 1.5 -> F0 = 0.04)
-			float Dr = GTR1(NDotH, Lerp(.1,.001, mat.clearcoatGloss));
-			float Fc = Lerp(.04f, 1.0f, FH);
-			float Gr = SmithGGX(NDotL, .25) * SmithGGX(NDotV, .25);
-
-			/*
-			// sheen
-			Vec3 Fsheen = FH * mat.sheen * Csheen;
-
-			Vec3 out = ((1/kPi) * Lerp(Fd, ss, mat.subsurface)*Cdlin + Fsheen)
-				* (1-mat.metallic)*(1.0f-mat.transmission)
-				+ Gs*Fs*Ds + .25*mat.clearcoat*Gr*Fr*Dr;
-			*/
-	
-			brdf = kInvPi*Fd*Cdlin*(1.0f-mat.metallic)*(1.0f-mat.subsurface) + Gs*Fs*Ds + mat.clearcoat*Gr*Fc*Dr;
-		}
-    }
-
-	return Lerp(brdf, bsdf, mat.transmission);
-}
 #endif
 
 
@@ -437,7 +489,7 @@ inline void BSDFTest(Material mat, Mat33 frame, float woTheta, const char* filen
 
     Vec3 wo = frame*Vec3(0.0f, -sinf(woTheta), cosf(woTheta));
 
-    Random rand;
+    Sampler rand;
 
     for (int j=0; j < height; ++j)
     {
@@ -448,8 +500,8 @@ inline void BSDFTest(Material mat, Mat33 frame, float woTheta, const char* filen
 
             Vec3 wi = ProbeUVToDir(Vec2(u,v));
 
-            Vec3 f = BSDFEval(mat, 1.0f, 1.0f, Vec3(0.0f), frame.GetCol(2), wo, wi); 
-            float pdf = BSDFPdf(mat, 1.0f, 1.0f, Vec3(0.0f), frame.GetCol(2), wo, wi);
+            float pdf;
+            Vec3 f = BSDFEvalPdf(mat, 1.0f, 1.0f, Vec3(0.0f), frame.GetCol(2), wo, wi, pdf);
 
           //  f.x = u;
             //f.y = v;
@@ -465,10 +517,11 @@ inline void BSDFTest(Material mat, Mat33 frame, float woTheta, const char* filen
     for (int i=0; i < numSamples; ++i)
     {
         Vec3 wi;
+        Vec3 f;
         float pdf;
 		BSDFType type;
 
-        BSDFSample(mat, 1.0f, 1.0f, Vec3(0.0f), frame.GetCol(0), frame.GetCol(1), frame.GetCol(2), wo, wi, pdf, type, rand);
+        BSDFSample(mat, 1.0f, 1.0f, Vec3(0.0f), frame.GetCol(0), frame.GetCol(1), frame.GetCol(2), wo, wi, f, pdf, type, rand);
             
         Vec2 uv = ProbeDirToUV(wi);
 
@@ -5,6 +5,13 @@
 #include "scene.h"
 #include "sampler.h"
 
+#if USE_WIDE_BVH && !__CUDACC__ && (__SSE2__ || _M_X64)
+#define USE_WIDE_BVH_SSE 1
+#include <emmintrin.h>
+#else
+#define USE_WIDE_BVH_SSE 0
+#endif
+
 template <typename T>
 CUDA_CALLABLE CUDA_CALLABLE inline void Sort2(T& a, T& b)
 {
@@ -583,6 +590,22 @@ CUDA_CALLABLE inline BVHNode fetchNode(const BVHNode* ptr, int index)
 
 
 
+CUDA_CALLABLE inline BVHLink fetchLink(const BVHLink* ptr, int index)
+{
+#if __CUDA_ARCH__ && USE_TEXTURES
+
+		// links are uploaded as pairs of ints
+		int words[2];
+
+		words[0] = tex1Dfetch<int>((cudaTextureObject_t)ptr, index*2+0);
+		words[1] = tex1Dfetch<int>((cudaTextureObject_t)ptr, index*2+1);
+
+		return (const BVHLink&)(words[0]);
+#else
+		return ptr[index];
+#endif
+}
+
 template <typename Func>
 CUDA_CALLABLE void QueryRay(const BVHNode* root, Func& f, const Vec3& start, const Vec3& dir)
 {
@@ -626,6 +649,141 @@ CUDA_CALLABLE void QueryRay(const BVHNode* root, Func& f, const Vec3& start, con
 }
 
 
+// work done by the traversal of a single ray, the instrumented queries take one of
+// these while the regular ones pass a NullTraversalStats that compiles away
+struct TraversalStats
+{
+	CUDA_CALLABLE inline TraversalStats() : nodes(0), boxes(0), triangles(0) {}
+
+	CUDA_CALLABLE inline void VisitNode() { nodes++; }
+	CUDA_CALLABLE inline void TestBoxes(int n) { boxes += n; }
+	CUDA_CALLABLE inline void TestTriangles(int n) { triangles += n; }
+
+	int nodes;
+	int boxes;
+	int triangles;
+};
+
+struct NullTraversalStats
+{
+	CUDA_CALLABLE inline void VisitNode() {}
+	CUDA_CALLABLE inline void TestBoxes(int n) {}
+	CUDA_CALLABLE inline void TestTriangles(int n) {}
+};
+
+// counts every leaf passed on to the wrapped query as a test of n triangles
+template <typename T, typename Stats>
+struct TriangleCounter
+{
+	CUDA_CALLABLE inline TriangleCounter(T& q, Stats& s, int n) : query(q), stats(s), count(n) {}
+
+	CUDA_CALLABLE inline void operator()(int i)
+	{
+		stats.TestTriangles(count);
+		query(i);
+	}
+
+	T& query;
+	Stats& stats;
+	int count;
+};
+
+// visits leaves hit closer than tmax until the callback returns true, as QueryBVHAny() but
+// walks the tree through its links, each node is tested on the way down and the walk
+// continues with the sibling of a near child or climbs to the parent of a far one
+template <typename T, typename Stats>
+CUDA_CALLABLE inline bool QueryBVHAnyStackless(T& callback, const BVHNode* root, const BVHLink* links, const Vec3& origin, const Vec3& dir, const float& tmax, Stats& stats)
+{
+	Vec3 rcpDir;
+	rcpDir.x = 1.0f/dir.x;
+	rcpDir.y = 1.0f/dir.y;
+	rcpDir.z = 1.0f/dir.z;
+
+	int current = 0;
+
+	// set when current was reached from above and still has to be tested
+	bool down = true;
+
+	for (;;)
+	{
+		const BVHLink link = fetchLink(links, current);
+
+		if (down)
+		{
+			const BVHNode node = fetchNode(root, current);
+
+			stats.VisitNode();
+			stats.TestBoxes(1);
+
+			float t;
+			if (IntersectRayAABBFast(origin, rcpDir, node.bounds.lower, node.bounds.upper, t) && t < tmax)
+			{
+				if (!node.leaf)
+				{
+					// descend to the near child
+					current = (dir[link.axis] >= 0.0f) == bool(link.leftLower) ? node.leftIndex : node.rightIndex;
+					continue;
+				}
+
+				if (callback(node.leftIndex))
+					return true;
+			}
+		}
+
+		// subtree below current is done
+		if (current == 0)
+			return false;
+
+		if (bool(link.lower) == (dir[link.parentAxis] >= 0.0f))
+		{
+			current = link.sibling;
+			down = true;
+		}
+		else
+		{
+			current = link.parent;
+			down = false;
+		}
+	}
+}
+
+// adapts a callback without a result to QueryBVHAnyStackless()
+template <typename T>
+struct AllLeaves
+{
+	CUDA_CALLABLE inline AllLeaves(T& c) : callback(c) {}
+
+	CUDA_CALLABLE inline bool operator()(int i)
+	{
+		callback(i);
+		return false;
+	}
+
+	T& callback;
+};
+
+// visits leaves whose bounds are hit closer than tmax, as QueryBVH() but through the tree links
+template <typename T, typename Stats>
+CUDA_CALLABLE inline void QueryBVHStackless(T& callback, const BVHNode* root, const BVHLink* links, const Vec3& origin, const Vec3& dir, const float& tmax, Stats& stats)
+{
+	AllLeaves<T> leaves(callback);
+	QueryBVHAnyStackless(leaves, root, links, origin, dir, tmax, stats);
+}
+
+template <typename T>
+CUDA_CALLABLE inline void QueryBVHStackless(T& callback, const BVHNode* root, const BVHLink* links, const Vec3& origin, const Vec3& dir, const float& tmax)
+{
+	NullTraversalStats stats;
+	QueryBVHStackless(callback, root, links, origin, dir, tmax, stats);
+}
+
+template <typename T>
+CUDA_CALLABLE inline bool QueryBVHAnyStackless(T& callback, const BVHNode* root, const BVHLink* links, const Vec3& origin, const Vec3& dir, float tmax)
+{
+	NullTraversalStats stats;
+	return QueryBVHAnyStackless(callback, root, links, origin, dir, tmax, stats);
+}
+
 struct MeshQuery
 {
 	CUDA_CALLABLE inline MeshQuery(const MeshGeometry& m, const Vec3& origin, const Vec3& dir) : mesh(m), rayOrigin(origin), rayDir(dir), closestT(FLT_MAX) {}
@@ -635,13 +793,12 @@ struct MeshQuery
 		float t, u, v, w;
 		Vec3 n;
 
-		int i0 = fetchInt(mesh.indices, i*3+0);
-		int i1 = fetchInt(mesh.indices, i*3+1);
-		int i2 = fetchInt(mesh.indices, i*3+2);
+		int i0, i1, i2;
+		MeshTriangle(mesh, i, i0, i1, i2);
 
-		const Vec3 a = fetchVec3(mesh.positions, i0);
-		const Vec3 b = fetchVec3(mesh.positions, i1);
-		const Vec3 c = fetchVec3(mesh.positions, i2);
+		const Vec3 a = MeshPosition(mesh, i0);
+		const Vec3 b = MeshPosition(mesh, i1);
+		const Vec3 c = MeshPosition(mesh, i2);
 
 		float sign;
 		//if (IntersectRayTri(rayOrigin, rayDir, a, b, c, t, u, v, w, &n))
@@ -675,11 +832,459 @@ struct MeshQuery
 
 
 
-CUDA_CALLABLE bool inline IntersectRayMesh(const MeshGeometry& mesh, const Vec3& origin, const Vec3& dir, float tmax, float& t, float& u, float& v, float& w, int& tri, Vec3& triNormal)
+#if USE_WIDE_BVH && !__CUDA_ARCH__
+
+// unused slots have inverted bounds which the slab test does not reject on its own
+template <typename Node>
+inline int MaskWideNodeEmpty(const Node& node, int mask)
+{
+	for (int i=0; i < kWideBVHWidth; ++i)
+	{
+		if (node.children[i] == kWideBVHEmpty)
+			mask &= ~(1<<i);
+	}
+
+	return mask;
+}
+
+// tests a ray against all children of a wide node, returns a mask of the children
+// hit closer than tmax and writes their entry distances to t, matches IntersectRayAABBFast
+inline int IntersectRayWideNode(const WideBVHNode& node, const Vec3& origin, const Vec3& rcpDir, float tmax, float* t)
+{
+#if USE_WIDE_BVH_SSE
+
+	const __m128 ox = _mm_set1_ps(origin.x);
+	const __m128 oy = _mm_set1_ps(origin.y);
+	const __m128 oz = _mm_set1_ps(origin.z);
+
+	const __m128 rx = _mm_set1_ps(rcpDir.x);
+	const __m128 ry = _mm_set1_ps(rcpDir.y);
+	const __m128 rz = _mm_set1_ps(rcpDir.z);
+
+	__m128 l1 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.lowerX), ox), rx);
+	__m128 l2 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.upperX), ox), rx);
+
+	__m128 lmin = _mm_min_ps(l1, l2);
+	__m128 lmax = _mm_max_ps(l1, l2);
+
+	l1 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.lowerY), oy), ry);
+	l2 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.upperY), oy), ry);
+
+	lmin = _mm_max_ps(_mm_min_ps(l1, l2), lmin);
+	lmax = _mm_min_ps(_mm_max_ps(l1, l2), lmax);
+
+	l1 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.lowerZ), oz), rz);
+	l2 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.upperZ), oz), rz);
+
+	lmin = _mm_max_ps(_mm_min_ps(l1, l2), lmin);
+	lmax = _mm_min_ps(_mm_max_ps(l1, l2), lmax);
+
+	const __m128 hit = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(lmax, _mm_setzero_ps()), _mm_cmpge_ps(lmax, lmin)), _mm_cmplt_ps(lmin, _mm_set1_ps(tmax)));
+
+	_mm_storeu_ps(t, lmin);
+
+	int mask = _mm_movemask_ps(hit);
+
+#else
+
+	int mask = 0;
+
+	for (int i=0; i < kWideBVHWidth; ++i)
+	{
+		const Vec3 lower(node.lowerX[i], node.lowerY[i], node.lowerZ[i]);
+		const Vec3 upper(node.upperX[i], node.upperY[i], node.upperZ[i]);
+
+		if (IntersectRayAABBFast(origin, rcpDir, lower, upper, t[i]) && t[i] < tmax)
+			mask |= 1<<i;
+	}
+
+#endif
+
+	return MaskWideNodeEmpty(node, mask);
+}
+
+// quantized variant, decodes the child bounds on the node grid before the slab test
+inline int IntersectRayWideNode(const QuantizedWideBVHNode& node, const Vec3& origin, const Vec3& rcpDir, float tmax, float* t)
+{
+#if USE_WIDE_BVH_SSE
+
+	const __m128 rx = _mm_set1_ps(rcpDir.x);
+	const __m128 ry = _mm_set1_ps(rcpDir.y);
+	const __m128 rz = _mm_set1_ps(rcpDir.z);
+
+	// widen all cells at once, lowerX to upperY are contiguous followed by lowerZ and upperZ
+	const __m128i zero = _mm_setzero_si128();
+
+	const __m128i qxy = _mm_loadu_si128((const __m128i*)node.lowerX);
+	const __m128i qz = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)node.lowerZ), zero);
+
+	const __m128i qx = _mm_unpacklo_epi8(qxy, zero);
+	const __m128i qy = _mm_unpackhi_epi8(qxy, zero);
+
+	// bounds relative to the ray origin, origin + q*scale - o
+	const __m128 sx = _mm_set1_ps(node.scale[0]);
+	const __m128 sy = _mm_set1_ps(node.scale[1]);
+	const __m128 sz = _mm_set1_ps(node.scale[2]);
+
+	const __m128 dx = _mm_set1_ps(node.origin[0]-origin.x);
+	const __m128 dy = _mm_set1_ps(node.origin[1]-origin.y);
+	const __m128 dz = _mm_set1_ps(node.origin[2]-origin.z);
+
+	__m128 l1 = _mm_mul_ps(_mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(qx, zero)), sx), dx), rx);
+	__m128 l2 = _mm_mul_ps(_mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(qx, zero)), sx), dx), rx);
+
+	__m128 lmin = _mm_min_ps(l1, l2);
+	__m128 lmax = _mm_max_ps(l1, l2);
+
+	l1 = _mm_mul_ps(_mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(qy, zero)), sy), dy), ry);
+	l2 = _mm_mul_ps(_mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(qy, zero)), sy), dy), ry);
+
+	lmin = _mm_max_ps(_mm_min_ps(l1, l2), lmin);
+	lmax = _mm_min_ps(_mm_max_ps(l1, l2), lmax);
+
+	l1 = _mm_mul_ps(_mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(qz, zero)), sz), dz), rz);
+	l2 = _mm_mul_ps(_mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(qz, zero)), sz), dz), rz);
+
+	lmin = _mm_max_ps(_mm_min_ps(l1, l2), lmin);
+	lmax = _mm_min_ps(_mm_max_ps(l1, l2), lmax);
+
+	const __m128 hit = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(lmax, _mm_setzero_ps()), _mm_cmpge_ps(lmax, lmin)), _mm_cmplt_ps(lmin, _mm_set1_ps(tmax)));
+
+	_mm_storeu_ps(t, lmin);
+
+	int mask = _mm_movemask_ps(hit);
+
+#else
+
+	int mask = 0;
+
+	for (int i=0; i < kWideBVHWidth; ++i)
+	{
+		const Vec3 lower = node.GetLower(i);
+		const Vec3 upper = node.GetUpper(i);
+
+		if (IntersectRayAABBFast(origin, rcpDir, lower, upper, t[i]) && t[i] < tmax)
+			mask |= 1<<i;
+	}
+
+#endif
+
+	return MaskWideNodeEmpty(node, mask);
+}
+
+// tests a ray against the lanes of a triangle packet with the same arithmetic as IntersectRayTriTwoSided,
+// returns a mask of the lanes hit in (0, tmax) and writes their distance, barycentrics and determinant
+inline int IntersectRayTriPacket(const TriPacket& packet, const Vec3& rayOrigin, const Vec3& rayDir, float tmax, float* t, float* v, float* w, float* d)
+{
+#if USE_WIDE_BVH_SSE
+
+	const __m128 ndx = _mm_set1_ps(-rayDir.x);
+	const __m128 ndy = _mm_set1_ps(-rayDir.y);
+	const __m128 ndz = _mm_set1_ps(-rayDir.z);
+
+	const __m128 nx = _mm_loadu_ps(packet.nx);
+	const __m128 ny = _mm_loadu_ps(packet.ny);
+	const __m128 nz = _mm_loadu_ps(packet.nz);
+
+	const __m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(ndx, nx), _mm_mul_ps(ndy, ny)), _mm_mul_ps(ndz, nz));
+	const __m128 ood = _mm_div_ps(_mm_set1_ps(1.0f), det);
+
+	const __m128 apx = _mm_sub_ps(_mm_set1_ps(rayOrigin.x), _mm_loadu_ps(packet.ax));
+	const __m128 apy = _mm_sub_ps(_mm_set1_ps(rayOrigin.y), _mm_loadu_ps(packet.ay));
+	const __m128 apz = _mm_sub_ps(_mm_set1_ps(rayOrigin.z), _mm_loadu_ps(packet.az));
+
+	const __m128 tt = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(apx, nx), _mm_mul_ps(apy, ny)), _mm_mul_ps(apz, nz)), ood);
+
+	// e = Cross(-dir, ap)
+	const __m128 ex = _mm_sub_ps(_mm_mul_ps(ndy, apz), _mm_mul_ps(apy, ndz));
+	const __m128 ey = _mm_sub_ps(_mm_mul_ps(ndz, apx), _mm_mul_ps(ndx, apz));
+	const __m128 ez = _mm_sub_ps(_mm_mul_ps(ndx, apy), _mm_mul_ps(ndy, apx));
+
+	const __m128 acx = _mm_loadu_ps(packet.acx);
+	const __m128 acy = _mm_loadu_ps(packet.acy);
+	const __m128 acz = _mm_loadu_ps(packet.acz);
+
+	const __m128 abx = _mm_loadu_ps(packet.abx);
+	const __m128 aby = _mm_loadu_ps(packet.aby);
+	const __m128 abz = _mm_loadu_ps(packet.abz);
+
+	const __m128 vv = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(acx, ex), _mm_mul_ps(acy, ey)), _mm_mul_ps(acz, ez)), ood);
+	const __m128 ww = _mm_mul_ps(_mm_sub_ps(_mm_setzero_ps(), _mm_add_ps(_mm_add_ps(_mm_mul_ps(abx, ex), _mm_mul_ps(aby, ey)), _mm_mul_ps(abz, ez))), ood);
+
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 one = _mm_set1_ps(1.0f);
+
+	__m128 hit = _mm_and_ps(_mm_cmpgt_ps(tt, zero), _mm_cmplt_ps(tt, _mm_set1_ps(tmax)));
+	hit = _mm_and_ps(hit, _mm_and_ps(_mm_cmpge_ps(vv, zero), _mm_cmple_ps(vv, one)));
+	hit = _mm_and_ps(hit, _mm_and_ps(_mm_cmpge_ps(ww, zero), _mm_cmple_ps(_mm_add_ps(vv, ww), one)));
+
+	int mask = _mm_movemask_ps(hit);
+
+	if (mask == 0)
+		return 0;
+
+	_mm_storeu_ps(t, tt);
+	_mm_storeu_ps(v, vv);
+	_mm_storeu_ps(w, ww);
+	_mm_storeu_ps(d, det);
+
+#else
+
+	int mask = 0;
+
+	for (int l=0; l < kWideBVHWidth; ++l)
+	{
+		const Vec3 n(packet.nx[l], packet.ny[l], packet.nz[l]);
+		const Vec3 ab(packet.abx[l], packet.aby[l], packet.abz[l]);
+		const Vec3 ac(packet.acx[l], packet.acy[l], packet.acz[l]);
+		const Vec3 ap = rayOrigin - Vec3(packet.ax[l], packet.ay[l], packet.az[l]);
+
+		d[l] = Dot(-rayDir, n);
+		const float ood = 1.0f/d[l];
+
+		t[l] = Dot(ap, n)*ood;
+
+		const Vec3 e = Cross(-rayDir, ap);
+		v[l] = Dot(ac, e)*ood;
+		w[l] = -Dot(ab, e)*ood;
+
+		if (t[l] > 0.0f && t[l] < tmax && v[l] >= 0.0f && v[l] <= 1.0f && w[l] >= 0.0f && v[l] + w[l] <= 1.0f)
+			mask |= 1<<l;
+	}
+
+#endif
+
+	return mask;
+}
+
+// closest hit query against the triangle packets of a wide mesh BVH, all lanes
+// of a packet are tested at once with the same arithmetic as IntersectRayTriTwoSided
+struct MeshPacketQuery : public MeshQuery
 {
+	inline MeshPacketQuery(const MeshGeometry& m, const Vec3& origin, const Vec3& dir) : MeshQuery(m, origin, dir) {}
+
+	inline void operator()(int p)
+	{
+		const TriPacket& packet = mesh.packets[p];
+
+		float t[kWideBVHWidth];
+		float v[kWideBVHWidth];
+		float w[kWideBVHWidth];
+		float d[kWideBVHWidth];
+
+		const int mask = IntersectRayTriPacket(packet, rayOrigin, rayDir, closestT, t, v, w, d);
+
+		if (mask == 0)
+			return;
+
+		for (int l=0; l < kWideBVHWidth; ++l)
+		{
+			if ((mask & (1<<l)) && packet.tri[l] >= 0 && t[l] < closestT)
+			{
+				closestT = t[l];
+				closestU = 1.0f - v[l] - w[l];
+				closestV = v[l];
+				closestW = w[l];
+
+				closestTri = packet.tri[l];
+				closestNormal = Vec3(packet.nx[l], packet.ny[l], packet.nz[l])*d[l];
+			}
+		}
+	}
+};
+
+// visits the leaves of a wide BVH whose bounds are hit closer than tmax, children are
+// visited near to far, tmax is re-read at every node so a callback that shortens it
+// (e.g.: by passing a reference to its closest hit distance) culls the remaining children
+template <typename T, typename Node, typename Stats>
+inline void QueryWideBVH(T& callback, const Node* root, const Vec3& origin, const Vec3& dir, const float& tmax, Stats& stats)
+{
+	Vec3 rcpDir;
+	rcpDir.x = 1.0f/dir.x;
+	rcpDir.y = 1.0f/dir.y;
+	rcpDir.z = 1.0f/dir.z;
+
+	// each level can push all but one child more than it pops
+	int stack[kWideBVHWidth*32];
+	stack[0] = 0;
+
+	int count = 1;
+
+	while (count)
+	{
+		const int index = stack[--count];
+
+		if (index < 0)
+		{
+			callback(~index);
+			continue;
+		}
+
+		const Node& node = root[index];
+
+		stats.VisitNode();
+		stats.TestBoxes(kWideBVHWidth);
+
+		float t[kWideBVHWidth];
+		const int mask = IntersectRayWideNode(node, origin, rcpDir, tmax, t);
+
+		if (mask == 0)
+			continue;
+
+		// sort hit children far to near so the nearest ends up on top of the stack
+		int hits[kWideBVHWidth];
+		float hitT[kWideBVHWidth];
+		int numHits = 0;
+
+		for (int i=0; i < kWideBVHWidth; ++i)
+		{
+			if (mask & (1<<i))
+			{
+				int j = numHits++;
+
+				while (j > 0 && hitT[j-1] < t[i])
+				{
+					hits[j] = hits[j-1];
+					hitT[j] = hitT[j-1];
+					--j;
+				}
+
+				hits[j] = node.children[i];
+				hitT[j] = t[i];
+			}
+		}
+
+		for (int i=0; i < numHits; ++i)
+			stack[count++] = hits[i];
+	}
+}
+
+template <typename T, typename Node>
+inline void QueryWideBVH(T& callback, const Node* root, const Vec3& origin, const Vec3& dir, const float& tmax)
+{
+	NullTraversalStats stats;
+	QueryWideBVH(callback, root, origin, dir, tmax, stats);
+}
+
+// visits leaves of a wide BVH hit closer than tmax until the callback returns true,
+// returns whether any callback did, used for occlusion queries so no ordering is done
+template <typename T, typename Node>
+inline bool QueryWideBVHAny(T& callback, const Node* root, const Vec3& origin, const Vec3& dir, float tmax)
+{
+	Vec3 rcpDir;
+	rcpDir.x = 1.0f/dir.x;
+	rcpDir.y = 1.0f/dir.y;
+	rcpDir.z = 1.0f/dir.z;
+
+	int stack[kWideBVHWidth*32];
+	stack[0] = 0;
+
+	int count = 1;
+
+	while (count)
+	{
+		const int index = stack[--count];
+
+		if (index < 0)
+		{
+			if (callback(~index))
+				return true;
+
+			continue;
+		}
+
+		const Node& node = root[index];
+
+		float t[kWideBVHWidth];
+		const int mask = IntersectRayWideNode(node, origin, rcpDir, tmax, t);
+
+		for (int i=0; i < kWideBVHWidth; ++i)
+		{
+			if (mask & (1<<i))
+				stack[count++] = node.children[i];
+		}
+	}
+
+	return false;
+}
+
+#endif // USE_WIDE_BVH
+
+template <typename Stats>
+CUDA_CALLABLE bool inline IntersectRayMesh(const MeshGeometry& mesh, const Vec3& origin, const Vec3& dir, float tmax, float& t, float& u, float& v, float& w, int& tri, Vec3& triNormal, Stats& stats)
+{
+#if USE_WIDE_BVH && !__CUDA_ARCH__
+
+	if (mesh.wideNodes)
+	{
+		MeshPacketQuery query(mesh, origin, dir);
+
+		// only accept hits closer than tmax, the query shortens it as hits are found
+		query.closestT = tmax;
+
+		// every lane of a packet is tested, including the padding
+		TriangleCounter<MeshPacketQuery, Stats> counter(query, stats, kWideBVHWidth);
+
+		QueryWideBVH(counter, mesh.wideNodes, origin, dir, query.closestT, stats);
+
+		if (query.closestT < tmax)
+		{
+			t = query.closestT;
+			u = query.closestU;
+			v = query.closestV;
+			w = query.closestW;	
+			tri = query.closestTri;
+			triNormal = query.closestNormal;
+
+			return true;
+		}
+		else
+		{
+			return false;
+		}
+	}
+
+#endif
+
+#if USE_STACKLESS_BVH
+
+	if (mesh.links)
+	{
+		MeshQuery query(mesh, origin, dir);
+
+		// only accept hits closer than tmax, the query shortens it as hits are found
+		query.closestT = tmax;
+
+		TriangleCounter<MeshQuery, Stats> counter(query, stats, 1);
+
+		QueryBVHStackless(counter, mesh.nodes, mesh.links, origin, dir, query.closestT, stats);
+
+		if (query.closestT < tmax)
+		{
+			t = query.closestT;
+			u = query.closestU;
+			v = query.closestV;
+			w = query.closestW;	
+			tri = query.closestTri;
+			triNormal = query.closestNormal;
+
+			return true;
+		}
+		else
+		{
+			return false;
+		}
+	}
+
+#endif
 
 	MeshQuery query(mesh, origin, dir);
 
+	// only accept hits closer than tmax, which is shortened below as hits are found
+	query.closestT = tmax;
+
+	const float limit = tmax;
+
 	Vec3 rcpDir;
 	rcpDir.x = 1.0f/dir.x;
 	rcpDir.y = 1.0f/dir.y;
@@ -694,8 +1299,12 @@ CUDA_CALLABLE bool inline IntersectRayMesh(const MeshGeometry& mesh, const Vec3&
 	{
 		BVHNode node = fetchNode(mesh.nodes, stack[--count]);
 
+		stats.VisitNode();
+
 		if (node.leaf)
 		{
+			stats.TestTriangles(1);
+
 			query(node.leftIndex);
 
 			// truncate ray
@@ -703,6 +1312,8 @@ CUDA_CALLABLE bool inline IntersectRayMesh(const MeshGeometry& mesh, const Vec3&
 		}
 		else
 		{
+			stats.TestBoxes(2);
+
 			// check children
 			BVHNode left = fetchNode(mesh.nodes, node.leftIndex);
 			BVHNode right = fetchNode(mesh.nodes, node.rightIndex);
@@ -730,7 +1341,7 @@ CUDA_CALLABLE bool inline IntersectRayMesh(const MeshGeometry& mesh, const Vec3&
 	}		
 
 	// output results
-	if (query.closestT < FLT_MAX)
+	if (query.closestT < limit)
 	{
 		t = query.closestT;
 		u = query.closestU;
@@ -748,8 +1359,17 @@ CUDA_CALLABLE bool inline IntersectRayMesh(const MeshGeometry& mesh, const Vec3&
 					
 }
 
-template <typename T>
-CUDA_CALLABLE inline void QueryBVH(T& callback, BVHNode* root, const Vec3& origin, const Vec3& dir)
+CUDA_CALLABLE bool inline IntersectRayMesh(const MeshGeometry& mesh, const Vec3& origin, const Vec3& dir, float tmax, float& t, float& u, float& v, float& w, int& tri, Vec3& triNormal)
+{
+	NullTraversalStats stats;
+	return IntersectRayMesh(mesh, origin, dir, tmax, t, u, v, w, tri, triNormal, stats);
+}
+
+// visits leaves whose bounds are hit closer than tmax, tmax is re-read at every node
+// so a callback that shortens it (e.g.: by passing a reference to its closest hit
+// distance) culls the remaining children
+template <typename T, typename Stats>
+CUDA_CALLABLE inline void QueryBVH(T& callback, BVHNode* root, const Vec3& origin, const Vec3& dir, const float& tmax, Stats& stats)
 {
 	Vec3 rcpDir;
 	rcpDir.x = 1.0f/dir.x;
@@ -765,21 +1385,25 @@ CUDA_CALLABLE inline void QueryBVH(T& callback, BVHNode* root, const Vec3& origi
 	{
 		BVHNode node = fetchNode(root, stack[--count]);
 
+		stats.VisitNode();
+
 		if (node.leaf)
 		{
 			callback(node.leftIndex);
 		}
 		else
 		{
+			stats.TestBoxes(2);
+
 			// check children
 			BVHNode left = fetchNode(root, node.leftIndex);
 			BVHNode right = fetchNode(root, node.rightIndex);
 
 			float tLeft;
-			bool hitLeft = IntersectRayAABBFast(origin, rcpDir, left.bounds.lower, left.bounds.upper, tLeft);
+			bool hitLeft = IntersectRayAABBFast(origin, rcpDir, left.bounds.lower, left.bounds.upper, tLeft) && tLeft < tmax;
 
 			float tRight;
-			bool hitRight = IntersectRayAABBFast(origin, rcpDir, right.bounds.lower, right.bounds.upper, tRight);
+			bool hitRight = IntersectRayAABBFast(origin, rcpDir, right.bounds.lower, right.bounds.upper, tRight) && tRight < tmax;
 
 			// traverse closest first
 			if (hitLeft && hitRight && (tLeft < tRight))
@@ -798,6 +1422,133 @@ CUDA_CALLABLE inline void QueryBVH(T& callback, BVHNode* root, const Vec3& origi
 	}		
 }
 
+template <typename T>
+CUDA_CALLABLE inline void QueryBVH(T& callback, BVHNode* root, const Vec3& origin, const Vec3& dir, const float& tmax)
+{
+	NullTraversalStats stats;
+	QueryBVH(callback, root, origin, dir, tmax, stats);
+}
+
+template <typename T>
+CUDA_CALLABLE inline void QueryBVH(T& callback, BVHNode* root, const Vec3& origin, const Vec3& dir)
+{
+	const float tmax = FLT_MAX;
+	QueryBVH(callback, root, origin, dir, tmax);
+}
+
+// visits leaves hit closer than tmax until the callback returns true, returns whether
+// any callback did, used for occlusion queries where any hit will do
+template <typename T>
+CUDA_CALLABLE inline bool QueryBVHAny(T& callback, const BVHNode* root, const Vec3& origin, const Vec3& dir, float tmax)
+{
+	Vec3 rcpDir;
+	rcpDir.x = 1.0f/dir.x;
+	rcpDir.y = 1.0f/dir.y;
+	rcpDir.z = 1.0f/dir.z;
+
+	int stack[32];
+	stack[0] = 0;
+
+	int count = 1;
+
+	while(count)
+	{
+		BVHNode node = fetchNode(root, stack[--count]);
+
+		if (node.leaf)
+		{
+			if (callback(node.leftIndex))
+				return true;
+		}
+		else
+		{
+			BVHNode left = fetchNode(root, node.leftIndex);
+			BVHNode right = fetchNode(root, node.rightIndex);
+
+			float tLeft;
+			if (IntersectRayAABBFast(origin, rcpDir, left.bounds.lower, left.bounds.upper, tLeft) && tLeft < tmax)
+				stack[count++] = node.leftIndex;
+
+			float tRight;
+			if (IntersectRayAABBFast(origin, rcpDir, right.bounds.lower, right.bounds.upper, tRight) && tRight < tmax)
+				stack[count++] = node.rightIndex;
+		}
+	}
+
+	return false;
+}
+
+// any hit triangle query, returns true for the first triangle hit closer than tmax
+struct MeshOcclusionQuery
+{
+	CUDA_CALLABLE inline MeshOcclusionQuery(const MeshGeometry& m, const Vec3& origin, const Vec3& dir, float tmax) : mesh(m), rayOrigin(origin), rayDir(dir), tmax(tmax) {}
+
+	CUDA_CALLABLE inline bool operator()(int i)
+	{
+		int i0, i1, i2;
+		MeshTriangle(mesh, i, i0, i1, i2);
+
+		const Vec3 a = MeshPosition(mesh, i0);
+		const Vec3 b = MeshPosition(mesh, i1);
+		const Vec3 c = MeshPosition(mesh, i2);
+
+		float t, u, v, w, sign;
+
+		return IntersectRayTriTwoSided(rayOrigin, rayDir, a, b, c, t, u, v, w, sign, NULL) && t > 0.0f && t < tmax;
+	}
+
+	const MeshGeometry& mesh;
+	const Vec3 rayOrigin;
+	const Vec3 rayDir;
+
+	float tmax;
+};
+
+#if USE_WIDE_BVH && !__CUDA_ARCH__
+
+// any hit query against the triangle packets of a wide mesh BVH
+struct MeshPacketOcclusionQuery
+{
+	inline MeshPacketOcclusionQuery(const MeshGeometry& m, const Vec3& origin, const Vec3& dir, float tmax) : query(m, origin, dir), tmax(tmax)
+	{
+		query.closestT = tmax;
+	}
+
+	inline bool operator()(int p)
+	{
+		query(p);
+		return query.closestT < tmax;
+	}
+
+	MeshPacketQuery query;
+	float tmax;
+};
+
+#endif
+
+// returns true if any triangle is hit closer than tmax, exits on the first hit found
+CUDA_CALLABLE inline bool OccludeRayMesh(const MeshGeometry& mesh, const Vec3& origin, const Vec3& dir, float tmax)
+{
+#if USE_WIDE_BVH && !__CUDA_ARCH__
+
+	if (mesh.wideNodes)
+	{
+		MeshPacketOcclusionQuery query(mesh, origin, dir, tmax);
+		return QueryWideBVHAny(query, mesh.wideNodes, origin, dir, tmax);
+	}
+
+#endif
+
+	MeshOcclusionQuery query(mesh, origin, dir, tmax);
+
+#if USE_STACKLESS_BVH
+	if (mesh.links)
+		return QueryBVHAnyStackless(query, mesh.nodes, mesh.links, origin, dir, tmax);
+#endif
+
+	return QueryBVHAny(query, mesh.nodes, origin, dir, tmax);
+}
+
 
 CUDA_CALLABLE bool inline IntersectRayMeshOld(const MeshGeometry& mesh, const Vec3& origin, const Vec3& dir, float tmax, float& t, float& u, float& v, float& w, int& tri, Vec3& triNormal)
 {
@@ -830,7 +1581,7 @@ CUDA_CALLABLE bool inline IntersectRayMeshOld(const MeshGeometry& mesh, const Ve
 //-------------
 // pdf that a point and dir were sampled by the light (assuming the ray hits the shape)
 
-CUDA_CALLABLE inline float PrimitiveArea(const Primitive& p)
+CUDA_CALLABLE inline float PrimitiveArea(const PrimitiveGeometry& p)
 {
 	switch (p.type)
 	{
@@ -845,16 +1596,40 @@ CUDA_CALLABLE inline float PrimitiveArea(const Primitive& p)
 		}
 		case eMesh:
 		{
-			return p.mesh.area*p.endTransform.s;
+			return p.mesh->area*p.endTransform.s;
 		}
 	};
 
 	return 0.0f;
 }
 
-CUDA_CALLABLE inline void PrimitiveSample(const Primitive& p, float time, Vec3& pos, Vec3& normal, Random& rand)
+// transform at the given time, static primitives skip the interpolation
+CUDA_CALLABLE inline Transform PrimitiveTransform(const PrimitiveGeometry& p, float time)
 {
-	Transform transform = InterpolateTransform(p.startTransform, p.endTransform, time);
+	if (p.moving)
+		return InterpolateTransform(p.startTransform, p.endTransform, time);
+	else
+		return p.startTransform;
+}
+
+// moves a ray into the primitive's local space, transform must come from PrimitiveTransform()
+CUDA_CALLABLE inline void PrimitiveLocalRay(const PrimitiveGeometry& p, const Transform& transform, const Vec3& origin, const Vec3& dir, Vec3& localOrigin, Vec3& localDir)
+{
+	if (p.moving)
+	{
+		localOrigin = InverseTransformPoint(transform, origin);
+		localDir = InverseTransformVector(transform, dir);
+	}
+	else
+	{
+		localOrigin = TransformPoint(p.inverseTransform, origin);
+		localDir = TransformVector(p.inverseTransform, dir);
+	}
+}
+
+CUDA_CALLABLE inline void PrimitiveSample(const PrimitiveGeometry& p, float time, Vec3& pos, Vec3& normal, Sampler& rand)
+{
+	const Transform transform = PrimitiveTransform(p, time);
 
 	switch (p.type)
 	{
@@ -875,26 +1650,28 @@ CUDA_CALLABLE inline void PrimitiveSample(const Primitive& p, float time, Vec3&
 		}
 		case eMesh:
 		{
-			float r = rand.Randf();
+			float r1, r2;
+			Sample2D(rand, r1, r2);
 
-			const float* triPtr = LowerBound(p.mesh.cdf, p.mesh.cdf+p.mesh.numIndices/3, r);
-			int tri = Min(int(triPtr-p.mesh.cdf), p.mesh.numIndices/3 - 1);
+			int tri = SampleAlias(p.mesh->triangleTable, p.mesh->numIndices/3, r1, r2);
+
+			float u1, u2;
+			Sample2D(rand, u1, u2);
 
 			float u, v;
-			UniformSampleTriangle(rand, u, v);
+			UniformSampleTriangle(u1, u2, u, v);
 			
 			// interpolate tri data
-			int i0 = fetchInt(p.mesh.indices, tri*3+0);
-			int i1 = fetchInt(p.mesh.indices, tri*3+1);
-			int i2 = fetchInt(p.mesh.indices, tri*3+2);
+			int i0, i1, i2;
+			MeshTriangle(*p.mesh, tri, i0, i1, i2);
 
-			const Vec3 a = fetchVec3(p.mesh.positions, i0);
-			const Vec3 b  = fetchVec3(p.mesh.positions, i1);
-			const Vec3 c = fetchVec3(p.mesh.positions, i2);
+			const Vec3 a = MeshPosition(*p.mesh, i0);
+			const Vec3 b  = MeshPosition(*p.mesh, i1);
+			const Vec3 c = MeshPosition(*p.mesh, i2);
 
-			const Vec3 n1 = fetchVec3(p.mesh.normals, i0);
-			const Vec3 n2  = fetchVec3(p.mesh.normals, i1);
-			const Vec3 n3 = fetchVec3(p.mesh.normals, i2);
+			const Vec3 n1 = MeshNormal(*p.mesh, i0);
+			const Vec3 n2  = MeshNormal(*p.mesh, i1);
+			const Vec3 n3 = MeshNormal(*p.mesh, i2);
 
 	        pos = TransformPoint(transform, u*a + v*b + (1.0f-u-v)*c);
 	        normal = SafeNormalize(TransformVector(transform, u*n1 + v*n2 + (1.0f-u-v)*n3));
@@ -903,7 +1680,7 @@ CUDA_CALLABLE inline void PrimitiveSample(const Primitive& p, float time, Vec3&
 	}
 }
 
-CUDA_CALLABLE inline Bounds PrimitiveBounds(const Primitive& p)
+CUDA_CALLABLE inline Bounds PrimitiveBounds(const PrimitiveGeometry& p)
 {
 	Bounds localBounds;
 
@@ -925,7 +1702,7 @@ CUDA_CALLABLE inline Bounds PrimitiveBounds(const Primitive& p)
 		case eMesh:
 		{
 			// read bounds from bvh root
-			localBounds = p.mesh.nodes[0].bounds;
+			localBounds = p.mesh->nodes[0].bounds;
 			break;
 		}
 	};
@@ -938,6 +1715,39 @@ CUDA_CALLABLE inline Bounds PrimitiveBounds(const Primitive& p)
 
 }
 
+// bounds over the part of the motion between time0 and time1
+CUDA_CALLABLE inline Bounds PrimitiveBounds(const PrimitiveGeometry& p, float time0, float time1)
+{
+	if (!p.moving)
+		return PrimitiveBounds(p);
+
+	// as for the whole shutter the transforms at the ends of the interval are taken to bound the motion
+	PrimitiveGeometry segment = p;
+	segment.startTransform = InterpolateTransform(p.startTransform, p.endTransform, time0);
+	segment.endTransform = InterpolateTransform(p.startTransform, p.endTransform, time1);
+
+	return PrimitiveBounds(segment);
+}
+
+// world space shading normal of a mesh hit, interpolates the vertex normals of the triangle
+CUDA_CALLABLE inline Vec3 MeshHitNormal(const PrimitiveGeometry& p, const Transform& transform, int tri, float u, float v, float w, const Vec3& triNormal)
+{
+	int i0, i1, i2;
+	MeshTriangle(*p.mesh, tri, i0, i1, i2);
+
+	const Vec3 n1 = MeshNormal(*p.mesh, i0);
+	const Vec3 n2  = MeshNormal(*p.mesh, i1);
+	const Vec3 n3 = MeshNormal(*p.mesh, i2);
+
+	Vec3 smoothNormal = u*n1 + v*n2 + w*n3;
+
+	// ensure smooth normal lies on the same side of the geometric normal
+	if (Dot(smoothNormal, triNormal) < 0.0f)
+		smoothNormal *= -1.0f;
+
+	return SafeNormalize(TransformVector(transform, smoothNormal), triNormal);
+}
+
 struct Ray
 {
 	CUDA_CALLABLE inline Ray(const Vec3& o, const Vec3& d, float t) : origin(o), dir(d), time(t) {}
@@ -948,9 +1758,11 @@ struct Ray
 	float time;
 };
 
-CUDA_CALLABLE inline bool PrimitiveIntersect(const Primitive& p, const Ray& ray, float& outT, Vec3* outNormal)
+// meshes only report hits closer than tmax, other types are cheap enough for the caller to check
+template <typename Stats>
+CUDA_CALLABLE inline bool PrimitiveIntersect(const PrimitiveGeometry& p, const Ray& ray, float& outT, Vec3* outNormal, float tmax, Stats& stats)
 {
-	Transform transform = InterpolateTransform(p.startTransform, p.endTransform, ray.time);
+	const Transform transform = PrimitiveTransform(p, ray.time);
 
 	switch (p.type)
 	{
@@ -981,38 +1793,64 @@ CUDA_CALLABLE inline bool PrimitiveIntersect(const Primitive& p, const Ray& ray,
 		}
 		case eMesh:
 		{
-			Vec3 localOrigin = InverseTransformPoint(transform, ray.origin);
-			Vec3 localDir = InverseTransformVector(transform, ray.dir);
+			Vec3 localOrigin, localDir;
+			PrimitiveLocalRay(p, transform, ray.origin, ray.dir, localOrigin, localDir);
 
 			float t, u, v, w;
 			int tri;
 			Vec3 triNormal;
 
 			// transform ray to mesh space
-			bool hit = IntersectRayMesh(p.mesh, localOrigin, localDir, FLT_MAX, t, u, v, w, tri, triNormal);
+			bool hit = IntersectRayMesh(*p.mesh, localOrigin, localDir, tmax, t, u, v, w, tri, triNormal, stats);
 			
 			if (hit)
 			{
-				// interpolate vertex normals
-				int i0 = fetchInt(p.mesh.indices, tri*3+0);
-				int i1 = fetchInt(p.mesh.indices, tri*3+1);
-				int i2 = fetchInt(p.mesh.indices, tri*3+2);
+				outT = t;
+				*outNormal = MeshHitNormal(p, transform, tri, u, v, w, triNormal);
+			}			
 
-				const Vec3 n1 = fetchVec3(p.mesh.normals, i0);
-				const Vec3 n2  = fetchVec3(p.mesh.normals, i1);
-				const Vec3 n3 = fetchVec3(p.mesh.normals, i2);
+			return hit;
+		}
+	}
 
-				Vec3 smoothNormal = u*n1 + v*n2 + w*n3;
+	return false;
+}
 
-				// ensure smooth normal lies on the same side of the geometric normal
-				if (Dot(smoothNormal, triNormal) < 0.0f)
-					smoothNormal *= -1.0f;
+CUDA_CALLABLE inline bool PrimitiveIntersect(const PrimitiveGeometry& p, const Ray& ray, float& outT, Vec3* outNormal, float tmax=FLT_MAX)
+{
+	NullTraversalStats stats;
+	return PrimitiveIntersect(p, ray, outT, outNormal, tmax, stats);
+}
 
-				outT = t;
-				*outNormal = SafeNormalize(TransformVector(transform, smoothNormal), triNormal);
-			}			
+// returns true if the primitive is hit in (0, tmax), skips the normal calculation of PrimitiveIntersect
+CUDA_CALLABLE inline bool PrimitiveOcclude(const PrimitiveGeometry& p, const Ray& ray, float tmax)
+{
+	const Transform transform = PrimitiveTransform(p, ray.time);
 
-			return hit;
+	switch (p.type)
+	{
+		case eSphere:
+		{
+			float minT, maxT;
+			bool hit = IntersectRaySphere(transform.p, p.sphere.radius*transform.s, ray.origin, ray.dir, minT, maxT);
+
+			return hit && minT > 0.0f && minT < tmax;
+		}
+		case ePlane:
+		{
+			float t;
+			bool hit = IntersectRayPlane(ray.origin, ray.dir, Vec4(p.plane.plane[0], p.plane.plane[1], p.plane.plane[2], p.plane.plane[3]), t);
+
+			return hit && t < tmax;
+		}
+		case eMesh:
+		{
+			// transform ray to mesh space, the scale is applied to both origin
+			// and direction so distances are the same in either space
+			Vec3 localOrigin, localDir;
+			PrimitiveLocalRay(p, transform, ray.origin, ray.dir, localOrigin, localDir);
+
+			return OccludeRayMesh(*p.mesh, localOrigin, localDir, tmax);
 		}
 	}
 
@@ -6,15 +6,49 @@
 #include "render.h"
 #include "util.h"
 #include "pfm.h"
+#include "parallel.h"
 
 #include <stdio.h>
 
 #include <map>
 #include <string>
+#include <vector>
 
 static const int kMaxLineLength = 2048;
 
-bool LoadTin(const char* filename, Scene* scene, Camera* camera, Options* options)
+namespace
+{
+
+// procedural volume shared by every bump mapped material
+const int kBumpSize = 128;
+const float kBumpFrequency = 0.1f;
+const int kBumpOctaves = 3;
+const float kBumpPersistence = 0.5f;
+
+// assets referenced by a file and its includes, mesh files, inline mesh builds and the
+// probe are all loaded concurrently once everything has been parsed
+struct PendingAssets
+{
+	// imported meshes keyed by path relative to the working directory, so includes share them,
+	// meshes resident from a previous frame start out non-NULL
+	std::map<std::string, Mesh*> imports;
+	std::vector<Mesh*> builds;
+
+	// file each imported mesh takes its vertices from this frame, keyed like imports
+	std::map<std::string, std::string> deforms;
+
+	// primitive indices, their geometry is resolved once the meshes are ready
+	std::vector<std::pair<int, Mesh*> > meshPrimitives;
+	std::vector<std::pair<int, std::string> > importPrimitives;
+
+	// probe of the last sky parsed if it isn't resident yet
+	std::string probe;
+
+	// materials that need the bump volume
+	std::vector<int> bumpMaterials;
+};
+
+bool ParseTin(const char* filename, Scene* scene, Camera* camera, Options* options, PendingAssets& pending)
 {
 	FILE* file = fopen(filename, "r");
 
@@ -24,8 +58,12 @@ bool LoadTin(const char* filename, Scene* scene, Camera* camera, Options* option
 		return false;
 	}
 
+	// inline meshes by the name this file uses for them, and the imports of mesh files
 	std::map<std::string, Mesh*> meshes;
-	std::map<std::string, Material> materials;
+	std::map<std::string, std::string> meshImports;
+
+	// indices into the scene's material table, shared by every primitive naming them
+	std::map<std::string, int> materials;
 
 	char line[kMaxLineLength];
 
@@ -46,8 +84,25 @@ bool LoadTin(const char* filename, Scene* scene, Camera* camera, Options* option
 			char path[kMaxLineLength];
 			MakeRelativePath(filename, name, path);
 
-			// recursive file processing
-			LoadTin(path, scene, camera, options);
+			// recursive file processing, assets are loaded along with this file's
+			ParseTin(path, scene, camera, options, pending);
+		}
+
+		//--------------------------------------------
+		// Deformed meshes, e.g.: deform cloth.obj cloth_12.obj renders the vertices of cloth_12.obj,
+		// batch frames refit the trees of the resident cloth.obj rather than building their own
+
+		char frameName[kMaxLineLength];
+
+		if (sscanf(line, "deform %s %s", name, frameName) == 2)
+		{
+			char path[kMaxLineLength];
+			char framePath[kMaxLineLength];
+
+			MakeRelativePath(filename, name, path);
+			MakeRelativePath(filename, frameName, framePath);
+
+			pending.deforms[path] = framePath;
 		}
 
 		//--------------------------------------------
@@ -64,6 +119,21 @@ bool LoadTin(const char* filename, Scene* scene, Camera* camera, Options* option
 				sscanf(line, " height %d", &options->height);
 				sscanf(line, " maxSamples %d", &options->maxSamples);
 				sscanf(line, " maxDepth %d", &options->maxDepth);
+				sscanf(line, " rouletteDepth %d", &options->rouletteDepth);
+				sscanf(line, " adaptiveThreshold %f", &options->adaptiveThreshold);
+				sscanf(line, " adaptiveMinSamples %d", &options->adaptiveMinSamples);
+
+				int features;
+				if (sscanf(line, " features %d", &features) == 1)
+					options->features = features != 0;
+
+				int reorderPaths;
+				if (sscanf(line, " reorderPaths %d", &reorderPaths) == 1)
+					options->reorderPaths = reorderPaths != 0;
+
+				int compressMeshes;
+				if (sscanf(line, " compressMeshes %d", &compressMeshes) == 1)
+					options->compressMeshes = compressMeshes != 0;
 
 
 				sscanf(line, " clamp %f", &options->clamp);
@@ -71,12 +141,29 @@ bool LoadTin(const char* filename, Scene* scene, Camera* camera, Options* option
 				sscanf(line, " exposure %f", &options->exposure);
 
 
+				// rebuild the filter so its table matches the new parameters
 				char type[kMaxLineLength];
-				sscanf(line, " filter %s %f %f", type, &options->filter.width, &options->filter.falloff);
-				if (strcmp(type, "box") == 0)
-					options->filter.type = eFilterBox;
-				if (strcmp(type, "gaussian") == 0)
-					options->filter.type = eFilterGaussian;				
+				float filterWidth = options->filter.width;
+				float filterFalloff = options->filter.falloff;
+
+				if (sscanf(line, " filter %s %f %f", type, &filterWidth, &filterFalloff) >= 1)
+				{
+					FilterType filterType = options->filter.type;
+
+					if (strcmp(type, "box") == 0)
+						filterType = eFilterBox;
+					if (strcmp(type, "gaussian") == 0)
+						filterType = eFilterGaussian;
+
+					options->filter = Filter(filterType, filterWidth, filterFalloff);
+				}
+
+				char sampler[kMaxLineLength] = "";
+				sscanf(line, " sampler %s", sampler);
+				if (strcmp(sampler, "random") == 0)
+					options->sampler = eSamplerRandom;
+				if (strcmp(sampler, "sobol") == 0)
+					options->sampler = eSamplerSobol;
 			}
 		}
 
@@ -128,6 +215,8 @@ bool LoadTin(const char* filename, Scene* scene, Camera* camera, Options* option
 		{
 			Sky sky;
 
+			pending.probe.clear();
+
 			while (fgets(line, kMaxLineLength, file))
 			{
 				// end group
@@ -143,7 +232,19 @@ bool LoadTin(const char* filename, Scene* scene, Camera* camera, Options* option
 					char path[kMaxLineLength];
 					MakeRelativePath(filename, probeName, path);
 
-					sky.probe = ProbeLoadFromFile(path);
+					// probes kept from a previous frame are used as is
+					Scene::ProbeCache::iterator resident = scene->residentProbes.find(path);
+
+					if (resident != scene->residentProbes.end())
+					{
+						sky.probe = resident->second;
+						pending.probe.clear();
+					}
+					else
+					{
+						sky.probe = Probe();
+						pending.probe = path;
+					}
 				}
 			}
 
@@ -195,38 +296,6 @@ bool LoadTin(const char* filename, Scene* scene, Camera* camera, Options* option
 
 			}
 
-			/*
-			if (material.bump > 0.0f)
-			{
-				// create Perlin bump map
-				int width = 128;
-				int height = 128;
-				int depth = 128;
-				
-				float* data = new float[width*height*depth];
-
-				float freq = 0.1f;
-
-				for (int z=0; z < depth; ++z)
-				{
-					for (int y=0; y < height; ++y)
-					{
-						for (int x=0; x < width; ++x)
-						{
-							data[z*width*height + y*width + x] = Perlin3DPeriodic(x*freq, y*freq, z*freq, width, height, depth, 3, 0.5f);
-						}
-					}
-				}	
-
-				material.bumpMap.data = data;
-				material.bumpMap.width = width;
-				material.bumpMap.height = height;
-				material.bumpMap.depth = depth;
-
-
-			}
-			*/
-
 			// if atDistance set then infer absorption from transmissionColor
 			if (atDistance > 0.0f)
 			{
@@ -235,7 +304,11 @@ bool LoadTin(const char* filename, Scene* scene, Camera* camera, Options* option
 
 
 			// add material to map
-			materials[name] = material;
+			materials[name] = scene->AddMaterial(material);
+
+			// the bump volume is created with the other assets
+			if (material.bump > 0.0f)
+				pending.bumpMaterials.push_back(materials[name]);
 		}
 
 		//--------------------------------------------
@@ -245,8 +318,6 @@ bool LoadTin(const char* filename, Scene* scene, Camera* camera, Options* option
 		{			
 			Primitive primitive;
 
-			bool valid = true;
-
 			while (fgets(line, kMaxLineLength, file))
 			{
 				// end group
@@ -324,41 +395,33 @@ bool LoadTin(const char* filename, Scene* scene, Camera* camera, Options* option
 
 				if (sscanf(line, " mesh %s", path) == 1)
 				{
-					// look up in the mesh array
-					if (meshes.find(path) != meshes.end())
-					{
-						primitive.mesh = GeometryFromMesh(meshes[path]);
-					}
-					else
+					const int index = int(scene->primitives.size());
+
+					// look up in the mesh array, otherwise queue an import
+					if (meshes.find(path) == meshes.end() && meshImports.find(path) == meshImports.end())
 					{
 						char relativePath[kMaxLineLength];
 
 						// make relative path to .tin
 						MakeRelativePath(filename, path, relativePath);
 
-						// import mesh
-						Mesh* mesh = ImportMesh(relativePath);
-
-						if (mesh)
-						{
-							primitive.mesh = GeometryFromMesh(mesh);							
-
-							meshes[path] = mesh;
-						}
-						else
-						{
-							printf("Failed to import mesh %s\n", path);
-							fflush(stdout);
+						// meshes kept from a previous frame are checked against the compression
+						// options once the whole file has been parsed
+						Scene::MeshCache::iterator resident = scene->residentMeshes.find(relativePath);
 
-							valid = false;
-						}
+						meshImports[path] = relativePath;
+						pending.imports[relativePath] = resident != scene->residentMeshes.end() ? resident->second : NULL;
 					}
+
+					if (meshes.find(path) != meshes.end())
+						pending.meshPrimitives.push_back(std::make_pair(index, meshes[path]));
+					else
+						pending.importPrimitives.push_back(std::make_pair(index, meshImports[path]));
 				}
 			}
 
 			// add to scene
-			if (valid)
-				scene->AddPrimitive(primitive);
+			scene->AddPrimitive(primitive);
 		}
 
 		//--------------------------------------------
@@ -411,18 +474,184 @@ bool LoadTin(const char* filename, Scene* scene, Camera* camera, Options* option
 				}
 			}
 
+			meshes[name] = mesh;
+			pending.builds.push_back(mesh);
+		}
+	}
+
+	fclose(file);
+
+	return true;
+}
+
+} // anonymous namespace
+
+bool LoadTin(const char* filename, Scene* scene, Camera* camera, Options* options)
+{
+	PendingAssets pending;
+
+	if (!ParseTin(filename, scene, camera, options, pending))
+		return false;
+
+	// imports, builds and the probe run as one parallel loop, each BVH build spawns its
+	// own subtree tasks so large meshes still use all workers, startup is then bounded
+	// by the largest asset rather than the sum of them
+	std::vector<std::pair<std::string, Mesh*> > imports(pending.imports.begin(), pending.imports.end());
+
+	const int numImports = int(imports.size());
+	const int numBuilds = int(pending.builds.size());
+
+	// the vertices each import is asked for, and those its resident mesh already has
+	std::vector<std::string> frames(numImports);
+	std::vector<std::string> deformations(numImports);
+
+	for (int i=0; i < numImports; ++i)
+	{
+		std::map<std::string, std::string>::const_iterator frame = pending.deforms.find(imports[i].first);
+		std::map<std::string, std::string>::const_iterator applied = scene->residentDeformations.find(imports[i].first);
+
+		if (frame != pending.deforms.end())
+			frames[i] = frame->second;
+
+		if (imports[i].second && applied != scene->residentDeformations.end())
+			deformations[i] = applied->second;
+	}
+
+	Probe probe;
+
+	// the bump volume is keyed by its parameters and cached on disk next to the scene
+	char bumpKey[kMaxLineLength];
+	sprintf(bumpKey, "perlin.cache-%d-%g-%d-%g.bin", kBumpSize, kBumpFrequency, kBumpOctaves, kBumpPersistence);
+
+	char bumpPath[kMaxLineLength];
+	MakeRelativePath(filename, bumpKey, bumpPath);
+
+	Scene::TextureCache::iterator bump = scene->residentTextures.find(bumpKey);
+
+	const bool createBump = !pending.bumpMaterials.empty() && bump == scene->residentTextures.end();
+	const int numProbes = int(!pending.probe.empty());
+
+	Texture bumpMap;
+
+	ParallelFor(numImports + numBuilds + numProbes + int(createBump), [&](int index, int worker)
+	{
+		if (index < numImports)
+		{
+			Mesh* mesh = imports[index].second;
+
+			const std::string& frame = frames[index];
+			const bool redeform = frame != deformations[index];
+
+			// compression and deformation can't be undone so resident meshes are imported again
+			// to go back, compressed meshes are also deformed from a fresh import
+			if (!mesh || (mesh->compressed && (!options->compressMeshes || redeform)) || (redeform && frame.empty()))
+			{
+				mesh = ImportMesh(imports[index].first.c_str());
+				deformations[index].clear();
+			}
+
+			if (mesh && frame.size() && frame != deformations[index])
+			{
+				double start = GetSeconds();
+
+				Mesh* target = ImportMeshVertices(frame.c_str());
+
+				if (target && mesh->Deform(*target))
+				{
+					deformations[index] = frame;
+
+					printf("Deformed mesh %s to %s in %fms\n", imports[index].first.c_str(), frame.c_str(), (GetSeconds()-start)*1000.0f);
+				}
+				else if (target)
+				{
+					printf("Could not deform mesh %s to %s, the triangles differ\n", imports[index].first.c_str(), frame.c_str());
+				}
+				else
+				{
+					printf("Could not import mesh %s\n", frame.c_str());
+				}
+
+				delete target;
+			}
+
+			if (mesh && options->compressMeshes && !mesh->compressed)
+				mesh->Compress();
+
+			imports[index].second = mesh;
+		}
+		else if (index < numImports + numBuilds)
+		{
+			Mesh* mesh = pending.builds[index-numImports];
+
+			// quantized as part of the build
+			mesh->compressed = options->compressMeshes;
+
 			mesh->CalculateNormals();
 			mesh->RebuildBVH();
+		}
+		else if (index < numImports + numBuilds + numProbes)
+		{
+			probe = ProbeLoadFromFile(pending.probe.c_str());
+		}
+		else
+		{
+			bumpMap = CreatePerlinTexture(kBumpSize, kBumpSize, kBumpSize, kBumpFrequency, kBumpOctaves, kBumpPersistence, bumpPath);
+		}
+	});
 
-			meshes[name] = mesh;
+	if (createBump)
+		bump = scene->residentTextures.insert(std::make_pair(std::string(bumpKey), bumpMap)).first;
+
+	for (size_t i=0; i < pending.bumpMaterials.size(); ++i)
+		scene->materials[pending.bumpMaterials[i]].bumpMap = bump->second;
+
+	if (probe.valid)
+	{
+		scene->residentProbes[pending.probe] = probe;
+		scene->sky.probe = probe;
+	}
+
+	for (int i=0; i < numImports; ++i)
+	{
+		if (imports[i].second)
+		{
+			// imported meshes stay resident, keyed by file, replacing a resident mesh imported again
+			Mesh*& resident = scene->residentMeshes[imports[i].first];
+
+			if (resident != imports[i].second)
+				delete resident;
+
+			resident = imports[i].second;
+			pending.imports[imports[i].first] = imports[i].second;
+
+			if (deformations[i].size())
+				scene->residentDeformations[imports[i].first] = deformations[i];
+			else
+				scene->residentDeformations.erase(imports[i].first);
+		}
+		else
+		{
+			printf("Failed to import mesh %s\n", imports[i].first.c_str());
+			fflush(stdout);
 		}
 	}
 
-	// keep list of meshes
-	for (std::map<std::string, Mesh*>::iterator iter=meshes.begin(); iter != meshes.end(); ++iter)
-		scene->meshes.push_back(iter->second);
+	for (size_t i=0; i < pending.meshPrimitives.size(); ++i)
+		scene->primitives[pending.meshPrimitives[i].first].mesh = scene->GetMeshGeometry(pending.meshPrimitives[i].second);
 
-	fclose(file);
+	// resolve imported mesh primitives, removing those whose mesh failed to import
+	for (size_t i=pending.importPrimitives.size(); i > 0; --i)
+	{
+		const int index = pending.importPrimitives[i-1].first;
+
+		if (Mesh* mesh = pending.imports[pending.importPrimitives[i-1].second])
+			scene->primitives[index].mesh = scene->GetMeshGeometry(mesh);
+		else
+			scene->primitives.erase(scene->primitives.begin() + index);
+	}
+
+	// inline meshes are owned by the frame
+	scene->meshes.insert(scene->meshes.end(), pending.builds.begin(), pending.builds.end());
 
 	return true;
-}
\ No newline at end of file
+}
@@ -7,8 +7,11 @@
 #include "util.h"
 #include "png.h"
 #include "nlm.h"
+#include "pfm.h"
 #include "disney.h"
 #include "sampler.h"
+#include "benchmark.h"
+#include "parallel.h"
 
 #if _WIN32
 
@@ -29,6 +32,7 @@
 #endif
 
 #include <iostream>
+#include <algorithm>
 
 using namespace std;
 
@@ -39,6 +43,18 @@ Mat44 g_camTransform;
 float g_flySpeed = 0.5f;
 bool g_flyMode = false;
 
+// interactive frames aim to take g_frameBudget seconds, the samples taken per frame follow
+// the rate of the previous frames
+float g_frameBudget = 1.0f/30.0f;
+float g_frameSamples = 1.0f;
+
+// while the fly camera moves frames take a single sample at 1/g_previewScale of the resolution,
+// the scale coarsens until moving fits the budget, accumulation restarts once the camera settles
+int g_previewScale = 1;
+int g_renderScale = 1;
+double g_lastMotion = 0.0;
+bool g_resetFrame = false;
+
 // renderer
 Renderer* g_renderer;
 
@@ -52,6 +68,11 @@ Color* g_pixels;
 Color* g_filtered;
 Color* g_exposed;
 
+// first hit features for the guided filter, filled when g_options.features is set
+Color* g_albedo;
+Color* g_normal;
+Color* g_depth;
+
 // total sample count so far
 int g_sampleCount;
 
@@ -63,6 +84,32 @@ int g_nlmWidth = 0;
 bool g_batchMode = false;
 int g_batchIndex = 0;
 
+// render every frame to completion and write it out without opening a window
+bool g_headless = false;
+
+// distributed rendering, node g_nodeIndex of g_numNodes renders its share of each frame's
+// samples and writes them out raw, the merge pass sums the shares of g_mergeNodes nodes
+int g_nodeIndex = 0;
+int g_numNodes = 0;
+int g_mergeNodes = 0;
+
+// headless renders write their raw samples every g_checkpointInterval seconds and -resume
+// continues from the last checkpoint, so preempted jobs don't start over
+float g_checkpointInterval = 0.0f;
+bool g_resume = false;
+
+// samples restored from a checkpoint, the renderer continues the sequence after them
+int g_resumedSamples = 0;
+
+// also write finished frames as linear radiance so exposure can be changed without a re-render
+bool g_writeHdr = false;
+
+// render on every visible CUDA device from a single scene load
+bool g_multiGpu = false;
+
+// megabytes of mesh geometry kept on the GPU, larger scenes are streamed by the wavefront renderer, zero disables
+int g_meshBudget = 0;
+
 int g_argc;
 char** g_argv;
 
@@ -70,21 +117,230 @@ const char* g_outputFile;
 
 double GetSeconds();
 
+// path of a file written next to the output image, replaces the image's extension with suffix
+std::string OutputPath(const std::string& suffix)
+{
+    const char* extension = strrchr(g_outputFile, '.');
+
+    std::string path = extension ? std::string(g_outputFile, extension) : std::string(g_outputFile);
+    path += suffix;
+
+    return path;
+}
+
+// writes a feature buffer next to the output image for external denoisers, e.g.: output.albedo.pfm
+void WriteFeature(const Color* feature, const char* name)
+{
+    const std::string path = OutputPath(std::string(".") + name + ".pfm");
+
+    const int numPixels = g_options.width*g_options.height;
+
+    std::vector<float> data(numPixels*3);
+
+    for (int i=0; i < numPixels; ++i)
+    {
+        data[i*3+0] = feature[i].x;
+        data[i*3+1] = feature[i].y;
+        data[i*3+2] = feature[i].z;
+    }
+
+    PfmImage image;
+    image.width = g_options.width;
+    image.height = g_options.height;
+    image.depth = 1;
+    image.data = &data[0];
+
+    PfmSave(path.c_str(), image);
+}
+
+// the raw samples a node writes next to the output image, e.g.: output.node3.accum
+std::string NodeFile(int node)
+{
+    char suffix[64];
+    sprintf(suffix, ".node%d.accum", node);
+
+    return OutputPath(suffix);
+}
+
+// nodes checkpoint their own share, e.g.: output.checkpoint.accum or output.node3.checkpoint.accum
+std::string CheckpointFile()
+{
+    char suffix[64];
+
+    if (g_numNodes > 0)
+        sprintf(suffix, ".node%d.checkpoint.accum", g_nodeIndex);
+    else
+        sprintf(suffix, ".checkpoint.accum");
+
+    return OutputPath(suffix);
+}
+
+// writes the raw samples taken so far along with the range of the sample sequence they cover
+bool SaveSamples(const std::string& path)
+{
+    AccumImage image;
+    image.width = g_options.width;
+    image.height = g_options.height;
+    image.firstSample = g_options.sampleOffset-g_resumedSamples;
+    image.numSamples = g_sampleCount;
+    image.data = (float*)g_pixels;
+
+    if (!AccumSave(path.c_str(), image))
+    {
+        printf("Couldn't open %s for writing.\n", path.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+// written to a temporary first so that being preempted mid-write keeps the previous checkpoint
+void WriteCheckpoint()
+{
+    const std::string path = CheckpointFile();
+    const std::string temp = path + ".tmp";
+
+    if (!SaveSamples(temp))
+        return;
+
+#if _WIN32
+    // rename doesn't replace existing files on windows
+    remove(path.c_str());
+#endif
+
+    rename(temp.c_str(), path.c_str());
+}
+
+// continues from the checkpoint of an earlier run of the same frame if there is one
+void ResumeCheckpoint()
+{
+    const std::string path = CheckpointFile();
+
+    AccumImage image;
+    if (!AccumLoad(path.c_str(), image))
+        return;
+
+    if (image.width != g_options.width || image.height != g_options.height || image.firstSample != g_options.sampleOffset || image.numSamples > g_options.maxSamples)
+    {
+        printf("%s was written for a different frame, starting over\n", path.c_str());
+
+        delete[] image.data;
+        return;
+    }
+
+    const int numPixels = g_options.width*g_options.height;
+
+    std::copy(image.data, image.data + numPixels*4, (float*)g_pixels);
+
+    delete[] image.data;
+
+    // renderers that keep their own accumulation are handed the restored samples
+    if (!g_renderer->Resume(g_pixels))
+    {
+        printf("%s can't be resumed with this renderer, starting over\n", path.c_str());
+
+        std::fill(g_pixels, g_pixels + numPixels, Color(0.0f));
+        return;
+    }
+
+    // the streams only depend on the sample index so the renderer picks up where the checkpoint ended
+    g_sampleCount = image.numSamples;
+    g_resumedSamples = image.numSamples;
+    g_options.sampleOffset += image.numSamples;
+
+    printf("Resumed %s at %d samples\n", path.c_str(), g_sampleCount);
+}
+
+// writes the frame's radiance before exposure and tone mapping, e.g.: output.pfm
+void WriteRadiance()
+{
+    const int numPixels = g_options.width*g_options.height;
+
+    std::vector<float> data(numPixels*3);
+
+    for (int i=0; i < numPixels; ++i)
+    {
+        const float s = g_pixels[i].w > 0.0f ? 1.0f/g_pixels[i].w : 0.0f;
+
+        data[i*3+0] = g_pixels[i].x*s;
+        data[i*3+1] = g_pixels[i].y*s;
+        data[i*3+2] = g_pixels[i].z*s;
+    }
+
+    PfmImage image;
+    image.width = g_options.width;
+    image.height = g_options.height;
+    image.depth = 1;
+    image.data = &data[0];
+
+    PfmSave(OutputPath(".pfm").c_str(), image);
+}
+
+// nodes take contiguous ranges of the sample sequence, so the merged frame is
+// the same as one rendered by a single process
+void AssignNodeSamples()
+{
+    if (g_numNodes == 0)
+        return;
+
+    const long long numSamples = g_options.maxSamples;
+
+    const int first = int(numSamples*g_nodeIndex/g_numNodes);
+    const int last = int(numSamples*(g_nodeIndex+1)/g_numNodes);
+
+    g_options.sampleOffset = first;
+    g_options.maxSamples = last-first;
+
+    // convergence is a property of the whole frame which no single node sees
+    if (g_options.adaptiveThreshold > 0.0f)
+    {
+        printf("Adaptive sampling is disabled for distributed rendering\n");
+        g_options.adaptiveThreshold = 0.0f;
+    }
+}
+
+// restarts accumulation, buffers are only reallocated by renderers if the size changed
+void ResetFrame(int width, int height)
+{
+    std::fill(g_pixels, g_pixels+width*height, Color(0.0f));
+
+    g_sampleCount = 0;
+    g_resumedSamples = 0;
+
+	g_renderer->Init(width, height);
+}
+
+// the camera changed, the next frame starts over and previews while the motion continues
+void CameraMoved()
+{
+	g_lastMotion = GetSeconds();
+	g_resetFrame = true;
+}
+
 void InitFrameBuffer()
 {
     delete[] g_pixels;
     delete[] g_filtered;
     delete[] g_exposed;
 
+    delete[] g_albedo;
+    delete[] g_normal;
+    delete[] g_depth;
+
     g_pixels = new Color[g_options.width*g_options.height];
     g_filtered = new Color[g_options.width*g_options.height];
     g_exposed = new Color[g_options.width*g_options.height];
 
-    g_sampleCount = 0;
+    g_albedo = new Color[g_options.width*g_options.height];
+    g_normal = new Color[g_options.width*g_options.height];
+    g_depth = new Color[g_options.width*g_options.height];
 
 	printf("%d %d\n", g_options.width, g_options.height);
 
-	g_renderer->Init(g_options.width, g_options.height);
+	ResetFrame(g_options.width, g_options.height);
+
+	g_renderScale = 1;
+	g_resetFrame = false;
 }
 
 #include "tests/testMaterials.h"
@@ -116,6 +372,12 @@ void ProcessCommandLine(int argc, char* argv[])
 
             g_batchMode = true;
         }
+        else if (g_headless && !g_outputFile)
+        {
+            static char output[2048];
+            sprintf(output, "%s.png", filename);
+            g_outputFile = output;
+        }
 
         bool success = false;
 
@@ -127,6 +389,13 @@ void ProcessCommandLine(int argc, char* argv[])
 
         if (!success)
         {
+            // a batch ends at the first frame that's missing
+            if (g_batchMode && g_batchIndex > 0)
+            {
+                printf("Finished batch of %d frames\n", g_batchIndex);
+                exit(0);
+            }
+
             printf("Couldn't open %s for reading.\n", filename);
             exit(-1);
         }
@@ -147,6 +416,27 @@ void ProcessCommandLine(int argc, char* argv[])
 		sscanf(argv[i], "-height=%d", &g_options.height);
 		sscanf(argv[i], "-exposure=%f", &g_options.exposure);
 		sscanf(argv[i], "-maxdepth=%d", &g_options.maxDepth);
+		sscanf(argv[i], "-roulette=%d", &g_options.rouletteDepth);
+		sscanf(argv[i], "-adaptive=%f", &g_options.adaptiveThreshold);
+
+		if (strcmp(argv[i], "-features") == 0)
+			g_options.features = true;
+
+		if (strcmp(argv[i], "-reorder") == 0)
+			g_options.reorderPaths = true;
+
+		sscanf(argv[i], "-checkpoint=%f", &g_checkpointInterval);
+		sscanf(argv[i], "-budget=%f", &g_frameBudget);
+		sscanf(argv[i], "-meshbudget=%d", &g_meshBudget);
+
+		if (strcmp(argv[i], "-resume") == 0)
+			g_resume = true;
+
+		if (strcmp(argv[i], "-hdr") == 0)
+			g_writeHdr = true;
+
+		if (strcmp(argv[i], "-multigpu") == 0)
+			g_multiGpu = true;
 
         // convert a mesh to flat binary format
         if (strstr(argv[i], "-convert") && filename)
@@ -186,7 +476,15 @@ void Init(int argc, char* argv[])
     g_options.limit = 1.5f;
 	g_options.clamp = FLT_MAX;
 	g_options.maxDepth = 4;
+	g_options.rouletteDepth = 3;
 	g_options.maxSamples = INT_MAX;
+	g_options.sampler = eSamplerSobol;
+	g_options.adaptiveThreshold = 0.0f;
+	g_options.adaptiveMinSamples = 16;
+	g_options.features = false;
+	g_options.reorderPaths = false;
+	g_options.sampleOffset = 0;
+	g_options.compressMeshes = false;
 
     g_camera.position = Vec3(0.0f, 1.0f, 5.0f);
     g_camera.rotation = Quat();
@@ -195,6 +493,8 @@ void Init(int argc, char* argv[])
     // allow command line to override options
     ProcessCommandLine(argc, argv);
 
+    AssignNodeSamples();
+
     // initialize scene
     g_scene.Build();
 
@@ -202,24 +502,141 @@ void Init(int argc, char* argv[])
 	g_camPos = g_camera.position;	
 
 
+	// renderers from the previous batch frame keep their resources if they can
+	if (g_renderer && !g_renderer->Update(&g_scene))
+	{
+		delete g_renderer;
+		g_renderer = NULL;
+	}
+
+	if (!g_renderer)
+	{
 #if _WIN32
-    // create renderer
-    g_renderer = CreateGpuRenderer(&g_scene);
-	//g_renderer = CreateNullRenderer(&g_scene);
-	//g_renderer = CreateGpuWavefrontRenderer(&g_scene);
+		// create renderer
+		if (g_multiGpu)
+			g_renderer = CreateMultiGpuRenderer(&g_scene);
+		else if (g_meshBudget > 0)
+			g_renderer = CreateGpuWavefrontRenderer(&g_scene, size_t(g_meshBudget)*1024*1024);
+		else
+			g_renderer = CreateGpuRenderer(&g_scene);
+		//g_renderer = CreateNullRenderer(&g_scene);
+		//g_renderer = CreateGpuWavefrontRenderer(&g_scene);
 #else
-    g_renderer = CreateCpuRenderer(&g_scene);
-	//g_renderer = CreateCpuWavefrontRenderer(&g_scene);
+		g_renderer = CreateCpuRenderer(&g_scene);
+		//g_renderer = CreateCpuWavefrontRenderer(&g_scene);
 #endif
+	}
 
 	double end = GetSeconds();
 
 	printf("Created renderer in %fms\n", (end-start)*1000.0f);
 
     InitFrameBuffer();
+
+    if (g_headless && g_resume && g_mergeNodes == 0)
+        ResumeCheckpoint();
 }
 
 
+// tone maps the samples and applies the optional filter, returns the image to present or save
+Color* Develop(const Options& options)
+{
+    Color* presentMem = g_pixels;
+
+    if (options.mode == ePathTrace)
+    {
+        const int numPixels = options.width*options.height;
+
+        // tone mapped in rows spread over the workers
+        const int kRowsPerTask = 16;
+        const int numTasks = (options.height + kRowsPerTask - 1)/kRowsPerTask;
+
+        ParallelFor(numTasks, [&](int task, int worker)
+        {
+            const int begin = task*kRowsPerTask*options.width;
+            const int end = Min(begin + kRowsPerTask*options.width, numPixels);
+
+            for (int i=begin; i < end; ++i)
+            {
+                //assert(g_pixels[i].w > 0.0f);
+
+                float s = options.exposure / g_pixels[i].w;
+
+                g_filtered[i] = LinearToSrgb(ToneMap(g_pixels[i] * s, options.limit));
+            }
+        });
+
+        if (g_nlmWidth)
+        {
+            // the GPU renderer filters its samples before they are read back unless features guide the filter
+            if (options.features && g_renderer->GetFeatures(g_albedo, g_normal, g_depth))
+                NonLocalMeansFeatureFilter(g_filtered, g_albedo, g_normal, g_depth, g_exposed, options.width, options.height, g_nlmFalloff, g_nlmWidth);
+            else if (!g_renderer->FilterNonLocalMeans(options, g_nlmFalloff, g_nlmWidth, g_exposed))
+                NonLocalMeansFilter(g_filtered, g_exposed, options.width, options.height, g_nlmFalloff, g_nlmWidth);
+
+            presentMem = g_exposed;
+        }
+        else
+        {
+            presentMem = g_filtered;
+        }
+    }
+
+    return presentMem;
+}
+
+// prints the per-stage timings of a wavefront renderer's last frame
+void PrintWavefrontStats(const WavefrontStats& stats)
+{
+    const char* names[eNumWavefrontStages] = { "generate", "advance", "reorder", "lights", "bsdfs", "terminate" };
+
+    printf("wavefront: %d waves of %d paths\n", stats.numWaves, stats.pathsPerWave);
+
+    for (int i=0; i < eNumWavefrontStages; ++i)
+        printf("    %-10s %8.3fms %10llu paths %10llu rays\n", names[i], stats.time[i], stats.paths[i], stats.rays[i]);
+
+    printf("    active paths per bounce:");
+
+    for (int i=0; i < Min(stats.numBounces, kMaxWavefrontBounces); ++i)
+        printf(" %llu", stats.activePaths[i]);
+
+    printf("\n");
+}
+
+// writes the finished frame and its features
+void WriteOutput()
+{
+    if (!g_outputFile)
+        return;
+
+    // nodes leave developing the frame to the merge pass
+    if (g_numNodes > 0)
+    {
+        SaveSamples(NodeFile(g_nodeIndex));
+        return;
+    }
+
+    // encoded in the background, the next frame of a batch can start loading meanwhile
+    WritePngAsync(g_filtered, g_options.width, g_options.height, g_outputFile);
+
+    if (g_writeHdr)
+        WriteRadiance();
+
+    // features are not merged across nodes
+    if (g_options.features && g_mergeNodes == 0 && g_renderer->GetFeatures(g_albedo, g_normal, g_depth))
+    {
+        WriteFeature(g_albedo, "albedo");
+        WriteFeature(g_normal, "normal");
+        WriteFeature(g_depth, "depth");
+    }
+}
+
+// bounds of the interactive scheduler, and how long the camera has to be still before
+// previews give way to full resolution accumulation
+const int kMaxFrameSamples = 256;
+const int kMaxPreviewScale = 8;
+const double kMotionSettleTime = 0.2;
+
 void Render()
 {
     Camera camera;
@@ -236,50 +653,70 @@ void Render()
     {
         camera = g_camera;
     }
+
+	// previews are rendered at a reduced size and zoomed up when presented
+	const bool moving = g_flyMode && GetSeconds()-g_lastMotion < kMotionSettleTime;
+	const int scale = moving ? g_previewScale : 1;
+
+	Options options = g_options;
+	options.width = Max(1, g_options.width/scale);
+	options.height = Max(1, g_options.height/scale);
+
+	if (g_resetFrame || scale != g_renderScale)
+	{
+		ResetFrame(options.width, options.height);
+
+		g_renderScale = scale;
+		g_resetFrame = false;
+	}
     
 	double startTime = GetSeconds();
 
-	const int numSamples = 16;
+	const int numSamples = moving ? 1 : Clamp(int(g_frameSamples), 1, kMaxFrameSamples);
 
-	if (g_sampleCount < g_options.maxSamples)
+	int taken = 0;
+
+	if (g_sampleCount < options.maxSamples && !g_renderer->Converged())
 	{
-		for (int i=0; i < numSamples; ++i)
-		{
-			// take one more sample per-pixel each frame for progressive rendering
-			g_renderer->Render(camera, g_options, g_pixels);
-		}
+		// take more samples per-pixel each frame for progressive rendering
+		taken = Min(numSamples, options.maxSamples-g_sampleCount);
+
+		g_renderer->RenderSamples(camera, options, g_pixels, taken);
 	}
 
 	double endRenderTime = GetSeconds();
 
-	// copy to frame buffer
-    Color* presentMem = g_pixels;
+    g_sampleCount += taken;
 
-    g_sampleCount += numSamples;
+	const double renderTime = endRenderTime-startTime;
 
-    if (g_options.mode == ePathTrace)
-    {
-        int numPixels = g_options.width*g_options.height;
+	if (taken && renderTime > 0.0)
+	{
+		if (moving)
+		{
+			if (renderTime > g_frameBudget && g_previewScale < kMaxPreviewScale)
+				g_previewScale *= 2;
+			else if (renderTime < g_frameBudget*0.25f && g_previewScale > 1)
+				g_previewScale /= 2;
+		}
+		else
+		{
+			// timings of short frames are noisy so the count at most halves or doubles per frame
+			const float target = float(taken*g_frameBudget/renderTime);
 
-        for (int i=0; i < numPixels; ++i)
-        {            
-            //assert(g_pixels[i].w > 0.0f);
+			g_frameSamples = Clamp(target, g_frameSamples*0.5f, g_frameSamples*2.0f);
+			g_frameSamples = Clamp(g_frameSamples, 1.0f, float(kMaxFrameSamples));
+		}
+	}
 
-            float s = g_options.exposure / g_pixels[i].w;
+    // adaptive sampling may stop every tile before the sample budget is used up, previews are never saved
+    const bool finished = !moving && (g_sampleCount >= options.maxSamples || g_renderer->Converged());
 
-            g_filtered[i] = LinearToSrgb(ToneMap(g_pixels[i] * s, g_options.limit));
-        }
+    // the final frame has to contain all samples before it is saved
+    if (finished)
+        g_renderer->Flush(g_pixels);
 
-        if (g_nlmWidth)
-        {
-            NonLocalMeansFilter(g_filtered, g_exposed, g_options.width, g_options.height, g_nlmFalloff, g_nlmWidth);
-            presentMem = g_exposed;
-        }
-        else
-        {
-            presentMem = g_filtered;
-        }
-    }
+    Color* presentMem = Develop(options);
 
 	// present in interactive mode
     glDisable(GL_BLEND);
@@ -296,39 +733,168 @@ void Render()
 	glMatrixMode(GL_MODELVIEW);
 	glLoadIdentity();
 
-	glPixelZoom(1.0f, -1.0f);
+	glPixelZoom(float(scale), -float(scale));
 	glRasterPos2f(0, g_options.height);
 
-    glDrawPixels(g_options.width, g_options.height, GL_RGBA, GL_FLOAT, presentMem);
+    glDrawPixels(options.width, options.height, GL_RGBA, GL_FLOAT, presentMem);
 
 	double endFrameTime = GetSeconds();
 
-	printf("%d render: (%.4fms) total: (%.4fms)\n", g_sampleCount, (endRenderTime-startTime)*1000.0f, (endFrameTime-startTime)*1000.0f);
+	printf("%d render: %d spp 1/%d res (%.4fms) total: (%.4fms)\n", g_sampleCount, taken, scale, (endRenderTime-startTime)*1000.0f, (endFrameTime-startTime)*1000.0f);
+
+	ComplexityStats complexity;
+
+	if (g_options.mode == eComplexity && g_renderer->GetComplexity(complexity) && complexity.rays)
+	{
+		const double scale = 1.0/double(complexity.rays);
+
+		printf("complexity: %llu rays, per ray %.1f nodes %.1f boxes %.1f triangles, max %u tests\n",
+			complexity.rays,
+			complexity.nodes*scale,
+			complexity.boxes*scale,
+			complexity.triangles*scale,
+			complexity.maxCost);
+	}
+
+	WavefrontStats wavefront;
+
+	if (g_renderer->GetWavefrontStats(wavefront))
+		PrintWavefrontStats(wavefront);
+
 	fflush(stdout);
 
 	// output frame to file if finished
-	if (g_sampleCount >= g_options.maxSamples)
+	if (finished)
 	{
-		if (g_outputFile)
-		{
-			WritePng(g_filtered, g_options.width, g_options.height, g_outputFile);
-		}
+		WriteOutput();
 
 		// finished rendering, output file and move onto next in batch
 		if (g_batchMode)
 		{
 			g_batchIndex++;
 
-			// re-init
-			delete g_renderer;
-			g_renderer = NULL;
-
+			// re-init, meshes, probes and the renderer stay resident across frames
 			Init(g_argc, g_argv);
 		}
 	}
 }
 
 
+// samples taken per dispatch in headless mode, large enough to amortize the dispatch while
+// still checking for convergence, and short enough to keep GPU launches well below any watchdog
+const int kHeadlessSamples = 64;
+
+// sums the raw samples written by each node into g_pixels, the nodes' ranges have to
+// follow on from each other and cover the frame's samples exactly once
+void MergeNodes()
+{
+    const int numPixels = g_options.width*g_options.height;
+
+    std::fill(g_pixels, g_pixels+numPixels, Color(0.0f));
+
+    g_sampleCount = 0;
+
+    for (int i=0; i < g_mergeNodes; ++i)
+    {
+        const std::string path = NodeFile(i);
+
+        AccumImage image;
+        if (!AccumLoad(path.c_str(), image))
+        {
+            printf("Couldn't open %s for reading.\n", path.c_str());
+            exit(-1);
+        }
+
+        if (image.width != g_options.width || image.height != g_options.height || image.firstSample != g_sampleCount)
+        {
+            printf("%s holds samples %d-%d of a %dx%d frame, expected a %dx%d frame starting at sample %d\n",
+                path.c_str(), image.firstSample, image.firstSample+image.numSamples, image.width, image.height,
+                g_options.width, g_options.height, g_sampleCount);
+            exit(-1);
+        }
+
+        const Color* samples = (const Color*)image.data;
+
+        for (int p=0; p < numPixels; ++p)
+            g_pixels[p] += samples[p];
+
+        g_sampleCount += image.numSamples;
+
+        delete[] image.data;
+    }
+
+    if (g_options.maxSamples != INT_MAX && g_sampleCount != g_options.maxSamples)
+    {
+        printf("Nodes hold %d samples of the frame's %d\n", g_sampleCount, g_options.maxSamples);
+        exit(-1);
+    }
+}
+
+void RenderHeadless()
+{
+    if (g_options.maxSamples == INT_MAX && (g_options.adaptiveThreshold <= 0.0f || g_numNodes > 0) && g_mergeNodes == 0)
+    {
+        printf("Headless rendering needs a sample count (-spp=N or maxSamples) or adaptive sampling\n");
+        exit(-1);
+    }
+
+    if (g_numNodes > 0 && (g_nodeIndex < 0 || g_nodeIndex >= g_numNodes))
+    {
+        printf("Node %d is outside of the %d nodes\n", g_nodeIndex, g_numNodes);
+        exit(-1);
+    }
+
+    for (;;)
+    {
+        const double startTime = GetSeconds();
+
+        if (g_mergeNodes > 0)
+        {
+            MergeNodes();
+        }
+        else
+        {
+            double lastCheckpoint = startTime;
+
+            while (g_sampleCount < g_options.maxSamples && !g_renderer->Converged())
+            {
+                const int numSamples = Min(kHeadlessSamples, g_options.maxSamples-g_sampleCount);
+
+                g_renderer->RenderSamples(g_camera, g_options, g_pixels, numSamples);
+                g_sampleCount += numSamples;
+
+                if (g_checkpointInterval > 0.0f && GetSeconds()-lastCheckpoint >= g_checkpointInterval)
+                {
+                    g_renderer->Flush(g_pixels);
+
+                    WriteCheckpoint();
+                    lastCheckpoint = GetSeconds();
+                }
+            }
+
+            g_renderer->Flush(g_pixels);
+        }
+
+        Develop(g_options);
+        WriteOutput();
+
+        // the finished frame supersedes its checkpoint
+        if (g_checkpointInterval > 0.0f)
+            remove(CheckpointFile().c_str());
+
+        printf("Rendered %s (%d samples) in %.2fs\n", g_outputFile ? g_outputFile : "frame", g_sampleCount, GetSeconds()-startTime);
+        fflush(stdout);
+
+        if (!g_batchMode)
+            break;
+
+        // re-init, meshes, probes and the renderer stay resident across frames
+        g_batchIndex++;
+
+        Init(g_argc, g_argv);
+    }
+}
+
 void GLUTUpdate()
 {
     Render();
@@ -363,16 +929,16 @@ void GLUTKeyboardDown(unsigned char key, int x, int y)
  	switch (key)
 	{
     case 'w':
-        g_camPos -= Vec3(g_camTransform.GetCol(2))*g_flySpeed; resetFrame = true;
+        g_camPos -= Vec3(g_camTransform.GetCol(2))*g_flySpeed; CameraMoved();
 		break;
     case 's':
-        g_camPos += Vec3(g_camTransform.GetCol(2))*g_flySpeed; resetFrame = true; 
+        g_camPos += Vec3(g_camTransform.GetCol(2))*g_flySpeed; CameraMoved();
         break;
     case 'a':
-        g_camPos -= Vec3(g_camTransform.GetCol(0))*g_flySpeed; resetFrame = true;
+        g_camPos -= Vec3(g_camTransform.GetCol(0))*g_flySpeed; CameraMoved();
         break;
     case 'd':
-        g_camPos += Vec3(g_camTransform.GetCol(0))*g_flySpeed; resetFrame = true;
+        g_camPos += Vec3(g_camTransform.GetCol(0))*g_flySpeed; CameraMoved();
         break;
 	case 'f':
 		g_flyMode = !g_flyMode;
@@ -402,7 +968,11 @@ void GLUTKeyboardDown(unsigned char key, int x, int y)
     }
 	case 'i':
 	{
-		WritePng(g_filtered, g_options.width, g_options.height, "images/output.png");
+		// previews only develop their reduced size, the rest of the buffer is stale
+		const int width = Max(1, g_options.width/g_renderScale);
+		const int height = Max(1, g_options.height/g_renderScale);
+
+		WritePng(g_filtered, width, height, "images/output.png");
 		break;
 	}
 	case 'q':
@@ -411,10 +981,10 @@ void GLUTKeyboardDown(unsigned char key, int x, int y)
 		break;
 	};
 
-    // reset image if there are any camera changes
+    // reset image if the mode changed
     if (resetFrame == true)
     {
-        InitFrameBuffer();
+        g_resetFrame = true;
     }
 }
 
@@ -464,7 +1034,7 @@ void GLUTMotionFunc(int x, int y)
 
     if (g_options.mode == ePathTrace)
     {
-        InitFrameBuffer();
+        CameraMoved();
     }
 }
 
@@ -505,8 +1075,57 @@ int main(int argc, char* argv[])
 	g_argc = argc;
 	g_argv = argv;
 
+	for (int i=1; i < argc; ++i)
+	{
+		if (strcmp(argv[i], "-headless") == 0)
+			g_headless = true;
+
+		// distributed rendering always runs headless, e.g.: -node=2/8 on each of eight machines
+		// then -merge=8 once they have all finished
+		if (sscanf(argv[i], "-node=%d/%d", &g_nodeIndex, &g_numNodes) == 2 || sscanf(argv[i], "-merge=%d", &g_mergeNodes) == 1)
+			g_headless = true;
+
+		if (strcmp(argv[i], "-benchmark") == 0)
+		{
+			// paths are relative to the repository root
+			const BenchmarkScene scenes[] =
+			{
+				{ "paniq", NULL, TestPaniq },
+				{ "veach", NULL, TestVeach },
+				{ "ajax", "data/ajax.tin", NULL },
+				{ "buddha", "data/buddha.tin", NULL },
+				{ "sponza", "data/sponza.tin", NULL },
+				{ "sportscar", "data/sportscar.tin", NULL },
+				{ "glass", "data/glass.tin", NULL },
+				{ "transmission", "data/transmission.tin", NULL },
+			};
+
+			int spp = 16;
+			int width = 512;
+			int height = 256;
+
+			for (int j=1; j < argc; ++j)
+			{
+				sscanf(argv[j], "-spp=%d", &spp);
+				sscanf(argv[j], "-width=%d", &width);
+				sscanf(argv[j], "-height=%d", &height);
+			}
+
+			RunBenchmark(scenes, sizeof(scenes)/sizeof(scenes[0]), spp, width, height);
+			return 0;
+		}
+	}
+
     Init(argc, argv);
 
+	if (g_headless)
+	{
+		RenderHeadless();
+		WaitForPngWrites();
+
+		return 0;
+	}
+
 	// init gl
 	glutInit(&argc, argv);
 	glutInitDisplayMode(GLUT_RGBA | GLUT_DOUBLE | GLUT_DEPTH );
@@ -592,8 +592,8 @@ CUDA_CALLABLE inline Transform Inverse(const Transform& transform)
 {
 	Transform t;
 	t.r = Conjugate(transform.r);
-	t.p = -Rotate(t.r, transform.p);
 	t.s = 1.0f/transform.s;
+	t.p = -t.s*Rotate(t.r, transform.p);
 
 	return t;
 }
@@ -1288,19 +1288,27 @@ CUDA_CALLABLE inline Vec3 UniformSampleSphere(float u1, float u2)
 
 
 
-CUDA_CALLABLE inline Vec3 UniformSampleHemisphere(Random& rand)
+CUDA_CALLABLE inline Vec3 UniformSampleHemisphere(float u1, float u2)
 {
 	// generate a random z value
-	float z = rand.Randf(0.0f, 1.0f);
+	float z = u1;
 	float w = sqrt(1.0f-z*z);
 
-	float phi = k2Pi*rand.Randf(0.0f, 1.0f);
+	float phi = k2Pi*u2;
 	float x = cosf(phi)*w;
 	float y = sinf(phi)*w;
 
 	return Vec3(x, y, z);
 }
 
+CUDA_CALLABLE inline Vec3 UniformSampleHemisphere(Random& rand)
+{
+	const float u1 = rand.Randf(0.0f, 1.0f);
+	const float u2 = rand.Randf(0.0f, 1.0f);
+
+	return UniformSampleHemisphere(u1, u2);
+}
+
 CUDA_CALLABLE inline Vec2 UniformSampleDisc(float u1, float u2)
 {
 	float r = sqrt(u1);
@@ -1309,11 +1317,19 @@ CUDA_CALLABLE inline Vec2 UniformSampleDisc(float u1, float u2)
 	return Vec2(r * cos(theta), r * sin(theta));
 }
 
-CUDA_CALLABLE inline void UniformSampleTriangle(Random& rand, float& u, float& v)
+CUDA_CALLABLE inline void UniformSampleTriangle(float u1, float u2, float& u, float& v)
 {
-	float r = sqrt(rand.Randf());
+	float r = sqrt(u1);
 	u = 1.0f - r;
-	v = rand.Randf() * r;
+	v = u2 * r;
+}
+
+CUDA_CALLABLE inline void UniformSampleTriangle(Random& rand, float& u, float& v)
+{
+	const float u1 = rand.Randf();
+	const float u2 = rand.Randf();
+
+	UniformSampleTriangle(u1, u2, u, v);
 }
 
 CUDA_CALLABLE inline Vec3 CosineSampleHemisphere(float u1, float u2)
@@ -1,14 +1,79 @@
 #include "mesh.h"
 #include "maths.h"
 #include "util.h"
+#include "parallel.h"
 
-#include <map>
 #include <fstream>
-#include <iostream>
 #include <string>
+#include <vector>
+#include <atomic>
+
+// cache imported meshes on disk in .bin form, see ImportMesh()
+#define USE_MESH_CACHE 1
 
 using namespace std;
 
+unsigned long NewMeshId()
+{
+	static std::atomic<unsigned long> counter(0);
+	return ++counter;
+}
+
+Mesh::~Mesh()
+{
+	delete[] bvh.nodes; 
+	delete[] wideBvh.nodes;
+
+	if (mapping)
+		UnmapFile(mapping, mappingSize);
+}
+
+MeshData Mesh::GetData() const
+{
+	if (mapping)
+		return mapped;
+
+	MeshData data;
+	data.positions = positions.size() ? &positions[0] : NULL;
+	data.normals = normals.size() ? &normals[0] : NULL;
+	data.indices = indices.size() ? &indices[0] : NULL;
+	data.triangleTable = triangleTable.size() ? &triangleTable[0] : NULL;
+
+	data.nodes = bvh.nodes;
+	data.wideNodes = wideBvh.nodes;
+	data.packets = packets.size() ? &packets[0] : NULL;
+
+	data.numVertices = positions.size();
+	data.numIndices = indices.size();
+	data.numNodes = bvh.numNodes;
+	data.numWideNodes = wideBvh.numNodes;
+	data.numPackets = packets.size();
+
+	data.area = area;
+
+	CompressedVertices& c = data.compressed;
+	memset(&c, 0, sizeof(CompressedVertices));
+
+	if (compressed)
+	{
+		c.positions = quantizedPositions.size() ? &quantizedPositions[0] : NULL;
+		c.normals = octNormals.size() ? &octNormals[0] : NULL;
+		c.indices = clusterIndices.size() ? &clusterIndices[0] : NULL;
+		c.clusterBases = clusterBases.size() ? &clusterBases[0] : NULL;
+		c.wideIndices = wideClusterIndices.size() ? &wideClusterIndices[0] : NULL;
+
+		c.lower[0] = quantizeLower.x;
+		c.lower[1] = quantizeLower.y;
+		c.lower[2] = quantizeLower.z;
+		c.spacing = quantizeSpacing;
+
+		c.numClusters = clusterBases.size();
+		c.numWideIndices = wideClusterIndices.size();
+	}
+
+	return data;
+}
+
 void Mesh::DuplicateVertex(int i)
 {
 	assert(positions.size() > i);	
@@ -58,291 +123,1328 @@ void Mesh::CalculateNormals()
 
 namespace 
 {
+	// hand rolled parsers for mapped text files, these handle the plain decimal
+	// numbers written by exporters and stop at the first character they don't accept
 
-    enum PlyFormat
-    {
-        eAscii,
-        eBinaryBigEndian,
+	inline bool IsSpace(char c)
+	{
+		return c == ' ' || c == '\t' || c == '\r';
+	}
+
+	inline const char* SkipSpace(const char* p, const char* end)
+	{
+		while (p < end && IsSpace(*p))
+			++p;
+
+		return p;
+	}
+
+	// returns the start of the next line
+	inline const char* SkipLine(const char* p, const char* end)
+	{
+		const char* n = (const char*)memchr(p, '\n', end-p);
+		return n ? n+1 : end;
+	}
+
+	inline bool IsDigit(char c)
+	{
+		return c >= '0' && c <= '9';
+	}
+
+	// returns p if no integer could be read
+	inline const char* ParseInt(const char* p, const char* end, int& value)
+	{
+		const char* start = p;
+
+		bool negative = false;
+		if (p < end && (*p == '-' || *p == '+'))
+			negative = *p++ == '-';
+
+		if (p == end || !IsDigit(*p))
+			return start;
+
+		int v = 0;
+		while (p < end && IsDigit(*p))
+			v = v*10 + (*p++ - '0');
+
+		value = negative ? -v : v;
+		return p;
+	}
+
+	// returns p if no number could be read, anything other than fixed or
+	// exponent notation (e.g.: nan, inf) is passed on to strtod
+	inline const char* ParseDouble(const char* p, const char* end, double& value)
+	{
+		static const double kPow10[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+
+		const char* start = p;
+
+		bool negative = false;
+		if (p < end && (*p == '-' || *p == '+'))
+			negative = *p++ == '-';
+
+		uint64_t mantissa = 0;
+		int exponent = 0;
+		int significant = 0;
+		bool digits = false;
+
+		for (; p < end && IsDigit(*p); ++p)
+		{
+			if (significant < 19)
+			{
+				mantissa = mantissa*10 + (*p - '0');
+				significant += mantissa != 0;
+			}
+			else
+			{
+				exponent++;
+			}
+
+			digits = true;
+		}
+
+		if (p < end && *p == '.')
+		{
+			for (++p; p < end && IsDigit(*p); ++p)
+			{
+				if (significant < 19)
+				{
+					mantissa = mantissa*10 + (*p - '0');
+					significant += mantissa != 0;
+					exponent--;
+				}
+
+				digits = true;
+			}
+		}
+
+		if (!digits)
+		{
+			char token[64];
+			int length = 0;
+
+			for (const char* c=start; c < end && length < 63 && !IsSpace(*c) && *c != '\n' && *c != '/'; ++c)
+				token[length++] = *c;
+
+			token[length] = 0;
+
+			char* tokenEnd;
+			value = strtod(token, &tokenEnd);
+
+			return start + (tokenEnd-token);
+		}
+
+		if (p < end && (*p == 'e' || *p == 'E'))
+		{
+			int e;
+			const char* q = ParseInt(p+1, end, e);
+
+			if (q != p+1)
+			{
+				exponent += e;
+				p = q;
+			}
+		}
+
+		double v = double(mantissa);
+
+		if (exponent < 0)
+			v = exponent >= -22 ? v/kPow10[-exponent] : v*pow(10.0, exponent);
+		else if (exponent > 0)
+			v = exponent <= 22 ? v*kPow10[exponent] : v*pow(10.0, exponent);
+
+		value = negative ? -v : v;
+		return p;
+	}
+
+	inline const char* ParseFloat(const char* p, const char* end, float& value)
+	{
+		double v;
+		const char* q = ParseDouble(p, end, v);
+
+		if (q != p)
+			value = float(v);
+
+		return q;
+	}
+
+	// adds triangles for a face given as a fan, quads are split as (0, 1, 2), (2, 3, 0)
+	inline void TriangulateFace(const int* face, int count, std::vector<int>& indices)
+	{
+		if (count < 3)
+			return;
+
+		indices.push_back(face[0]);
+		indices.push_back(face[1]);
+		indices.push_back(face[2]);
+
+		for (int i=3; i < count; ++i)
+		{
+			indices.push_back(face[i-1]);
+			indices.push_back(face[i]);
+			indices.push_back(face[0]);
+		}
+	}
+
+	// area weighted vertex normals, accumulated on top of any normals already present
+	void AccumulateFaceNormals(Mesh* m)
+	{
+		m->normals.resize(m->positions.size());
+
+		const int numFaces = m->indices.size()/3;
+
+		for (int i=0; i < numFaces; ++i)
+		{
+			int a = m->indices[i*3+0];
+			int b = m->indices[i*3+1];
+			int c = m->indices[i*3+2];
+
+			const Vec3& v0 = m->positions[a];
+			const Vec3& v1 = m->positions[b];
+			const Vec3& v2 = m->positions[c];
+
+			Vec3 n = SafeNormalize(Cross(v1-v0, v2-v0), Vec3(0.0f, 1.0f, 0.0f));
+
+			m->normals[a] += n;
+			m->normals[b] += n;
+			m->normals[c] += n;
+		}
+
+		for (size_t i=0; i < m->normals.size(); ++i)
+			m->normals[i] = SafeNormalize(m->normals[i], Vec3(0.0f, 1.0f, 0.0f));
+	}
+
+	// checks the exponent bits directly as isfinite() may be folded away under fast math
+	inline bool IsFinite(float f)
+	{
+		uint32_t bits;
+		memcpy(&bits, &f, sizeof(bits));
+
+		return (bits & 0x7f800000) != 0x7f800000;
+	}
+
+	// some scanned meshes contain nan vertices, zero them and drop the triangles using them
+	void RemoveNonFiniteVertices(Mesh* m)
+	{
+		vector<bool> invalid(m->positions.size(), false);
+		bool any = false;
+
+		for (size_t i=0; i < m->positions.size(); ++i)
+		{
+			const Vec3& p = m->positions[i];
+
+			if (!IsFinite(p.x) || !IsFinite(p.y) || !IsFinite(p.z))
+			{
+				m->positions[i] = Vec3(0.0f);
+				invalid[i] = any = true;
+			}
+		}
+
+		if (!any)
+			return;
+
+		size_t count = 0;
+
+		for (size_t i=0; i+2 < m->indices.size(); i += 3)
+		{
+			const int a = m->indices[i+0];
+			const int b = m->indices[i+1];
+			const int c = m->indices[i+2];
+
+			if (invalid[a] || invalid[b] || invalid[c])
+				continue;
+
+			m->indices[count++] = a;
+			m->indices[count++] = b;
+			m->indices[count++] = c;
+		}
+
+		m->indices.resize(count);
+	}
+
+	enum PlyFormat
+	{
+		eAscii,
+		eBinaryBigEndian,
 		eBinaryLittleEndian
-    };
+	};
 
-    template <typename T>
-    T PlyRead(ifstream& s, PlyFormat format)
-    {
-        T data = eAscii;
+	enum PlyType
+	{
+		ePlyInvalid,
+		ePlyInt8,
+		ePlyUInt8,
+		ePlyInt16,
+		ePlyUInt16,
+		ePlyInt32,
+		ePlyUInt32,
+		ePlyFloat32,
+		ePlyFloat64
+	};
 
-        switch (format)
-        {
-            case eAscii:
-            {
-                s >> data;
-                break;
-            }
-            case eBinaryBigEndian:
-            {
-                char c[sizeof(T)];
-                s.read(c, sizeof(T));
-                reverse(c, c+sizeof(T));
-                data = *(T*)c;
-                break;
-            }      
-			case eBinaryLittleEndian:
+	PlyType PlyTypeFromName(const char* name)
+	{
+		if (strcmp(name, "char") == 0 || strcmp(name, "int8") == 0) return ePlyInt8;
+		if (strcmp(name, "uchar") == 0 || strcmp(name, "uint8") == 0) return ePlyUInt8;
+		if (strcmp(name, "short") == 0 || strcmp(name, "int16") == 0) return ePlyInt16;
+		if (strcmp(name, "ushort") == 0 || strcmp(name, "uint16") == 0) return ePlyUInt16;
+		if (strcmp(name, "int") == 0 || strcmp(name, "int32") == 0) return ePlyInt32;
+		if (strcmp(name, "uint") == 0 || strcmp(name, "uint32") == 0) return ePlyUInt32;
+		if (strcmp(name, "float") == 0 || strcmp(name, "float32") == 0) return ePlyFloat32;
+		if (strcmp(name, "double") == 0 || strcmp(name, "float64") == 0) return ePlyFloat64;
+
+		return ePlyInvalid;
+	}
+
+	int PlyTypeSize(PlyType type)
+	{
+		static const int kSizes[] = { 0, 1, 1, 2, 2, 4, 4, 4, 8 };
+		return kSizes[type];
+	}
+
+	struct PlyProperty
+	{
+		std::string name;
+
+		// for lists type is the type of the items
+		PlyType type;
+		PlyType countType;
+		bool list;
+	};
+
+	struct PlyElement
+	{
+		std::string name;
+		int count;
+
+		std::vector<PlyProperty> properties;
+	};
+
+	// reads values from the body of a ply file, marks itself invalid instead of reading past the end
+	struct PlyReader
+	{
+		PlyReader(const char* p, const char* end, PlyFormat format) : p(p), end(end), format(format), valid(true) {}
+
+		double Read(PlyType type)
+		{
+			double value = 0.0;
+
+			if (format == eAscii)
 			{
-			    char c[sizeof(T)];
-                s.read(c, sizeof(T));
-                data = *(T*)c;
-                break;
+				while (p < end && (IsSpace(*p) || *p == '\n'))
+					++p;
+
+				const char* q = ParseDouble(p, end, value);
+
+				if (q == p)
+					valid = false;
+
+				p = q;
 			}
-			default:
-				assert(0);
-        }
+			else
+			{
+				const int size = PlyTypeSize(type);
 
-        return data;
-    }
+				if (p + size > end)
+				{
+					valid = false;
+					return 0.0;
+				}
 
-} // namespace anonymous
+				value = ReadBinary(p, type);
+				p += size;
+			}
 
-Mesh* ImportMesh(const char* path)
-{
-	const char* ext = strrchr(path, '.');
+			return value;
+		}
 
-	Mesh* mesh = NULL;
+		double ReadBinary(const char* src, PlyType type) const
+		{
+			char c[8];
+			const int size = PlyTypeSize(type);
 
-	if (strcmp(ext, ".ply") == 0)
-		mesh = ImportMeshFromPly(path);
-	else if (strcmp(ext, ".obj") == 0)
-		mesh = ImportMeshFromObj(path);
-    else if (strcmp(ext, ".wo3") == 0)
-        mesh = ImportMeshFromWo3(path);
-	else if (strcmp(ext, ".bin") == 0)
-		mesh = ImportMeshFromBin(path);
+			memcpy(c, src, size);
 
-	if (mesh && strcmp(ext, ".bin") != 0)
+			if (format == eBinaryBigEndian)
+				reverse(c, c+size);
+
+			switch (type)
+			{
+				case ePlyInt8: return *(int8_t*)c;
+				case ePlyUInt8: return *(uint8_t*)c;
+				case ePlyInt16: return *(int16_t*)c;
+				case ePlyUInt16: return *(uint16_t*)c;
+				case ePlyInt32: return *(int32_t*)c;
+				case ePlyUInt32: return *(uint32_t*)c;
+				case ePlyFloat32: return *(float*)c;
+				case ePlyFloat64: return *(double*)c;
+				default: return 0.0;
+			}
+		}
+
+		const char* p;
+		const char* end;
+
+		PlyFormat format;
+		bool valid;
+	};
+
+	// a range of lines of an obj file that is parsed independently of the others
+	struct ObjChunk
 	{
-        if (strcmp(ext, ".wo3") != 0)
-        {
-		   mesh->Normalize();
-	       mesh->CalculateNormals();
-        }
-        
-		mesh->RebuildBVH();
+		// obj indices are 1 based, negative ones are relative to the attributes read so far, these
+		// are made relative to the start of the chunk and patched once the preceding chunks are counted
+		enum { eRelativeV = 1, eRelativeVt = 2, eRelativeVn = 4 };
+
+		struct Index
+		{
+			int v;
+			int vt;
+			int vn;
+			int relative;
+		};
+
+		const char* begin;
+		const char* end;
+
+		std::vector<Vec3> positions;
+		std::vector<Vec3> normals;
+		int numTexcoords;
+
+		std::vector<Index> indices;
+		std::vector<int> faceSizes;
+	};
+
+	void ParseObjChunk(ObjChunk& chunk)
+	{
+		chunk.numTexcoords = 0;
+
+		const char* end = chunk.end;
+
+		for (const char* p=chunk.begin; p < end; p = SkipLine(p, end))
+		{
+			p = SkipSpace(p, end);
+
+			if (p+1 >= end)
+				break;
+
+			if (p[0] == 'v')
+			{
+				if (IsSpace(p[1]))
+				{
+					// positions
+					Vec3 v;
+					p = ParseFloat(SkipSpace(p+1, end), end, v.x);
+					p = ParseFloat(SkipSpace(p, end), end, v.y);
+					p = ParseFloat(SkipSpace(p, end), end, v.z);
+
+					chunk.positions.push_back(v);
+				}
+				else if (p[1] == 'n')
+				{
+					// normals
+					Vec3 n;
+					p = ParseFloat(SkipSpace(p+2, end), end, n.x);
+					p = ParseFloat(SkipSpace(p, end), end, n.y);
+					p = ParseFloat(SkipSpace(p, end), end, n.z);
+
+					chunk.normals.push_back(n);
+				}
+				else if (p[1] == 't')
+				{
+					// texture coords are not used, only counted for relative indices
+					chunk.numTexcoords++;
+				}
+			}
+			else if (p[0] == 'f' && IsSpace(p[1]))
+			{
+				int count = 0;
+
+				for (p=SkipSpace(p+1, end); p < end && *p != '\n'; p=SkipSpace(p, end))
+				{
+					ObjChunk::Index index = { 0, 0, 0, 0 };
+
+					const char* q = ParseInt(p, end, index.v);
+					if (q == p)
+						break;
+
+					p = q;
+
+					if (p < end && *p == '/')
+					{
+						p = ParseInt(p+1, end, index.vt);
+
+						if (p < end && *p == '/')
+							p = ParseInt(p+1, end, index.vn);
+					}
+
+					if (index.v < 0)
+					{
+						index.v += int(chunk.positions.size()) + 1;
+						index.relative |= ObjChunk::eRelativeV;
+					}
+
+					if (index.vt < 0)
+					{
+						index.vt += chunk.numTexcoords + 1;
+						index.relative |= ObjChunk::eRelativeVt;
+					}
+
+					if (index.vn < 0)
+					{
+						index.vn += int(chunk.normals.size()) + 1;
+						index.relative |= ObjChunk::eRelativeVn;
+					}
+
+					chunk.indices.push_back(index);
+					count++;
+
+					// skip anything unexpected up to the next vertex
+					while (p < end && !IsSpace(*p) && *p != '\n')
+						++p;
+				}
+
+				chunk.faceSizes.push_back(count);
+			}
+		}
 	}
 
-	return mesh;
-}
 
-Mesh* ImportMeshFromPly(const char* path)
-{
-    ifstream file(path, ios_base::in | ios_base::binary);
+	// parses positions, file normals (zero where missing) and triangles, returns NULL on failure
+	Mesh* ParseObj(const char* path)
+	{
+		size_t size;
+		const char* data = (const char*)MapFile(path, &size);
 
-    if (!file)
-        return NULL;
+		if (!data)
+			return NULL;
+
+		const char* end = data+size;
+
+		// split the file into chunks on line boundaries, a few per worker so stealing can balance them
+		const size_t kMinChunkSize = 1024*1024;
+		const int numChunks = max(1, min(GetNumWorkers()*4, int(size/kMinChunkSize)));
+
+		vector<ObjChunk> chunks(numChunks);
+
+		const char* p = data;
+		for (int i=0; i < numChunks; ++i)
+		{
+			chunks[i].begin = p;
+
+			if (i == numChunks-1)
+				p = end;
+			else
+				p = SkipLine(max(p, data + size_t((unsigned long long)size*(i+1)/numChunks)), end);
+
+			chunks[i].end = p;
+		}
+
+		ParallelFor(numChunks, [&](int index, int worker)
+		{
+			ParseObjChunk(chunks[index]);
+		});
+
+		// resolve indices to 0 based offsets into the concatenated attributes, -1 for missing ones
+		int numPositions = 0;
+		int numTexcoords = 0;
+		int numNormals = 0;
+		int numCorners = 0;
+
+		for (int i=0; i < numChunks; ++i)
+		{
+			ObjChunk& chunk = chunks[i];
+
+			for (size_t j=0; j < chunk.indices.size(); ++j)
+			{
+				ObjChunk::Index& index = chunk.indices[j];
+
+				index.v += (index.relative & ObjChunk::eRelativeV ? numPositions : 0) - 1;
+				index.vt += (index.relative & ObjChunk::eRelativeVt ? numTexcoords : 0) - 1;
+				index.vn += (index.relative & ObjChunk::eRelativeVn ? numNormals : 0) - 1;
+			}
+
+			numPositions += int(chunk.positions.size());
+			numTexcoords += chunk.numTexcoords;
+			numNormals += int(chunk.normals.size());
+			numCorners += int(chunk.indices.size());
+		}
+
+		vector<Vec3> positions;
+		vector<Vec3> normals;
+
+		positions.reserve(numPositions);
+		normals.reserve(numNormals);
+
+		for (int i=0; i < numChunks; ++i)
+		{
+			positions.insert(positions.end(), chunks[i].positions.begin(), chunks[i].positions.end());
+			normals.insert(normals.end(), chunks[i].normals.begin(), chunks[i].normals.end());
+
+			vector<Vec3>().swap(chunks[i].positions);
+			vector<Vec3>().swap(chunks[i].normals);
+		}
+
+		UnmapFile((void*)data, size);
+
+		// dedup (v, vt, vn) triples in face order so vertex order only depends on the file,
+		// open addressing with linear probing, slots hold the index of the output vertex
+		int tableSize = 1;
+		while (tableSize < numCorners*2)
+			tableSize *= 2;
+
+		vector<int> table(tableSize, -1);
+		vector<ObjChunk::Index> keys;
+
+		Mesh* m = new Mesh();
+
+		m->positions.reserve(numPositions);
+		m->normals.reserve(numPositions);
+		m->indices.reserve(numCorners*3/2);
+
+		vector<int> face;
+
+		for (int i=0; i < numChunks; ++i)
+		{
+			const ObjChunk& chunk = chunks[i];
+			const ObjChunk::Index* corner = chunk.indices.size() ? &chunk.indices[0] : NULL;
+
+			for (size_t f=0; f < chunk.faceSizes.size(); ++f)
+			{
+				const int count = chunk.faceSizes[f];
+
+				face.resize(0);
+
+				for (int c=0; c < count; ++c, ++corner)
+				{
+					const ObjChunk::Index& key = *corner;
+
+					if (key.v < 0 || key.v >= numPositions || key.vt >= numTexcoords || key.vn >= numNormals || key.vt < -1 || key.vn < -1)
+					{
+						printf("Invalid face index in %s\n", path);
+
+						delete m;
+						return NULL;
+					}
+
+					uint32_t hash = (uint32_t(key.v)*73856093u) ^ (uint32_t(key.vt)*19349663u) ^ (uint32_t(key.vn)*83492791u);
+					hash *= 2654435761u;
+
+					int slot = int(hash & (tableSize-1));
+
+					for (;;)
+					{
+						const int vertex = table[slot];
+
+						if (vertex == -1)
+						{
+							// add vertex
+							const int newIndex = int(m->positions.size());
+
+							table[slot] = newIndex;
+							keys.push_back(key);
+
+							m->positions.push_back(positions[key.v]);
+							m->normals.push_back(key.vn >= 0 ? normals[key.vn] : Vec3(0.0f));
+
+							face.push_back(newIndex);
+							break;
+						}
+
+						const ObjChunk::Index& existing = keys[vertex];
+
+						if (existing.v == key.v && existing.vt == key.vt && existing.vn == key.vn)
+						{
+							face.push_back(vertex);
+							break;
+						}
+
+						slot = (slot+1)&(tableSize-1);
+					}
+				}
+
+				if (count < 3)
+					printf("Face with less than 3 vertices in %s\n", path);
+
+				TriangulateFace(face.size() ? &face[0] : NULL, count, m->indices);
+			}
+		}
+
+		RemoveNonFiniteVertices(m);
+
+		return m;
+	}
+
+	// parses positions and triangles from faces or triangle strips, normals are zero, returns NULL on failure
+	Mesh* ParsePly(const char* path)
+	{
+		size_t size;
+		const char* data = (const char*)MapFile(path, &size);
+
+		if (!data)
+			return NULL;
+
+		const char* end = data+size;
+
+		if (size < 3 || strncmp(data, "ply", 3) != 0)
+		{
+			UnmapFile((void*)data, size);
+			return NULL;
+		}
+
+		PlyFormat format = eAscii;
+		vector<PlyElement> elements;
+
+		bool valid = true;
+		bool header = false;
+
+		const char* p = SkipLine(data, end);
+
+		while (p < end && valid)
+		{
+			const char* next = SkipLine(p, end);
+
+			char line[1024];
+			const int length = min(int(next-p), 1023);
+
+			memcpy(line, p, length);
+			line[length] = 0;
+
+			p = next;
+
+			char tokens[5][256];
+			const int n = sscanf(line, "%255s %255s %255s %255s %255s", tokens[0], tokens[1], tokens[2], tokens[3], tokens[4]);
+
+			if (n <= 0)
+				continue;
+
+			if (strcmp(tokens[0], "end_header") == 0)
+			{
+				header = true;
+				break;
+			}
+			else if (strcmp(tokens[0], "format") == 0 && n >= 2)
+			{
+				if (strcmp(tokens[1], "ascii") == 0)
+					format = eAscii;
+				else if (strcmp(tokens[1], "binary_little_endian") == 0)
+					format = eBinaryLittleEndian;
+				else if (strcmp(tokens[1], "binary_big_endian") == 0)
+					format = eBinaryBigEndian;
+				else
+					valid = false;
+			}
+			else if (strcmp(tokens[0], "element") == 0 && n >= 3)
+			{
+				PlyElement element;
+				element.name = tokens[1];
+				element.count = max(0, atoi(tokens[2]));
+
+				elements.push_back(element);
+			}
+			else if (strcmp(tokens[0], "property") == 0 && elements.size())
+			{
+				PlyProperty property;
+				property.list = strcmp(tokens[1], "list") == 0;
+
+				if (property.list && n >= 5)
+				{
+					property.countType = PlyTypeFromName(tokens[2]);
+					property.type = PlyTypeFromName(tokens[3]);
+					property.name = tokens[4];
+				}
+				else if (!property.list && n >= 3)
+				{
+					property.countType = ePlyInvalid;
+					property.type = PlyTypeFromName(tokens[1]);
+					property.name = tokens[2];
+				}
+				else
+				{
+					property.type = ePlyInvalid;
+				}
+
+				valid = property.type != ePlyInvalid && (!property.list || property.countType != ePlyInvalid);
+
+				elements.back().properties.push_back(property);
+			}
+		}
+
+		if (!valid || !header)
+		{
+			printf("Invalid ply header in %s\n", path);
+
+			UnmapFile((void*)data, size);
+			return NULL;
+		}
+
+		Mesh* m = new Mesh();
+
+		PlyReader reader(p, end, format);
+
+		vector<int> list;
+
+		for (size_t e=0; e < elements.size() && reader.valid; ++e)
+		{
+			const PlyElement& element = elements[e];
+			const int numProperties = int(element.properties.size());
+
+			// byte offsets of x, y, z for binary elements without lists
+			int stride = 0;
+			int offsets[3] = { -1, -1, -1 };
+			PlyType types[3] = { ePlyInvalid, ePlyInvalid, ePlyInvalid };
+
+			// the property holding the face or strip indices
+			int indexProperty = -1;
+
+			for (int i=0; i < numProperties; ++i)
+			{
+				const PlyProperty& property = element.properties[i];
+
+				if (property.list)
+				{
+					if (property.name == "vertex_indices" || property.name == "vertex_index")
+						indexProperty = i;
+
+					stride = -1;
+				}
+				else
+				{
+					const int axis = property.name == "x" ? 0 : property.name == "y" ? 1 : property.name == "z" ? 2 : -1;
+
+					if (axis != -1 && stride != -1)
+					{
+						offsets[axis] = stride;
+						types[axis] = property.type;
+					}
+
+					if (stride != -1)
+						stride += PlyTypeSize(property.type);
+				}
+			}
+
+			const bool fixed = format != eAscii && stride != -1;
+
+			if (element.name == "vertex")
+			{
+				m->positions.resize(element.count);
+
+				if (fixed && offsets[0] != -1 && offsets[1] != -1 && offsets[2] != -1)
+				{
+					if (size_t(end-reader.p) < size_t(element.count)*stride)
+					{
+						reader.valid = false;
+						break;
+					}
+
+					const int kBlockSize = 16*1024;
+					const char* base = reader.p;
+
+					ParallelFor((element.count+kBlockSize-1)/kBlockSize, [&](int block, int worker)
+					{
+						const int first = block*kBlockSize;
+						const int last = min(element.count, first+kBlockSize);
+
+						for (int i=first; i < last; ++i)
+						{
+							const char* vertex = base + size_t(i)*stride;
+
+							m->positions[i] = Vec3(
+								float(reader.ReadBinary(vertex+offsets[0], types[0])),
+								float(reader.ReadBinary(vertex+offsets[1], types[1])),
+								float(reader.ReadBinary(vertex+offsets[2], types[2])));
+						}
+					});
+
+					reader.p += size_t(element.count)*stride;
+				}
+				else
+				{
+					for (int i=0; i < element.count && reader.valid; ++i)
+					{
+						float v[3] = { 0.0f, 0.0f, 0.0f };
+
+						for (int j=0; j < numProperties; ++j)
+						{
+							const PlyProperty& property = element.properties[j];
+
+							if (property.list)
+							{
+								const int count = int(reader.Read(property.countType));
+
+								for (int k=0; k < count; ++k)
+									reader.Read(property.type);
+							}
+							else
+							{
+								const double value = reader.Read(property.type);
+
+								const int axis = property.name == "x" ? 0 : property.name == "y" ? 1 : property.name == "z" ? 2 : -1;
+
+								if (axis != -1)
+									v[axis] = float(value);
+							}
+						}
+
+						m->positions[i] = Vec3(v[0], v[1], v[2]);
+					}
+				}
+			}
+			else if (fixed)
+			{
+				// unused element, skip over it
+				if (size_t(end-reader.p) < size_t(element.count)*stride)
+				{
+					reader.valid = false;
+					break;
+				}
+
+				reader.p += size_t(element.count)*stride;
+			}
+			else
+			{
+				const bool strips = element.name == "tristrips";
+				const bool faces = element.name == "face";
+
+				for (int i=0; i < element.count && reader.valid; ++i)
+				{
+					for (int j=0; j < numProperties; ++j)
+					{
+						const PlyProperty& property = element.properties[j];
+
+						if (!property.list)
+						{
+							reader.Read(property.type);
+							continue;
+						}
+
+						const int count = int(reader.Read(property.countType));
+
+						if (j != indexProperty || !(faces || strips))
+						{
+							for (int k=0; k < count; ++k)
+								reader.Read(property.type);
+
+							continue;
+						}
+
+						list.resize(max(count, 0));
+
+						for (int k=0; k < count; ++k)
+							list[k] = int(reader.Read(property.type));
+
+						if (faces)
+						{
+							TriangulateFace(list.size() ? &list[0] : NULL, count, m->indices);
+						}
+						else
+						{
+							// strips are separated by -1, winding alternates along each strip
+							int start = 0;
+
+							for (int k=0; k < count; ++k)
+							{
+								if (list[k] < 0)
+								{
+									start = k+1;
+									continue;
+								}
+
+								if (k-start < 2)
+									continue;
+
+								int a = list[k-2];
+								int b = list[k-1];
+								int c = list[k];
+
+								if ((k-start)&1)
+									swap(a, b);
+
+								if (a == b || b == c || a == c)
+									continue;
+
+								m->indices.push_back(a);
+								m->indices.push_back(b);
+								m->indices.push_back(c);
+							}
+						}
+					}
+				}
+			}
+		}
+
+		UnmapFile((void*)data, size);
+
+		bool indicesValid = reader.valid;
+
+		for (size_t i=0; i < m->indices.size() && indicesValid; ++i)
+			indicesValid = m->indices[i] >= 0 && m->indices[i] < int(m->positions.size());
+
+		if (!indicesValid)
+		{
+			printf("Failed to read ply file %s\n", path);
+
+			delete m;
+			return NULL;
+		}
+
+		RemoveNonFiniteVertices(m);
+
+		m->normals.resize(m->positions.size());
+
+		return m;
+	}
+
+	// imported meshes are cached next to the source as .bin files named after a hash
+	// of the source contents, bump the version when the import processing changes
+	const uint64_t kMeshCacheVersion = 1;
+
+	inline uint64_t HashBytes(const char* data, size_t size, uint64_t seed)
+	{
+		const uint64_t kPrime = 0x9e3779b97f4a7c15ull;
+
+		uint64_t h = seed ^ (uint64_t(size)*kPrime);
+
+		size_t i = 0;
+		for (; i+8 <= size; i += 8)
+		{
+			uint64_t w;
+			memcpy(&w, data+i, sizeof(w));
+
+			h = (h^w)*kPrime;
+			h ^= h >> 29;
+		}
+
+		for (; i < size; ++i)
+		{
+			h = (h^uint8_t(data[i]))*kPrime;
+			h ^= h >> 29;
+		}
+
+		return h;
+	}
+
+	// returns false if the file can't be read, blocks are hashed in parallel and combined in order
+	bool HashFile(const char* path, uint64_t* hash)
+	{
+		size_t size;
+		const char* data = (const char*)MapFile(path, &size);
+
+		if (!data)
+			return false;
+
+		const size_t kBlockSize = 4*1024*1024;
+		const int numBlocks = int((size+kBlockSize-1)/kBlockSize);
+
+		vector<uint64_t> blocks(numBlocks);
+
+		ParallelFor(numBlocks, [&](int index, int worker)
+		{
+			const size_t offset = size_t(index)*kBlockSize;
+			blocks[index] = HashBytes(data+offset, min(kBlockSize, size-offset), index);
+		});
+
+		UnmapFile((void*)data, size);
+
+		// layout of the cached arrays is part of the key
+		const uint64_t layout[] = { kMeshCacheVersion, sizeof(BVHNode), sizeof(MeshWideBVHNode), sizeof(TriPacket), uint64_t(USE_WIDE_BVH) };
+
+		uint64_t h = HashBytes((const char*)layout, sizeof(layout), size);
+
+		if (numBlocks)
+			h = HashBytes((const char*)&blocks[0], sizeof(uint64_t)*numBlocks, h);
+
+		*hash = h;
+		return true;
+	}
+
+	std::string GetMeshCachePath(const char* path, uint64_t hash)
+	{
+		char suffix[64];
+		sprintf(suffix, ".cache-%016llx.bin", (unsigned long long)hash);
+
+		return std::string(path) + suffix;
+	}
+
+} // namespace anonymous
+
+Mesh* ImportMesh(const char* path)
+{
+	const char* ext = strrchr(path, '.');
+
+	if (!ext)
+		return NULL;
+
+#if USE_MESH_CACHE
+	std::string cachePath;
+
+	if (strcmp(ext, ".bin") != 0)
+	{
+		uint64_t hash;
+
+		if (HashFile(path, &hash))
+		{
+			cachePath = GetMeshCachePath(path, hash);
+
+			// a cache hit skips parsing and building entirely
+			size_t size;
+			void* mapping = MapFile(cachePath.c_str(), &size);
+
+			if (mapping)
+			{
+				UnmapFile(mapping, size);
+
+				Mesh* mesh = ImportMeshFromBin(cachePath.c_str());
+
+				if (mesh)
+					return mesh;
+			}
+		}
+	}
+#endif
+
+	double start = GetSeconds();
+
+	Mesh* mesh = NULL;
+
+	if (strcmp(ext, ".ply") == 0)
+		mesh = ParsePly(path);
+	else if (strcmp(ext, ".obj") == 0)
+		mesh = ParseObj(path);
+	else if (strcmp(ext, ".wo3") == 0)
+		mesh = ImportMeshFromWo3(path);
+	else if (strcmp(ext, ".bin") == 0)
+		mesh = ImportMeshFromBin(path);
+
+	if (mesh && strcmp(ext, ".bin") != 0)
+	{
+		if (strcmp(ext, ".wo3") != 0)
+		{
+			mesh->Normalize();
+			mesh->CalculateNormals();
+		}
+
+		double end = GetSeconds();
+
+		mesh->RebuildBVH();
+
+		double endBuild = GetSeconds();
+
+		printf("Imported mesh %s (%d vertices, %d triangles) in %fms, build BVH in %fms\n", path, int(mesh->positions.size()), int(mesh->indices.size()/3), (end-start)*1000.0f, (endBuild-end)*1000.0f);
+
+#if USE_MESH_CACHE
+		if (cachePath.size())
+			ExportMeshToBin(cachePath.c_str(), mesh);
+#endif
+	}
+
+	return mesh;
+}
+
+Mesh* ImportMeshVertices(const char* path)
+{
+	const char* ext = strrchr(path, '.');
+
+	if (!ext)
+		return NULL;
+
+	if (strcmp(ext, ".bin") == 0)
+		return ImportMeshFromBin(path);
+
+	Mesh* mesh = NULL;
+
+	if (strcmp(ext, ".ply") == 0)
+		mesh = ParsePly(path);
+	else if (strcmp(ext, ".obj") == 0)
+		mesh = ParseObj(path);
+
+	// transformed like an import so the frame lines up with what importing it would render
+	if (mesh)
+	{
+		mesh->Normalize();
+		mesh->CalculateNormals();
+	}
+
+	return mesh;
+}
+
+Mesh* ImportMeshFromPly(const char* path)
+{
+	Mesh* m = ParsePly(path);
+
+	if (m)
+		AccumulateFaceNormals(m);
+
+	return m;
+}
+
+namespace
+{
+	void CalculateTriangleBounds(const Mesh& m, std::vector<Bounds>& bounds)
+	{
+		const int numTris = m.indices.size()/3;
+		const int kChunkSize = 1<<14;
+
+		bounds.resize(numTris);
+
+		ParallelFor((numTris + kChunkSize - 1)/kChunkSize, [&](int chunk, int worker)
+		{
+			const int end = Min(numTris, (chunk+1)*kChunkSize);
+
+			for (int i=chunk*kChunkSize; i < end; ++i)
+			{
+				const Vec3 a = m.positions[m.indices[i*3+0]];
+				const Vec3 b = m.positions[m.indices[i*3+1]];
+				const Vec3 c = m.positions[m.indices[i*3+2]];
+
+				Bounds triangleBounds;
+				triangleBounds.AddPoint(a);
+				triangleBounds.AddPoint(b);
+				triangleBounds.AddPoint(c);
+
+				bounds[i] = triangleBounds;
+			}
+		});
+	}
+
+} // anonymous namespace
+
+void Mesh::RebuildBVH()
+{
+	const int numTris = indices.size()/3;
+
+	++generation;
+
+	if (compressed)
+		QuantizeVertices();
+	
+	if (numTris)
+	{
+		std::vector<Bounds> triangleBounds;
+		CalculateTriangleBounds(*this, triangleBounds);
+
+		delete[] bvh.nodes;
+	
+		BVHBuilder builder;
+		bvh = builder.Build(&triangleBounds[0], numTris);
+		bvhCost = BVHCost(bvh);
+
+		RebuildWideBVH();
+	}
+
+    RebuildTriangleTable();
+}
+
+bool Mesh::RefitBVH(float threshold)
+{
+	const int numTris = indices.size()/3;
 
-    // some scratch memory
-    const int kMaxLineLength = 1024;
-    char buffer[kMaxLineLength];
+	// meshes mapped from .bin files are read-only
+	if (mapping)
+		return false;
 
-    //double startTime = GetSeconds();
+	++generation;
 
-    file >> buffer;
-    if (strcmp(buffer, "ply") != 0)
-        return NULL;
+	if (compressed)
+		QuantizeVertices();
 
-    PlyFormat format = eAscii;
+	// a binary tree with one triangle per leaf, anything else is built from scratch
+	if (numTris == 0 || bvh.numNodes != 2*numTris-1)
+	{
+		RebuildBVH();
+		return true;
+	}
 
-    int numFaces = 0;
-    int numVertices = 0;
+	// trees loaded from disk don't know their build cost, the current one is as good
+	if (bvhCost <= 0.0f)
+		bvhCost = BVHCost(bvh);
 
-    const int kMaxProperties = 16;
-    int numProperties = 0; 
-    float properties[kMaxProperties];
+	std::vector<Bounds> triangleBounds;
+	CalculateTriangleBounds(*this, triangleBounds);
 
-    bool vertexElement = false;
+	::RefitBVH(bvh, &triangleBounds[0]);
 
-    while (file)
-    {
-        file >> buffer;
+	bool rebuilt = false;
 
-        if (strcmp(buffer, "element") == 0)
-        {
-            file >> buffer;
-
-            if (strcmp(buffer, "face") == 0)
-            {                
-                vertexElement = false;
-                file >> numFaces;
-            }
-
-            else if (strcmp(buffer, "vertex") == 0)
-            {
-                vertexElement = true;
-                file >> numVertices;
-            }
-        }
-        else if (strcmp(buffer, "format") == 0)
-        {
-            file >> buffer;
-            if (strcmp(buffer, "ascii") == 0)
-            {
-                format = eAscii;
-            }
-            else if (strcmp(buffer, "binary_big_endian") == 0)
-            {
-                format = eBinaryBigEndian;
-            }
-			else
-			{
-				format = eBinaryLittleEndian;
-			}
-        }
-        else if (strcmp(buffer, "property") == 0)
-        {
-            if (vertexElement)
-                ++numProperties;
-        }
-        else if (strcmp(buffer, "end_header") == 0)
-        {
-            break;
-        }
-    }
+	if (BVHCost(bvh) > bvhCost*threshold)
+	{
+		delete[] bvh.nodes;
 
-    // eat newline
-    char nl;
-    file.read(&nl, 1);
-	
-	// debug
-	printf ("Loaded mesh: %s numFaces: %d numVertices: %d format: %d numProperties: %d\n", path, numFaces, numVertices, format, numProperties);
+		BVHBuilder builder;
+		bvh = builder.Build(&triangleBounds[0], numTris);
+		bvhCost = BVHCost(bvh);
 
-    Mesh* mesh = new Mesh;
+		rebuilt = true;
+	}
 
-    mesh->positions.resize(numVertices);
-    mesh->normals.resize(numVertices);
-    mesh->indices.reserve(numFaces*3);
+	// the packets hold copies of the vertices so the wide tree is always collapsed again
+	RebuildWideBVH();
+	RebuildTriangleTable();
 
-    // read vertices
-    for (int v=0; v < numVertices; ++v)
-    {
-        for (int i=0; i < numProperties; ++i)
-        {
-            properties[i] = PlyRead<float>(file, format);
-        }
+	return rebuilt;
+}
 
-        mesh->positions[v] = Vec3(properties[0], properties[1], properties[2]);
-        mesh->normals[v] = Vec3(0.0f, 0.0f, 0.0f);
-    }
+void Mesh::RebuildWideBVH()
+{
+#if USE_WIDE_BVH
 
-    // read indices
-    for (int f=0; f < numFaces; ++f)
-    {
-        int numIndices = PlyRead<int>(file, format);
-		int indices[4];
+	delete[] wideBvh.nodes;
 
-		for (int i=0; i < numIndices; ++i)
-		{
-			indices[i] = PlyRead<int>(file, format);
-		}
+	// small subtrees collapse into leaves of up to four triangles
+	std::vector<int> groups;
+	wideBvh = CollapseBVH<MeshWideBVHNode>(bvh, &groups);
 
-		switch (numIndices)
-		{
-		case 3:
-			mesh->indices.push_back(indices[0]);
-			mesh->indices.push_back(indices[1]);
-			mesh->indices.push_back(indices[2]);
-			break;
-		case 4:
-			mesh->indices.push_back(indices[0]);
-			mesh->indices.push_back(indices[1]);
-			mesh->indices.push_back(indices[2]);
-
-			mesh->indices.push_back(indices[2]);
-			mesh->indices.push_back(indices[3]);
-			mesh->indices.push_back(indices[0]);
-			break;
-
-		default:
-			assert(!"invalid number of indices, only support tris and quads");
-			break;
-		};
+	const int numPackets = groups.size()/kWideBVHWidth;
 
-		// calculate vertex normals as we go
-        Vec3& v0 = mesh->positions[indices[0]];
-        Vec3& v1 = mesh->positions[indices[1]];
-        Vec3& v2 = mesh->positions[indices[2]];
+	packets.resize(numPackets);
 
-        Vec3 n = SafeNormalize(Cross(v1-v0, v2-v0), Vec3(0.0f, 1.0f, 0.0f));
+	for (int p=0; p < numPackets; ++p)
+	{
+		TriPacket& packet = packets[p];
 
-		for (int i=0; i < numIndices; ++i)
+		for (int l=0; l < kWideBVHWidth; ++l)
 		{
-	        mesh->normals[indices[i]] += n;
-	    }
-	}
-
-    for (int i=0; i < numVertices; ++i)
-    {
-        mesh->normals[i] = SafeNormalize(mesh->normals[i], Vec3(0.0f, 1.0f, 0.0f));
-    }
+			const int tri = groups[p*kWideBVHWidth + l];
 
-    //cout << "Imported mesh " << path << " in " << (GetSeconds()-startTime)*1000.f << "ms" << endl;
+			Vec3 a, ab, ac, n;
 
-    return mesh;
+			if (tri >= 0)
+			{
+				a = positions[indices[tri*3+0]];
+				ab = positions[indices[tri*3+1]] - a;
+				ac = positions[indices[tri*3+2]] - a;
+				n = Cross(ab, ac);
+			}
 
-}
+			packet.ax[l] = a.x;
+			packet.ay[l] = a.y;
+			packet.az[l] = a.z;
 
-// map of Material name to Material
-struct VertexKey
-{
-	VertexKey() :  v(0), vt(0), vn(0) {}
-	
-	int v, vt, vn;
-	
-	bool operator == (const VertexKey& rhs) const
-	{
-		return v == rhs.v && vt == rhs.vt && vn == rhs.vn;
-	}
-	
-	bool operator < (const VertexKey& rhs) const
-	{
-		if (v != rhs.v)
-			return v < rhs.v;
-		else if (vt != rhs.vt)
-			return vt < rhs.vt;
-		else
-			return vn < rhs.vn;
-	}
-};
+			packet.abx[l] = ab.x;
+			packet.aby[l] = ab.y;
+			packet.abz[l] = ab.z;
 
-void Mesh::RebuildBVH()
-{
-	const int numTris = indices.size()/3;
-	
-	if (numTris)
-	{
-		std::vector<Bounds> triangleBounds(numTris);
+			packet.acx[l] = ac.x;
+			packet.acy[l] = ac.y;
+			packet.acz[l] = ac.z;
 
-		for (int i=0; i < numTris; ++i)
-		{
-			const Vec3 a = positions[indices[i*3+0]];
-			const Vec3 b = positions[indices[i*3+1]];
-			const Vec3 c = positions[indices[i*3+2]];
+			packet.nx[l] = n.x;
+			packet.ny[l] = n.y;
+			packet.nz[l] = n.z;
 
-			triangleBounds[i].AddPoint(a);
-			triangleBounds[i].AddPoint(b);
-			triangleBounds[i].AddPoint(c);
+			packet.tri[l] = tri;
 		}
-	
-		BVHBuilder builder;
-		bvh = builder.Build(&triangleBounds[0], numTris);
 	}
 
-    RebuildCDF();
+#endif
 }
 
-void Mesh::RebuildCDF()
+void Mesh::RebuildTriangleTable()
 {
     int numTris = indices.size()/3;
 
     float totalArea = 0.0f;
-    cdf.resize(0);
+    std::vector<float> areas(numTris);
 
     for (int i=0; i < numTris; ++i)
     {
@@ -350,18 +1452,15 @@ void Mesh::RebuildCDF()
         const Vec3 b = positions[indices[i*3+1]];
         const Vec3 c = positions[indices[i*3+2]];
 
-        const float area = 0.5f*Length(Cross(b-a, c-a));
+        areas[i] = 0.5f*Length(Cross(b-a, c-a));
 
-        totalArea += area;
-
-        cdf.push_back(totalArea);
+        totalArea += areas[i];
     }
 
-    // normalize cdf
-    for (int i=0; i < numTris; ++i)
-    {
-        cdf[i] /= totalArea;
-    }
+    triangleTable.resize(numTris);
+
+    if (numTris)
+        BuildAliasTable(&areas[0], numTris, &triangleTable[0]);
 
     // save total area
     area = totalArea;
@@ -369,447 +1468,418 @@ void Mesh::RebuildCDF()
 
 Mesh* ImportMeshFromObj(const char* path)
 {
-    double start = GetSeconds();
+	double start = GetSeconds();
 
-    ifstream file(path);
+	Mesh* m = ParseObj(path);
 
-    if (!file)
-        return NULL;
+	if (!m)
+		return NULL;
 
-    Mesh* m = new Mesh();
+	// add face normals on top of the ones specified in the file
+	AccumulateFaceNormals(m);
 
-    vector<Vec3> positions;
-    vector<Vec3> normals;
-    vector<Vec2> texcoords;
-    vector<Vec3> colors;
-    vector<int>& indices = m->indices;
+	double end = GetSeconds();
 
-    //typedef unordered_map<VertexKey, int, MemoryHash<VertexKey> > VertexMap;
-    typedef map<VertexKey, int> VertexMap;
-    VertexMap vertexLookup;	
+	m->RebuildBVH();
 
-    // some scratch memory
-    const int kMaxLineLength = 1024;
-    char buffer[kMaxLineLength];
+	double endBuild = GetSeconds();
 
-    //double startTime = GetSeconds();
+	printf("Imported mesh %s (%d vertices, %d triangles) in %fms, build BVH in %fms\n", path, int(m->positions.size()), int(m->indices.size()/3), (end-start)*1000.0f, (endBuild-end)*1000.0f);
 
-    while (file)
-    {
-        file >> buffer;
-	
-        if (strcmp(buffer, "vn") == 0)
-        {
-            // normals
-            float x, y, z;
-            file >> x >> y >> z;
+	return m;
+}
 
-            normals.push_back(Vec3(x, y, z));
-        }
-        else if (strcmp(buffer, "vt") == 0)
-        {
-            // texture coords
-            float u, v;
-            file >> u >> v;
+namespace
+{
 
-            texcoords.push_back(Vec2(u, v));
-        }
-        else if (buffer[0] == 'v')
-        {
-            // positions
-            float x, y, z;
-            file >> x >> y >> z;
+// .bin files start with a header followed by the mesh arrays, each array starts on
+// a kBinAlignment boundary so it can be used directly from a memory mapping, files
+// without the magic are the original unversioned layout which is copied on load
+//
+// version 3 records the size of a wide node, files written with another wide node
+// layout (version 2 always used float bounds) have their wide trees rebuilt on load
+//
+// version 4 stores an alias table for the triangles instead of an area cdf, older
+// files have their table rebuilt on load
+const char kBinMagic[4] = { 'T', 'I', 'N', 'B' };
+const int kBinVersion = 4;
+const int kBinVersionFloatWideNodes = 2;
+const int kBinAlignment = 64;
+
+enum BinArray
+{
+	eBinPositions,
+	eBinNormals,
+	eBinIndices,
+	eBinTriangleTable,
+	eBinNodes,
+	eBinWideNodes,
+	eBinPackets,
+
+	eBinNumArrays
+};
 
-            positions.push_back(Vec3(x, y, z));
-        }
-        else if (buffer[0] == 's' || buffer[0] == 'g' || buffer[0] == 'o')
-        {
-            // ignore smoothing groups, groups and objects
-            char linebuf[256];
-            file.getline(linebuf, 256);		
-        }
-        else if (strcmp(buffer, "mtllib") == 0)
-        {
-            // ignored
-            std::string MaterialFile;
-            file >> MaterialFile;
-        }		
-        else if (strcmp(buffer, "usemtl") == 0)
-        {
-            // read Material name
-            std::string materialName;
-            file >> materialName;
-        }
-        else if (buffer[0] == 'f')
-        {
-            // faces
-            int faceIndices[4];
-            int faceIndexCount = 0;
+struct BinHeader
+{
+	char magic[4];
+	int version;
 
-            for (int i=0; i < 4; ++i)
-            {
-                VertexKey key;
+	int numVertices;
+	int numIndices;
+	int numNodes;
+	int numWideNodes;
+	int numPackets;
 
-                file >> key.v;
+	float area;
 
-				if (!file.eof())
-				{
-					// failed to read another index continue on
-					if (file.fail())
-					{
-						file.clear();
-						break;
-					}
+	// byte offset of each array from the start of the file
+	uint64_t offsets[eBinNumArrays];
 
-					if (file.peek() == '/')
-					{
-						file.ignore();
+	int wideNodeSize;
+};
 
-						if (file.peek() != '/')
-						{
-							file >> key.vt;
-						}
+// size in bytes of each array of a mesh
+void GetBinArraySizes(const MeshData& data, uint64_t* sizes)
+{
+	sizes[eBinPositions] = uint64_t(data.numVertices)*sizeof(Vec3);
+	sizes[eBinNormals] = uint64_t(data.numVertices)*sizeof(Vec3);
+	sizes[eBinIndices] = uint64_t(data.numIndices)*sizeof(int);
+	sizes[eBinTriangleTable] = uint64_t(data.numIndices/3)*sizeof(AliasEntry);
+	sizes[eBinNodes] = uint64_t(data.numNodes)*sizeof(BVHNode);
+	sizes[eBinWideNodes] = uint64_t(data.numWideNodes)*sizeof(MeshWideBVHNode);
+	sizes[eBinPackets] = uint64_t(data.numPackets)*sizeof(TriPacket);
+}
 
-						if (file.peek() == '/')
-						{
-							file.ignore();
-							file >> key.vn;
-						}
-					}
+// sets up a mesh to render straight from a mapped file, returns false if the file is malformed
+bool MapMeshFromBin(Mesh* m, void* mapping, size_t size)
+{
+	const BinHeader& header = *(const BinHeader*)mapping;
+	const char* base = (const char*)mapping;
 
-					// convert relative coordinates to absolute
-					if (key.v < 0)
-						key.v = positions.size() + key.v + 1;
-					
-					if (key.vn < 0)
-						key.vn = normals.size() + key.vn + 1;
-					
-					if (key.vt < 0)
-						key.vt = texcoords.size() + key.vt + 1;
+	MeshData& data = m->mapped;
+	memset(&data.compressed, 0, sizeof(CompressedVertices));
 
-					// find / add vertex, index
-					VertexMap::iterator iter = vertexLookup.find(key);
+	data.numVertices = header.numVertices;
+	data.numIndices = header.numIndices;
+	data.numNodes = header.numNodes;
+	data.numWideNodes = header.numWideNodes;
+	data.numPackets = header.numPackets;
+	data.area = header.area;
 
-					if (iter != vertexLookup.end())
-					{
-						faceIndices[faceIndexCount++] = iter->second;
-					}
-					else
-					{
-						// add vertex
-						int newIndex = m->positions.size();
-						faceIndices[faceIndexCount++] = newIndex;
+	const int wideNodeSize = header.version == kBinVersionFloatWideNodes ? 112 : header.wideNodeSize;
 
-						vertexLookup.insert(make_pair(key, newIndex)); 	
+	if (wideNodeSize != int(sizeof(MeshWideBVHNode)))
+	{
+		data.numWideNodes = 0;
+		data.numPackets = 0;
+	}
 
-						// push back vertex data
-						assert(key.v > 0);
+	uint64_t sizes[eBinNumArrays];
+	GetBinArraySizes(data, sizes);
 
-						m->positions.push_back(positions[key.v-1]);
-						
-						// normal [optional]
-						if (key.vn)
-						{
-							m->normals.push_back(normals[key.vn-1]);
-						}
+	// older files store one float per triangle
+	const bool triangleCdf = header.version < kBinVersion;
 
-						// texcoord [optional]
-						if (key.vt)
-						{
-							//m->texcoords[0].push_back(texcoords[key.vt-1]);
-						}
-					}
-				}
-            }
-
-            if (faceIndexCount == 3)
-            {
-                // a triangle
-                indices.insert(indices.end(), faceIndices, faceIndices+3);
-            }
-            else if (faceIndexCount == 4)
-            {
-                // a quad, triangulate clockwise
-                indices.insert(indices.end(), faceIndices, faceIndices+3);
-
-                indices.push_back(faceIndices[2]);
-                indices.push_back(faceIndices[3]);
-                indices.push_back(faceIndices[0]);
-            }
-            else
-            {
-                cout << "Face with more than 4 vertices are not suppoted" << endl;
-            }
-
-        }		
-        else if (buffer[0] == '#')
-        {
-            // comment
-            char linebuf[256];
-            file.getline(linebuf, 256);
-        }
-    }
+	if (triangleCdf)
+		sizes[eBinTriangleTable] = uint64_t(data.numIndices/3)*sizeof(float);
 
-    // calculate normals if none specified in file
-    m->normals.resize(m->positions.size());
+	for (int i=0; i < eBinNumArrays; ++i)
+	{
+		if (header.offsets[i]%kBinAlignment || header.offsets[i] + sizes[i] > size)
+			return false;
+	}
 
-    const int numFaces = indices.size()/3;
-    for (int i=0; i < numFaces; ++i)
-    {
-        int a = indices[i*3+0];
-        int b = indices[i*3+1];
-        int c = indices[i*3+2];
+	data.positions = (const Vec3*)(base + header.offsets[eBinPositions]);
+	data.normals = (const Vec3*)(base + header.offsets[eBinNormals]);
+	data.indices = (const int*)(base + header.offsets[eBinIndices]);
+	data.triangleTable = triangleCdf ? NULL : (const AliasEntry*)(base + header.offsets[eBinTriangleTable]);
+	data.nodes = (const BVHNode*)(base + header.offsets[eBinNodes]);
+	data.wideNodes = data.numWideNodes ? (const MeshWideBVHNode*)(base + header.offsets[eBinWideNodes]) : NULL;
+	data.packets = data.numPackets ? (const TriPacket*)(base + header.offsets[eBinPackets]) : NULL;
+
+#if !USE_WIDE_BVH
+	data.wideNodes = NULL;
+	data.packets = NULL;
+	data.numWideNodes = 0;
+	data.numPackets = 0;
+#endif
+
+	m->mapping = mapping;
+	m->mappingSize = size;
+
+	return true;
+}
 
-        Vec3& v0 = m->positions[a];
-        Vec3& v1 = m->positions[b];
-        Vec3& v2 = m->positions[c];
+// copies the arrays of a mapped mesh into its own storage and releases the mapping
+void CopyMappedMesh(Mesh* m)
+{
+	const MeshData& data = m->mapped;
 
-        Vec3 n = SafeNormalize(Cross(v1-v0, v2-v0), Vec3(0.0f, 1.0f, 0.0f));
+	m->positions.assign(data.positions, data.positions + data.numVertices);
+	m->normals.assign(data.normals, data.normals + data.numVertices);
+	m->indices.assign(data.indices, data.indices + data.numIndices);
+	if (data.triangleTable)
+		m->triangleTable.assign(data.triangleTable, data.triangleTable + data.numIndices/3);
 
-        m->normals[a] += n;
-        m->normals[b] += n;
-        m->normals[c] += n;
-    }
+	m->area = data.area;
 
-    for (int i=0; i < m->normals.size(); ++i)
-    {
-        m->normals[i] = SafeNormalize(m->normals[i], Vec3(0.0f, 1.0f, 0.0f));
-    }
-        
-    double end = GetSeconds();
+	m->bvh.nodes = new BVHNode[data.numNodes];
+	m->bvh.numNodes = data.numNodes;
 
-    //cout << "Imported mesh " << path << " in " << (GetSeconds()-startTime)*1000.f << "ms" << endl;
-	m->RebuildBVH();
+	memcpy(m->bvh.nodes, data.nodes, sizeof(BVHNode)*data.numNodes);
 
-    double endBuild = GetSeconds();
+	UnmapFile(m->mapping, m->mappingSize);
 
-    printf("Imported mesh %s (%d vertices, %d triangles) in %fms, build BVH in %fms\n", path, int(m->positions.size()), int(m->indices.size()/3), (end-start)*1000.0f, (endBuild-end)*1000.0f);
+	m->mapping = NULL;
+	m->mappingSize = 0;
+}
 
+// renumbers the triangles in the order the tree's leaves are laid out and the vertices in the
+// order they are first used, nearby triangles then mostly index nearby vertices so that their
+// clusters fit in 16 bits, the trees refer to the new triangle indices
+void ReorderForCompression(Mesh* m)
+{
+	const int numTris = m->indices.size()/3;
+	const int numVertices = m->positions.size();
 
+	std::vector<int> order;
+	order.reserve(numTris);
 
-    return m;
+	for (int i=0; i < m->bvh.numNodes; ++i)
+	{
+		if (m->bvh.nodes[i].leaf)
+			order.push_back(m->bvh.nodes[i].leftIndex);
+	}
+
+	// only trees with one triangle per leaf
+	if (int(order.size()) != numTris || int(m->normals.size()) != numVertices)
+		return;
+
+	std::vector<int> newTri(numTris);
+
+	for (int i=0; i < numTris; ++i)
+		newTri[order[i]] = i;
+
+	for (int i=0; i < m->bvh.numNodes; ++i)
+	{
+		if (m->bvh.nodes[i].leaf)
+			m->bvh.nodes[i].leftIndex = newTri[m->bvh.nodes[i].leftIndex];
+	}
+
+	std::vector<int> indices(numTris*3);
+	std::vector<int> newVertex(numVertices, -1);
+
+	int numUsed = 0;
+
+	for (int i=0; i < numTris; ++i)
+	{
+		for (int j=0; j < 3; ++j)
+		{
+			const int v = m->indices[order[i]*3+j];
+
+			if (newVertex[v] < 0)
+				newVertex[v] = numUsed++;
+
+			indices[i*3+j] = newVertex[v];
+		}
+	}
+
+	// unreferenced vertices go last
+	for (int v=0; v < numVertices; ++v)
+	{
+		if (newVertex[v] < 0)
+			newVertex[v] = numUsed++;
+	}
+
+	std::vector<Vec3> positions(numVertices);
+	std::vector<Vec3> normals(numVertices);
+
+	for (int v=0; v < numVertices; ++v)
+	{
+		positions[newVertex[v]] = m->positions[v];
+		normals[newVertex[v]] = m->normals[v];
+	}
+
+	m->indices.swap(indices);
+	m->positions.swap(positions);
+	m->normals.swap(normals);
 }
 
+} // anonymous namespace
 
-Mesh* ImportMeshFromObjNew(const char* path)
+void Mesh::Compress()
 {
-    double start = GetSeconds();
+	// mapped meshes are read-only and never compressed, the copy is refit below
+	if (mapping)
+		CopyMappedMesh(this);
 
-    FILE* file = fopen(path, "r");
+	compressed = true;
+	++generation;
 
-    if (!file)
-    {
-        printf("Could not open %s\n", path);
-        return NULL;
-    }
+	ReorderForCompression(this);
 
-    Mesh* m = new Mesh();
+	// quantizes the vertices before refitting the trees to them
+	RefitBVH();
 
-    vector<Vec3> positions;
-    vector<Vec3> normals; 
-    vector<Vec2> texcoords;
-    vector<Vec3> colors;
-    vector<int>& indices = m->indices;
+	const double rawSize = double(positions.size())*sizeof(Vec3)*2 + double(indices.size())*sizeof(int);
+	const double compressedSize = double(quantizedPositions.size())*sizeof(unsigned long long) + double(octNormals.size())*sizeof(unsigned int) +
+								  double(clusterIndices.size())*sizeof(unsigned short) + double(clusterBases.size() + wideClusterIndices.size())*sizeof(int);
 
-    //typedef unordered_map<VertexKey, int, MemoryHash<VertexKey> > VertexMap;
-    typedef map<VertexKey, int> VertexMap;
-    VertexMap vertexLookup; 
+	printf("Compressed mesh vertices from %.1fMB to %.1fMB\n", rawSize/(1024.0*1024.0), compressedSize/(1024.0*1024.0));
+}
 
-    // some scratch memory
-    const int kMaxLineLength = 1024;
-    char line[kMaxLineLength];
+bool Mesh::Deform(const Mesh& frame)
+{
+	const MeshData current = GetData();
+	const MeshData target = frame.GetData();
 
-    //double startTime = GetSeconds();
+	// compression renumbers the vertices so they no longer match the frame's
+	if (compressed || current.numVertices != target.numVertices || current.numIndices != target.numIndices)
+		return false;
 
-    while (!feof(file))
-    {
-        fgets(line, kMaxLineLength, file);
+	if (current.numIndices && memcmp(current.indices, target.indices, sizeof(int)*current.numIndices) != 0)
+		return false;
 
-        Vec3 v;
-        if (line[0] == 'v')
-        {
-            if (line[1] == ' ')
-            {
-                sscanf(&line[2], "%f %f %f", &v.x, &v.y, &v.z);
-                positions.push_back(v);
-            }
-            else if (line[1] == 'n')
-            {
-                sscanf(&line[2], "%f %f %f", &v.x, &v.y, &v.z);
-                normals.push_back(v);
-            }
-            else if (line[1] == 't')
-            {
-                sscanf(&line[2], "%f %f", &v.x, &v.y);
-                texcoords.push_back(Vec2(v.x, v.y));
-            }
-        }
-        else if (line[0] == 's' || line[0] == 'g' || line[0] == 'o')
-        {
-            // ignore smoothing group  
-        }
-        /*
-        else if (sscanf(line, " mtllib ") == 0)
-        {
-            // ignore material libs
-            //std::string MaterialFile;
-            //file >> MaterialFile;
-        }       
-        else if (sscanf(line, "usemtl") == 0)
-        {
-            // read Material name
-            //std::string materialName;
-            //file >> materialName;
-        }
-        */
-        else if (line[0] == 'f')
-        {
-            // faces
-            int faceIndices[4];
-            int faceIndexCount = 0;
-            int attribCount = 0;
-
-            // eat "f "
-            int cursor = 2;
-            int start = cursor;
-
-            VertexKey key;
-            int* keyptr = (int*)(&key);
-
-            for(;;)
-            {
-                if (line[cursor] == '/' || line[cursor] == ' ' || line[cursor] == 0)
-                {
-                    // read index
-                    sscanf(&line[start], "%d", &keyptr[attribCount]);
-
-                    attribCount++;
-
-                    start = cursor+1;
-
-                }
-
-                // end of vertex definition, add to lookup
-                if (line[cursor] == ' ' || line[cursor] == 0)
-                {
-                    attribCount = 0;
-
-                    // find / add vertex, index
-                    VertexMap::iterator iter = vertexLookup.find(key);
-
-                    if (iter != vertexLookup.end())
-                    {
-                        faceIndices[faceIndexCount] = iter->second;
-                    }
-                    else
-                    {
-                        // add vertex
-                        int newIndex = m->positions.size();
-                        faceIndices[faceIndexCount] = newIndex;
-
-                        vertexLookup.insert(make_pair(key, newIndex));  
-
-                        // push back vertex data
-                        assert(key.v > 0);
-
-                        m->positions.push_back(positions[key.v-1]);
-                        
-                        // normal [optional]
-                        if (key.vn)
-                        {
-                            m->normals.push_back(normals[key.vn-1]);
-                        }
-
-                        // texcoord [optional]
-                        if (key.vt)
-                        {
-                           // m->texcoords[0].push_back(texcoords[key.vt-1]);
-                        }
-                    }
-            
-                    faceIndexCount++;
-                }
-    
-                if (line[cursor] == 0)
-                    break;
-                
-                ++cursor;
-            }
-
-           // printf("%d %d %d\n", faceIndices[0], faceIndices[1], faceIndices[2]);;
-
-            if (faceIndexCount == 3)
-            {
-                // a triangle
-                indices.insert(indices.end(), faceIndices, faceIndices+3);
-            }
-            else if (faceIndexCount == 4)
-            {
-                // a quad, triangulate clockwise
-                indices.insert(indices.end(), faceIndices, faceIndices+3);
-
-                indices.push_back(faceIndices[2]);
-                indices.push_back(faceIndices[3]);
-                indices.push_back(faceIndices[0]);
-            }
-            else
-            {
-                cout << "Face with more than 4 vertices are not supported" << endl;
-            }
-
-        }       
-        /*
-        else if (line[0] == '#')
-        {
-            // comment
-        }
-        */
-    }
+	if (mapping)
+		CopyMappedMesh(this);
 
-    // calculate normals if none specified in file
-    m->normals.resize(m->positions.size());
+	positions.assign(target.positions, target.positions + target.numVertices);
+	normals.assign(target.normals, target.normals + target.numVertices);
 
-    const int numFaces = indices.size()/3;
-    for (int i=0; i < numFaces; ++i)
-    {
-        int a = indices[i*3+0];
-        int b = indices[i*3+1];
-        int c = indices[i*3+2];
+	RefitBVH();
 
-        Vec3& v0 = m->positions[a];
-        Vec3& v1 = m->positions[b];
-        Vec3& v2 = m->positions[c];
+	return true;
+}
 
-        Vec3 n = SafeNormalize(Cross(v1-v0, v2-v0), Vec3(0.0f, 1.0f, 0.0f));
+void Mesh::QuantizeVertices()
+{
+	const int numVertices = positions.size();
+	const int numTris = indices.size()/3;
 
-        m->normals[a] += n;
-        m->normals[b] += n;
-        m->normals[c] += n;
-    }
+	Vec3 lower, upper;
+	GetBounds(lower, upper);
 
-    for (int i=0; i < m->normals.size(); ++i)
-    {
-        m->normals[i] = SafeNormalize(m->normals[i], Vec3(0.0f, 1.0f, 0.0f));
-    }
-        
-    double end = GetSeconds();
+	if (numVertices == 0)
+		lower = upper = Vec3(0.0f);
 
-    //cout << "Imported mesh " << path << " in " << (GetSeconds()-startTime)*1000.f << "ms" << endl;
-    m->RebuildBVH();
+	// smallest power of two spacing that covers the largest extent
+	const float extent = Max(Max(upper.x-lower.x, upper.y-lower.y), upper.z-lower.z);
 
-    double endBuild = GetSeconds();
+	int exponent;
+	frexpf(Max(extent/float(kQuantizedPositionMask), FLT_MIN), &exponent);
 
-    printf("Imported mesh %s (%d vertices, %d triangles) in %fms, build BVH in %fms\n", path, int(m->positions.size()), int(m->indices.size()/3), (end-start)*1000.0f, (endBuild-end)*1000.0f);
+	quantizeLower = lower;
+	quantizeSpacing = ldexpf(1.0f, exponent);
 
-    fclose(file);
+	CompressedVertices c;
+	c.lower[0] = lower.x;
+	c.lower[1] = lower.y;
+	c.lower[2] = lower.z;
+	c.spacing = quantizeSpacing;
 
-    return m;
+	quantizedPositions.resize(numVertices);
+	octNormals.resize(numVertices);
+
+	for (int i=0; i < numVertices; ++i)
+	{
+		quantizedPositions[i] = EncodePosition(c, positions[i]);
+
+		// snap so that the trees and light sampling tables match the decoded triangles
+		positions[i] = DecodePosition(c, quantizedPositions[i]);
+
+		octNormals[i] = i < int(normals.size()) ? EncodeNormal(normals[i]) : 0;
+	}
+
+	const int numClusters = (numTris + kIndexClusterSize - 1)/kIndexClusterSize;
+
+	clusterIndices.assign(numTris*3, 0);
+	clusterBases.resize(numClusters);
+	wideClusterIndices.resize(0);
+
+	for (int cluster=0; cluster < numClusters; ++cluster)
+	{
+		const int begin = cluster*kIndexClusterSize*3;
+		const int end = Min(begin + kIndexClusterSize*3, numTris*3);
+
+		int minIndex = indices[begin];
+		int maxIndex = indices[begin];
+
+		for (int i=begin+1; i < end; ++i)
+		{
+			minIndex = Min(minIndex, indices[i]);
+			maxIndex = Max(maxIndex, indices[i]);
+		}
+
+		if (maxIndex-minIndex <= 0xffff)
+		{
+			clusterBases[cluster] = minIndex;
+
+			for (int i=begin; i < end; ++i)
+				clusterIndices[i] = (unsigned short)(indices[i]-minIndex);
+		}
+		else
+		{
+			clusterBases[cluster] = -1 - int(wideClusterIndices.size());
+
+			wideClusterIndices.insert(wideClusterIndices.end(), indices.begin()+begin, indices.begin()+end);
+		}
+	}
 }
 
 Mesh* ImportMeshFromBin(const char* path)
 {
 	double start = GetSeconds();
 
+	size_t size = 0;
+	void* mapping = MapFile(path, &size);
+
+	if (mapping && size >= sizeof(BinHeader) && memcmp(mapping, kBinMagic, sizeof(kBinMagic)) == 0)
+	{
+		const int version = ((const BinHeader*)mapping)->version;
+
+		Mesh* m = new Mesh();
+
+		if (version < kBinVersionFloatWideNodes || version > kBinVersion || !MapMeshFromBin(m, mapping, size))
+		{
+			printf("Mesh %s is not a valid version %d .bin file\n", path, kBinVersion);
+
+			UnmapFile(mapping, size);
+			delete m;
+
+			return NULL;
+		}
+
+		bool rebuildWide = false;
+		bool rebuildTable = m->mapped.triangleTable == NULL;
+
+#if USE_WIDE_BVH
+		// written without wide trees or with another node layout
+		rebuildWide = m->mapped.numWideNodes == 0;
+#endif
+
+		if (rebuildWide || rebuildTable)
+		{
+			// build the missing parts in regular memory instead, only the
+			// binary tree is copied so the wide tree is always collapsed again
+			CopyMappedMesh(m);
+
+			m->RebuildWideBVH();
+
+			if (rebuildTable)
+				m->RebuildTriangleTable();
+		}
+
+		double end = GetSeconds();
+
+		printf("Imported mesh %s in %f ms\n", path, (end-start)*1000.0f);
+
+		return m;
+	}
+
+	if (mapping)
+		UnmapFile(mapping, size);
+
+	// unversioned layout
 	FILE* f = fopen(path, "rb");
 
 	if (f)
@@ -826,7 +1896,6 @@ Mesh* ImportMeshFromBin(const char* path)
 		m->positions.resize(numVertices);
 		m->normals.resize(numVertices);
 		m->indices.resize(numIndices);
-		m->cdf.resize(numIndices/3);
 		
 		m->bvh.nodes = new BVHNode[numNodes];
 		m->bvh.numNodes = numNodes;
@@ -837,10 +1906,13 @@ Mesh* ImportMeshFromBin(const char* path)
 		fread(m->bvh.nodes, sizeof(BVHNode)*numNodes, 1, f);
 		
 		fread(&m->area, sizeof(float), 1, f);
-		fread(&m->cdf[0], sizeof(float)*numIndices/3, 1, f);
 
+		// the area cdf that follows is replaced by an alias table
 		fclose(f);
 
+		m->RebuildWideBVH();
+		m->RebuildTriangleTable();
+
 		double end = GetSeconds();
 
 		printf("Imported mesh %s in %f ms\n", path, (end-start)*1000.0f);
@@ -853,29 +1925,74 @@ Mesh* ImportMeshFromBin(const char* path)
 
 void ExportMeshToBin(const char* path, const Mesh* m)
 {
-	FILE* f = fopen(path, "wb");
+	const MeshData data = m->GetData();
+
+	BinHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, kBinMagic, sizeof(kBinMagic));
+
+	header.version = kBinVersion;
+	header.numVertices = data.numVertices;
+	header.numIndices = data.numIndices;
+	header.numNodes = data.numNodes;
+	header.numWideNodes = data.numWideNodes;
+	header.numPackets = data.numPackets;
+	header.area = data.area;
+	header.wideNodeSize = int(sizeof(MeshWideBVHNode));
+
+	uint64_t sizes[eBinNumArrays];
+	GetBinArraySizes(data, sizes);
+
+	uint64_t offset = sizeof(BinHeader);
+
+	for (int i=0; i < eBinNumArrays; ++i)
+	{
+		offset = (offset + kBinAlignment-1)/kBinAlignment*kBinAlignment;
+
+		header.offsets[i] = offset;
+		offset += sizes[i];
+	}
+
+	const void* arrays[eBinNumArrays] = { data.positions, data.normals, data.indices, data.triangleTable, data.nodes, data.wideNodes, data.packets };
+
+	// write to a temporary file and move it into place so that processes
+	// mapping the existing file (or reading it concurrently) never see a partial file
+	// the suffix keeps concurrent writers of the same file apart
+	char suffix[64];
+	sprintf(suffix, ".%llx.tmp", (unsigned long long)(uint64_t(GetSeconds()*1.0e9) ^ uint64_t(uintptr_t(&header))));
+
+	std::string tempPath = std::string(path) + suffix;
+
+	FILE* f = fopen(tempPath.c_str(), "wb");
 
 	if (f)
 	{
-		int numVertices = m->positions.size();
-		int numIndices = m->indices.size();
-		int numNodes = m->bvh.numNodes;
+		fwrite(&header, sizeof(header), 1, f);
 
-		fwrite(&numVertices, sizeof(numVertices), 1, f);
-		fwrite(&numIndices, sizeof(numIndices), 1, f);
-		fwrite(&numNodes, sizeof(numNodes), 1, f);
+		uint64_t written = sizeof(header);
+
+		for (int i=0; i < eBinNumArrays; ++i)
+		{
+			// pad to the start of the array
+			const char zeros[kBinAlignment] = {};
+			fwrite(zeros, 1, size_t(header.offsets[i]-written), f);
 
-		// write data blocks
-		fwrite(&m->positions[0], sizeof(Vec3)*numVertices, 1, f);
-		fwrite(&m->normals[0], sizeof(Vec3)*numVertices, 1, f);		
-		fwrite(&m->indices[0], sizeof(int)*numIndices, 1, f);
-		fwrite(m->bvh.nodes, sizeof(BVHNode)*numNodes, 1, f);
+			if (sizes[i])
+				fwrite(arrays[i], size_t(sizes[i]), 1, f);
 
-		// cdf for light sampling
-		fwrite(&m->area, sizeof(float), 1, f);
-		fwrite(&m->cdf[0], sizeof(float)*numIndices/3, 1, f);
+			written = header.offsets[i] + sizes[i];
+		}
 
 		fclose(f);
+
+#if _WIN32
+		remove(path);
+#endif
+		if (rename(tempPath.c_str(), path) != 0)
+		{
+			printf("Could not write mesh %s\n", path);
+			remove(tempPath.c_str());
+		}
 	}
 }
 
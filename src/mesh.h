@@ -4,14 +4,173 @@
 
 #include "maths.h"
 #include "bvh.h"
+#include "sampler.h"
 
-struct Mesh
+// leaf of a mesh's wide BVH, up to four triangles stored with their edges and
+// (unnormalized) face normal precomputed so they can be tested as one SIMD packet
+struct TriPacket
+{
+	float ax[kWideBVHWidth];
+	float ay[kWideBVHWidth];
+	float az[kWideBVHWidth];
+
+	float abx[kWideBVHWidth];
+	float aby[kWideBVHWidth];
+	float abz[kWideBVHWidth];
+
+	float acx[kWideBVHWidth];
+	float acy[kWideBVHWidth];
+	float acz[kWideBVHWidth];
+
+	float nx[kWideBVHWidth];
+	float ny[kWideBVHWidth];
+	float nz[kWideBVHWidth];
+
+	// triangle index, -1 for unused lanes
+	int tri[kWideBVHWidth];
+};
+
+// compressed vertex attributes, see Mesh::Compress(), positions are quantized to a grid over
+// the mesh bounds whose spacing is a power of two so that lower + q*spacing is exact whether or
+// not it is contracted to a multiply-add, every device decodes the same floats the trees were built from
+const int kQuantizedPositionBits = 21;
+const unsigned int kQuantizedPositionMask = (1<<kQuantizedPositionBits)-1;
+
+// triangles are grouped into clusters of this many, a cluster whose vertices span less
+// than 64k stores its indices as 16 bit offsets from the lowest one
+const int kIndexClusterShift = 6;
+const int kIndexClusterSize = 1<<kIndexClusterShift;
+
+// arrays are NULL for meshes which aren't compressed
+struct CompressedVertices
+{
+	// x, y and z in consecutive runs of kQuantizedPositionBits
+	const unsigned long long* positions;
+
+	// octahedral encoded, two 16 bit snorms
+	const unsigned int* normals;
+
+	// three per triangle, offsets from the base vertex of the triangle's cluster
+	const unsigned short* indices;
+
+	// base vertex of each cluster, clusters whose vertices are too far apart store
+	// -1 - the offset of their indices in wideIndices instead
+	const int* clusterBases;
+	const int* wideIndices;
+
+	// kept trivial as meshes live in a union with the other geometry types
+	float lower[3];
+	float spacing;
+
+	int numClusters;
+	int numWideIndices;
+};
+
+CUDA_CALLABLE inline Vec3 DecodePosition(const CompressedVertices& c, unsigned long long q)
 {
-	~Mesh()
+	const float x = float((unsigned int)(q)&kQuantizedPositionMask);
+	const float y = float((unsigned int)(q>>kQuantizedPositionBits)&kQuantizedPositionMask);
+	const float z = float((unsigned int)(q>>(2*kQuantizedPositionBits))&kQuantizedPositionMask);
+
+	return Vec3(c.lower[0] + x*c.spacing, c.lower[1] + y*c.spacing, c.lower[2] + z*c.spacing);
+}
+
+CUDA_CALLABLE inline unsigned long long EncodePosition(const CompressedVertices& c, const Vec3& p)
+{
+	const float rcpSpacing = 1.0f/c.spacing;
+
+	unsigned long long q = 0;
+
+	for (int i=0; i < 3; ++i)
 	{
-		delete[] bvh.nodes; 
+		const float x = floorf((p[i]-c.lower[i])*rcpSpacing + 0.5f);
+		const unsigned long long b = (unsigned long long)Clamp(x, 0.0f, float(kQuantizedPositionMask));
+
+		q |= b<<(i*kQuantizedPositionBits);
 	}
 
+	return q;
+}
+
+// maps the unit sphere onto an octahedron unfolded into [-1, 1]^2
+CUDA_CALLABLE inline unsigned int EncodeNormal(const Vec3& n)
+{
+	const float l1 = fabsf(n.x) + fabsf(n.y) + fabsf(n.z);
+
+	if (l1 <= 0.0f)
+		return 0;
+
+	float x = n.x/l1;
+	float y = n.y/l1;
+
+	// the lower hemisphere folds over the diagonals
+	if (n.z < 0.0f)
+	{
+		const float fx = (1.0f-fabsf(y))*(x >= 0.0f ? 1.0f : -1.0f);
+		const float fy = (1.0f-fabsf(x))*(y >= 0.0f ? 1.0f : -1.0f);
+
+		x = fx;
+		y = fy;
+	}
+
+	const int ex = int(floorf(Clamp(x, -1.0f, 1.0f)*32767.0f + 0.5f));
+	const int ey = int(floorf(Clamp(y, -1.0f, 1.0f)*32767.0f + 0.5f));
+
+	return (unsigned int)(ex & 0xffff) | ((unsigned int)(ey & 0xffff)<<16);
+}
+
+CUDA_CALLABLE inline Vec3 DecodeNormal(unsigned int e)
+{
+	float x = float(short(e & 0xffff))/32767.0f;
+	float y = float(short(e>>16))/32767.0f;
+
+	const float z = 1.0f - fabsf(x) - fabsf(y);
+
+	if (z < 0.0f)
+	{
+		const float fx = (1.0f-fabsf(y))*(x >= 0.0f ? 1.0f : -1.0f);
+		const float fy = (1.0f-fabsf(x))*(y >= 0.0f ? 1.0f : -1.0f);
+
+		x = fx;
+		y = fy;
+	}
+
+	const Vec3 n(x, y, z);
+	return n/Length(n);
+}
+
+// flat view of the arrays used for rendering a mesh, these either point
+// into the mesh's own storage or into a memory mapped .bin file
+struct MeshData
+{
+	const Vec3* positions;
+	const Vec3* normals;
+	const int* indices;
+	const AliasEntry* triangleTable;
+
+	const BVHNode* nodes;
+	const MeshWideBVHNode* wideNodes;
+	const TriPacket* packets;
+
+	int numVertices;
+	int numIndices;
+	int numNodes;
+	int numWideNodes;
+	int numPackets;
+
+	float area;
+
+	CompressedVertices compressed;
+};
+
+// returns a process wide unique mesh id, never reused even after the mesh is freed
+unsigned long NewMeshId();
+
+struct Mesh
+{
+	Mesh() : area(0.0f), bvhCost(0.0f), mapping(NULL), mappingSize(0), compressed(false), quantizeSpacing(0.0f), id(NewMeshId()), generation(0) {}
+	~Mesh();
+
     void AddMesh(Mesh& m);
 
 	void DuplicateVertex(int i);
@@ -23,16 +182,67 @@ struct Mesh
     void GetBounds(Vec3& minExtents, Vec3& maxExtents) const;
 
 	void RebuildBVH();
-    void RebuildCDF();
+	void RebuildWideBVH();
+    void RebuildTriangleTable();
+
+	// updates the trees after positions moved but the triangles stayed the same, the BVH
+	// keeps its topology unless the refitted tree's SAH cost exceeds threshold times the
+	// cost it had when built, returns true if it had to be rebuilt
+	bool RefitBVH(float threshold=1.3f);
+
+	// moves the vertices to those of frame, which must have the same triangles, e.g.: the next
+	// frame of a deforming mesh, and refits the trees, returns false if the triangles differ
+	bool Deform(const Mesh& frame);
+
+	// returns the rendering arrays of the mesh wherever they are stored
+	MeshData GetData() const;
+
+	// renderers read the compressed attributes below instead of positions, normals and indices
+	// from here on, positions are snapped to their quantized values and the trees refit so that
+	// everything built from them matches what is decoded, they stay compressed through later rebuilds
+	void Compress();
+	void QuantizeVertices();
     
     std::vector<Vec3> positions;
     std::vector<Vec3> normals;
     std::vector<int> indices;
 
-    std::vector<float> cdf;
+    // area weighted alias table of the triangles for sampling the mesh as a light
+    std::vector<AliasEntry> triangleTable;
     float area;
 
 	BVH bvh;
+
+	// SAH cost of bvh when it was last built, 0 if unknown
+	float bvhCost;
+
+	// CPU traversal structures derived from bvh
+	MeshWideBVH wideBvh;
+	std::vector<TriPacket> packets;
+
+	// meshes loaded in place from a .bin file leave the arrays above empty and
+	// reference the mapped file instead, these are read-only
+	void* mapping;
+	size_t mappingSize;
+	MeshData mapped;
+
+	bool compressed;
+
+	std::vector<unsigned long long> quantizedPositions;
+	std::vector<unsigned int> octNormals;
+	std::vector<unsigned short> clusterIndices;
+	std::vector<int> clusterBases;
+	std::vector<int> wideClusterIndices;
+
+	Vec3 quantizeLower;
+	float quantizeSpacing;
+
+	// identifies the mesh to renderers that keep their own copies of it
+	unsigned long id;
+
+	// bumped whenever the mesh's trees or arrays are rebuilt in place, copies of an older
+	// generation are stale, see RebuildBVH(), RefitBVH() and Compress()
+	unsigned long generation;
 };
 
 
@@ -42,9 +252,14 @@ Mesh* ImportMeshFromPly(const char* path);
 Mesh* ImportMeshFromBin(const char* path);
 Mesh* ImportMeshFromWo3(const char* path);
 
-// just switches on filename
+// switches on filename, non .bin meshes are cached as <path>.cache-<hash>.bin
+// where hash covers the file contents so later loads (in any process) map the cache
 Mesh* ImportMesh(const char* path);
 
+// imports the vertices and triangles of a mesh file as ImportMesh() does but builds no trees
+// and bypasses the cache, e.g.: the frames a resident mesh is deformed to with Mesh::Deform()
+Mesh* ImportMeshVertices(const char* path);
+
 // save mesh in optimized binary format
 void ExportMeshToBin(const char* path, const Mesh* m);
 void ExportMeshToObj(const char* path, const Mesh* m);
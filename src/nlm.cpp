@@ -1,77 +1,377 @@
 #include "nlm.h"
 #include "maths.h"
+#include "parallel.h"
 
-void AverageFilter(const Color* in, Color* out, int width, int height, int radius)
+#include <vector>
+
+#if !__CUDACC__ && (__SSE2__ || _M_X64)
+#define USE_NLM_SSE 1
+#include <emmintrin.h>
+#else
+#define USE_NLM_SSE 0
+#endif
+
+namespace
 {
-	for (int y=0; y < height; ++y)
+
+// rows handed to a worker at once
+const int kNlmRowsPerTask = 8;
+
+// the image and its box filtered means are stored as one plane per channel so that
+// neighbouring pixels along a row can be processed together
+struct Planes
+{
+	std::vector<float> c[4];
+
+	void Resize(int n)
 	{
-		for (int x=0; x < width; ++x)
-		{
-			int xlower = std::max(0, x-radius);
-			int xupper = std::min(width-1, x+radius);
+		for (int i=0; i < 4; ++i)
+			c[i].resize(n);
+	}
+};
+
+// scratch reused across calls so that filtering doesn't allocate every frame,
+// the filter is only ever run from the presenting thread
+Planes g_input;
+Planes g_rows;
+Planes g_means;
+
+Planes g_albedo;
+Planes g_normal;
+std::vector<float> g_depth;
+
+#if USE_NLM_SSE
+
+// exp(x) for x <= 0, splits into 2^n*2^f and approximates 2^f on [0, 1) with a polynomial,
+// relative error is around 1e-7 which is far below what the filter weights can resolve
+inline __m128 ExpNegative(__m128 x)
+{
+	x = _mm_max_ps(x, _mm_set1_ps(-87.0f));
 
-			int ylower = std::max(0, y-radius);
-			int yupper = std::min(height-1, y+radius);
+	const __m128 t = _mm_mul_ps(x, _mm_set1_ps(1.44269504f));
 
-			int count = 0;
-			Color sum;
+	// floor, t is negative so truncation rounds the wrong way
+	__m128 n = _mm_cvtepi32_ps(_mm_cvttps_epi32(t));
+	n = _mm_sub_ps(n, _mm_and_ps(_mm_cmplt_ps(t, n), _mm_set1_ps(1.0f)));
 
-			for (int fx=xlower; fx <= xupper; ++fx)
+	const __m128 f = _mm_sub_ps(t, n);
+
+	__m128 p = _mm_set1_ps(1.8775767e-3f);
+	p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(8.9893397e-3f));
+	p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(5.5826318e-2f));
+	p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(2.4015361e-1f));
+	p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(6.9315308e-1f));
+	p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(9.9999994e-1f));
+
+	// scale by 2^n through the exponent bits
+	const __m128i e = _mm_slli_epi32(_mm_add_epi32(_mm_cvttps_epi32(n), _mm_set1_epi32(127)), 23);
+
+	return _mm_mul_ps(p, _mm_castsi128_ps(e));
+}
+
+#endif
+
+// box filter along rows, writes the mean of each window
+void BoxFilterRows(const Planes& in, Planes& out, int width, int height, int radius)
+{
+	const int numTasks = (height + kNlmRowsPerTask - 1)/kNlmRowsPerTask;
+
+	ParallelFor(numTasks, [&](int task, int worker)
+	{
+		const int begin = task*kNlmRowsPerTask;
+		const int end = Min(begin + kNlmRowsPerTask, height);
+
+		for (int c=0; c < 4; ++c)
+		{
+			for (int y=begin; y < end; ++y)
 			{
-				for (int fy=ylower; fy <= yupper; ++fy)
+				const float* src = &in.c[c][y*width];
+				float* dst = &out.c[c][y*width];
+
+				// running sum over the window, the window is clamped to the image
+				float sum = 0.0f;
+				for (int x=0; x <= Min(radius, width-1); ++x)
+					sum += src[x];
+
+				for (int x=0; x < width; ++x)
 				{
-					sum += in[fy*width + fx];
-					count += 1;
+					const int lower = Max(0, x-radius);
+					const int upper = Min(width-1, x+radius);
+
+					dst[x] = sum/float(upper-lower+1);
+
+					if (x+radius+1 < width)
+						sum += src[x+radius+1];
+					if (x-radius >= 0)
+						sum -= src[x-radius];
 				}
 			}
+		}
+	});
+}
+
+// box filter along columns, each task keeps a running row of sums so memory is walked row by row
+void BoxFilterColumns(const Planes& in, Planes& out, int width, int height, int radius)
+{
+	const int numTasks = (height + kNlmRowsPerTask - 1)/kNlmRowsPerTask;
+
+	ParallelFor(numTasks, [&](int task, int worker)
+	{
+		const int begin = task*kNlmRowsPerTask;
+		const int end = Min(begin + kNlmRowsPerTask, height);
+
+		std::vector<float> sum(width);
+
+		for (int c=0; c < 4; ++c)
+		{
+			const float* src = &in.c[c][0];
+
+			for (int x=0; x < width; ++x)
+				sum[x] = 0.0f;
 
-			out[y*width + x] = sum*(1.0f/count);
+			for (int y=Max(0, begin-radius); y <= Min(begin+radius, height-1); ++y)
+			{
+				for (int x=0; x < width; ++x)
+					sum[x] += src[y*width + x];
+			}
+
+			for (int y=begin; y < end; ++y)
+			{
+				const int lower = Max(0, y-radius);
+				const int upper = Min(height-1, y+radius);
+
+				const float scale = 1.0f/float(upper-lower+1);
+
+				float* dst = &out.c[c][y*width];
+
+				for (int x=0; x < width; ++x)
+					dst[x] = sum[x]*scale;
+
+				// slide the window down a row
+				if (y+1 < end)
+				{
+					if (y+radius+1 < height)
+					{
+						const float* add = &src[(y+radius+1)*width];
+						for (int x=0; x < width; ++x)
+							sum[x] += add[x];
+					}
+
+					if (y-radius >= 0)
+					{
+						const float* sub = &src[(y-radius)*width];
+						for (int x=0; x < width; ++x)
+							sum[x] -= sub[x];
+					}
+				}
+			}
 		}
-	}
+	});
 }
 
-void NonLocalMeansFilter(const Color* in, Color* out, int width, int height, float falloff, int radius)
+// copies an image into planes
+void Split(const Color* in, Planes& out, int n)
 {
-	Color* means = new Color[width*height];
+	out.Resize(n);
 
-	AverageFilter(in, means, width, height, radius);
+	for (int i=0; i < n; ++i)
+	{
+		out.c[0][i] = in[i].x;
+		out.c[1][i] = in[i].y;
+		out.c[2][i] = in[i].z;
+		out.c[3][i] = in[i].w;
+	}
+}
+
+// averages the input over each pixel's window, a neighbour's weight is exp(-sum(scale*diff^2))
+// over the differences between the guide values of the two pixels, pixels covered by the same
+// window along x are independent so runs of four are processed together with SSE
+template <int kNumGuides>
+void FilterPixels(const Planes& input, const float* const* guides, const float* scales, Color* out, int width, int height, int radius)
+{
+	const float* ir = &input.c[0][0];
+	const float* ig = &input.c[1][0];
+	const float* ib = &input.c[2][0];
+	const float* iw = &input.c[3][0];
 
-	float invRadiusSq = falloff;//200.0f;//1.0f/(0.5f*0.5f);
+	const int numTasks = (height + kNlmRowsPerTask - 1)/kNlmRowsPerTask;
 
-	for (int y=0; y < height; ++y)
+	ParallelFor(numTasks, [&](int task, int worker)
 	{
-		for (int x=0; x < width; ++x)
+		const int begin = task*kNlmRowsPerTask;
+		const int end = Min(begin + kNlmRowsPerTask, height);
+
+		for (int y=begin; y < end; ++y)
 		{
-			int xlower = std::max(0, x-radius);
-			int xupper = std::min(width-1, x+radius);
+			const int ylower = Max(0, y-radius);
+			const int yupper = Min(height-1, y+radius);
+
+			int x = 0;
+
+			while (x < width)
+			{
+#if USE_NLM_SSE
+				// four pixels whose windows are all inside the image along x are filtered together,
+				// their neighbours at each offset are then contiguous in memory
+				if (x >= radius && x+3+radius < width)
+				{
+					const int p = y*width + x;
 
-			int ylower = std::max(0, y-radius);
-			int yupper = std::min(height-1, y+radius);
+					__m128 center[kNumGuides];
+					__m128 scale[kNumGuides];
 
-			float totalWeight = 0.0f;
-			Color sum;
+					for (int g=0; g < kNumGuides; ++g)
+					{
+						center[g] = _mm_loadu_ps(guides[g]+p);
+						scale[g] = _mm_set1_ps(-scales[g]);
+					}
 
-			// 
-			Color mean = means[y*width + x];
+					__m128 sr = _mm_setzero_ps();
+					__m128 sg = _mm_setzero_ps();
+					__m128 sb = _mm_setzero_ps();
+					__m128 sw = _mm_setzero_ps();
+					__m128 totalWeight = _mm_setzero_ps();
 
-			for (int fx=xlower; fx <= xupper; ++fx)
-			{
+					for (int fy=ylower; fy <= yupper; ++fy)
+					{
+						for (int fx=x-radius; fx <= x+radius; ++fx)
+						{
+							const int q = fy*width + fx;
+
+							__m128 d = _mm_setzero_ps();
+
+							for (int g=0; g < kNumGuides; ++g)
+							{
+								const __m128 diff = _mm_sub_ps(center[g], _mm_loadu_ps(guides[g]+q));
+								d = _mm_add_ps(d, _mm_mul_ps(scale[g], _mm_mul_ps(diff, diff)));
+							}
+
+							const __m128 weight = ExpNegative(d);
+
+							sr = _mm_add_ps(sr, _mm_mul_ps(_mm_loadu_ps(ir+q), weight));
+							sg = _mm_add_ps(sg, _mm_mul_ps(_mm_loadu_ps(ig+q), weight));
+							sb = _mm_add_ps(sb, _mm_mul_ps(_mm_loadu_ps(ib+q), weight));
+							sw = _mm_add_ps(sw, _mm_mul_ps(_mm_loadu_ps(iw+q), weight));
+							totalWeight = _mm_add_ps(totalWeight, weight);
+						}
+					}
+
+					float r[4], g[4], b[4], w[4], t[4];
+					_mm_storeu_ps(r, sr);
+					_mm_storeu_ps(g, sg);
+					_mm_storeu_ps(b, sb);
+					_mm_storeu_ps(w, sw);
+					_mm_storeu_ps(t, totalWeight);
+
+					for (int i=0; i < 4; ++i)
+						out[p+i] = Color(r[i], g[i], b[i], w[i])*(1.0f/t[i]);
+
+					x += 4;
+					continue;
+				}
+#endif
+				const int xlower = Max(0, x-radius);
+				const int xupper = Min(width-1, x+radius);
+
+				const int p = y*width + x;
+
+				float sr = 0.0f;
+				float sg = 0.0f;
+				float sb = 0.0f;
+				float sw = 0.0f;
+				float totalWeight = 0.0f;
+
+				// walk the window row by row so neighbours are visited in memory order
 				for (int fy=ylower; fy <= yupper; ++fy)
 				{
-					float weight = expf(-invRadiusSq*LengthSq(mean - means[fy*width+fx]));
+					for (int fx=xlower; fx <= xupper; ++fx)
+					{
+						const int q = fy*width + fx;
+
+						float d = 0.0f;
 
-					sum += in[fy*width + fx]*weight;
-					totalWeight += weight;
+						for (int g=0; g < kNumGuides; ++g)
+						{
+							const float diff = guides[g][p]-guides[g][q];
+							d += scales[g]*diff*diff;
+						}
+
+						const float weight = expf(-d);
+
+						sr += ir[q]*weight;
+						sg += ig[q]*weight;
+						sb += ib[q]*weight;
+						sw += iw[q]*weight;
+						totalWeight += weight;
+					}
 				}
-			}
 
-			out[y*width + x] = sum*(1.0f/totalWeight);
+				out[p] = Color(sr, sg, sb, sw)*(1.0f/totalWeight);
+
+				++x;
+			}
 		}
-	}
+	});
+}
+
+} // anonymous namespace
+
+void NonLocalMeansFilter(const Color* in, Color* out, int width, int height, float falloff, int radius)
+{
+	const int n = width*height;
+
+	Split(in, g_input, n);
+
+	g_rows.Resize(n);
+	g_means.Resize(n);
 
-	delete[] means;
+	// the weights compare the box filtered neighbourhoods of two pixels
+	BoxFilterRows(g_input, g_rows, width, height, radius);
+	BoxFilterColumns(g_rows, g_means, width, height, radius);
+
+	const float* guides[4] = { &g_means.c[0][0], &g_means.c[1][0], &g_means.c[2][0], &g_means.c[3][0] };
+	const float scales[4] = { falloff, falloff, falloff, falloff };
+
+	FilterPixels<4>(g_input, guides, scales, out, width, height, radius);
 }
 
+void NonLocalMeansFeatureFilter(const Color* in, const Color* albedo, const Color* normal, const Color* depth, Color* out, int width, int height, float falloff, int radius, const FeatureFalloff& features)
+{
+	const int n = width*height;
+
+	Split(in, g_input, n);
+
+	g_rows.Resize(n);
+	g_means.Resize(n);
+
+	BoxFilterRows(g_input, g_rows, width, height, radius);
+	BoxFilterColumns(g_rows, g_means, width, height, radius);
 
+	// features are close to noise free after a few samples so they are compared per-pixel,
+	// depth is compared on a log scale so the falloff doesn't depend on the scene's size
+	Split(albedo, g_albedo, n);
+	Split(normal, g_normal, n);
 
+	g_depth.resize(n);
 
+	for (int i=0; i < n; ++i)
+		g_depth[i] = logf(1.0f + Max(0.0f, depth[i].x));
+
+	const float* guides[11] =
+	{
+		&g_means.c[0][0], &g_means.c[1][0], &g_means.c[2][0], &g_means.c[3][0],
+		&g_albedo.c[0][0], &g_albedo.c[1][0], &g_albedo.c[2][0],
+		&g_normal.c[0][0], &g_normal.c[1][0], &g_normal.c[2][0],
+		&g_depth[0]
+	};
+
+	const float scales[11] =
+	{
+		falloff, falloff, falloff, falloff,
+		features.albedo, features.albedo, features.albedo,
+		features.normal, features.normal, features.normal,
+		features.depth
+	};
+
+	FilterPixels<11>(g_input, guides, scales, out, width, height, radius);
+}
@@ -2,4 +2,29 @@
 
 #include "maths.h"
 
-void NonLocalMeansFilter(const Color* in, Color* out, int width, int height, float falloff, int radius);
\ No newline at end of file
+// filters a tone mapped image, each pixel is replaced by an average over its square neighbourhood
+// of the given radius weighted by how similar the box filtered means of the two pixels are,
+// runs in parallel and keeps its scratch memory between calls
+void NonLocalMeansFilter(const Color* in, Color* out, int width, int height, float falloff, int radius);
+
+// filter weight of a neighbour given the box filtered means around both pixels
+CUDA_CALLABLE inline float NonLocalMeansWeight(const Color& mean, const Color& neighbourMean, float falloff)
+{
+	return expf(-falloff*LengthSq(mean - neighbourMean));
+}
+
+// how quickly the weights of the feature guided filter fall off with the squared difference
+// of each feature between two pixels, depth is compared as log(1 + depth)
+struct FeatureFalloff
+{
+	FeatureFalloff(float albedo=50.0f, float normal=20.0f, float depth=25.0f) : albedo(albedo), normal(normal), depth(depth) {}
+
+	float albedo;
+	float normal;
+	float depth;
+};
+
+// cross-bilateral variant of NonLocalMeansFilter(), neighbours are also weighted by how similar
+// their first hit albedo, normal and depth are, so edges the features resolve stay sharp
+// even where the samples are too noisy to tell them apart, features are normalized (w=1)
+void NonLocalMeansFeatureFilter(const Color* in, const Color* albedo, const Color* normal, const Color* depth, Color* out, int width, int height, float falloff, int radius, const FeatureFalloff& features=FeatureFalloff());
@@ -0,0 +1,407 @@
+#pragma once
+
+#include "intersection.h"
+
+// camera rays of a tile are traced in square packets that walk the BVHs together,
+// rays are tested four at a time so packets are only built with the SSE wide BVH
+#if USE_WIDE_BVH_SSE
+#define USE_RAY_PACKETS 1
+#else
+#define USE_RAY_PACKETS 0
+#endif
+
+#if USE_RAY_PACKETS
+
+const int kPacketWidth = 8;
+const int kPacketSize = kPacketWidth*kPacketWidth;
+
+// packets fall back to tracing rays one at a time below a node reached by this few rays
+const int kPacketMinRays = 4;
+
+// one bit per ray of a packet
+typedef unsigned long long PacketMask;
+
+// rays sharing an origin, directions are stored structure-of-arrays so that
+// four rays can be tested at once, t holds the closest hit of each ray so far
+struct RayPacket
+{
+	Vec3 origin;
+
+	float dirX[kPacketSize];
+	float dirY[kPacketSize];
+	float dirZ[kPacketSize];
+
+	float rcpX[kPacketSize];
+	float rcpY[kPacketSize];
+	float rcpZ[kPacketSize];
+
+	float t[kPacketSize];
+
+	// rays set since Reset()
+	PacketMask active;
+
+	// bounds of the reciprocal directions over the active rays, only valid when coherent
+	Vec3 rcpLower;
+	Vec3 rcpUpper;
+
+	bool coherent;
+
+	inline void Reset(const Vec3& o)
+	{
+		origin = o;
+		active = 0;
+	}
+
+	inline void SetRay(int i, const Vec3& dir, float tmax)
+	{
+		dirX[i] = dir.x;
+		dirY[i] = dir.y;
+		dirZ[i] = dir.z;
+
+		rcpX[i] = 1.0f/dir.x;
+		rcpY[i] = 1.0f/dir.y;
+		rcpZ[i] = 1.0f/dir.z;
+
+		t[i] = tmax;
+
+		active |= PacketMask(1)<<i;
+	}
+
+	inline Vec3 GetDir(int i) const
+	{
+		return Vec3(dirX[i], dirY[i], dirZ[i]);
+	}
+
+	// the frustum test needs the rays to agree on the direction sign of every axis,
+	// directions are kept away from zero so that the reciprocals stay finite
+	inline void Finish()
+	{
+		rcpLower = Vec3(FLT_MAX);
+		rcpUpper = Vec3(-FLT_MAX);
+
+		Vec3 dirLower(FLT_MAX);
+		Vec3 dirUpper(-FLT_MAX);
+
+		for (int i=0; i < kPacketSize; ++i)
+		{
+			if ((active & (PacketMask(1)<<i)) == 0)
+				continue;
+
+			dirLower = Min(dirLower, GetDir(i));
+			dirUpper = Max(dirUpper, GetDir(i));
+
+			rcpLower = Min(rcpLower, Vec3(rcpX[i], rcpY[i], rcpZ[i]));
+			rcpUpper = Max(rcpUpper, Vec3(rcpX[i], rcpY[i], rcpZ[i]));
+		}
+
+		coherent = active != 0;
+
+		for (int a=0; a < 3; ++a)
+			coherent &= dirLower[a] > FLT_MIN || dirUpper[a] < -FLT_MIN;
+	}
+};
+
+// child bounds relative to the packet origin, computed as IntersectRayWideNode() does
+inline void WideChildBounds(const WideBVHNode& node, int i, const Vec3& origin, Vec3& lower, Vec3& upper)
+{
+	lower = Vec3(node.lowerX[i]-origin.x, node.lowerY[i]-origin.y, node.lowerZ[i]-origin.z);
+	upper = Vec3(node.upperX[i]-origin.x, node.upperY[i]-origin.y, node.upperZ[i]-origin.z);
+}
+
+inline void WideChildBounds(const QuantizedWideBVHNode& node, int i, const Vec3& origin, Vec3& lower, Vec3& upper)
+{
+	const Vec3 d(node.origin[0]-origin.x, node.origin[1]-origin.y, node.origin[2]-origin.z);
+
+	lower = Vec3(float(node.lowerX[i])*node.scale[0] + d.x, float(node.lowerY[i])*node.scale[1] + d.y, float(node.lowerZ[i])*node.scale[2] + d.z);
+	upper = Vec3(float(node.upperX[i])*node.scale[0] + d.x, float(node.upperY[i])*node.scale[1] + d.y, float(node.upperZ[i])*node.scale[2] + d.z);
+}
+
+// true when no ray of a coherent packet can hit the box, the slab distances of every ray are
+// bounded by interval arithmetic over the reciprocal directions so a single test culls all rays
+inline bool FrustumMissesBox(const RayPacket& packet, const Vec3& lower, const Vec3& upper)
+{
+	float nearMax = -FLT_MAX;
+	float farMin = FLT_MAX;
+
+	for (int a=0; a < 3; ++a)
+	{
+		const float rl = packet.rcpLower[a];
+		const float ru = packet.rcpUpper[a];
+
+		const float n = rl > 0.0f ? lower[a] : upper[a];
+		const float f = rl > 0.0f ? upper[a] : lower[a];
+
+		nearMax = Max(nearMax, Min(n*rl, n*ru));
+		farMin = Min(farMin, Max(f*rl, f*ru));
+	}
+
+	return nearMax > farMin || farMin < 0.0f;
+}
+
+// slab test of a box against the rays of mask, returns the rays that hit it closer than their t
+// with the same arithmetic as IntersectRayWideNode(), entry is the nearest entry distance of those
+inline PacketMask IntersectRayPacketBox(const RayPacket& packet, PacketMask mask, const Vec3& lower, const Vec3& upper, float& entry)
+{
+	const __m128 lx = _mm_set1_ps(lower.x);
+	const __m128 ly = _mm_set1_ps(lower.y);
+	const __m128 lz = _mm_set1_ps(lower.z);
+
+	const __m128 ux = _mm_set1_ps(upper.x);
+	const __m128 uy = _mm_set1_ps(upper.y);
+	const __m128 uz = _mm_set1_ps(upper.z);
+
+	PacketMask hits = 0;
+	entry = FLT_MAX;
+
+	for (int g=0; g < kPacketSize; g += 4)
+	{
+		const int groupMask = int(mask>>g)&0xf;
+
+		if (groupMask == 0)
+			continue;
+
+		const __m128 rx = _mm_loadu_ps(packet.rcpX+g);
+		const __m128 ry = _mm_loadu_ps(packet.rcpY+g);
+		const __m128 rz = _mm_loadu_ps(packet.rcpZ+g);
+
+		__m128 l1 = _mm_mul_ps(lx, rx);
+		__m128 l2 = _mm_mul_ps(ux, rx);
+
+		__m128 lmin = _mm_min_ps(l1, l2);
+		__m128 lmax = _mm_max_ps(l1, l2);
+
+		l1 = _mm_mul_ps(ly, ry);
+		l2 = _mm_mul_ps(uy, ry);
+
+		lmin = _mm_max_ps(_mm_min_ps(l1, l2), lmin);
+		lmax = _mm_min_ps(_mm_max_ps(l1, l2), lmax);
+
+		l1 = _mm_mul_ps(lz, rz);
+		l2 = _mm_mul_ps(uz, rz);
+
+		lmin = _mm_max_ps(_mm_min_ps(l1, l2), lmin);
+		lmax = _mm_min_ps(_mm_max_ps(l1, l2), lmax);
+
+		const __m128 hit = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(lmax, _mm_setzero_ps()), _mm_cmpge_ps(lmax, lmin)), _mm_cmplt_ps(lmin, _mm_loadu_ps(packet.t+g)));
+
+		const int groupHits = _mm_movemask_ps(hit)&groupMask;
+
+		if (groupHits == 0)
+			continue;
+
+		float t[4];
+		_mm_storeu_ps(t, lmin);
+
+		for (int i=0; i < 4; ++i)
+		{
+			if (groupHits & (1<<i))
+				entry = Min(entry, t[i]);
+		}
+
+		hits |= PacketMask(groupHits)<<g;
+	}
+
+	return hits;
+}
+
+// number of rays in a mask
+inline int CountRays(PacketMask mask)
+{
+	int count = 0;
+
+	for (; mask; mask &= mask-1)
+		++count;
+
+	return count;
+}
+
+
+// visits the leaves below a node hit by a single ray of the packet, ordered as by QueryWideBVH()
+template <typename T, typename Node>
+inline void QueryWideBVHRay(T& callback, const Node* root, int start, const RayPacket& packet, int r)
+{
+	const Vec3 rcpDir(packet.rcpX[r], packet.rcpY[r], packet.rcpZ[r]);
+	const PacketMask mask = PacketMask(1)<<r;
+
+	int stack[kWideBVHWidth*32];
+	stack[0] = start;
+
+	int count = 1;
+
+	while (count)
+	{
+		const int index = stack[--count];
+
+		if (index < 0)
+		{
+			callback(~index, mask);
+			continue;
+		}
+
+		float t[kWideBVHWidth];
+		const int hit = IntersectRayWideNode(root[index], packet.origin, rcpDir, packet.t[r], t);
+
+		int hits[kWideBVHWidth];
+		float hitT[kWideBVHWidth];
+		int numHits = 0;
+
+		for (int i=0; i < kWideBVHWidth; ++i)
+		{
+			if (hit & (1<<i))
+			{
+				int j = numHits++;
+
+				while (j > 0 && hitT[j-1] < t[i])
+				{
+					hits[j] = hits[j-1];
+					hitT[j] = hitT[j-1];
+					--j;
+				}
+
+				hits[j] = root[index].children[i];
+				hitT[j] = t[i];
+			}
+		}
+
+		for (int i=0; i < numHits; ++i)
+			stack[count++] = hits[i];
+	}
+}
+
+// visits the leaves of a wide BVH hit by any ray of the packet, passing the rays whose
+// slab test passed, children are culled by the packet frustum before the rays are tested
+// and visited near to far by their nearest entry, callbacks shorten the rays through packet.t
+template <typename T, typename Node>
+inline void QueryWideBVHPacket(T& callback, const Node* root, const RayPacket& packet)
+{
+	struct Entry
+	{
+		int index;
+		PacketMask mask;
+	};
+
+	Entry stack[kWideBVHWidth*32];
+	stack[0].index = 0;
+	stack[0].mask = packet.active;
+
+	int count = 1;
+
+	while (count)
+	{
+		const Entry entry = stack[--count];
+
+		if (entry.index < 0)
+		{
+			callback(~entry.index, entry.mask);
+			continue;
+		}
+
+		// once a packet has split up the remaining rays are cheaper to trace on their own
+		if (CountRays(entry.mask) <= kPacketMinRays)
+		{
+			for (int r=0; r < kPacketSize; ++r)
+			{
+				if (entry.mask & (PacketMask(1)<<r))
+					QueryWideBVHRay(callback, root, entry.index, packet, r);
+			}
+
+			continue;
+		}
+
+		const Node& node = root[entry.index];
+
+		// sort hit children far to near so the nearest ends up on top of the stack
+		Entry hits[kWideBVHWidth];
+		float hitT[kWideBVHWidth];
+		int numHits = 0;
+
+		for (int i=0; i < kWideBVHWidth; ++i)
+		{
+			if (node.children[i] == kWideBVHEmpty)
+				continue;
+
+			Vec3 lower, upper;
+			WideChildBounds(node, i, packet.origin, lower, upper);
+
+			if (packet.coherent && FrustumMissesBox(packet, lower, upper))
+				continue;
+
+			float t;
+			const PacketMask mask = IntersectRayPacketBox(packet, entry.mask, lower, upper, t);
+
+			if (mask == 0)
+				continue;
+
+			int j = numHits++;
+
+			while (j > 0 && hitT[j-1] < t)
+			{
+				hits[j] = hits[j-1];
+				hitT[j] = hitT[j-1];
+				--j;
+			}
+
+			hits[j].index = node.children[i];
+			hits[j].mask = mask;
+			hitT[j] = t;
+		}
+
+		for (int i=0; i < numHits; ++i)
+			stack[count++] = hits[i];
+	}
+}
+
+// closest hits of a packet against the triangle packets of a wide mesh BVH,
+// each ray is updated the same way as by MeshPacketQuery
+struct MeshRayPacketQuery
+{
+	inline MeshRayPacketQuery(const MeshGeometry& m, RayPacket& p) : mesh(m), packet(p) {}
+
+	inline void operator()(int p, PacketMask mask)
+	{
+		const TriPacket& tris = mesh.packets[p];
+
+		for (int r=0; r < kPacketSize; ++r)
+		{
+			if ((mask & (PacketMask(1)<<r)) == 0)
+				continue;
+
+			float t[kWideBVHWidth];
+			float v[kWideBVHWidth];
+			float w[kWideBVHWidth];
+			float d[kWideBVHWidth];
+
+			const int hit = IntersectRayTriPacket(tris, packet.origin, packet.GetDir(r), packet.t[r], t, v, w, d);
+
+			if (hit == 0)
+				continue;
+
+			for (int l=0; l < kWideBVHWidth; ++l)
+			{
+				if ((hit & (1<<l)) && tris.tri[l] >= 0 && t[l] < packet.t[r])
+				{
+					packet.t[r] = t[l];
+
+					closestU[r] = 1.0f - v[l] - w[l];
+					closestV[r] = v[l];
+					closestW[r] = w[l];
+
+					closestTri[r] = tris.tri[l];
+					closestNormal[r] = Vec3(tris.nx[l], tris.ny[l], tris.nz[l])*d[l];
+				}
+			}
+		}
+	}
+
+	const MeshGeometry& mesh;
+	RayPacket& packet;
+
+	float closestU[kPacketSize];
+	float closestV[kPacketSize];
+	float closestW[kPacketSize];
+
+	Vec3 closestNormal[kPacketSize];
+	int closestTri[kPacketSize];
+};
+
+#endif // USE_RAY_PACKETS
@@ -0,0 +1,321 @@
+#include "parallel.h"
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <memory>
+#include <algorithm>
+#include <vector>
+
+namespace
+{
+
+// worker index of the current thread, -1 for threads outside the scheduler
+thread_local int tls_worker = -1;
+
+// a contiguous range of loop indices, the owning worker pops
+// from the front while thieves take half from the back
+struct WorkQueue
+{
+	WorkQueue() : begin(0), end(0) {}
+
+	void Set(int b, int e)
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		begin = b;
+		end = e;
+	}
+
+	bool Pop(int& index)
+	{
+		std::lock_guard<std::mutex> guard(lock);
+
+		if (begin < end)
+		{
+			index = begin++;
+			return true;
+		}
+		return false;
+	}
+
+	bool Steal(int& outBegin, int& outEnd)
+	{
+		std::lock_guard<std::mutex> guard(lock);
+
+		const int remaining = end-begin;
+		if (remaining <= 0)
+			return false;
+
+		const int count = (remaining+1)/2;
+
+		outBegin = end-count;
+		outEnd = end;
+
+		end -= count;
+		return true;
+	}
+
+	bool Empty()
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		return begin >= end;
+	}
+
+	std::mutex lock;
+
+	int begin;
+	int end;
+};
+
+// a loop in flight, nested loops publish their own job so that
+// idle workers can help with them while the caller waits
+struct Job
+{
+	Job(int numWorkers, int count, const std::function<void(int, int)>& func) : func(func), queues(numWorkers), remaining(count), users(0) {}
+
+	const std::function<void(int, int)>& func;
+
+	std::vector<WorkQueue> queues;
+
+	// indices not yet completed
+	std::atomic<int> remaining;
+	// workers currently inside Work() for this job, guarded by the scheduler lock
+	int users;
+};
+
+struct Scheduler
+{
+	Scheduler(int numWorkers) : numWorkers(numWorkers), version(0), quit(false)
+	{
+		for (int i=1; i < numWorkers; ++i)
+			threads.push_back(std::thread(&Scheduler::ThreadMain, this, i));
+	}
+
+	~Scheduler()
+	{
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			quit = true;
+		}
+
+		wake.notify_all();
+
+		for (size_t i=0; i < threads.size(); ++i)
+			threads[i].join();
+	}
+
+	void Run(int count, const std::function<void(int, int)>& func)
+	{
+		// threads outside the scheduler act as worker 0, so only one may submit at a time
+		std::unique_lock<std::mutex> submitGuard(submit, std::defer_lock);
+
+		int worker = tls_worker;
+		if (worker == -1)
+		{
+			submitGuard.lock();
+			worker = 0;
+		}
+
+		Job job(numWorkers, count, func);
+
+		if (tls_worker == -1)
+		{
+			// top level loops are spread evenly to keep neighbouring indices on one worker
+			for (int i=0; i < numWorkers; ++i)
+				job.queues[i].Set(int((long long)count*i/numWorkers), int((long long)count*(i+1)/numWorkers));
+		}
+		else
+		{
+			// nested loops start on the caller, other workers steal as they become idle
+			job.queues[worker].Set(0, count);
+		}
+
+		{
+			std::lock_guard<std::mutex> guard(lock);
+
+			jobs.push_back(&job);
+			version++;
+		}
+
+		wake.notify_all();
+
+		const int previous = tls_worker;
+		tls_worker = worker;
+
+		Work(job, worker);
+
+		// indices stolen by other workers may still be running, only help with our
+		// own job while waiting as per-worker state of outer loops is still in use
+		while (job.remaining.load() > 0)
+		{
+			std::this_thread::yield();
+			Work(job, worker);
+		}
+
+		tls_worker = previous;
+
+		// retire the job and wait for thieves to let go of it
+		std::unique_lock<std::mutex> guard(lock);
+
+		jobs.erase(std::find(jobs.begin(), jobs.end(), &job));
+
+		while (job.users > 0)
+			done.wait(guard);
+	}
+
+	// most recently published job with indices left, must hold the lock
+	Job* FindJob()
+	{
+		for (size_t i=jobs.size(); i > 0; --i)
+		{
+			Job* job = jobs[i-1];
+
+			for (int w=0; w < numWorkers; ++w)
+			{
+				if (!job->queues[w].Empty())
+					return job;
+			}
+		}
+
+		return NULL;
+	}
+
+	void Release(Job& job)
+	{
+		std::lock_guard<std::mutex> guard(lock);
+
+		if (--job.users == 0)
+			done.notify_all();
+	}
+
+	void ThreadMain(int worker)
+	{
+		tls_worker = worker;
+
+		for (;;)
+		{
+			Job* job;
+
+			{
+				std::unique_lock<std::mutex> guard(lock);
+
+				int seen = version;
+
+				while ((job = FindJob()) == NULL && !quit)
+				{
+					while (version == seen && !quit)
+						wake.wait(guard);
+
+					seen = version;
+				}
+
+				if (quit)
+					return;
+
+				job->users++;
+			}
+
+			Work(*job, worker);
+
+			Release(*job);
+		}
+	}
+
+	void Work(Job& job, int worker)
+	{
+		for (;;)
+		{
+			int index;
+			while (job.queues[worker].Pop(index))
+			{
+				job.func(index, worker);
+				job.remaining--;
+			}
+
+			// own queue is empty, look for a victim starting from our neighbour
+			bool stolen = false;
+
+			for (int i=1; i < numWorkers && !stolen; ++i)
+			{
+				int begin, end;
+				if (job.queues[(worker+i)%numWorkers].Steal(begin, end))
+				{
+					job.queues[worker].Set(begin, end);
+					stolen = true;
+				}
+			}
+
+			if (!stolen)
+				break;
+		}
+	}
+
+	const int numWorkers;
+
+	std::vector<std::thread> threads;
+	std::vector<Job*> jobs;
+
+	std::mutex submit;
+	std::mutex lock;
+	std::condition_variable wake;
+	std::condition_variable done;
+
+	int version;
+	bool quit;
+};
+
+std::mutex g_schedulerLock;
+std::unique_ptr<Scheduler> g_scheduler;
+int g_numWorkers = 0;
+
+Scheduler& GetScheduler()
+{
+	std::lock_guard<std::mutex> guard(g_schedulerLock);
+
+	if (!g_scheduler)
+	{
+		int count = g_numWorkers;
+		if (count <= 0)
+			count = std::max(1, int(std::thread::hardware_concurrency()));
+
+		g_scheduler.reset(new Scheduler(count));
+	}
+
+	return *g_scheduler;
+}
+
+} // anonymous namespace
+
+int GetNumWorkers()
+{
+	return GetScheduler().numWorkers;
+}
+
+void SetNumWorkers(int count)
+{
+	std::lock_guard<std::mutex> guard(g_schedulerLock);
+
+	g_numWorkers = count;
+	g_scheduler.reset();
+}
+
+void ParallelFor(int count, const std::function<void(int index, int worker)>& func)
+{
+	if (count <= 0)
+		return;
+
+	Scheduler& scheduler = GetScheduler();
+
+	if (scheduler.numWorkers == 1 || count == 1)
+	{
+		const int worker = tls_worker == -1 ? 0 : tls_worker;
+
+		for (int i=0; i < count; ++i)
+			func(i, worker);
+
+		return;
+	}
+
+	scheduler.Run(count, func);
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <functional>
+
+// number of workers used by the scheduler, including the calling thread
+int GetNumWorkers();
+
+// override the number of workers, 0 selects one per hardware thread, must
+// not be called while a parallel loop is in flight
+void SetNumWorkers(int count);
+
+// executes func(index, worker) for every index in [0, count), indices are evenly
+// distributed over per-worker queues and idle workers steal half of the remaining
+// range of another worker, worker is in the range [0, GetNumWorkers()) and is
+// unique among the threads running the loop so it can be used to address
+// per-worker scratch memory, returns once all indices have been processed
+//
+// nested calls (from inside a loop body) are published as their own loop which
+// idle workers help with, the caller only works on its own loop until it completes
+void ParallelFor(int count, const std::function<void(int index, int worker)>& func);
@@ -4,8 +4,11 @@
 #include <stdio.h>
 #include <string.h>
 #include <algorithm>
+#include <vector>
+#include <string>
 
 #include "maths.h"
+#include "parallel.h"
 
 namespace
 {
@@ -82,6 +85,65 @@ void PfmSave(const char* filename, const PfmImage& image)
 	fprintf(f, "-%f\n", *std::max_element(image.data, image.data+(image.width*image.height*image.depth*3)));
 
 	fwrite(image.data, image.width*image.height*image.depth*sizeof(float)*3, 1, f);
+	fclose(f);
+}
+
+///--------
+
+// same layout as pfm, a text header followed by raw floats in the host's byte order
+
+bool AccumLoad(const char* filename, AccumImage& image)
+{
+	FilePointer f = fopen(filename, "rb");
+	if (!f)
+		return false;
+
+	memset(&image, 0, sizeof(AccumImage));
+
+	const uint32_t kBufSize = 1024;
+	char buffer[kBufSize];
+
+	if (!fgets(buffer, kBufSize, f))
+		return false;
+
+	if (strcmp(buffer, "TA\n") != 0)
+		return false;
+
+	if (!fgets(buffer, kBufSize, f) || sscanf(buffer, "%d %d", &image.width, &image.height) != 2)
+		return false;
+
+	if (!fgets(buffer, kBufSize, f) || sscanf(buffer, "%d %d", &image.firstSample, &image.numSamples) != 2)
+		return false;
+
+	if (image.width <= 0 || image.height <= 0)
+		return false;
+
+	const size_t numFloats = size_t(image.width)*image.height*4;
+
+	image.data = new float[numFloats];
+
+	if (fread(image.data, numFloats*sizeof(float), 1, f) != 1)
+	{
+		delete[] image.data;
+		image.data = NULL;
+
+		return false;
+	}
+
+	return true;
+}
+
+bool AccumSave(const char* filename, const AccumImage& image)
+{
+	FilePointer f = fopen(filename, "wb");
+	if (!f)
+		return false;
+
+	fprintf(f, "TA\n");
+	fprintf(f, "%d %d\n", image.width, image.height);
+	fprintf(f, "%d %d\n", image.firstSample, image.numSamples);
+
+	return fwrite(image.data, size_t(image.width)*image.height*4*sizeof(float), 1, f) == 1;
 }
 
 ///--------
@@ -95,180 +157,254 @@ typedef unsigned char RGBE[4];
 #define  MINELEN	8				// minimum scanline length for encoding
 #define  MAXELEN	0x7fff			// maximum scanline length for encoding
 
-static void workOnRGBE(RGBE *scan, PfmImage& res, float *cols );
-static bool decrunch(RGBE *scanline, int len, FILE *file);
-static bool oldDecrunch(RGBE *scanline, int len, FILE *file);
+namespace
+{
 
-bool HdrLoad(const char *fileName, PfmImage& res)
+// scanlines converted per task
+const int kHdrRowsPerTask = 16;
+
+// old style run length encoding, a pixel of 1, 1, 1 repeats the previous pixel,
+// consecutive repeats scale the count by another 8 bits
+const unsigned char* OldDecrunch(const unsigned char* p, const unsigned char* end, RGBE* scanline, int start, int len)
 {
-	int i;
-	char str[200];
-	FILE *file;
+	int rshift = 0;
+	int x = start;
 
-	file = fopen(fileName, "rb");
-	if (!file)
-		return false;
+	while (x < len)
+	{
+		if (end-p < 4)
+			return NULL;
+
+		if (p[R] == 1 && p[G] == 1 && p[B] == 1)
+		{
+			const int count = Min(int(p[E]) << rshift, len-x);
+
+			// nothing to repeat at the start of a scanline
+			if (scanline)
+			{
+				for (int i=0; i < count; ++i)
+				{
+					if (x > 0)
+						memcpy(scanline[x+i], scanline[x-1], 4);
+					else
+						memset(scanline[x+i], 0, 4);
+				}
+			}
 
-	fread(str, 10, 1, file);
-	if (memcmp(str, "#?RADIANCE", 10)) {
-		fclose(file);
-		return false;
-	}
+			x += count;
+			rshift += 8;
+		}
+		else
+		{
+			if (scanline)
+				memcpy(scanline[x], p, 4);
 
-	fseek(file, 1, SEEK_CUR);
-
-	char cmd[200];
-	i = 0;
-	char c = 0, oldc;
-	while(true) {
-		oldc = c;
-		c = fgetc(file);
-		if (c == 0xa && oldc == 0xa)
-			break;
-		cmd[i++] = c;
-	}
+			++x;
+			rshift = 0;
+		}
 
-	char reso[200];
-	i = 0;
-	while(true) {
-		c = fgetc(file);
-		reso[i++] = c;
-		if (c == 0xa)
-			break;
+		p += 4;
 	}
 
-	int w, h;
-	if (!sscanf(reso, "-Y %d +X %d", &h, &w)) {
-		fclose(file);
-		return false;
-	}
+	return p;
+}
 
-	res.width = w;
-	res.height = h;
+// decodes the scanline starting at p, if scanline is NULL the scanline is only skipped,
+// returns the start of the next scanline or NULL if the data is malformed
+const unsigned char* Decrunch(const unsigned char* p, const unsigned char* end, RGBE* scanline, int len)
+{
+	if (len < MINELEN || len > MAXELEN || end-p < 4 || p[0] != 2 || p[1] != 2 || (p[2] & 128))
+		return OldDecrunch(p, end, scanline, 0, len);
 
-	float *cols = new float[w * h * 3];
-	res.data = cols;
-	res.emin = 127;
-	res.emax = -127;
+	p += 4;
 
-	RGBE *scanline = new RGBE[w];
-	if (!scanline) {
-		fclose(file);
-		return false;
-	}
+	// each component is run length encoded separately
+	for (int i=0; i < 4; ++i)
+	{
+		for (int j=0; j < len;)
+		{
+			if (p >= end)
+				return NULL;
 
-	// convert image 
-	for (int y = h - 1; y >= 0; y--) {
-		if (decrunch(scanline, w, file) == false)
-			break;
-		workOnRGBE(scanline, res, cols );
-		cols += w * 3;
-	}
+			int code = *p++;
 
-	delete [] scanline;
-	fclose(file);
+			if (code > 128)
+			{
+				code &= 127;
 
-	return true;
+				if (p >= end || j+code > len)
+					return NULL;
+
+				const unsigned char val = *p++;
+
+				if (scanline)
+				{
+					for (int k=0; k < code; ++k)
+						scanline[j+k][i] = val;
+				}
+
+				j += code;
+			}
+			else
+			{
+				if (code == 0 || end-p < code || j+code > len)
+					return NULL;
+
+				if (scanline)
+				{
+					for (int k=0; k < code; ++k)
+						scanline[j+k][i] = p[k];
+				}
+
+				p += code;
+				j += code;
+			}
+		}
+	}
+
+	return p;
 }
 
-float convertComponent(int expo, int val)
+// scale of the mantissas for each exponent byte, val/256*2^(e-128) or 0 for e == 0,
+// the products are exact so this matches evaluating the power directly
+struct ExponentTable
 {
-	if( expo == -128 ) return 0.0;
-	float v = val / 256.0f;
-	float d = (float) powf(2.0f, expo);
-	return v * d;
-}
+	ExponentTable()
+	{
+		scale[0] = 0.0f;
+
+		for (int e=1; e < 256; ++e)
+			scale[e] = ldexpf(1.0f, e-136);
+	}
+
+	float scale[256];
+};
+
+const ExponentTable g_exponents;
 
-void workOnRGBE(RGBE *scan, PfmImage& res, float *cols )
+void ConvertRGBE(const RGBE* scan, int len, float* cols, int& emin, int& emax)
 {
+	for (int x=0; x < len; ++x)
+	{
+		const int expo = scan[x][E] - 128;
+
+		if (expo > emax) emax = expo;
+		if (expo != -128 && expo < emin) emin = expo;
 
-	int len = res.width;
+		const float scale = g_exponents.scale[scan[x][E]];
+
+		cols[0] = float(scan[x][R])*scale;
+		cols[1] = float(scan[x][G])*scale;
+		cols[2] = float(scan[x][B])*scale;
 
-	while (len-- > 0) {
-		int expo = scan[0][E] - 128;
-		if( expo > res.emax ) res.emax = expo;
-		if( expo != -128 && expo < res.emin ) res.emin = expo;
-		cols[0] = convertComponent(expo, scan[0][R]);
-		cols[1] = convertComponent(expo, scan[0][G]);
-		cols[2] = convertComponent(expo, scan[0][B]);
 		cols += 3;
-		scan++;
 	}
 }
 
-bool decrunch(RGBE *scanline, int len, FILE *file)
+} // anonymous namespace
+
+// the file is read with a single call, scanlines are located with a quick pass over their
+// run lengths and then decoded and converted in parallel
+bool HdrLoad(const char *fileName, PfmImage& res)
 {
-	int  i, j;
-					
-	if (len < MINELEN || len > MAXELEN)
-		return oldDecrunch(scanline, len, file);
-
-	i = fgetc(file);
-	if (i != 2) {
-		fseek(file, -1, SEEK_CUR);
-		return oldDecrunch(scanline, len, file);
+	std::vector<unsigned char> buffer;
+
+	{
+		FilePointer f = fopen(fileName, "rb");
+		if (!f)
+			return false;
+
+		fseek(f, 0, SEEK_END);
+		const long size = ftell(f);
+		fseek(f, 0, SEEK_SET);
+
+		if (size <= 0)
+			return false;
+
+		buffer.resize(size);
+
+		if (fread(&buffer[0], size, 1, f) != 1)
+			return false;
 	}
 
-	scanline[0][G] = fgetc(file);
-	scanline[0][B] = fgetc(file);
-	i = fgetc(file);
+	const unsigned char* p = &buffer[0];
+	const unsigned char* end = p + buffer.size();
+
+	if (buffer.size() < 11 || memcmp(p, "#?RADIANCE", 10))
+		return false;
+
+	p += 11;
+
+	// header lines end with an empty line
+	while (end-p >= 2 && !(p[0] == 0xa && p[1] == 0xa))
+		++p;
+
+	if (end-p < 2)
+		return false;
+
+	p += 2;
+
+	const unsigned char* lineEnd = (const unsigned char*)memchr(p, 0xa, end-p);
+	if (!lineEnd)
+		return false;
+
+	const std::string reso((const char*)p, (const char*)lineEnd);
 
-	if (scanline[0][G] != 2 || scanline[0][B] & 128) {
-		scanline[0][R] = 2;
-		scanline[0][E] = i;
-		return oldDecrunch(scanline + 1, len - 1, file);
+	p = lineEnd+1;
+
+	int w, h;
+	if (sscanf(reso.c_str(), "-Y %d +X %d", &h, &w) != 2 || w <= 0 || h <= 0)
+		return false;
+
+	res.width = w;
+	res.height = h;
+	res.emin = 127;
+	res.emax = -127;
+
+	float* cols = new float[size_t(w)*h*3];
+	res.data = cols;
+
+	// start of each scanline, a malformed scanline truncates the image
+	std::vector<const unsigned char*> scanlines;
+	scanlines.reserve(h);
+
+	for (int y=0; y < h && p; ++y)
+	{
+		scanlines.push_back(p);
+		p = Decrunch(p, end, NULL, w);
 	}
 
-	// read each component
-	for (i = 0; i < 4; i++) {
-	    for (j = 0; j < len; ) {
-			unsigned char code = fgetc(file);
-			if (code > 128) { // run
-			    code &= 127;
-			    unsigned char val = fgetc(file);
-			    while (code--)
-					scanline[j++][i] = val;
-			}
-			else  {	// non-run
-			    while(code--)
-					scanline[j++][i] = fgetc(file);
-			}
-		}
-    }
+	if (!p)
+		scanlines.pop_back();
 
-	return feof(file) ? false : true;
-}
+	const int numRows = int(scanlines.size());
 
-bool oldDecrunch(RGBE *scanline, int len, FILE *file)
-{
-	int i;
-	int rshift = 0;
-	
-	while (len > 0) {
-		scanline[0][R] = fgetc(file);
-		scanline[0][G] = fgetc(file);
-		scanline[0][B] = fgetc(file);
-		scanline[0][E] = fgetc(file);
-		if (feof(file))
-			return false;
+	memset(cols + size_t(numRows)*w*3, 0, sizeof(float)*size_t(h-numRows)*w*3);
 
-		if (scanline[0][R] == 1 &&
-			scanline[0][G] == 1 &&
-			scanline[0][B] == 1) {
-			for (i = scanline[0][E] << rshift; i > 0; i--) {
-				memcpy(&scanline[0][0], &scanline[-1][0], 4);
-				scanline++;
-				len--;
-			}
-			rshift += 8;
-		}
-		else {
-			scanline++;
-			len--;
-			rshift = 0;
+	const int numTasks = (numRows + kHdrRowsPerTask - 1)/kHdrRowsPerTask;
+
+	std::vector<int> taskMin(numTasks, 127);
+	std::vector<int> taskMax(numTasks, -127);
+
+	ParallelFor(numTasks, [&](int task, int worker)
+	{
+		std::vector<RGBE> scanline(w);
+
+		const int begin = task*kHdrRowsPerTask;
+		const int last = Min(begin + kHdrRowsPerTask, numRows);
+
+		for (int y=begin; y < last; ++y)
+		{
+			Decrunch(scanlines[y], end, &scanline[0], w);
+			ConvertRGBE(&scanline[0], w, cols + size_t(y)*w*3, taskMin[task], taskMax[task]);
 		}
+	});
+
+	for (int i=0; i < numTasks; ++i)
+	{
+		res.emin = Min(res.emin, float(taskMin[i]));
+		res.emax = Max(res.emax, float(taskMax[i]));
 	}
+
 	return true;
 }
-
-
@@ -19,4 +19,20 @@ struct PfmImage
 bool PfmLoad(const char* filename, PfmImage& image);
 void PfmSave(const char* filename, const PfmImage& image);
 
-bool HdrLoad(const char* filename, PfmImage& image);
\ No newline at end of file
+bool HdrLoad(const char* filename, PfmImage& image);
+
+// raw accumulation buffer of a renderer, four floats per pixel holding the filter weighted
+// sums of numSamples samples per-pixel starting at firstSample, the weight sum in w
+struct AccumImage
+{
+	int width;
+	int height;
+
+	int firstSample;
+	int numSamples;
+
+	float* data;
+};
+
+bool AccumLoad(const char* filename, AccumImage& image);
+bool AccumSave(const char* filename, const AccumImage& image);
\ No newline at end of file
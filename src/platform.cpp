@@ -3,6 +3,9 @@
 #include <windows.h>
 #include <commdlg.h>
 #include <mmsystem.h>
+#include <psapi.h>
+
+#pragma comment(lib, "psapi.lib")
 
 double GetSeconds()
 {
@@ -34,6 +37,47 @@ double GetSeconds()
 
 }
 
+void* MapFile(const char* path, size_t* size)
+{
+	HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+
+	if (file == INVALID_HANDLE_VALUE)
+		return NULL;
+
+	LARGE_INTEGER fileSize;
+	GetFileSizeEx(file, &fileSize);
+
+	void* data = NULL;
+
+	HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (mapping)
+	{
+		data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+		CloseHandle(mapping);
+	}
+
+	CloseHandle(file);
+
+	*size = size_t(fileSize.QuadPart);
+
+	return data;
+}
+
+void UnmapFile(void* data, size_t size)
+{
+	UnmapViewOfFile(data);
+}
+
+size_t GetPeakMemory()
+{
+	PROCESS_MEMORY_COUNTERS counters;
+
+	if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+		return 0;
+
+	return counters.PeakWorkingSetSize;
+}
+
 #else
 
 
@@ -60,4 +104,58 @@ double GetSeconds()
 	return time;
 }
 
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+void* MapFile(const char* path, size_t* size)
+{
+	int fd = open(path, O_RDONLY);
+
+	if (fd == -1)
+		return NULL;
+
+	struct stat info;
+	if (fstat(fd, &info) != 0 || info.st_size == 0)
+	{
+		close(fd);
+		return NULL;
+	}
+
+	// shared read-only mapping so processes loading the same file share page cache
+	void* data = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+
+	close(fd);
+
+	if (data == MAP_FAILED)
+		return NULL;
+
+	*size = size_t(info.st_size);
+
+	return data;
+}
+
+void UnmapFile(void* data, size_t size)
+{
+	munmap(data, size);
+}
+
+#include <sys/resource.h>
+
+size_t GetPeakMemory()
+{
+	struct rusage usage;
+
+	if (getrusage(RUSAGE_SELF, &usage) != 0)
+		return 0;
+
+	// reported in bytes on mac and in kilobytes on linux
+#if __APPLE__
+	return size_t(usage.ru_maxrss);
+#else
+	return size_t(usage.ru_maxrss)*1024;
+#endif
+}
+
 #endif
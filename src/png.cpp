@@ -1,372 +1,961 @@
-/* 
- * Tiny PNG Output (C)
- * 
- * Copyright (c) 2016 Project Nayuki
- * https://www.nayuki.io/page/tiny-png-output-c
- * 
- * This program is free software: you can redistribute it and/or modify
- * it under the terms of the GNU General Public License as published by
- * the Free Software Foundation, either version 3 of the License, or
- * (at your option) any later version.
- * 
- * This program is distributed in the hope that it will be useful,
- * but WITHOUT ANY WARRANTY; without even the implied warranty of
- * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
- * GNU General Public License for more details.
- * 
- * You should have received a copy of the GNU General Public License
- * along with this program (see COPYING.txt).
- * If not, see <http://www.gnu.org/licenses/>.
- */
+#include "png.h"
+#include "parallel.h"
 
-#include <limits.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <sys/types.h>
-
-#include "maths.h"
-
-/* 
- * TinyPngOut data structure. Treat this as opaque; do not read or write any fields directly.
- */
-struct TinyPngOut {
-    
-    // Configuration
-    int32_t width;   // Measured in bytes, not pixels. A row has (width * 3 + 1) bytes.
-    int32_t height;  // Measured in pixels
-    
-    // State
-    FILE *outStream;
-    int32_t positionX;  // Measured in bytes
-    int32_t positionY;  // Measured in pixels
-    int32_t deflateRemain;  // Measured in bytes
-    int32_t deflateFilled;  // Number of bytes filled in the current block (0 <= n < 65535)
-    uint32_t crc;    // For IDAT chunk
-    uint32_t adler;  // For DEFLATE data within IDAT
-    
+#include <string.h>
+#include <limits.h>
+
+#include <algorithm>
+#include <vector>
+#include <string>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+namespace
+{
+
+// rows are filtered and quantized in groups, and deflated in chunks of roughly this many
+// bytes which are compressed independently and joined at byte boundaries
+const int kPngRowsPerTask = 8;
+const int kDeflateChunkBytes = 1<<18;
+
+// tokens per deflate block, each block gets its own Huffman tables
+const int kDeflateBlockTokens = 1<<15;
+
+// LZ77 window and match search, chains are cut short as image data has few long matches
+const int kDeflateWindow = 32768;
+const int kDeflateHashBits = 15;
+const int kDeflateMaxChain = 32;
+const int kDeflateMinMatch = 3;
+const int kDeflateMaxMatch = 258;
+
+const int kNumLiteralCodes = 286;
+const int kNumDistanceCodes = 30;
+const int kNumLengthCodes = 19;
+
+const int kLengthBase[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+const int kLengthExtra[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+
+const int kDistanceBase[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+const int kDistanceExtra[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+
+// order the code length code lengths are stored in
+const int kLengthOrder[kNumLengthCodes] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+
+// a literal in the low 9 bits if the distance in the upper bits is zero, a match otherwise
+typedef uint32_t Token;
+
+inline Token MakeLiteral(int value) { return Token(value); }
+inline Token MakeMatch(int length, int distance) { return Token(distance) << 9 | Token(length); }
+
+inline int TokenDistance(Token t) { return int(t >> 9); }
+inline int TokenValue(Token t) { return int(t & 511); }
+
+inline int LengthCode(int length)
+{
+	int c = 28;
+	while (kLengthBase[c] > length)
+		--c;
+
+	return c;
+}
+
+inline int DistanceCode(int distance)
+{
+	int c = 29;
+	while (kDistanceBase[c] > distance)
+		--c;
+
+	return c;
+}
+
+// deflate packs bits starting from the least significant bit of each byte
+struct BitWriter
+{
+	BitWriter() : bits(0), count(0) {}
+
+	void Write(uint32_t value, int n)
+	{
+		bits |= uint64_t(value) << count;
+		count += n;
+
+		while (count >= 8)
+		{
+			bytes.push_back(uint8_t(bits));
+			bits >>= 8;
+			count -= 8;
+		}
+	}
+
+	void Align()
+	{
+		if (count > 0)
+			Write(0, 8-count);
+	}
+
+	std::vector<uint8_t> bytes;
+
+	uint64_t bits;
+	int count;
 };
 
+struct HuffmanNode
+{
+	uint32_t weight;
+	int left;
+	int right;
+};
+
+// code lengths of a Huffman code over freq limited to maxBits, every code is complete
+// so at least two symbols get a length even if fewer are used
+void BuildLengths(const uint32_t* freq, int n, int maxBits, uint8_t* lengths)
+{
+	std::vector<uint32_t> weights(freq, freq+n);
+
+	int used = 0;
+	for (int i=0; i < n; ++i)
+		used += weights[i] > 0;
+
+	for (int i=0; i < n && used < 2; ++i)
+	{
+		if (weights[i] == 0)
+		{
+			weights[i] = 1;
+			++used;
+		}
+	}
+
+	for (;;)
+	{
+		// leaves sorted by weight, merged internal nodes are created in weight order
+		// so the two lightest nodes are always at the front of one of the two lists
+		std::vector<HuffmanNode> nodes;
+
+		for (int i=0; i < n; ++i)
+		{
+			if (weights[i])
+			{
+				HuffmanNode leaf = { weights[i], -1, i };
+				nodes.push_back(leaf);
+			}
+		}
+
+		std::stable_sort(nodes.begin(), nodes.end(), [](const HuffmanNode& a, const HuffmanNode& b) { return a.weight < b.weight; });
+
+		const int numLeaves = int(nodes.size());
+
+		int leaf = 0;
+		int internal = numLeaves;
+
+		for (int i=0; i < numLeaves-1; ++i)
+		{
+			int children[2];
+
+			for (int c=0; c < 2; ++c)
+			{
+				if (internal < int(nodes.size()) && (leaf == numLeaves || nodes[internal].weight <= nodes[leaf].weight))
+					children[c] = internal++;
+				else
+					children[c] = leaf++;
+			}
+
+			HuffmanNode parent = { nodes[children[0]].weight + nodes[children[1]].weight, children[0], children[1] };
+			nodes.push_back(parent);
+		}
+
+		// the root is the last node, depths are propagated from there down
+		std::vector<int> depth(nodes.size(), 0);
+
+		int maxDepth = 0;
+
+		memset(lengths, 0, n);
+
+		for (int i=int(nodes.size())-1; i >= 0; --i)
+		{
+			if (nodes[i].left == -1)
+			{
+				lengths[nodes[i].right] = uint8_t(depth[i]);
+				maxDepth = Max(maxDepth, depth[i]);
+			}
+			else
+			{
+				depth[nodes[i].left] = depth[i]+1;
+				depth[nodes[i].right] = depth[i]+1;
+			}
+		}
+
+		if (maxDepth <= maxBits)
+			return;
+
+		// flatten the distribution until the tree fits, used symbols stay used
+		for (int i=0; i < n; ++i)
+		{
+			if (weights[i])
+				weights[i] = (weights[i] >> 1) | 1;
+		}
+	}
+}
+
+// canonical codes for the given lengths, bit reversed so they can be written LSB first
+void BuildCodes(const uint8_t* lengths, int n, uint16_t* codes)
+{
+	int counts[16] = { 0 };
+	for (int i=0; i < n; ++i)
+		counts[lengths[i]]++;
+
+	counts[0] = 0;
+
+	int next[16];
+	int code = 0;
+
+	for (int b=1; b < 16; ++b)
+	{
+		code = (code + counts[b-1]) << 1;
+		next[b] = code;
+	}
+
+	for (int i=0; i < n; ++i)
+	{
+		const int length = lengths[i];
+		if (length == 0)
+			continue;
+
+		int c = next[length]++;
+		int reversed = 0;
 
-/* 
- * Enumeration of status codes
- */
-enum TinyPngOutStatus {
-	TINYPNGOUT_OK,
-	TINYPNGOUT_DONE,
-	TINYPNGOUT_INVALID_ARGUMENT,
-	TINYPNGOUT_IO_ERROR,
-	TINYPNGOUT_IMAGE_TOO_LARGE,
+		for (int b=0; b < length; ++b)
+		{
+			reversed = (reversed << 1) | (c & 1);
+			c >>= 1;
+		}
+
+		codes[i] = uint16_t(reversed);
+	}
+}
+
+// code length symbol with its extra bits, see RunLengths()
+struct LengthSymbol
+{
+	uint8_t symbol;
+	uint8_t extra;
 };
 
+// run length encodes the literal and distance code lengths as one sequence
+void RunLengths(const uint8_t* lengths, int n, std::vector<LengthSymbol>& symbols)
+{
+	for (int i=0; i < n;)
+	{
+		const int length = lengths[i];
 
-/* 
- * Initialization function.
- * 
- * Example usage:
- *   #define WIDTH 640
- *   #define HEIGHT 480
- *   FILE *fout = fopen("image.png", "wb");
- *   struct TinyPngOut pngout;
- *   if (fout == NULL || TinyPngOut_init(&pngout, fout, WIDTH, HEIGHT) != TINYPNGOUT_OK) {
- *     ... (handle error) ...
- *   }
- */
-enum TinyPngOutStatus TinyPngOut_init(struct TinyPngOut *pngout, FILE *fout, int32_t width, int32_t height);
-
-/* 
- * Pixel-writing function. The function reads 3*count bytes from the array.
- * Pixels are presented in the array in RGB order, from top to bottom, left to right.
- * It is an error to write more pixels in total than width*height.
- * After all the pixels are written, every subsequent call will return TINYPNGOUT_DONE (which is considered success).
- * 
- * Example usage:
- *   uint8_t pixels[WIDTH * HEIGHT * 3];
- *   ... (fill pixels) ...
- *   if (TinyPngOut_write(&pngout, pixels, WIDTH * HEIGHT) != TINYPNGOUT_OK) {
- *     ... (handle error) ...
- *   }
- *   if (TinyPngOut_write(&pngout, NULL, 0) != TINYPNGOUT_DONE) {
- *     ... (handle error) ...
- *   }
- *   fclose(fout);
- */
-enum TinyPngOutStatus TinyPngOut_write(struct TinyPngOut *pngout, const uint8_t *pixels, int count);
-
-
-/* 
- * Tiny PNG Output (C)
- * 
- * Copyright (c) 2014 Project Nayuki
- * https://www.nayuki.io/page/tiny-png-output-c
- * 
- * This program is free software: you can redistribute it and/or modify
- * it under the terms of the GNU General Public License as published by
- * the Free Software Foundation, either version 3 of the License, or
- * (at your option) any later version.
- * 
- * This program is distributed in the hope that it will be useful,
- * but WITHOUT ANY WARRANTY; without even the implied warranty of
- * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
- * GNU General Public License for more details.
- * 
- * You should have received a copy of the GNU General Public License
- * along with this program (see COPYING.txt).
- * If not, see <http://www.gnu.org/licenses/>.
- */
-
-
-
-
-
-/* Local declarations */
-
-#define DEFLATE_MAX_BLOCK_SIZE 65535
-#define MIN(x, y) ((x) < (y) ? (x) : (y))
-
-static enum TinyPngOutStatus finish(const struct TinyPngOut *pngout);
-static uint32_t crc32  (uint32_t state, const uint8_t *data, size_t len);
-static uint32_t adler32(uint32_t state, const uint8_t *data, size_t len);
-
-
-/* Public function implementations */
-
-enum TinyPngOutStatus TinyPngOut_init(struct TinyPngOut *pngout, FILE *fout, int32_t width, int32_t height) {
-	// Check arguments
-	if (fout == NULL || width <= 0 || height <= 0)
-		return TINYPNGOUT_INVALID_ARGUMENT;
-	
-	// Calculate data sizes
-	if (width > (UINT32_MAX - 1) / 3)
-		return TINYPNGOUT_IMAGE_TOO_LARGE;
-	uint32_t lineSize = width * 3 + 1;
-	
-	if (lineSize > UINT32_MAX / height)
-		return TINYPNGOUT_IMAGE_TOO_LARGE;
-	uint32_t size = lineSize * height;  // Size of DEFLATE input
-	pngout->deflateRemain = size;
-	
-	uint32_t overhead = size / DEFLATE_MAX_BLOCK_SIZE;
-	if (overhead * DEFLATE_MAX_BLOCK_SIZE < size)
-		overhead++;  // Round up to next block
-	overhead = overhead * 5 + 6;
-	if (size > UINT32_MAX - overhead)
-		return TINYPNGOUT_IMAGE_TOO_LARGE;
-	size += overhead;  // Size of zlib+DEFLATE output
-	
-	// Set most of the fields
-	pngout->width = lineSize;  // In bytes
-	pngout->height = height;   // In pixels
-	pngout->outStream = fout;
-	pngout->positionX = 0;
-	pngout->positionY = 0;
-	pngout->deflateFilled = 0;
-	pngout->adler = 1;
-	
-	// Write header (not a pure header, but a couple of things concatenated together)
-	#define HEADER_SIZE 43
-	uint8_t header[HEADER_SIZE] = {
-		// PNG header
-		0x89, 0x50, 0x4E, 0x47, 0x0D, 0x0A, 0x1A, 0x0A,
-		// IHDR chunk
-		0x00, 0x00, 0x00, 0x0D,
-		0x49, 0x48, 0x44, 0x52,
-		width  >> 24, width  >> 16, width  >> 8, width  >> 0,
-		height >> 24, height >> 16, height >> 8, height >> 0,
-		0x08, 0x02, 0x00, 0x00, 0x00,
-		0, 0, 0, 0,  // IHDR CRC-32 to be filled in (starting at offset 29)
-		// IDAT chunk
-		size >> 24, size >> 16, size >> 8, size >> 0,
-		0x49, 0x44, 0x41, 0x54,
-		// DEFLATE data
-		0x08, 0x1D,
-	};
-	uint32_t crc = crc32(0, &header[12], 17);
-	header[29] = crc >> 24;
-	header[30] = crc >> 16;
-	header[31] = crc >>  8;
-	header[32] = crc >>  0;
-	if (fwrite(header, 1, HEADER_SIZE, fout) != HEADER_SIZE)
-		return TINYPNGOUT_IO_ERROR;
-	
-	pngout->crc = crc32(0, &header[37], 6);
-	return TINYPNGOUT_OK;
+		int run = 1;
+		while (i+run < n && lengths[i+run] == length)
+			++run;
+
+		if (length == 0 && run >= 3)
+		{
+			const int count = Min(run, 138);
+
+			LengthSymbol s = { uint8_t(count >= 11 ? 18 : 17), uint8_t(count >= 11 ? count-11 : count-3) };
+			symbols.push_back(s);
+
+			i += count;
+		}
+		else if (length != 0 && run >= 4)
+		{
+			// the first length is written as is, repeats of it follow
+			LengthSymbol s = { uint8_t(length), 0 };
+			symbols.push_back(s);
+
+			const int count = Min(run-1, 6);
+
+			LengthSymbol r = { 16, uint8_t(count-3) };
+			symbols.push_back(r);
+
+			i += count+1;
+		}
+		else
+		{
+			LengthSymbol s = { uint8_t(length), 0 };
+			symbols.push_back(s);
+
+			++i;
+		}
+	}
 }
 
+inline int LengthSymbolExtraBits(int symbol)
+{
+	return symbol == 16 ? 2 : (symbol == 17 ? 3 : (symbol == 18 ? 7 : 0));
+}
 
-enum TinyPngOutStatus TinyPngOut_write(struct TinyPngOut *pngout, const uint8_t *pixels, int count) {
-	int32_t width  = pngout->width;
-	int32_t height = pngout->height;
-	if (pngout->positionY == height)
-		return TINYPNGOUT_DONE;
-	if (count < 0 || count > INT_MAX / 3 || pngout->positionY < 0 || pngout->positionY > height)
-		return TINYPNGOUT_INVALID_ARGUMENT;
-	
-	count *= 3;
-	FILE *f = pngout->outStream;
-	while (count > 0) {
-		// Start DEFLATE block
-		if (pngout->deflateFilled == 0) {
-			#define BLOCK_HEADER_SIZE 5
-			uint16_t size = (uint16_t)MIN(pngout->deflateRemain, DEFLATE_MAX_BLOCK_SIZE);
-			uint8_t blockheader[BLOCK_HEADER_SIZE] = {
-				pngout->deflateRemain <= DEFLATE_MAX_BLOCK_SIZE ? 1 : 0,
-				size >> 0,
-				size >> 8,
-				(size ^ UINT16_C(0xFFFF)) >> 0,
-				(size ^ UINT16_C(0xFFFF)) >> 8,
-			};
-			if (fwrite(blockheader, 1, BLOCK_HEADER_SIZE, f) != BLOCK_HEADER_SIZE)
-				return TINYPNGOUT_IO_ERROR;
-			pngout->crc = crc32(pngout->crc, blockheader, BLOCK_HEADER_SIZE);
+// writes tokens covering the raw bytes [raw, raw+rawSize) as a block with its own Huffman tables,
+// or as stored blocks if that is smaller (e.g.: noise)
+void WriteBlock(BitWriter& out, const std::vector<Token>& tokens, const uint8_t* raw, int rawSize, bool final)
+{
+	uint32_t literalFreq[kNumLiteralCodes] = { 0 };
+	uint32_t distanceFreq[kNumDistanceCodes] = { 0 };
+
+	for (size_t i=0; i < tokens.size(); ++i)
+	{
+		const int distance = TokenDistance(tokens[i]);
+
+		if (distance == 0)
+		{
+			literalFreq[TokenValue(tokens[i])]++;
 		}
-		
-		// Calculate number of bytes to write in this loop iteration
-		int n = MIN(count, width - pngout->positionX);
-		n = MIN(DEFLATE_MAX_BLOCK_SIZE - pngout->deflateFilled, n);
-		if (n <= 0)  // Impossible
-			exit(EXIT_FAILURE);
-		
-		// Beginning of row - write filter method
-		if (pngout->positionX == 0) {
-			uint8_t b = 0;
-			if (fputc(b, f) == EOF)
-				return TINYPNGOUT_IO_ERROR;
-			pngout->crc = crc32(pngout->crc, &b, 1);
-			pngout->adler = adler32(pngout->adler, &b, 1);
-			pngout->deflateRemain--;
-			pngout->deflateFilled++;
-			pngout->positionX++;
-			n--;
+		else
+		{
+			literalFreq[257 + LengthCode(TokenValue(tokens[i]))]++;
+			distanceFreq[DistanceCode(distance)]++;
 		}
-		
-		// Write bytes and update checksums
-		if (fwrite(pixels, 1, n, f) != n)
-			return TINYPNGOUT_IO_ERROR;
-		pngout->crc = crc32(pngout->crc, pixels, n);
-		pngout->adler = adler32(pngout->adler, pixels, n);
-		
-		// Increment the position
-		count -= n;
-		pixels += n;
-		
-		pngout->deflateRemain -= n;
-		pngout->deflateFilled += n;
-		if (pngout->deflateFilled == DEFLATE_MAX_BLOCK_SIZE)
-			pngout->deflateFilled = 0;
-		
-		pngout->positionX += n;
-		if (pngout->positionX == width) {
-			pngout->positionX = 0;
-			pngout->positionY++;
-			if (pngout->positionY == height) {
-				if (count > 0)
-					return TINYPNGOUT_INVALID_ARGUMENT;
-				return finish(pngout);
-			}
+	}
+
+	// end of block
+	literalFreq[256] = 1;
+
+	uint8_t lengths[kNumLiteralCodes + kNumDistanceCodes];
+
+	uint8_t* literalLengths = lengths;
+	uint8_t* distanceLengths = lengths + kNumLiteralCodes;
+
+	BuildLengths(literalFreq, kNumLiteralCodes, 15, literalLengths);
+	BuildLengths(distanceFreq, kNumDistanceCodes, 15, distanceLengths);
+
+	int numLiterals = kNumLiteralCodes;
+	while (numLiterals > 257 && literalLengths[numLiterals-1] == 0)
+		--numLiterals;
+
+	int numDistances = kNumDistanceCodes;
+	while (numDistances > 1 && distanceLengths[numDistances-1] == 0)
+		--numDistances;
+
+	// the code lengths of both tables are stored back to back
+	uint8_t packed[kNumLiteralCodes + kNumDistanceCodes];
+	memcpy(packed, literalLengths, numLiterals);
+	memcpy(packed + numLiterals, distanceLengths, numDistances);
+
+	std::vector<LengthSymbol> symbols;
+	RunLengths(packed, numLiterals + numDistances, symbols);
+
+	uint32_t lengthFreq[kNumLengthCodes] = { 0 };
+
+	for (size_t i=0; i < symbols.size(); ++i)
+		lengthFreq[symbols[i].symbol]++;
+
+	uint8_t lengthLengths[kNumLengthCodes];
+	BuildLengths(lengthFreq, kNumLengthCodes, 7, lengthLengths);
+
+	int numLengths = kNumLengthCodes;
+	while (numLengths > 4 && lengthLengths[kLengthOrder[numLengths-1]] == 0)
+		--numLengths;
+
+	// compare sizes in bits
+	uint64_t dynamicBits = 3 + 5 + 5 + 4 + 3*numLengths;
+
+	for (size_t i=0; i < symbols.size(); ++i)
+		dynamicBits += lengthLengths[symbols[i].symbol] + LengthSymbolExtraBits(symbols[i].symbol);
+
+	for (int i=0; i < kNumLiteralCodes; ++i)
+		dynamicBits += uint64_t(literalFreq[i])*literalLengths[i];
+
+	for (int i=0; i < 29; ++i)
+		dynamicBits += uint64_t(literalFreq[257+i])*kLengthExtra[i];
+
+	for (int i=0; i < kNumDistanceCodes; ++i)
+		dynamicBits += uint64_t(distanceFreq[i])*(distanceLengths[i] + kDistanceExtra[i]);
+
+	const int numStored = Max(1, (rawSize + 65534)/65535);
+	const uint64_t storedBits = 8 + uint64_t(numStored)*(5*8) + uint64_t(rawSize)*8;
+
+	if (storedBits < dynamicBits)
+	{
+		for (int b=0; b < numStored; ++b)
+		{
+			const int begin = b*65535;
+			const int size = Min(rawSize-begin, 65535);
+
+			out.Write((final && b == numStored-1) ? 1 : 0, 1);
+			out.Write(0, 2);
+			out.Align();
+
+			out.Write(size & 0xffff, 16);
+			out.Write(~size & 0xffff, 16);
+
+			out.bytes.insert(out.bytes.end(), raw + begin, raw + begin + size);
+		}
+
+		return;
+	}
+
+	uint16_t literalCodes[kNumLiteralCodes];
+	uint16_t distanceCodes[kNumDistanceCodes];
+	uint16_t lengthCodes[kNumLengthCodes];
+
+	BuildCodes(literalLengths, kNumLiteralCodes, literalCodes);
+	BuildCodes(distanceLengths, kNumDistanceCodes, distanceCodes);
+	BuildCodes(lengthLengths, kNumLengthCodes, lengthCodes);
+
+	out.Write(final ? 1 : 0, 1);
+	out.Write(2, 2);
+
+	out.Write(numLiterals-257, 5);
+	out.Write(numDistances-1, 5);
+	out.Write(numLengths-4, 4);
+
+	for (int i=0; i < numLengths; ++i)
+		out.Write(lengthLengths[kLengthOrder[i]], 3);
+
+	for (size_t i=0; i < symbols.size(); ++i)
+	{
+		const int s = symbols[i].symbol;
+
+		out.Write(lengthCodes[s], lengthLengths[s]);
+		out.Write(symbols[i].extra, LengthSymbolExtraBits(s));
+	}
+
+	for (size_t i=0; i < tokens.size(); ++i)
+	{
+		const int distance = TokenDistance(tokens[i]);
+		const int value = TokenValue(tokens[i]);
+
+		if (distance == 0)
+		{
+			out.Write(literalCodes[value], literalLengths[value]);
+		}
+		else
+		{
+			const int lc = LengthCode(value);
+			out.Write(literalCodes[257+lc], literalLengths[257+lc]);
+			out.Write(value - kLengthBase[lc], kLengthExtra[lc]);
+
+			const int dc = DistanceCode(distance);
+			out.Write(distanceCodes[dc], distanceLengths[dc]);
+			out.Write(distance - kDistanceBase[dc], kDistanceExtra[dc]);
 		}
 	}
-	return TINYPNGOUT_OK;
+
+	out.Write(literalCodes[256], literalLengths[256]);
 }
 
+inline uint32_t Hash3(const uint8_t* p)
+{
+	const uint32_t v = uint32_t(p[0]) | uint32_t(p[1]) << 8 | uint32_t(p[2]) << 16;
+	return (v*2654435761u) >> (32-kDeflateHashBits);
+}
 
-/* Private function implementations */
+// compresses a chunk on its own with greedy LZ77 matching, chunks other than the last end
+// with an empty stored block so the next chunk's stream can start at a byte boundary
+void DeflateChunk(const uint8_t* data, int size, bool last, std::vector<uint8_t>& output)
+{
+	std::vector<int> head(1<<kDeflateHashBits, -1);
+	std::vector<int> prev(kDeflateWindow, -1);
 
-static enum TinyPngOutStatus finish(const struct TinyPngOut *pngout) {
-	#define FOOTER_SIZE 20
-	uint32_t adler = pngout->adler;
-	uint8_t footer[FOOTER_SIZE] = {
-		adler >> 24, adler >> 16, adler >> 8, adler >> 0,
-		0, 0, 0, 0,  // IDAT CRC-32 to be filled in (starting at offset 4)
-		// IEND chunk
-		0x00, 0x00, 0x00, 0x00,
-		0x49, 0x45, 0x4E, 0x44,
-		0xAE, 0x42, 0x60, 0x82,
-	};
-	uint32_t crc = crc32(pngout->crc, &footer[0], 4);
-	footer[4] = crc >> 24;
-	footer[5] = crc >> 16;
-	footer[6] = crc >>  8;
-	footer[7] = crc >>  0;
-	
-	if (fwrite(footer, 1, FOOTER_SIZE, pngout->outStream) != FOOTER_SIZE)
-		return TINYPNGOUT_IO_ERROR;
-	return TINYPNGOUT_OK;
+	std::vector<Token> tokens;
+	tokens.reserve(kDeflateBlockTokens);
+
+	BitWriter out;
+
+	int blockStart = 0;
+	int pos = 0;
+
+	while (pos < size)
+	{
+		int bestLength = 0;
+		int bestDistance = 0;
+
+		if (pos + kDeflateMinMatch <= size)
+		{
+			const uint32_t h = Hash3(data+pos);
+			const int maxLength = Min(kDeflateMaxMatch, size-pos);
+
+			int candidate = head[h];
+
+			for (int chain=0; chain < kDeflateMaxChain && candidate >= 0 && pos-candidate <= kDeflateWindow; ++chain)
+			{
+				const uint8_t* a = data+candidate;
+				const uint8_t* b = data+pos;
+
+				if (a[bestLength] == b[bestLength])
+				{
+					int length = 0;
+					while (length < maxLength && a[length] == b[length])
+						++length;
+
+					if (length > bestLength)
+					{
+						bestLength = length;
+						bestDistance = pos-candidate;
+
+						if (length == maxLength)
+							break;
+					}
+				}
+
+				// slots of the window are reused so stale links can point forward
+				const int next = prev[candidate & (kDeflateWindow-1)];
+				if (next >= candidate)
+					break;
+
+				candidate = next;
+			}
+		}
+
+		const int advance = bestLength >= kDeflateMinMatch ? bestLength : 1;
+
+		if (advance > 1)
+			tokens.push_back(MakeMatch(bestLength, bestDistance));
+		else
+			tokens.push_back(MakeLiteral(data[pos]));
+
+		// every position covered is added to the hash chains
+		for (int i=0; i < advance; ++i, ++pos)
+		{
+			if (pos + kDeflateMinMatch <= size)
+			{
+				const uint32_t h = Hash3(data+pos);
+
+				prev[pos & (kDeflateWindow-1)] = head[h];
+				head[h] = pos;
+			}
+		}
+
+		if (tokens.size() == kDeflateBlockTokens)
+		{
+			WriteBlock(out, tokens, data+blockStart, pos-blockStart, last && pos == size);
+
+			tokens.resize(0);
+			blockStart = pos;
+		}
+	}
+
+	if (!tokens.empty() || size == 0)
+		WriteBlock(out, tokens, data+blockStart, pos-blockStart, last);
+
+	if (!last)
+	{
+		out.Write(0, 3);
+		out.Align();
+		out.Write(0x0000, 16);
+		out.Write(0xffff, 16);
+	}
+
+	out.Align();
+	output.swap(out.bytes);
 }
 
+uint32_t g_crcTable[256];
+
+struct CrcTableInit
+{
+	CrcTableInit()
+	{
+		for (uint32_t i=0; i < 256; ++i)
+		{
+			uint32_t c = i;
+			for (int j=0; j < 8; ++j)
+				c = (c & 1) ? (c >> 1) ^ 0xEDB88320u : c >> 1;
 
-static uint32_t crc32(uint32_t state, const uint8_t *data, size_t len) {
-	state = ~state;
-	size_t i;
-	for (i = 0; i < len; i++) {
-		unsigned int j;
-		for (j = 0; j < 8; j++) {  // Inefficient bitwise implementation, instead of table-based
-			uint32_t bit = (state ^ (data[i] >> j)) & 1;
-			state = (state >> 1) ^ ((-bit) & 0xEDB88320);
+			g_crcTable[i] = c;
 		}
 	}
-	return ~state;
+} g_crcTableInit;
+
+uint32_t Crc32(uint32_t crc, const uint8_t* data, size_t size)
+{
+	crc = ~crc;
+
+	for (size_t i=0; i < size; ++i)
+		crc = g_crcTable[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+
+	return ~crc;
 }
 
+const uint32_t kAdlerBase = 65521;
+
+uint32_t Adler32(uint32_t adler, const uint8_t* data, size_t size)
+{
+	uint32_t s1 = adler & 0xffff;
+	uint32_t s2 = adler >> 16;
 
-static uint32_t adler32(uint32_t state, const uint8_t *data, size_t len) {
-	uint16_t s1 = state >>  0;
-	uint16_t s2 = state >> 16;
-	size_t i;
-	for (i = 0; i < len; i++) {
-		s1 = (s1 + data[i]) % 65521;
-		s2 = (s2 + s1) % 65521;
+	// largest run that can't overflow the sums before they are reduced
+	const size_t kRun = 5552;
+
+	while (size > 0)
+	{
+		const size_t n = Min(size, kRun);
+
+		for (size_t i=0; i < n; ++i)
+		{
+			s1 += data[i];
+			s2 += s1;
+		}
+
+		s1 %= kAdlerBase;
+		s2 %= kAdlerBase;
+
+		data += n;
+		size -= n;
 	}
-	return (uint32_t)s2 << 16 | s1;
+
+	return s2 << 16 | s1;
 }
 
+// checksum of two buffers joined together from their own checksums, as in zlib
+uint32_t Adler32Combine(uint32_t a, uint32_t b, size_t sizeB)
+{
+	const uint32_t rem = uint32_t(sizeB % kAdlerBase);
+
+	uint32_t s1 = a & 0xffff;
+	uint32_t s2 = uint32_t((uint64_t(rem)*s1) % kAdlerBase);
+
+	s1 += (b & 0xffff) + kAdlerBase - 1;
+	s2 += (a >> 16) + (b >> 16) + kAdlerBase - rem;
+
+	if (s1 >= kAdlerBase) s1 -= kAdlerBase;
+	if (s1 >= kAdlerBase) s1 -= kAdlerBase;
+	if (s2 >= kAdlerBase*2) s2 -= kAdlerBase*2;
+	if (s2 >= kAdlerBase) s2 -= kAdlerBase;
+
+	return s2 << 16 | s1;
+}
 
 inline uint8_t Quantize(float x)
 {
 	return uint8_t(Clamp(x, 0.0f, 255.0f));
 }
 
-void WritePng(const Color* pixels, int width, int height, const char* filename)
+inline int Paeth(int a, int b, int c)
+{
+	const int p = a + b - c;
+	const int pa = abs(p-a);
+	const int pb = abs(p-b);
+	const int pc = abs(p-c);
+
+	if (pa <= pb && pa <= pc)
+		return a;
+	else if (pb <= pc)
+		return b;
+	else
+		return c;
+}
+
+// picks the PNG filter with the smallest sum of absolute residuals, the usual heuristic
+void FilterRow(const uint8_t* row, const uint8_t* above, int size, uint8_t* out)
 {
-	uint8_t* buffer = new uint8_t[width*height*3];
+	const int bpp = 3;
 
-	Random rand;
+	int bestFilter = 0;
+	unsigned int bestCost = UINT_MAX;
 
-	for (int i=0; i < width*height; ++i)
+	for (int f=0; f < 5; ++f)
 	{
-		Color c = pixels[i];
+		unsigned int cost = 0;
+
+		for (int i=0; i < size; ++i)
+		{
+			const int a = i >= bpp ? row[i-bpp] : 0;
+			const int b = above ? above[i] : 0;
+			const int c = (i >= bpp && above) ? above[i-bpp] : 0;
+
+			int predicted = 0;
+
+			switch (f)
+			{
+				case 1: predicted = a; break;
+				case 2: predicted = b; break;
+				case 3: predicted = (a+b)/2; break;
+				case 4: predicted = Paeth(a, b, c); break;
+			};
+
+			const int8_t residual = int8_t(row[i]-predicted);
+			cost += abs(int(residual));
+		}
 
-		buffer[i*3+0] = Quantize(c.x*255.0 + rand.Randf() + rand.Randf() - 0.5f);
-		buffer[i*3+1] = Quantize(c.y*255.0 + rand.Randf() + rand.Randf() - 0.5f);
-		buffer[i*3+2] = Quantize(c.z*255.0 + rand.Randf() + rand.Randf() - 0.5f);
+		if (cost < bestCost)
+		{
+			bestCost = cost;
+			bestFilter = f;
+		}
 	}
 
-	FILE *fout = fopen(filename, "wb");
-	
-	if (fout)
+	out[0] = uint8_t(bestFilter);
+
+	for (int i=0; i < size; ++i)
 	{
+		const int a = i >= bpp ? row[i-bpp] : 0;
+		const int b = above ? above[i] : 0;
+		const int c = (i >= bpp && above) ? above[i-bpp] : 0;
+
+		int predicted = 0;
 
-		struct TinyPngOut pngout;
-		if (fout == NULL || TinyPngOut_init(&pngout, fout, width, height) != TINYPNGOUT_OK)
-			goto error;
-	
-		// Write image data
-		if (TinyPngOut_write(&pngout, buffer, width * height) != TINYPNGOUT_OK)
-			goto error;
-	
-		// Check for proper completion
-		if (TinyPngOut_write(&pngout, NULL, 0) != TINYPNGOUT_DONE)
-			goto error;
+		switch (bestFilter)
+		{
+			case 1: predicted = a; break;
+			case 2: predicted = b; break;
+			case 3: predicted = (a+b)/2; break;
+			case 4: predicted = Paeth(a, b, c); break;
+		};
+
+		out[i+1] = uint8_t(row[i]-predicted);
 	}
-	else
+}
+
+void WriteChunk(FILE* f, const char* type, const uint8_t* data, size_t size)
+{
+	const uint8_t header[8] =
+	{
+		uint8_t(size >> 24), uint8_t(size >> 16), uint8_t(size >> 8), uint8_t(size),
+		uint8_t(type[0]), uint8_t(type[1]), uint8_t(type[2]), uint8_t(type[3])
+	};
+
+	uint32_t crc = Crc32(0, header+4, 4);
+	crc = Crc32(crc, data, size);
+
+	const uint8_t footer[4] = { uint8_t(crc >> 24), uint8_t(crc >> 16), uint8_t(crc >> 8), uint8_t(crc) };
+
+	fwrite(header, 1, 8, f);
+
+	if (size)
+		fwrite(data, 1, size, f);
+
+	fwrite(footer, 1, 4, f);
+}
+
+// pending writes of WritePngAsync(), images are written in the order they were queued
+struct PngWriter
+{
+	struct Job
+	{
+		std::vector<Color> pixels;
+		int width;
+		int height;
+		std::string filename;
+	};
+
+	PngWriter() : busy(false), quit(false)
+	{
+		thread = std::thread(&PngWriter::ThreadMain, this);
+	}
+
+	~PngWriter()
+	{
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			quit = true;
+		}
+
+		wake.notify_all();
+		thread.join();
+	}
+
+	void Push(Job* job)
+	{
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			jobs.push_back(job);
+		}
+
+		wake.notify_all();
+	}
+
+	void Wait()
+	{
+		std::unique_lock<std::mutex> guard(lock);
+
+		while (busy || !jobs.empty())
+			done.wait(guard);
+	}
+
+	void ThreadMain()
+	{
+		for (;;)
+		{
+			Job* job;
+
+			{
+				std::unique_lock<std::mutex> guard(lock);
+
+				// queued images are still written on shutdown
+				while (jobs.empty() && !quit)
+					wake.wait(guard);
+
+				if (jobs.empty())
+					return;
+
+				job = jobs.front();
+				jobs.pop_front();
+
+				busy = true;
+			}
+
+			WritePng(&job->pixels[0], job->width, job->height, job->filename.c_str());
+			delete job;
+
+			{
+				std::lock_guard<std::mutex> guard(lock);
+				busy = false;
+			}
+
+			done.notify_all();
+		}
+	}
+
+	std::thread thread;
+
+	std::mutex lock;
+	std::condition_variable wake;
+	std::condition_variable done;
+
+	std::deque<Job*> jobs;
+
+	bool busy;
+	bool quit;
+};
+
+PngWriter& GetPngWriter()
+{
+	static PngWriter writer;
+	return writer;
+}
+
+} // anonymous namespace
+
+void WritePng(const Color* pixels, int width, int height, const char* filename)
+{
+	if (width <= 0 || height <= 0)
+		return;
+
+	const int rowSize = width*3;
+	const int filteredSize = rowSize+1;
+
+	std::vector<uint8_t> rgb(size_t(rowSize)*height);
+	std::vector<uint8_t> filtered(size_t(filteredSize)*height);
+
+	const int numRowTasks = (height + kPngRowsPerTask - 1)/kPngRowsPerTask;
+
+	// dithered quantization, each row draws from its own stream so the result doesn't
+	// depend on the number of workers
+	ParallelFor(numRowTasks, [&](int task, int worker)
+	{
+		const int begin = task*kPngRowsPerTask;
+		const int end = Min(begin + kPngRowsPerTask, height);
+
+		for (int y=begin; y < end; ++y)
+		{
+			Random rand(y);
+
+			const Color* src = pixels + size_t(y)*width;
+			uint8_t* dst = &rgb[size_t(y)*rowSize];
+
+			for (int x=0; x < width; ++x)
+			{
+				const Color c = src[x];
+
+				dst[x*3+0] = Quantize(c.x*255.0f + rand.Randf() + rand.Randf() - 0.5f);
+				dst[x*3+1] = Quantize(c.y*255.0f + rand.Randf() + rand.Randf() - 0.5f);
+				dst[x*3+2] = Quantize(c.z*255.0f + rand.Randf() + rand.Randf() - 0.5f);
+			}
+		}
+	});
+
+	// filters predict from the unfiltered row above so rows are independent
+	ParallelFor(numRowTasks, [&](int task, int worker)
+	{
+		const int begin = task*kPngRowsPerTask;
+		const int end = Min(begin + kPngRowsPerTask, height);
+
+		for (int y=begin; y < end; ++y)
+		{
+			const uint8_t* above = y > 0 ? &rgb[size_t(y-1)*rowSize] : NULL;
+			FilterRow(&rgb[size_t(y)*rowSize], above, rowSize, &filtered[size_t(y)*filteredSize]);
+		}
+	});
+
+	// deflate chunks of whole rows in parallel, the zlib checksum is combined from each chunk's
+	const int rowsPerChunk = Max(1, kDeflateChunkBytes/filteredSize);
+	const int numChunks = (height + rowsPerChunk - 1)/rowsPerChunk;
+
+	std::vector<std::vector<uint8_t> > chunks(numChunks);
+	std::vector<uint32_t> chunkAdler(numChunks);
+
+	ParallelFor(numChunks, [&](int c, int worker)
+	{
+		const int begin = c*rowsPerChunk;
+		const int end = Min(begin + rowsPerChunk, height);
+
+		const uint8_t* data = &filtered[size_t(begin)*filteredSize];
+		const int size = (end-begin)*filteredSize;
+
+		DeflateChunk(data, size, c == numChunks-1, chunks[c]);
+		chunkAdler[c] = Adler32(1, data, size);
+	});
+
+	uint32_t adler = chunkAdler[0];
+
+	for (int c=1; c < numChunks; ++c)
+	{
+		const int rows = Min(rowsPerChunk, height - c*rowsPerChunk);
+		adler = Adler32Combine(adler, chunkAdler[c], size_t(rows)*filteredSize);
+	}
+
+	// zlib stream, 32k window with no preset dictionary
+	std::vector<uint8_t> stream;
+	stream.push_back(0x78);
+	stream.push_back(0x01);
+
+	for (int c=0; c < numChunks; ++c)
+		stream.insert(stream.end(), chunks[c].begin(), chunks[c].end());
+
+	stream.push_back(uint8_t(adler >> 24));
+	stream.push_back(uint8_t(adler >> 16));
+	stream.push_back(uint8_t(adler >> 8));
+	stream.push_back(uint8_t(adler));
+
+	FILE* f = fopen(filename, "wb");
+
+	if (!f)
 	{
 		printf("Failed to open %s for PNG write\n", filename);
+		return;
 	}
 
-error:
+	const uint8_t signature[8] = { 0x89, 0x50, 0x4E, 0x47, 0x0D, 0x0A, 0x1A, 0x0A };
+	fwrite(signature, 1, 8, f);
 
-	delete[] buffer;
-	fclose(fout);
+	// 8 bit RGB, no interlacing
+	const uint8_t header[13] =
+	{
+		uint8_t(width >> 24), uint8_t(width >> 16), uint8_t(width >> 8), uint8_t(width),
+		uint8_t(height >> 24), uint8_t(height >> 16), uint8_t(height >> 8), uint8_t(height),
+		8, 2, 0, 0, 0
+	};
 
+	WriteChunk(f, "IHDR", header, sizeof(header));
+	WriteChunk(f, "IDAT", &stream[0], stream.size());
+	WriteChunk(f, "IEND", NULL, 0);
 
-}
\ No newline at end of file
+	if (ferror(f))
+		printf("Failed to write %s\n", filename);
+
+	fclose(f);
+}
+
+void WritePngAsync(const Color* pixels, int width, int height, const char* filename)
+{
+	PngWriter::Job* job = new PngWriter::Job();
+	job->pixels.assign(pixels, pixels + width*height);
+	job->width = width;
+	job->height = height;
+	job->filename = filename;
+
+	GetPngWriter().Push(job);
+}
+
+void WaitForPngWrites()
+{
+	GetPngWriter().Wait();
+}
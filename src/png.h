@@ -2,4 +2,12 @@
 
 #include "maths.h"
 
-void WritePng(const Color* pixels, int width, int height, const char* filename);
\ No newline at end of file
+// writes 8 bit sRGB with dithering, pixels are expected to be tone mapped to [0, 1]
+void WritePng(const Color* pixels, int width, int height, const char* filename);
+
+// copies the pixels and writes them from a background thread, e.g.: so a batch can move onto
+// its next frame while the previous one is encoded
+void WritePngAsync(const Color* pixels, int width, int height, const char* filename);
+
+// waits until every image queued by WritePngAsync() has been written
+void WaitForPngWrites();
@@ -0,0 +1,142 @@
+#include "probe.h"
+#include "parallel.h"
+
+namespace
+{
+
+// rows handed to a worker at once
+const int kProbeRowsPerTask = 16;
+
+} // anonymous namespace
+
+void Probe::BuildTable()
+{
+	const int numPixels = width*height;
+
+	float* weights = new float[numPixels];
+
+	const int numTasks = (height + kProbeRowsPerTask - 1)/kProbeRowsPerTask;
+
+	ParallelFor(numTasks, [&](int task, int worker)
+	{
+		const int begin = task*kProbeRowsPerTask*width;
+		const int end = Min(begin + kProbeRowsPerTask*width, numPixels);
+
+		for (int i=begin; i < end; ++i)
+			weights[i] = Max(0.0f, Luminance(data[i]));
+	});
+
+	table = new AliasEntry[numPixels];
+
+	BuildAliasTable(weights, numPixels, table);
+
+	delete[] weights;
+
+	valid = true;
+}
+
+void Probe::BuildMips()
+{
+	delete[] mips;
+	mips = NULL;
+
+	// level 0 is the probe itself so takes no space
+	numLevels = 1;
+	mipOffsets[0] = 0;
+	mipOffsets[1] = 0;
+
+	while (numLevels < kMaxProbeLevels && ((width >> (numLevels-1)) > 1 || (height >> (numLevels-1)) > 1))
+	{
+		const int levelWidth = Max(1, width >> numLevels);
+		const int levelHeight = Max(1, height >> numLevels);
+
+		mipOffsets[numLevels+1] = mipOffsets[numLevels] + levelWidth*levelHeight;
+		numLevels++;
+	}
+
+	if (numLevels == 1)
+		return;
+
+	mips = new Color[mipOffsets[numLevels]];
+
+	for (int l=1; l < numLevels; ++l)
+	{
+		const Color* src = l == 1 ? data : mips + mipOffsets[l-1];
+
+		const int srcWidth = Max(1, width >> (l-1));
+		const int srcHeight = Max(1, height >> (l-1));
+
+		const int dstWidth = Max(1, width >> l);
+		const int dstHeight = Max(1, height >> l);
+
+		Color* dst = mips + mipOffsets[l];
+
+		const int numTasks = (dstHeight + kProbeRowsPerTask - 1)/kProbeRowsPerTask;
+
+		// 2x2 box filter, odd dimensions drop their last row or column as the map has no seam to wrap over
+		ParallelFor(numTasks, [&](int task, int worker)
+		{
+			const int begin = task*kProbeRowsPerTask;
+			const int end = Min(begin + kProbeRowsPerTask, dstHeight);
+
+			for (int y=begin; y < end; ++y)
+			{
+				const int y0 = Min(y*2, srcHeight-1);
+				const int y1 = Min(y*2+1, srcHeight-1);
+
+				for (int x=0; x < dstWidth; ++x)
+				{
+					const int x0 = Min(x*2, srcWidth-1);
+					const int x1 = Min(x*2+1, srcWidth-1);
+
+					dst[y*dstWidth + x] = (src[y0*srcWidth + x0] + src[y0*srcWidth + x1] + src[y1*srcWidth + x0] + src[y1*srcWidth + x1])*0.25f;
+				}
+			}
+		});
+	}
+}
+
+Probe ProbeLoadFromFile(const char* path)
+{
+	double start = GetSeconds();
+
+	PfmImage image;
+	//PfmLoad(path, image);
+	if (HdrLoad(path, image))
+	{
+		Probe probe;
+		probe.width = image.width;
+		probe.height = image.height;
+
+		const int numPixels = image.width*image.height;
+
+		// convert image data to color data, apply pre-exposure etc
+		probe.data = new Color[numPixels];
+
+		const int numTasks = (image.height + kProbeRowsPerTask - 1)/kProbeRowsPerTask;
+
+		ParallelFor(numTasks, [&](int task, int worker)
+		{
+			const int begin = task*kProbeRowsPerTask*image.width;
+			const int end = Min(begin + kProbeRowsPerTask*image.width, numPixels);
+
+			for (int i=begin; i < end; ++i)
+				probe.data[i] = Color(image.data[i*3+0], image.data[i*3+1], image.data[i*3+2]);
+		});
+
+		probe.BuildTable();
+		probe.BuildMips();
+
+		delete[] image.data;
+
+		double end = GetSeconds();
+
+		printf("Imported probe %s in %fms\n", path, (end-start)*1000.0f);
+
+		return probe;
+	}
+	else
+	{
+		return Probe();
+	}
+}
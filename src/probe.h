@@ -6,6 +6,9 @@
 
 double GetSeconds();
 
+// enough levels for probes up to 32k wide
+const int kMaxProbeLevels = 16;
+
 struct Probe
 {
 	int width;
@@ -13,12 +16,18 @@ struct Probe
 
 	Color* data;
 
+	// box filtered levels below the full resolution one, level l is max(1, width>>l) by
+	// max(1, height>>l) texels starting at mips[mipOffsets[l]], level 0 is data itself
+	Color* mips;
+	int mipOffsets[kMaxProbeLevels+1];
+	int numLevels;
+
 	// world space offset to effectively warp the skybox
 	Vec3 offset;
 
-	Probe() : valid(false) {}
+	Probe() : data(NULL), mips(NULL), numLevels(1), valid(false), table(NULL) {}
 
-	// cdf
+	// sampling distribution
 
 		struct Entry
 		{
@@ -28,63 +37,17 @@ struct Probe
 			inline bool operator < (const Entry& e) const { return weight < e.weight; }
 		};
 
-	inline void BuildCDF()
-	{
-		pdfValuesX = new float[width*height];
-		pdfValuesY = new float[height];
-
-		cdfValuesX = new float[width*height];
-		cdfValuesY = new float[height];
-
-		float totalWeightY = 0.0f;
-
-		for (int j=0; j < height; ++j)
-		{
-			float totalWeightX = 0.0f;
-
-			for (int i=0; i < width; ++i)
-			{
-				float weight = Luminance(data[j*width + i]);
-
-				totalWeightX += weight;
-				
-				pdfValuesX[j*width + i] = weight;
-				cdfValuesX[j*width + i] = totalWeightX;
-			}			
-
-			float invTotalWeightX = 1.0f/totalWeightX;
-
-			// convert to pdf and cdf
-			for (int i=0; i < width; ++i)
-			{
-				pdfValuesX[j*width + i] *= invTotalWeightX;
-				cdfValuesX[j*width + i] *= invTotalWeightX;
-			}
-
-			// total weight y 
-			totalWeightY += totalWeightX;
-
-			pdfValuesY[j] = totalWeightX;
-			cdfValuesY[j] = totalWeightY;
-		}
-
-		// convert Y to cdf
-		for (int j=0; j < height; ++j)
-		{
-			cdfValuesY[j] /= float(totalWeightY);
-			pdfValuesY[j] /= float(totalWeightY);
-		}
+	// one alias table over all pixels weighted by luminance, the joint pdf of a pixel
+	// is the same as the product of the row and column pdfs of a 2D marginal cdf
+	void BuildTable();
 
-		valid = true;
-	}
+	// downsamples data into mips, see ProbeEvalLod()
+	void BuildMips();
 
 	bool valid;
 	
-	float* pdfValuesX;
-	float* cdfValuesX;
-
-	float* pdfValuesY;
-	float* cdfValuesY;
+	// width*height entries, the pdf of each entry is the probability of its pixel
+	AliasEntry* table;
 };
 
 
@@ -133,6 +96,38 @@ CUDA_CALLABLE inline Vec3 ProbeEval(const Probe& image, const Vec2& uv)
 	return Vec3(fetchVec4(image.data, py*image.width+px));
 }
 
+// looks up the nearest level to lod, coarse levels average the probe over a footprint so
+// lookups of rough bounces stay within a few cache resident texels
+CUDA_CALLABLE inline Vec3 ProbeEvalLod(const Probe& image, const Vec2& uv, float lod)
+{
+	const int level = Clamp(int(lod + 0.5f), 0, image.numLevels-1);
+
+	if (level == 0)
+		return ProbeEval(image, uv);
+
+	const int width = Max(1, image.width >> level);
+	const int height = Max(1, image.height >> level);
+
+	int px = Clamp(int(uv.x*width), 0, width-1);
+	int py = Clamp(int(uv.y*height), 0, height-1);
+
+	// offset the index rather than the pointer as mips may be a texture object
+	return Vec3(fetchVec4(image.mips, image.mipOffsets[level] + py*width+px));
+}
+
+// level whose texels cover about as much solid angle as a direction sampled with the given pdf,
+// as in filtered importance sampling, biased a level finer to keep the blur below the footprint
+CUDA_CALLABLE inline float ProbeLod(const Probe& image, float pdf)
+{
+	if (pdf <= 0.0f)
+		return 0.0f;
+
+	// texels of the full resolution map cover 4pi/(width*height) steradians on average
+	const float texelSolidAngle = 4.0f*kPi/(float(image.width)*float(image.height));
+
+	return Max(0.0f, 0.5f*log2f(1.0f/(pdf*texelSolidAngle)) - 1.0f);
+}
+
 CUDA_CALLABLE inline float ProbePdf(const Probe& image, const Vec3& d)
 {
 
@@ -141,7 +136,7 @@ CUDA_CALLABLE inline float ProbePdf(const Probe& image, const Vec3& d)
 	int col = Clamp(int(uv.x * image.width), 0, image.width-1);
 	int row = Clamp(int(uv.y * image.height), 0, image.height-1);
 
-	float pdf = fetchFloat(image.pdfValuesX, row*image.width + col)*fetchFloat(image.pdfValuesY, row);
+	float pdf = image.table[row*image.width + col].pdf;
 
 	Validate(pdf);
 	Validate(uv.y);
@@ -202,25 +197,19 @@ CUDA_CALLABLE inline int LowerBound(const float* array, int lower, int upper, co
 	return lower;
 }
 
-CUDA_CALLABLE inline void ProbeSample(const Probe& image, Vec3& dir, Vec3& color, float& pdf, Random& rand)
+CUDA_CALLABLE inline void ProbeSample(const Probe& image, Vec3& dir, Vec3& color, float& pdf, Sampler& rand)
 {
     float r1, r2;
     Sample2D(rand, r1, r2);
 
-	// sample rows
-	//float* rowPtr = std::lower_bound(image.cdfValuesY, image.cdfValuesY+image.height, r1);
-	//const float* rowPtr = LowerBound(image.cdfValuesY, image.cdfValuesY+image.height, r1);
-	//int row = rowPtr - image.cdfValuesY;
-	int row = LowerBound(image.cdfValuesY, 0, image.height, r1);
+	// pick a pixel
+	const int pixel = SampleAlias(image.table, image.width*image.height, r1, r2);
 
-	// sample cols of row
-	//float* colPtr = std::lower_bound(&image.cdfValuesX[row*image.width], &image.cdfValuesX[(row+1)*image.width], r2);
-	//const float* colPtr = LowerBound(&image.cdfValuesX[row*image.width], &image.cdfValuesX[(row+1)*image.width], r2);
-	//int col = colPtr - &image.cdfValuesX[row*image.width];
-	int col = LowerBound(image.cdfValuesX, row*image.width, (row+1)*image.width, r2) - row*image.width;
+	int row = pixel/image.width;
+	int col = pixel - row*image.width;
 
-	color = Vec3(fetchVec4(image.data, row*image.width + col));
-	pdf = fetchFloat(image.pdfValuesX, row*image.width + col)*fetchFloat(image.pdfValuesY, row);
+	color = Vec3(fetchVec4(image.data, pixel));
+	pdf = image.table[pixel].pdf;
 
 	float u = col/float(image.width);
 	float v = row/float(image.height);
@@ -235,40 +224,20 @@ CUDA_CALLABLE inline void ProbeSample(const Probe& image, Vec3& dir, Vec3& color
 
 }
 
-inline Probe ProbeLoadFromFile(const char* path)
-{
-	double start = GetSeconds();
+// loads an .hdr probe and builds its sampling table and mips
+Probe ProbeLoadFromFile(const char* path);
 
-	PfmImage image;
-	//PfmLoad(path, image);
-	if (HdrLoad(path, image))
+inline void ProbeDestroy(Probe& probe)
+{
+	if (probe.valid)
 	{
-		Probe probe;
-		probe.width = image.width;
-		probe.height = image.height;
+		delete[] probe.data;
+		delete[] probe.mips;
 
-		int numPixels = image.width*image.height;
-
-		// convert image data to color data, apply pre-exposure etc
-		probe.data = new Color[numPixels];
-
-		for (int i=0; i < numPixels; ++i)
-			probe.data[i] = Color(image.data[i*3+0], image.data[i*3+1], image.data[i*3+2]);
-	
-		probe.BuildCDF();
-
-		delete[] image.data;
-
-		double end = GetSeconds();
-
-		printf("Imported probe %s in %fms\n", path, (end-start)*1000.0f);
-
-		return probe;
-	}
-	else
-	{
-		return Probe();
+		delete[] probe.table;
 	}
+
+	probe = Probe();
 }
 
 inline Probe ProbeCreateTest()
@@ -302,8 +271,8 @@ inline Probe ProbeCreateTest()
 		}
 	}
 
-	p.BuildCDF();
-
+	p.BuildTable();
+	p.BuildMips();
 
 	return p;
 }
@@ -311,7 +280,7 @@ inline Probe ProbeCreateTest()
 
 inline void ProbeMark(Probe& probe)
 {
-	Random rand;
+	Sampler rand;
 
 	// sample probe a number of times
 	for (int i=0; i < 500; ++i)
@@ -3,6 +3,8 @@
 #include "util.h"
 #include "sampler.h"
 #include "disney.h"
+#include "parallel.h"
+#include "packet.h"
 //#include "lambert.h"
 
 
@@ -13,8 +15,12 @@
 #define USE_LIGHT_SAMPLING 1
 #define USE_SCENE_BVH 1
 
-// trace a ray against the scene returning the closest intersection
-inline bool Trace(const Scene& scene, const Ray& ray, float& outT, Vec3& outNormal, const Primitive** outPrimitive)
+// escaped rays of rough bounces read the probe's prefiltered levels
+#define USE_PROBE_MIPS 1
+
+// trace a ray against the scene returning the closest intersection, the work done is counted into stats
+template <typename Stats>
+inline bool Trace(const Scene& scene, const Ray& ray, float& outT, Vec3& outNormal, const Primitive** outPrimitive, Stats& stats)
 {
 
 #if USE_SCENE_BVH
@@ -27,8 +33,9 @@ inline bool Trace(const Scene& scene, const Ray& ray, float& outT, Vec3& outNorm
 
 		Ray ray;
 		const Scene& scene;
+		Stats& stats;
 
-		Callback(const Scene& s, const Ray& r) : minT(REAL_MAX), closestPrimitive(NULL), ray(r), scene(s)
+		Callback(const Scene& s, const Ray& r, Stats& st) : minT(REAL_MAX), closestPrimitive(NULL), ray(r), scene(s), stats(st)
 		{
 
 		}
@@ -40,7 +47,7 @@ inline bool Trace(const Scene& scene, const Ray& ray, float& outT, Vec3& outNorm
 
 			const Primitive& primitive = scene.primitives[index];
 
-			if (PrimitiveIntersect(primitive, ray, t, &n))
+			if (PrimitiveIntersect(primitive, ray, t, &n, minT, stats))
 			{
 				if (t < minT && t > 0.0f)
 				{
@@ -52,8 +59,17 @@ inline bool Trace(const Scene& scene, const Ray& ray, float& outT, Vec3& outNorm
 		}
 	};
 
-	Callback callback(scene, ray);
-	QueryBVH(callback, scene.bvh.nodes, ray.origin, ray.dir);
+	Callback callback(scene, ray, stats);
+
+	// the scene trees are split over the shutter when anything moves
+	const int segment = MotionSegment(ray.time, scene.numMotionSegments);
+
+	// cull nodes beyond the closest hit found so far
+#if USE_WIDE_BVH
+	QueryWideBVH(callback, scene.wideBvh[segment].nodes, ray.origin, ray.dir, callback.minT, stats);
+#else
+	QueryBVH(callback, scene.bvh[segment].nodes, ray.origin, ray.dir, callback.minT, stats);
+#endif
 
 	outT = callback.minT;		
 	outNormal = FaceForward(callback.closestNormal, -ray.dir);
@@ -76,7 +92,7 @@ inline bool Trace(const Scene& scene, const Ray& ray, float& outT, Vec3& outNorm
 
 		const Primitive& primitive = *iter;
 
-		if (PrimitiveIntersect(primitive, ray, t, &n))
+		if (PrimitiveIntersect(primitive, ray, t, &n, FLT_MAX, stats))
 		{
 			if (t < minT && t > 0.0f)
 			{
@@ -98,9 +114,167 @@ inline bool Trace(const Scene& scene, const Ray& ray, float& outT, Vec3& outNorm
 	
 }
 
+inline bool Trace(const Scene& scene, const Ray& ray, float& outT, Vec3& outNormal, const Primitive** outPrimitive)
+{
+	NullTraversalStats stats;
+	return Trace(scene, ray, outT, outNormal, outPrimitive, stats);
+}
+
+// closest hit of a camera ray traced ahead of its path, as returned by Trace()
+struct PrimaryHit
+{
+	const Primitive* primitive;
+	float t;
+	Vec3 normal;
+
+	inline bool Get(float& outT, Vec3& outNormal, const Primitive** outPrimitive) const
+	{
+		outT = t;
+		outNormal = normal;
+		*outPrimitive = primitive;
+
+		return primitive != NULL;
+	}
+};
+
+#if USE_RAY_PACKETS
+
+// traces a packet of camera rays against a scene where nothing moves, each ray gets the
+// same hit as from Trace(), meshes with a wide BVH are walked by the whole packet at once
+inline void TracePacket(const Scene& scene, RayPacket& packet, PrimaryHit* hits)
+{
+	struct Callback
+	{
+		const Scene& scene;
+		RayPacket& packet;
+		PrimaryHit* hits;
+
+		Callback(const Scene& s, RayPacket& p, PrimaryHit* h) : scene(s), packet(p), hits(h) {}
+
+		void Hit(int r, const Primitive& primitive, float t, const Vec3& n)
+		{
+			packet.t[r] = t;
+
+			hits[r].primitive = &primitive;
+			hits[r].t = t;
+			hits[r].normal = n;
+		}
+
+		void operator()(int index, PacketMask mask)
+		{
+			const Primitive& primitive = scene.primitives[index];
+
+			if (primitive.type == eMesh && primitive.mesh->wideNodes)
+			{
+				// primitives are static so the rays keep a shared origin in mesh space
+				const Transform transform = PrimitiveTransform(primitive, 0.0f);
+
+				RayPacket local;
+				local.Reset(TransformPoint(primitive.inverseTransform, packet.origin));
+
+				for (int r=0; r < kPacketSize; ++r)
+				{
+					if (mask & (PacketMask(1)<<r))
+						local.SetRay(r, TransformVector(primitive.inverseTransform, packet.GetDir(r)), packet.t[r]);
+				}
+
+				local.Finish();
+
+				MeshRayPacketQuery query(*primitive.mesh, local);
+				QueryWideBVHPacket(query, primitive.mesh->wideNodes, local);
+
+				for (int r=0; r < kPacketSize; ++r)
+				{
+					if ((mask & (PacketMask(1)<<r)) && local.t[r] < packet.t[r])
+						Hit(r, primitive, local.t[r], MeshHitNormal(primitive, transform, query.closestTri[r], query.closestU[r], query.closestV[r], query.closestW[r], query.closestNormal[r]));
+				}
+
+				return;
+			}
+
+			for (int r=0; r < kPacketSize; ++r)
+			{
+				if ((mask & (PacketMask(1)<<r)) == 0)
+					continue;
+
+				float t;
+				Vec3 n;
+
+				if (PrimitiveIntersect(primitive, Ray(packet.origin, packet.GetDir(r), 0.0f), t, &n, packet.t[r]))
+				{
+					if (t < packet.t[r] && t > 0.0f)
+						Hit(r, primitive, t, n);
+				}
+			}
+		}
+	};
+
+	for (int r=0; r < kPacketSize; ++r)
+	{
+		hits[r].primitive = NULL;
+		hits[r].t = packet.t[r];
+		hits[r].normal = Vec3(0.0f);
+	}
+
+	Callback callback(scene, packet, hits);
+
+	if (scene.wideBvh[0].nodes)
+		QueryWideBVHPacket(callback, scene.wideBvh[0].nodes, packet);
+
+	for (int r=0; r < kPacketSize; ++r)
+		hits[r].normal = FaceForward(hits[r].normal, -packet.GetDir(r));
+}
+
+#endif // USE_RAY_PACKETS
+
+
+// returns true if anything is hit closer than tmax, exits on the first hit so is
+// cheaper than Trace() for shadow rays which don't need the closest intersection
+inline bool Occluded(const Scene& scene, const Ray& ray, float tmax)
+{
+#if USE_SCENE_BVH
+
+	struct Callback
+	{
+		const Scene& scene;
+		const Ray& ray;
+		float tmax;
+
+		Callback(const Scene& s, const Ray& r, float t) : scene(s), ray(r), tmax(t) {}
+
+		bool operator()(int index)
+		{
+			return PrimitiveOcclude(scene.primitives[index], ray, tmax);
+		}
+	};
+
+	Callback callback(scene, ray, tmax);
+
+	// the scene trees are split over the shutter when anything moves
+	const int segment = MotionSegment(ray.time, scene.numMotionSegments);
+
+#if USE_WIDE_BVH
+	return QueryWideBVHAny(callback, scene.wideBvh[segment].nodes, ray.origin, ray.dir, tmax);
+#else
+	return QueryBVHAny(callback, scene.bvh[segment].nodes, ray.origin, ray.dir, tmax);
+#endif
+
+#else
+
+	for (int i=0; i < scene.primitives.size(); ++i)
+	{
+		if (PrimitiveOcclude(scene.primitives[i], ray, tmax))
+			return true;
+	}
+
+	return false;
+
+#endif
+}
+
 
 
-inline Vec3 SampleLights(const Scene& scene, const Primitive& surfacePrimitive, float etaI, float etaO, const Vec3& surfacePos, const Vec3& surfaceNormal, const Vec3& shadingNormal, const Vec3& wo, float time, Random& rand)
+inline Vec3 SampleLights(const Scene& scene, const Primitive& surfacePrimitive, float etaI, float etaO, const Vec3& surfacePos, const Vec3& surfaceNormal, const Vec3& shadingNormal, const Vec3& wo, float time, Sampler& rand, RayStats& stats)
 {	
 	Vec3 sum(0.0f);
 
@@ -116,13 +290,12 @@ inline Vec3 SampleLights(const Scene& scene, const Primitive& surfacePrimitive,
 			ProbeSample(scene.sky.probe, wi, skyColor, skyPdf, rand);
 
 			// check if occluded
-			float t;
-			Vec3 n;
-			const Primitive* hit;
-			if (Trace(scene, Ray(surfacePos + FaceForward(surfaceNormal, wi)*kRayEpsilon, wi, time), t, n, &hit) == false)
+			stats.shadow++;
+
+			if (!Occluded(scene, Ray(surfacePos + FaceForward(surfaceNormal, wi)*kRayEpsilon, wi, time), FLT_MAX))
 			{
-				float bsdfPdf = BSDFPdf(surfacePrimitive.material, etaI, etaO, surfacePos, surfaceNormal, wo, wi);
-				Vec3 f = BSDFEval(surfacePrimitive.material, etaI, etaO, surfacePos, surfaceNormal, wo, wi);
+				float bsdfPdf;
+				Vec3 f = BSDFEvalPdf(scene.materials[surfacePrimitive.material], etaI, etaO, surfacePos, surfaceNormal, wo, wi, bsdfPdf);
 				
 				if (bsdfPdf > 0.0f)
 				{
@@ -143,18 +316,22 @@ inline Vec3 SampleLights(const Scene& scene, const Primitive& surfacePrimitive,
 			sum /= float(kProbeSamples);
 	}
 
-	for (int i=0; i < scene.primitives.size(); ++i)
+	if (!scene.lights.empty())
 	{
+		// pick one light in proportion to its power rather than visiting every light
+		float u;
+		Sample1D(rand, u);
+
+		const int light = SampleAlias(&scene.lightTable[0], int(scene.lights.size()), u);
+		const float selectPdf = scene.lightTable[light].pdf;
+
 		// assume all lights are area lights for now
-		const Primitive& lightPrimitive = scene.primitives[i];
+		const Primitive& lightPrimitive = scene.primitives[scene.lights[light]];
 
 		Vec3 L(0.0f);
 
 		int numSamples = lightPrimitive.lightSamples;
 
-		if (numSamples == 0)
-			continue;
-
 		for (int s=0; s < numSamples; ++s)
 		{
 			// sample light source
@@ -168,55 +345,50 @@ inline Vec3 SampleLights(const Scene& scene, const Primitive& surfacePrimitive,
 			float dSq = LengthSq(wi);
 			wi /= sqrtf(dSq);
 
-			// check visibility
-			float t;
-			Vec3 n;
-			const Primitive* hit;
-			if (Trace(scene, Ray(surfacePos + FaceForward(surfaceNormal, wi)*kRayEpsilon, wi, time), t, n, &hit))			
-			{
-				float tSq = t*t;
+			// check visibility, nothing may be hit before the light sample less a tolerance
+			// for the light's own surface, this works for portal sampling where you have
+			// a large light that you sample through a small window
+			const float kTolerance = 1.e-2f;
 
-				// if our next hit was further than distance to light then accept
-				// sample, this works for portal sampling where you have a large light
-				// that you sample through a small window
-				const float kTolerance = 1.e-2f;
+			stats.shadow++;
 
-				if (fabsf(t - sqrtf(dSq)) <= kTolerance)
-				{				
-					const float nl = Abs(Dot(lightNormal, wi));
+			if (Occluded(scene, Ray(surfacePos + FaceForward(surfaceNormal, wi)*kRayEpsilon, wi, time), sqrtf(dSq) - kTolerance))
+				continue;
 
-					// for glancing rays, note we use abs to include cases
-					// where light surface is backfacing, e.g.: inside the weak furnace
-					if (Abs(nl) < 1.e-6f)
-						continue;
+			const float tSq = dSq;
 
-					// light pdf with respect to area and convert to pdf with respect to solid angle
-					float lightArea = PrimitiveArea(lightPrimitive);
-					float lightPdf = ((1.0f/lightArea)*tSq)/nl;
+			const float nl = Abs(Dot(lightNormal, wi));
 
-					// bsdf pdf for light's direction
-					float bsdfPdf = BSDFPdf(surfacePrimitive.material, etaI, etaO, surfacePos, shadingNormal, wo, wi);
-					Vec3 f = BSDFEval(surfacePrimitive.material, etaI, etaO, surfacePos, shadingNormal, wo, wi);
+			// for glancing rays, note we use abs to include cases
+			// where light surface is backfacing, e.g.: inside the weak furnace
+			if (Abs(nl) < 1.e-6f)
+				continue;
 
-		            Validate(bsdfPdf);
-		            Validate(f);
+			// light pdf with respect to area and convert to pdf with respect to solid angle
+			float lightArea = PrimitiveArea(lightPrimitive);
+			float lightPdf = ((1.0f/lightArea)*tSq)/nl;
 
-					// this branch is only necessary to exclude specular paths from light sampling
-					// todo: make BSDFEval always return zero for pure specular paths and roll specular eval into BSDFSample()
-					if (bsdfPdf > 0.0f)
-					{
-						// calculate relative weighting of the light and bsdf sampling
-						int N = lightPrimitive.lightSamples+kBsdfSamples;
-						float cbsdf = kBsdfSamples/N;
-						float clight = float(lightPrimitive.lightSamples)/N;
-						float weight = clight*lightPdf/(cbsdf*bsdfPdf + clight*lightPdf);
-
-						Validate(lightPdf);
-						Validate(weight);
-						
-						L += weight*f*hit->material.emission*(Abs(Dot(wi, shadingNormal))/Max(1.e-3f, lightPdf));
-					}
-				}
+			// bsdf pdf for light's direction
+			float bsdfPdf;
+			Vec3 f = BSDFEvalPdf(scene.materials[surfacePrimitive.material], etaI, etaO, surfacePos, shadingNormal, wo, wi, bsdfPdf);
+
+            Validate(bsdfPdf);
+            Validate(f);
+
+			// this branch is only necessary to exclude specular paths from light sampling
+			// todo: make BSDFEval always return zero for pure specular paths and roll specular eval into BSDFSample()
+			if (bsdfPdf > 0.0f)
+			{
+				// calculate relative weighting of the light and bsdf sampling
+				int N = lightPrimitive.lightSamples+kBsdfSamples;
+				float cbsdf = kBsdfSamples/N;
+				float clight = float(lightPrimitive.lightSamples)/N;
+				float weight = clight*selectPdf*lightPdf/(cbsdf*bsdfPdf + clight*selectPdf*lightPdf);
+
+				Validate(lightPdf);
+				Validate(weight);
+
+				L += weight*f*scene.materials[lightPrimitive.material].emission*(Abs(Dot(wi, shadingNormal))/(selectPdf*Max(1.e-3f, lightPdf)));
 			}
 		}
 	
@@ -226,9 +398,16 @@ inline Vec3 SampleLights(const Scene& scene, const Primitive& surfacePrimitive,
 	return sum;
 }
 
-// reference, no light sampling, uniform hemisphere sampling
-Vec3 PathTrace(const Scene& scene, const Vec3& startOrigin, const Vec3& startDir, float time, int maxDepth, Random& rand)
+// reference, no light sampling, uniform hemisphere sampling, the camera ray's hit may be passed in when traced in a packet
+Vec3 PathTrace(const Scene& scene, const Vec3& startOrigin, const Vec3& startDir, float time, int maxDepth, int rouletteDepth, Sampler& rand, RayStats& stats, PathFeatures* features=NULL, const PrimaryHit* primary=NULL)
 {	
+    if (features)
+    {
+        features->albedo = 0.0f;
+        features->normal = 0.0f;
+        features->depth = 0.0f;
+    }
+
     // path throughput
     Vec3 pathThroughput(1.0f, 1.0f, 1.0f);
     // accumulated radiance
@@ -249,17 +428,24 @@ Vec3 PathTrace(const Scene& scene, const Vec3& startOrigin, const Vec3& startDir
 
     for (int i=0; i < maxDepth; ++i)
     {
+        if (i == 0)
+            stats.primary++;
+        else
+            stats.secondary++;
+
         // find closest hit
-        if (Trace(scene, Ray(rayOrigin, rayDir, rayTime), t, n, &hit))
+        if ((i == 0 && primary) ? primary->Get(t, n, &hit) : Trace(scene, Ray(rayOrigin, rayDir, rayTime), t, n, &hit))
         {	
+			const Material& material = scene.materials[hit->material];
+
 			float outEta;
 			Vec3 outAbsorption;
 
         	// index of refraction for transmission, 1.0 corresponds to air
 			if (rayEta == 1.0f)
 			{
-        		outEta = hit->material.GetIndexOfRefraction();
-				outAbsorption = Vec3(hit->material.absorption);
+        		outEta = material.GetIndexOfRefraction();
+				outAbsorption = Vec3(material.absorption);
 			}
 			else
 			{
@@ -274,13 +460,19 @@ Vec3 PathTrace(const Scene& scene, const Vec3& startOrigin, const Vec3& startDir
         	// calculate new ray position
             const Vec3 p = rayOrigin + rayDir*t;
 
+            if (features && i == 0)
+            {
+                features->albedo = material.color;
+                features->normal = n;
+                features->depth = t;
+            }
 
 #if USE_LIGHT_SAMPLING
 
 			if (i == 0)
 			{
 				// first trace is our only chance to add contribution from directly visible light sources        
-				totalRadiance += hit->material.emission;
+				totalRadiance += material.emission;
 			}			
 			else if (kBsdfSamples > 0)
 			{
@@ -289,8 +481,8 @@ Vec3 PathTrace(const Scene& scene, const Vec3& startOrigin, const Vec3& startDir
 
 				if (lightArea > 0.0f)
 				{
-					// convert to pdf with respect to solid angle
-					float lightPdf = ((1.0f/lightArea)*t*t)/Clamp(Dot(-rayDir, n), 1.e-3f, 1.0f);
+					// convert to pdf with respect to solid angle, including the chance of picking this light
+					float lightPdf = scene.lightSelectPdf[hit-&scene.primitives[0]]*((1.0f/lightArea)*t*t)/Clamp(Dot(-rayDir, n), 1.e-3f, 1.0f);
 
 					// calculate weight for bsdf sampling
 					int N = hit->lightSamples+kBsdfSamples;
@@ -305,17 +497,17 @@ Vec3 PathTrace(const Scene& scene, const Vec3& startOrigin, const Vec3& startDir
 					Validate(weight);
 
 					// pathThroughput already includes the bsdf pdf
-					totalRadiance += weight*pathThroughput*hit->material.emission;
+					totalRadiance += weight*pathThroughput*material.emission;
 				}
 			}
 
 
 			// integrate direct light over hemisphere
-			totalRadiance += pathThroughput*SampleLights(scene, *hit, rayEta, outEta, p, n, n, -rayDir, rayTime, rand);	
+			totalRadiance += pathThroughput*SampleLights(scene, *hit, rayEta, outEta, p, n, n, -rayDir, rayTime, rand, stats);	
 #else
 
 			// include emission from the new primitive
-			totalRadiance += pathThroughput*hit->material.emission;
+			totalRadiance += pathThroughput*material.emission;
 
 #endif
 
@@ -329,7 +521,8 @@ Vec3 PathTrace(const Scene& scene, const Vec3& startOrigin, const Vec3& startDir
 
 			Vec3 bsdfDir;
 			BSDFType bsdfType;
-			BSDFSample(hit->material, rayEta, outEta, p, u, v, n, -rayDir, bsdfDir, bsdfPdf, bsdfType, rand);
+			Vec3 f;
+			BSDFSample(material, rayEta, outEta, p, u, v, n, -rayDir, bsdfDir, f, bsdfPdf, bsdfType, rand);
 
             if (bsdfPdf <= 0.0f)
             	break;
@@ -337,9 +530,6 @@ Vec3 PathTrace(const Scene& scene, const Vec3& startOrigin, const Vec3& startDir
             Validate(bsdfDir);
             Validate(bsdfPdf);
 
-            // reflectance
-            Vec3 f = BSDFEval(hit->material, rayEta, outEta, p, n, -rayDir, bsdfDir);
-
             Validate(f);
 
             // update ray medium if we are transmitting through the material
@@ -357,6 +547,15 @@ Vec3 PathTrace(const Scene& scene, const Vec3& startOrigin, const Vec3& startDir
             // update throughput with primitive reflectance
             pathThroughput *= f * Abs(Dot(n, bsdfDir))/bsdfPdf;
 
+            if (RouletteActive(i+1, rouletteDepth))
+            {
+            	float u;
+            	Sample1D(rand, u);
+
+            	if (!RussianRoulette(pathThroughput, u))
+            		break;
+            }
+
             // update path direction
 			rayType = bsdfType;
             rayDir = bsdfDir;
@@ -379,7 +578,14 @@ Vec3 PathTrace(const Scene& scene, const Vec3& startOrigin, const Vec3& startDir
 				weight = cbsdf*bsdfPdf/(cbsdf*bsdfPdf+ csky*skyPdf);
 			}
 		
-       		totalRadiance += weight*scene.sky.Eval(rayDir)*pathThroughput; 
+#if USE_PROBE_MIPS
+			// rough bounces only resolve the probe at the scale of their footprint
+			const float lod = (scene.sky.probe.valid && i > 0 && rayType != eSpecular) ? ProbeLod(scene.sky.probe, bsdfPdf) : 0.0f;
+#else
+			const float lod = 0.0f;
+#endif
+
+       		totalRadiance += weight*scene.sky.Eval(rayDir, lod)*pathThroughput; 
 			break;
         }
     }
@@ -389,138 +595,566 @@ Vec3 PathTrace(const Scene& scene, const Vec3& startOrigin, const Vec3& startDir
 
 struct CpuRenderer : public Renderer
 {
-	CpuRenderer(const Scene* s) : scene(s) 
+	CpuRenderer(const Scene* s) : scene(s), frame(0)
 	{
 
 	}
 
+	virtual bool Update(const Scene* s)
+	{
+		// restart the random streams so a frame renders the same as with a new renderer
+		scene = s;
+		frame = 0;
+
+		return true;
+	}
+
 	const Scene* scene;
 
-	Random rand;
+	// frame counter used to seed the per-tile random streams, a given
+	// frame index always produces the same image regardless of thread count
+	int frame;
+
+	// image is split into square tiles which are handed out to workers,
+	// each tile splats into a private padded buffer so that filter footprints
+	// crossing tile borders never touch memory shared with other workers
+	enum { kTileSize = 32 };
+
+	struct Tile
+	{
+		int x;
+		int y;
+		int width;
+		int height;
+
+		// origin and stride of the padded accumulation buffer in image space
+		int bufferX;
+		int bufferY;
+		int bufferWidth;
+		int bufferHeight;
+
+		Color* buffer;
+
+		// samples per-pixel taken since Init(), and whether adaptive sampling stopped the tile
+		int samples;
+		bool converged;
+
+		// rays traced by the tile since Init()
+		RayStats stats;
+
+		// traversal totals of the tile's last frame in eComplexity mode
+		ComplexityStats complexity;
+	};
+
+	std::vector<Tile> tiles;
+	std::vector<Color> tileBuffers;
+
+	// per-pixel sum and sum of squares of the sample luminance, only
+	// written by the tile owning the pixel so workers never share them
+	std::vector<Vec2> moments;
+
+	// per-pixel sums of the path features with the sample count in w, owned like moments
+	std::vector<Color> albedo;
+	std::vector<Color> normals;
+	std::vector<Color> depths;
+
+	int tilesX;
+	int tilesY;
+
+	// key of the current tile layout, rebuilt when the image size or filter radius changes
+	int layoutWidth;
+	int layoutHeight;
+	int layoutApron;
+
+	virtual void Init(int width, int height)
+	{
+		tiles.resize(0);
+		tileBuffers.resize(0);
+		moments.resize(0);
+
+		albedo.resize(0);
+		normals.resize(0);
+		depths.resize(0);
+	}
+
+	virtual bool GetRayStats(RayStats& stats)
+	{
+		stats = RayStats();
+
+		for (size_t i=0; i < tiles.size(); ++i)
+			stats += tiles[i].stats;
+
+		return true;
+	}
 
-	void AddSample(Color* output, int width, int height, float rasterX, float rasterY, float clamp, const Filter& filter, const Vec3& sample)
+	virtual bool GetComplexity(ComplexityStats& stats)
 	{
-		switch (filter.type)		
+		stats = ComplexityStats();
+
+		for (size_t i=0; i < tiles.size(); ++i)
+			stats += tiles[i].complexity;
+
+		return true;
+	}
+
+	virtual bool GetFeatures(Color* albedoOut, Color* normalOut, Color* depthOut)
+	{
+		if (albedo.empty())
+			return false;
+
+		for (size_t i=0; i < albedo.size(); ++i)
 		{
-			case eFilterBox:
-			{		
-				int startX = Max(0, int(rasterX - filter.width));
-				int startY = Max(0, int(rasterY - filter.width));
-				int endX = Min(int(rasterX + filter.width), width-1);
-				int endY = Min(int(rasterY + filter.width), height-1);
+			const float scale = albedo[i].w > 0.0f ? 1.0f/albedo[i].w : 0.0f;
 
-				Vec3 c =  ClampLength(sample, clamp);
+			albedoOut[i] = albedo[i]*scale;
+			normalOut[i] = normals[i]*scale;
+			depthOut[i] = depths[i]*scale;
+		}
 
-				for (int x=startX; x <= endX; ++x)
-				{
-					for (int y=startY; y <= endY; ++y)
-					{
-						output[y*width+x] += Color(c, 1.0f);
-					}
-				}
+		return true;
+	}
 
-				break;
+	// tiles are merged into the caller's output so it already holds the restored samples
+	virtual bool Resume(const Color* accum) { return true; }
+
+	virtual bool Converged() const
+	{
+		for (size_t i=0; i < tiles.size(); ++i)
+		{
+			if (!tiles[i].converged)
+				return false;
+		}
+
+		return tiles.size() > 0;
+	}
+
+	void BuildTiles(int width, int height, int apron)
+	{
+		if (tiles.size() && layoutWidth == width && layoutHeight == height && layoutApron == apron)
+			return;
+
+		tilesX = (width + kTileSize - 1)/kTileSize;
+		tilesY = (height + kTileSize - 1)/kTileSize;
+
+		tiles.resize(tilesX*tilesY);
+
+		size_t bufferSize = 0;
+
+		for (int y=0; y < tilesY; ++y)
+		{
+			for (int x=0; x < tilesX; ++x)
+			{
+				Tile& tile = tiles[y*tilesX + x];
+
+				tile.x = x*kTileSize;
+				tile.y = y*kTileSize;
+				tile.width = Min(int(kTileSize), width-tile.x);
+				tile.height = Min(int(kTileSize), height-tile.y);
+
+				tile.bufferX = Max(0, tile.x-apron);
+				tile.bufferY = Max(0, tile.y-apron);
+				tile.bufferWidth = Min(width, tile.x+tile.width+apron) - tile.bufferX;
+				tile.bufferHeight = Min(height, tile.y+tile.height+apron) - tile.bufferY;
+
+				bufferSize += tile.bufferWidth*tile.bufferHeight;
+
+				tile.samples = 0;
+				tile.converged = false;
+				tile.stats = RayStats();
 			}
-			case eFilterGaussian:
+		}
+
+		tileBuffers.resize(bufferSize);
+
+		moments.assign(width*height, Vec2(0.0f, 0.0f));
+
+		Color* buffer = &tileBuffers[0];
+
+		for (size_t i=0; i < tiles.size(); ++i)
+		{
+			tiles[i].buffer = buffer;
+			buffer += tiles[i].bufferWidth*tiles[i].bufferHeight;
+		}
+
+		layoutWidth = width;
+		layoutHeight = height;
+		layoutApron = apron;
+	}
+
+	void AddSample(const Tile& tile, float rasterX, float rasterY, float clamp, const Filter& filter, const Vec3& sample)
+	{
+		// footprint is clipped to the tile's buffer, which covers the filter
+		// radius around the tile except where it meets the image border
+		int startX = Max(tile.bufferX, int(rasterX - filter.width));
+		int startY = Max(tile.bufferY, int(rasterY - filter.width));
+		int endX = Min(int(rasterX + filter.width), tile.bufferX+tile.bufferWidth-1);
+		int endY = Min(int(rasterY + filter.width), tile.bufferY+tile.bufferHeight-1);
+
+		Vec3 c =  ClampLength(sample, clamp);
+
+		// the filter is separable so each axis is only looked up once per sample
+		float weightsX[kMaxFilterFootprint];
+		float weightsY[kMaxFilterFootprint];
+
+		const int countX = Min(endX-startX+1, kMaxFilterFootprint);
+		const int countY = Min(endY-startY+1, kMaxFilterFootprint);
+
+		filter.Weights(rasterX, startX, countX, weightsX);
+		filter.Weights(rasterY, startY, countY, weightsY);
+
+		for (int y=0; y < countY; ++y)
+		{
+			Color* row = tile.buffer + (startY+y-tile.bufferY)*tile.bufferWidth + startX-tile.bufferX;
+
+			for (int x=0; x < countX; ++x)
 			{
-				int startX = Max(0, int(rasterX - filter.width));
-				int startY = Max(0, int(rasterY - filter.width));
-				int endX = Min(int(rasterX + filter.width), width-1);
-				int endY = Min(int(rasterY + filter.width), height-1);
+				const float w = weightsX[x]*weightsY[y];
 
-				Vec3 c =  ClampLength(sample, clamp);
+				row[x] += Color(c*w, w);
+			}
+		}
+	}
+
+	// accumulates a path traced sample of pixel (i, j) taken at raster position (x, y)
+	void AddPathSample(Tile& tile, int i, int j, float x, float y, Vec3 sample, const PathFeatures& features, const Options& options, bool adaptive)
+	{
+		Validate(sample);
+
+		AddSample(tile, x, y, options.clamp, options.filter, sample);
+
+		if (options.features)
+		{
+			const int p = j*options.width + i;
+
+			albedo[p] += Color(features.albedo, 1.0f);
+			normals[p] += Color(features.normal, 1.0f);
+			depths[p] += Color(Vec3(features.depth), 1.0f);
+		}
+
+		if (adaptive)
+		{
+			const float l = Luminance(Color(sample, 0.0f));
 
-				for (int x=startX; x <= endX; ++x)
+			Vec2& m = moments[j*options.width + i];
+			m.x += l;
+			m.y += l*l;
+		}
+	}
+
+	// traces the tile pixel by pixel
+	void RenderPixels(Tile& tile, const Camera& camera, CameraSampler& sampler, Sampler& rand, const Options& options, bool adaptive, Color* output)
+	{
+		for (int j=tile.y; j < tile.y+tile.height; ++j)
+		{
+			for (int i=tile.x; i < tile.x+tile.width; ++i)
+			{
+				Vec3 origin;
+				Vec3 dir;
+
+				// generate a ray         
+				switch (options.mode)
 				{
-					for (int y=startY; y <= endY; ++y)
+					case ePathTrace:
+					{							
+						float x, y, t;
+
+						// each frame takes one sample per pixel of the tile
+						rand.Start(j*options.width + i, options.sampleOffset + tile.samples);
+
+						Sample2D(rand, x, y);
+						Sample1D(rand, t);
+
+						float time = Lerp(camera.shutterStart, camera.shutterEnd, t);
+						
+						x += i;
+						y += j;
+
+						sampler.GenerateRay(x, y, origin, dir);
+
+						PathFeatures features;
+
+						Vec3 sample = PathTrace(*scene, origin, dir, time, options.maxDepth, options.rouletteDepth, rand, tile.stats, options.features ? &features : NULL);
+
+						AddPathSample(tile, i, j, x, y, sample, features, options, adaptive);
+
+						break;
+					}
+					case eNormals:
 					{
-						float w = filter.Eval(x-rasterX, y-rasterY);
+						const float x = i;// + 0.5f;
+						const float y = j;// + 0.5f;
+
+						sampler.GenerateRay(x, y, origin, dir);
+
+						const Primitive* p;
+						float t;
+						Vec3 n;
 
-						output[y*width+x] += Color(c*w, w);
+						tile.stats.primary++;
+
+						if (Trace(*scene, Ray(origin, dir, 1.0f), t, n, &p))
+						{
+							n = n*0.5f+0.5f;
+							output[j*options.width+i] = Color(n.x, n.y, n.z, 1.0f);
+						}
+						else
+						{
+							output[j*options.width+i] = Color(0.0f);
+						}
+						break;
 					}
+					case eComplexity:
+					{
+						sampler.GenerateRay(i, j, origin, dir);
+
+						const Primitive* p;
+						float t;
+						Vec3 n;
+
+						tile.stats.primary++;
+
+						TraversalStats stats;
+						Trace(*scene, Ray(origin, dir, 1.0f), t, n, &p, stats);
+
+						output[j*options.width+i] = ComplexityColor(stats);
+
+						tile.complexity.Add(stats);
+						break;
+					}		
 				}
-				break;
 			}
-		};
+		}
 	}
 
-	void Render(const Camera& camera, const Options& options, Color* output)
-	{
-		// create a sampler for the camera
-		CameraSampler sampler(
-			Transform(camera.position, camera.rotation),
-			camera.fov, 
-			0.001f,
-			1.0f,
-			options.width,
-			options.height);
+#if USE_RAY_PACKETS
 
-		Random decorrelation;
+	// traces the camera rays of the tile in packets of kPacketWidth^2 pixels before their paths
+	// continue one at a time, samples are splatted in scanline order afterwards and each pixel
+	// restarts its own copy of the sampler so the image matches RenderPixels()
+	void RenderPackets(Tile& tile, const Camera& camera, CameraSampler& sampler, const Sampler& rand, const Options& options, bool adaptive, Color* output)
+	{
+		Vec3 samples[kTileSize*kTileSize];
+		Vec2 positions[kTileSize*kTileSize];
+		PathFeatures features[kTileSize*kTileSize];
 
-		//for (int k=0; k < options.numSamples; ++k)
+		for (int by=tile.y; by < tile.y+tile.height; by += kPacketWidth)
 		{
-			for (int j=0; j < options.height; ++j)
+			for (int bx=tile.x; bx < tile.x+tile.width; bx += kPacketWidth)
 			{
-				for (int i=0; i < options.width; ++i)
-				{
-					Vec3 origin;
-					Vec3 dir;
+				const int packetWidth = Min(kPacketWidth, tile.x+tile.width-bx);
+				const int packetHeight = Min(kPacketWidth, tile.y+tile.height-by);
+
+				RayPacket packet;
+				Sampler rands[kPacketSize];
+				float times[kPacketSize];
 
-					// generate a ray         
-					switch (options.mode)
+				for (int y=0; y < packetHeight; ++y)
+				{
+					for (int x=0; x < packetWidth; ++x)
 					{
-						case ePathTrace:
-						{							
-							float x, y, t;
+						const int r = y*kPacketWidth + x;
+						const int i = bx+x;
+						const int j = by+y;
 
-							Sample2D(rand, x, y);
-							Sample1D(rand, t);
+						const int p = (j-tile.y)*kTileSize + i-tile.x;
 
-							float time = Lerp(camera.shutterStart, camera.shutterEnd, t);
-							
-							x += i;
-							y += j;
+						Vec3 origin;
+						Vec3 dir;
 
-							sampler.GenerateRay(x, y, origin, dir);
+						if (options.mode == ePathTrace)
+						{
+							float sx, sy, st;
 
-							Vec3 sample = PathTrace(*scene, origin, dir, time, options.maxDepth, rand);
+							rands[r] = rand;
+							rands[r].Start(j*options.width + i, options.sampleOffset + tile.samples);
 
-							Validate(sample);
+							Sample2D(rands[r], sx, sy);
+							Sample1D(rands[r], st);
 
-							AddSample(output, options.width, options.height, x, y, options.clamp, options.filter, sample);
+							times[r] = Lerp(camera.shutterStart, camera.shutterEnd, st);
 
-							break;
+							positions[p] = Vec2(sx + i, sy + j);
 						}
-						case eNormals:
+						else
 						{
-							const float x = i;// + 0.5f;
-							const float y = j;// + 0.5f;
+							positions[p] = Vec2(float(i), float(j));
+						}
+
+						sampler.GenerateRay(positions[p].x, positions[p].y, origin, dir);
+
+						// camera rays share their origin
+						if (r == 0)
+							packet.Reset(origin);
+
+						packet.SetRay(r, dir, REAL_MAX);
+					}
+				}
 
-							sampler.GenerateRay(x, y, origin, dir);
+				packet.Finish();
 
-							const Primitive* p;
-							float t;
-							Vec3 n;
+				PrimaryHit hits[kPacketSize];
+				TracePacket(*scene, packet, hits);
 
-							if (Trace(*scene, Ray(origin, dir, 1.0f), t, n, &p))
+				for (int y=0; y < packetHeight; ++y)
+				{
+					for (int x=0; x < packetWidth; ++x)
+					{
+						const int r = y*kPacketWidth + x;
+						const int i = bx+x;
+						const int j = by+y;
+
+						const int p = (j-tile.y)*kTileSize + i-tile.x;
+
+						if (options.mode == ePathTrace)
+						{
+							samples[p] = PathTrace(*scene, packet.origin, packet.GetDir(r), times[r], options.maxDepth, options.rouletteDepth, rands[r], tile.stats, options.features ? &features[p] : NULL, &hits[r]);
+						}
+						else
+						{
+							tile.stats.primary++;
+
+							if (hits[r].primitive)
 							{
-								n = n*0.5f+0.5f;
+								const Vec3 n = hits[r].normal*0.5f+0.5f;
 								output[j*options.width+i] = Color(n.x, n.y, n.z, 1.0f);
 							}
 							else
 							{
 								output[j*options.width+i] = Color(0.0f);
 							}
-							break;
 						}
-						case eComplexity:
-						{
-							break;
-						}		
 					}
 				}
 			}
 		}
+
+		if (options.mode != ePathTrace)
+			return;
+
+		for (int j=tile.y; j < tile.y+tile.height; ++j)
+		{
+			for (int i=tile.x; i < tile.x+tile.width; ++i)
+			{
+				const int p = (j-tile.y)*kTileSize + i-tile.x;
+
+				AddPathSample(tile, i, j, positions[p].x, positions[p].y, samples[p], features[p], options, adaptive);
+			}
+		}
+	}
+
+#endif // USE_RAY_PACKETS
+
+	void RenderTile(Tile& tile, int tileIndex, const Camera& camera, CameraSampler sampler, const Options& options, Color* output)
+	{
+		const bool adaptive = options.adaptiveThreshold > 0.0f && options.mode == ePathTrace;
+
+		if (adaptive && tile.converged)
+			return;
+
+		// each tile owns an independent stream so the result does not depend on scheduling
+		Sampler rand(options.sampler, (options.sampleOffset + frame)*int(tiles.size()) + tileIndex + 1);
+
+#if USE_RAY_PACKETS
+		// camera rays are traced in packets when nothing moves, paths need a sampler that can be
+		// restarted at any pixel as a packet's camera samples are all drawn before its paths
+		if (scene->numMotionSegments == 1 && (options.mode == eNormals || (options.mode == ePathTrace && options.sampler == eSamplerSobol)))
+			RenderPackets(tile, camera, sampler, rand, options, adaptive, output);
+		else
+#endif
+			RenderPixels(tile, camera, sampler, rand, options, adaptive, output);
+
+		tile.samples++;
+
+		if (adaptive && tile.samples >= Max(2, options.adaptiveMinSamples))
+		{
+			float error = 0.0f;
+
+			for (int j=tile.y; j < tile.y+tile.height; ++j)
+			{
+				for (int i=tile.x; i < tile.x+tile.width; ++i)
+				{
+					const Vec2 m = moments[j*options.width + i];
+					error += PixelError(m.x, m.y, tile.samples);
+				}
+			}
+
+			tile.converged = error < options.adaptiveThreshold*tile.width*tile.height;
+		}
+	}
+
+	void MergeTile(const Tile& tile, int width, Color* output)
+	{
+		for (int y=0; y < tile.bufferHeight; ++y)
+		{
+			Color* src = tile.buffer + y*tile.bufferWidth;
+			Color* dst = output + (tile.bufferY+y)*width + tile.bufferX;
+
+			for (int x=0; x < tile.bufferWidth; ++x)
+			{
+				dst[x] += src[x];
+				src[x] = Color(0.0f);
+			}
+		}
+	}
+
+	void Render(const Camera& camera, const Options& options, Color* output)
+	{
+		// create a sampler for the camera
+		CameraSampler sampler(
+			Transform(camera.position, camera.rotation),
+			camera.fov, 
+			0.001f,
+			1.0f,
+			options.width,
+			options.height);
+
+		// padding must cover the largest footprint a sample inside the tile can splat to,
+		// limited to half a tile so that tiles two apart never overlap
+		const int apron = Min(int(kTileSize)/2, int(ceilf(options.filter.width)) + 1);
+
+		BuildTiles(options.width, options.height, apron);
+
+		if (options.features && options.mode == ePathTrace && albedo.size() != size_t(options.width)*options.height)
+		{
+			albedo.assign(options.width*options.height, Color(0.0f));
+			normals.assign(options.width*options.height, Color(0.0f));
+			depths.assign(options.width*options.height, Color(0.0f));
+		}
+
+		if (options.mode == eComplexity)
+		{
+			for (size_t i=0; i < tiles.size(); ++i)
+				tiles[i].complexity = ComplexityStats();
+		}
+
+		ParallelFor(int(tiles.size()), [&](int index, int worker)
+		{
+			RenderTile(tiles[index], index, camera, sampler, options, output);
+		});
+
+		if (options.mode == ePathTrace)
+		{
+			// tiles only overlap their direct neighbours, so merging in four passes
+			// over a 2x2 checkerboard never has two workers write the same pixel
+			for (int pass=0; pass < 4; ++pass)
+			{
+				const int offsetX = pass&1;
+				const int offsetY = pass>>1;
+
+				const int countX = (tilesX - offsetX + 1)/2;
+				const int countY = (tilesY - offsetY + 1)/2;
+
+				ParallelFor(countX*countY, [&](int index, int worker)
+				{
+					const int x = offsetX + (index%countX)*2;
+					const int y = offsetY + (index/countX)*2;
+
+					MergeTile(tiles[y*tilesX + x], options.width, output);
+				});
+			}
+		}
+
+		frame++;
 	}
 };
 
@@ -3,8 +3,12 @@
 #include "util.h"
 #include "disney.h"
 #include "bvh.h"
+#include "nlm.h"
 
 #include <map>
+#include <set>
+#include <thread>
+#include <atomic>
 
 
 #define kBsdfSamples 1.0f
@@ -13,20 +17,56 @@
 
 #define USE_LIGHT_SAMPLING 1
 
+// escaped rays of rough bounces read the probe's prefiltered levels
+#define USE_PROBE_MIPS 1
+
+// keep one grid of blocks resident for the whole frame and have warps fetch
+// (pixel, sample) work from a global counter until all samples are taken
+#define USE_PERSISTENT_THREADS 1
+
+// render on a stream and read the framebuffer back into double-buffered pinned memory,
+// the host receives the previous frame so it never waits on the kernel in flight
+#define USE_ASYNC_READBACK 1
+
+// adaptive sampling works on square tiles of pixels, each tile is reduced by one block
+#define kAdaptiveTileSize 16
+
 namespace
 {
 	
+// device copy of a primitive, traversal only touches the geometry so the
+// material lives in a separate table that is read once a hit is shaded, like
+// the scene's primitives these refer to meshes in a table shared by all instances
+struct GPUPrimitive : public PrimitiveGeometry
+{
+	int material;
+	int lightSamples;
+
+	// probability the light is picked by SampleLights(), zero for non-emitters
+	float lightSelectPdf;
+};
+
 struct GPUScene
 {
-	Primitive* primitives;
+	GPUPrimitive* primitives;
 	int numPrimitives;
 
-	Primitive* lights;
+	GPUPrimitive* lights;
+	AliasEntry* lightTable;
 	int numLights;
 
+	Material* materials;
+	int numMaterials;
+
+	// one entry per mesh referenced, the primitives point into this
+	MeshGeometry* meshes;
+	int numMeshes;
+
 	Sky sky;
 
-	BVH bvh;
+	// trees split over the shutter, see Scene
+	BVH bvh[kMotionSegments];
+	int numMotionSegments;
 };
 
 // create a texture object from memory and store it in a 64-bit pointer
@@ -147,6 +187,40 @@ void DestroyTexture(const void* texture)
 
 }
 
+// plain device copy of an array, NULL if it is empty
+template <typename T>
+const T* CreateDeviceArray(const T* hostBuffer, int count)
+{
+	if (!hostBuffer || count == 0)
+		return NULL;
+
+	T* buffer;
+	cudaMalloc(&buffer, sizeof(T)*count);
+	cudaMemcpy(buffer, hostBuffer, sizeof(T)*count, cudaMemcpyHostToDevice);
+
+	return buffer;
+}
+
+// links for stackless traversal are derived from the nodes on upload
+BVHLink* CreateGPULinks(const BVHNode* nodes, int numNodes)
+{
+#if USE_STACKLESS_BVH
+
+	if (numNodes == 0)
+		return NULL;
+
+	std::vector<BVHLink> links(numNodes);
+	BuildBVHLinks(nodes, numNodes, &links[0]);
+
+	BVHLink* gpuLinks;
+	CreateIntTexture((int**)&gpuLinks, (int*)&links[0], sizeof(BVHLink)*numNodes);
+
+	return gpuLinks;
+#else
+	return NULL;
+#endif
+}
+
 MeshGeometry CreateGPUMesh(const MeshGeometry& hostMesh)
 {
 	const int numVertices = hostMesh.numVertices;
@@ -156,37 +230,68 @@ MeshGeometry CreateGPUMesh(const MeshGeometry& hostMesh)
 	
 	MeshGeometry gpuMesh;
 
-#if USE_TEXTURES
-	
-	// expand positions out to vec4
-	std::vector<Vec4> positions;
-	std::vector<Vec4> normals;
+	// compressed meshes upload their compressed attributes only
+	gpuMesh.compressed = hostMesh.compressed;
 
-	for (int i=0; i < numVertices; ++i)
+	if (hostMesh.compressed.positions)
 	{
-		positions.push_back(Vec4(hostMesh.positions[i], 1.0f));
-		normals.push_back(Vec4(hostMesh.normals[i], 0.0f));
+		const CompressedVertices& c = hostMesh.compressed;
+
+		gpuMesh.compressed.positions = CreateDeviceArray(c.positions, numVertices);
+		gpuMesh.compressed.normals = CreateDeviceArray(c.normals, numVertices);
+		gpuMesh.compressed.indices = CreateDeviceArray(c.indices, numIndices);
+		gpuMesh.compressed.clusterBases = CreateDeviceArray(c.clusterBases, c.numClusters);
+		gpuMesh.compressed.wideIndices = CreateDeviceArray(c.wideIndices, c.numWideIndices);
+
+		gpuMesh.positions = NULL;
+		gpuMesh.normals = NULL;
+		gpuMesh.indices = NULL;
 	}
+	else
+	{
+#if USE_TEXTURES
+	
+		// expand positions out to vec4
+		std::vector<Vec4> positions;
+		std::vector<Vec4> normals;
 
-	CreateVec4Texture((Vec4**)&gpuMesh.positions, (Vec4*)&positions[0], sizeof(Vec4)*numVertices);
-	CreateVec4Texture((Vec4**)&gpuMesh.normals, (Vec4*)&normals[0], sizeof(Vec4)*numVertices);
+		for (int i=0; i < numVertices; ++i)
+		{
+			positions.push_back(Vec4(hostMesh.positions[i], 1.0f));
+			normals.push_back(Vec4(hostMesh.normals[i], 0.0f));
+		}
+
+		CreateVec4Texture((Vec4**)&gpuMesh.positions, (Vec4*)&positions[0], sizeof(Vec4)*numVertices);
+		CreateVec4Texture((Vec4**)&gpuMesh.normals, (Vec4*)&normals[0], sizeof(Vec4)*numVertices);
 
 #else
-	CreateFloatTexture((float**)&gpuMesh.positions, (float*)&hostMesh.positions[0], sizeof(Vec3)*numVertices);
-	CreateFloatTexture((float**)&gpuMesh.normals, (float*)&hostMesh.normals[0], sizeof(Vec3)*numVertices);
+		CreateFloatTexture((float**)&gpuMesh.positions, (float*)&hostMesh.positions[0], sizeof(Vec3)*numVertices);
+		CreateFloatTexture((float**)&gpuMesh.normals, (float*)&hostMesh.normals[0], sizeof(Vec3)*numVertices);
 
 #endif
 
-	CreateIntTexture((int**)&gpuMesh.indices, (int*)&hostMesh.indices[0], sizeof(int)*numIndices);
+		CreateIntTexture((int**)&gpuMesh.indices, (int*)&hostMesh.indices[0], sizeof(int)*numIndices);
+	}
+
 	CreateVec4Texture((Vec4**)&gpuMesh.nodes, (Vec4*)&hostMesh.nodes[0], sizeof(BVHNode)*numNodes);
+
+	gpuMesh.links = CreateGPULinks(hostMesh.nodes, numNodes);
 	
-	cudaMalloc((float**)&gpuMesh.cdf, sizeof(float)*numIndices/3);
-	cudaMemcpy((float*)gpuMesh.cdf, &hostMesh.cdf[0], sizeof(float)*numIndices/3, cudaMemcpyHostToDevice);
+	cudaMalloc((AliasEntry**)&gpuMesh.triangleTable, sizeof(AliasEntry)*numIndices/3);
+	cudaMemcpy((AliasEntry*)gpuMesh.triangleTable, &hostMesh.triangleTable[0], sizeof(AliasEntry)*numIndices/3, cudaMemcpyHostToDevice);
 	
 	gpuMesh.numIndices = numIndices;
 	gpuMesh.numVertices = numVertices;
 	gpuMesh.numNodes = numNodes;
+
+	// wide trees are only traversed on the CPU
+	gpuMesh.wideNodes = NULL;
+	gpuMesh.packets = NULL;
+	gpuMesh.numWideNodes = 0;
+	gpuMesh.numPackets = 0;
 	gpuMesh.area = hostMesh.area;
+	gpuMesh.id = hostMesh.id;
+	gpuMesh.generation = hostMesh.generation;
 
 	return gpuMesh;
 
@@ -198,8 +303,17 @@ void DestroyGPUMesh(const MeshGeometry& gpuMesh)
 	DestroyTexture(gpuMesh.normals);
 	DestroyTexture(gpuMesh.indices);
 	DestroyTexture(gpuMesh.nodes);
+
+	if (gpuMesh.links)
+		DestroyTexture(gpuMesh.links);
+
+	cudaFree((void*)gpuMesh.compressed.positions);
+	cudaFree((void*)gpuMesh.compressed.normals);
+	cudaFree((void*)gpuMesh.compressed.indices);
+	cudaFree((void*)gpuMesh.compressed.clusterBases);
+	cudaFree((void*)gpuMesh.compressed.wideIndices);
 	
-	cudaFree((void*)gpuMesh.cdf);
+	cudaFree((void*)gpuMesh.triangleTable);
 }
 
 Texture CreateGPUTexture(const Texture& tex)
@@ -208,8 +322,8 @@ Texture CreateGPUTexture(const Texture& tex)
 	
 	Texture gpuTex = tex;
 
-	cudaMalloc((void**)&gpuTex.data, sizeof(float)*numTexels);
-	cudaMemcpy(gpuTex.data, tex.data, sizeof(float)*numTexels, cudaMemcpyHostToDevice);
+	cudaMalloc((void**)&gpuTex.data, sizeof(*tex.data)*numTexels);
+	cudaMemcpy(gpuTex.data, tex.data, sizeof(*tex.data)*numTexels, cudaMemcpyHostToDevice);
 
 	return gpuTex;
 }
@@ -226,12 +340,13 @@ Sky CreateGPUSky(const Sky& sky)
 		// copy pixel data
 		CreateVec4Texture((Vec4**)&gpuSky.probe.data, sky.probe.data, numPixels*sizeof(float)*4);
 
-		// copy cdf tables
-		CreateFloatTexture((float**)&gpuSky.probe.cdfValuesX, sky.probe.cdfValuesX, numPixels*sizeof(float));
-		CreateFloatTexture((float**)&gpuSky.probe.pdfValuesX, sky.probe.pdfValuesX, numPixels*sizeof(float));
+		// copy sampling table
+		cudaMalloc((AliasEntry**)&gpuSky.probe.table, numPixels*sizeof(AliasEntry));
+		cudaMemcpy(gpuSky.probe.table, sky.probe.table, numPixels*sizeof(AliasEntry), cudaMemcpyHostToDevice);
 
-		CreateFloatTexture((float**)&gpuSky.probe.cdfValuesY, sky.probe.cdfValuesY, sky.probe.height*sizeof(float));
-		CreateFloatTexture((float**)&gpuSky.probe.pdfValuesY, sky.probe.pdfValuesY, sky.probe.height*sizeof(float));
+		// copy prefiltered levels
+		if (sky.probe.mips)
+			CreateVec4Texture((Vec4**)&gpuSky.probe.mips, sky.probe.mips, sky.probe.mipOffsets[sky.probe.numLevels]*sizeof(float)*4);
 	}
 
 	return gpuSky;
@@ -241,16 +356,23 @@ void DestroyGPUSky(const Sky& gpuSky)
 {
 	if (gpuSky.probe.valid)
 	{
-		// todo
+		DestroyTexture(gpuSky.probe.data);
+
+		if (gpuSky.probe.mips)
+			DestroyTexture(gpuSky.probe.mips);
+
+		cudaFree(gpuSky.probe.table);
 	}
 }
 
 } // anonymous
 
-#if 1
+#if !USE_STACKLESS_BVH
 
-// a combined intersection routine that shares the traversal stack for the scene BVH and triangle mesh BVH
-inline __device__ bool Trace(const GPUScene& scene, const Vec3& rayOrigin, const Vec3& rayDir, float rayTime, float& outT, Vec3& outNormal, int& outPrimitive)
+// a combined intersection routine that shares the traversal stack for the scene BVH and triangle mesh BVH,
+// the work done is counted into stats
+template <typename Stats>
+inline __device__ bool Trace(const GPUScene& scene, const Vec3& rayOrigin, const Vec3& rayDir, float rayTime, float& outT, Vec3& outNormal, int& outPrimitive, Stats& stats)
 {
 	int stack[32];
 	stack[0] = 0;
@@ -266,9 +388,11 @@ inline __device__ bool Trace(const GPUScene& scene, const Vec3& rayOrigin, const
 	origin = rayOrigin;
 	dir = rayDir;
 
-	const BVHNode* RESTRICT root = scene.bvh.nodes;
+	// scene tree covering the part of the shutter the ray is in
+	const BVHNode* RESTRICT sceneRoot = scene.bvh[MotionSegment(rayTime, scene.numMotionSegments)].nodes;
+	const BVHNode* RESTRICT root = sceneRoot;
 
-	MeshGeometry mesh;
+	const MeshGeometry* mesh = NULL;
 	int primitiveIndex = -1;
 
 	float closestT = FLT_MAX;
@@ -292,7 +416,7 @@ inline __device__ bool Trace(const GPUScene& scene, const Vec3& rayOrigin, const
 			rcpDir.z = 1.0f/rayDir.z;
 			origin = rayOrigin;
 			dir = rayDir;
-			root = scene.bvh.nodes;
+			root = sceneRoot;
 			primitiveIndex = -1;
 
 			continue;
@@ -300,6 +424,8 @@ inline __device__ bool Trace(const GPUScene& scene, const Vec3& rayOrigin, const
 
 		BVHNode node = fetchNode(root, nodeIndex);
 
+		stats.VisitNode();
+
 		int leftIndex = node.leftIndex;
 		int rightIndex = node.rightIndex;
 
@@ -307,9 +433,9 @@ inline __device__ bool Trace(const GPUScene& scene, const Vec3& rayOrigin, const
 		{
 			if (primitiveIndex < 0)
 			{
-				const Primitive& p = scene.primitives[leftIndex];
+				const GPUPrimitive& p = scene.primitives[leftIndex];
 
-				Transform transform = InterpolateTransform(p.startTransform, p.endTransform, rayTime);
+				const Transform transform = PrimitiveTransform(p, rayTime);
 
 				switch (p.type)
 				{
@@ -351,15 +477,14 @@ inline __device__ bool Trace(const GPUScene& scene, const Vec3& rayOrigin, const
 						stack[count++] = 0;
 
 						// transform ray to primitive local space
-						origin = InverseTransformPoint(transform, rayOrigin);					
-						dir = InverseTransformVector(transform, rayDir);
+						PrimitiveLocalRay(p, transform, rayOrigin, rayDir, origin, dir);
 
 						rcpDir.x = 1.0f/dir.x;
 						rcpDir.y = 1.0f/dir.y;
 						rcpDir.z = 1.0f/dir.z;				
 				
 						// set bvh and mesh sources
-						root = p.mesh.nodes;
+						root = p.mesh->nodes;
 						mesh = p.mesh;
 
 						primitiveIndex = leftIndex;
@@ -370,13 +495,14 @@ inline __device__ bool Trace(const GPUScene& scene, const Vec3& rayOrigin, const
 			else
 			{
 				// mesh mode
-				int i0 = fetchInt(mesh.indices, leftIndex*3+0);
-				int i1 = fetchInt(mesh.indices, leftIndex*3+1);
-				int i2 = fetchInt(mesh.indices, leftIndex*3+2);
+				stats.TestTriangles(1);
+
+				int i0, i1, i2;
+				MeshTriangle(*mesh, leftIndex, i0, i1, i2);
 
-				const Vec3 a = fetchVec3(mesh.positions, i0);
-				const Vec3 b = fetchVec3(mesh.positions, i1);
-				const Vec3 c = fetchVec3(mesh.positions, i2);
+				const Vec3 a = MeshPosition(*mesh, i0);
+				const Vec3 b = MeshPosition(*mesh, i1);
+				const Vec3 c = MeshPosition(*mesh, i2);
 
 				float t, u, v, w;
 				float sign;
@@ -400,6 +526,8 @@ inline __device__ bool Trace(const GPUScene& scene, const Vec3& rayOrigin, const
 		}
 		else
 		{
+			stats.TestBoxes(2);
+
 			// check children
 			BVHNode left = fetchNode(root, leftIndex);
 			BVHNode right = fetchNode(root, rightIndex);
@@ -427,20 +555,19 @@ inline __device__ bool Trace(const GPUScene& scene, const Vec3& rayOrigin, const
 	
 	if (closestPrimitive >= 0)
 	{
-		const Primitive& p = scene.primitives[closestPrimitive];
+		const GPUPrimitive& p = scene.primitives[closestPrimitive];
 
 		if (p.type == eMesh)
 		{
-			Transform transform = InterpolateTransform(p.startTransform, p.endTransform, rayTime);
+			const Transform transform = PrimitiveTransform(p, rayTime);
 
 			// interpolate vertex normals
-			int i0 = fetchInt(p.mesh.indices, closestTri*3+0);
-			int i1 = fetchInt(p.mesh.indices, closestTri*3+1);
-			int i2 = fetchInt(p.mesh.indices, closestTri*3+2);
+			int i0, i1, i2;
+			MeshTriangle(*p.mesh, closestTri, i0, i1, i2);
 
-			const Vec3 n1 = fetchVec3(p.mesh.normals, i0);
-			const Vec3 n2  = fetchVec3(p.mesh.normals, i1);
-			const Vec3 n3 = fetchVec3(p.mesh.normals, i2);
+			const Vec3 n1 = MeshNormal(*p.mesh, i0);
+			const Vec3 n2  = MeshNormal(*p.mesh, i1);
+			const Vec3 n3 = MeshNormal(*p.mesh, i2);
 
 			Vec3 smoothNormal = (1.0f-closestV-closestW)*n1 + closestV*n2 + closestW*n3;
 
@@ -464,22 +591,30 @@ inline __device__ bool Trace(const GPUScene& scene, const Vec3& rayOrigin, const
 	}
 }
 
-#else
-
-// trace a ray against the scene returning the closest intersection
 inline __device__ bool Trace(const GPUScene& scene, const Vec3& rayOrigin, const Vec3& rayDir, float rayTime, float& outT, Vec3& outNormal, int& outPrimitive)
 {
+	NullTraversalStats stats;
+	return Trace(scene, rayOrigin, rayDir, rayTime, outT, outNormal, outPrimitive, stats);
+}
+
+#else
 
+// trace a ray against the scene returning the closest intersection, the scene and mesh trees are
+// walked through their links so no traversal stack is kept, the work done is counted into stats
+template <typename Stats>
+inline __device__ bool Trace(const GPUScene& scene, const Vec3& rayOrigin, const Vec3& rayDir, float rayTime, float& outT, Vec3& outNormal, int& outPrimitive, Stats& stats)
+{
 	struct Callback
 	{
 		float minT;
 		Vec3 closestNormal;
-		const Primitive* closestPrimitive;
+		const GPUPrimitive* closestPrimitive;
 
-		const Ray& ray;
+		const Ray ray;
 		const GPUScene& scene;
+		Stats& stats;
 
-		CUDA_CALLABLE inline Callback(const GPUScene& s, const Ray& r) : minT(REAL_MAX), closestPrimitive(NULL), ray(r), scene(s)
+		CUDA_CALLABLE inline Callback(const GPUScene& s, const Ray& r, Stats& st) : minT(REAL_MAX), closestPrimitive(NULL), ray(r), scene(s), stats(st)
 		{
 
 		}
@@ -487,11 +622,11 @@ inline __device__ bool Trace(const GPUScene& scene, const Vec3& rayOrigin, const
 		CUDA_CALLABLE inline void operator()(int index)
 		{
 			float t;
-			Vec3 n, ns;
+			Vec3 n;
 
-			const Primitive& primitive = scene.primitives[index];
+			const GPUPrimitive& primitive = scene.primitives[index];
 
-			if (PrimitiveIntersect(primitive, ray, t, &n))
+			if (PrimitiveIntersect(primitive, ray, t, &n, minT, stats))
 			{
 				if (t < minT && t > 0.0f)
 				{
@@ -503,52 +638,64 @@ inline __device__ bool Trace(const GPUScene& scene, const Vec3& rayOrigin, const
 		}
 	};
 
-	Callback callback(scene, ray);
-	QueryBVH(callback, scene.bvh.nodes, ray.origin, ray.dir);
+	const BVH& bvh = scene.bvh[MotionSegment(rayTime, scene.numMotionSegments)];
 
-	outT = callback.minT;		
-	outNormal = FaceForward(callback.closestNormal, -ray.dir);
-	outPrimitive = callback.closestPrimitive-scene.primitives;
+	Callback callback(scene, Ray(rayOrigin, rayDir, rayTime), stats);
+	QueryBVHStackless(callback, bvh.nodes, bvh.links, rayOrigin, rayDir, callback.minT, stats);
 
-	return callback.closestPrimitive != NULL;
-	
-	/*
-	
-	// reference trace method, no scene BVH
+	if (callback.closestPrimitive)
+	{
+		outT = callback.minT;		
+		outNormal = FaceForward(callback.closestNormal, -rayDir);
+		outPrimitive = callback.closestPrimitive-scene.primitives;
+
+		return true;
+	}
+	else
+	{
+		// no hit
+		return false;
+	}
+}
+
+inline __device__ bool Trace(const GPUScene& scene, const Vec3& rayOrigin, const Vec3& rayDir, float rayTime, float& outT, Vec3& outNormal, int& outPrimitive)
+{
+	NullTraversalStats stats;
+	return Trace(scene, rayOrigin, rayDir, rayTime, outT, outNormal, outPrimitive, stats);
+}
+
+#endif
 
-	float minT = REAL_MAX;
-	const Primitive* closestPrimitive = NULL;
-	Vec3 closestNormal(0.0f);
 
-	for (int i=0; i < scene.numPrimitives; ++i)
+// returns true if anything is hit closer than tmax, exits on the first hit so is
+// cheaper than Trace() for shadow rays which don't need the closest intersection
+inline __device__ bool Occluded(const GPUScene& scene, const Vec3& rayOrigin, const Vec3& rayDir, float rayTime, float tmax)
+{
+	struct Callback
 	{
-		const Primitive& primitive = scene.primitives[i];
+		const GPUScene& scene;
+		const Ray ray;
+		float tmax;
 
-		float t;
-		Vec3 n;
+		CUDA_CALLABLE inline Callback(const GPUScene& s, const Ray& r, float t) : scene(s), ray(r), tmax(t) {}
 
-		if (PrimitiveIntersect(primitive, Ray(rayOrigin, rayDir, rayTime), t, &n))
+		CUDA_CALLABLE inline bool operator()(int index)
 		{
-			if (t < minT && t > 0.0f)
-			{
-				minT = t;
-				closestPrimitive = &primitive;
-				closestNormal = n;
-			}
+			return PrimitiveOcclude(scene.primitives[index], ray, tmax);
 		}
-	}
-	
-	outT = minT;		
-	outNormal = FaceForward(closestNormal, -rayDir);
-	outPrimitive = closestPrimitive-scene.primitives;;
+	};
 
-	return closestPrimitive != NULL;
+	Callback callback(scene, Ray(rayOrigin, rayDir, rayTime), tmax);
 
-	*/
+	const BVH& bvh = scene.bvh[MotionSegment(rayTime, scene.numMotionSegments)];
 
+#if USE_STACKLESS_BVH
+	return QueryBVHAnyStackless(callback, bvh.nodes, bvh.links, rayOrigin, rayDir, tmax);
+#else
+	return QueryBVHAny(callback, bvh.nodes, rayOrigin, rayDir, tmax);
+#endif
 }
 
-#endif
 
 
 __device__ inline float SampleTexture(const Texture& map, int i, int j, int k)
@@ -557,7 +704,7 @@ __device__ inline float SampleTexture(const Texture& map, int i, int j, int k)
 	int y = int(Abs(j))%map.height;
 	int z = int(Abs(k))%map.depth;
 	
-	return map.data[z*map.width*map.height + y*map.width + x];
+	return TexelValue(map, z*map.width*map.height + y*map.width + x);
 }
 
 
@@ -585,7 +732,7 @@ __device__ inline float LinearInterp(const Texture& map, const Vec3& pos)
 	return g;
 }
 
-__device__ inline Vec3 EvaluateBumpNormal(const Vec3& surfaceNormal, const Vec3& surfacePos, const Texture& bumpMap, const Vec3& bumpTile, float bumpStrength, Random& rand)
+__device__ inline Vec3 EvaluateBumpNormal(const Vec3& surfaceNormal, const Vec3& surfacePos, const Texture& bumpMap, const Vec3& bumpTile, float bumpStrength, Sampler& rand)
 {
 	Vec3 u, v;
 	BasisFromVector(surfaceNormal, &u, &v);
@@ -600,7 +747,7 @@ __device__ inline Vec3 EvaluateBumpNormal(const Vec3& surfaceNormal, const Vec3&
 
 
 
-__device__ inline Vec3 SampleLights(const GPUScene& scene, const Primitive& surfacePrimitive, float etaI, float etaO, const Vec3& surfacePos, const Vec3& surfaceNormal, const Vec3& shadingNormal, const Vec3& wo, float time, Random& rand)
+__device__ inline Vec3 SampleLights(const GPUScene& scene, const Material& surfaceMaterial, float etaI, float etaO, const Vec3& surfacePos, const Vec3& surfaceNormal, const Vec3& shadingNormal, const Vec3& wo, float time, Sampler& rand, RayStats& stats)
 {	
 	Vec3 sum(0.0f);
 
@@ -616,13 +763,12 @@ __device__ inline Vec3 SampleLights(const GPUScene& scene, const Primitive& surf
 			ProbeSample(scene.sky.probe, wi, skyColor, skyPdf, rand);
 
 			// check if occluded
-			float t;
-			Vec3 n;
-			int hit;
-			if (Trace(scene, surfacePos + FaceForward(surfaceNormal, wi)*kRayEpsilon, wi, time, t, n, hit) == false)
+			stats.shadow++;
+
+			if (!Occluded(scene, surfacePos + FaceForward(surfaceNormal, wi)*kRayEpsilon, wi, time, FLT_MAX))
 			{
-				float bsdfPdf = BSDFPdf(surfacePrimitive.material, etaI, etaO, surfacePos, surfaceNormal, wo, wi);
-				Vec3 f = BSDFEval(surfacePrimitive.material, etaI, etaO, surfacePos, surfaceNormal, wo, wi);
+				float bsdfPdf;
+				Vec3 f = BSDFEvalPdf(surfaceMaterial, etaI, etaO, surfacePos, surfaceNormal, wo, wi, bsdfPdf);
 				
 				if (bsdfPdf > 0.0f)
 				{
@@ -643,18 +789,22 @@ __device__ inline Vec3 SampleLights(const GPUScene& scene, const Primitive& surf
 			sum /= float(kProbeSamples);
 	}
 
-	for (int i=0; i < scene.numLights; ++i)
+	if (scene.numLights > 0)
 	{
+		// pick one light in proportion to its power rather than visiting every light
+		float u;
+		Sample1D(rand, u);
+
+		const int light = SampleAlias(scene.lightTable, scene.numLights, u);
+		const float selectPdf = scene.lightTable[light].pdf;
+
 		// assume all lights are area lights for now
-		const Primitive& lightPrimitive = scene.lights[i];
+		const GPUPrimitive& lightPrimitive = scene.lights[light];
 
 		Vec3 L(0.0f);
 
 		int numSamples = lightPrimitive.lightSamples;
 
-		if (numSamples == 0)
-			continue;
-
 		for (int s=0; s < numSamples; ++s)
 		{
 			// sample light source
@@ -668,49 +818,44 @@ __device__ inline Vec3 SampleLights(const GPUScene& scene, const Primitive& surf
 			float dSq = LengthSq(wi);
 			wi /= sqrtf(dSq);
 
-			// check visibility
-			float t;
-			Vec3 n;
-			int hit;
-			if (Trace(scene, surfacePos + FaceForward(surfaceNormal, wi)*kRayEpsilon, wi, time, t, n, hit))			
-			{
-				float tSq = t*t;
+			// check visibility, nothing may be hit before the light sample less a tolerance
+			// for the light's own surface, this works for portal sampling where you have
+			// a large light that you sample through a small window
+			const float kTolerance = 1.e-2f;
 
-				// if our next hit was further than distance to light then accept
-				// sample, this works for portal sampling where you have a large light
-				// that you sample through a small window
-				const float kTolerance = 1.e-2f;
+			stats.shadow++;
 
-				if (fabsf(t - sqrtf(dSq)) <= kTolerance)
-				{				
-					const float nl = Abs(Dot(lightNormal, wi));
+			if (Occluded(scene, surfacePos + FaceForward(surfaceNormal, wi)*kRayEpsilon, wi, time, sqrtf(dSq) - kTolerance))
+				continue;
 
-					// for glancing rays, note we use abs to include cases
-					// where light surface is backfacing, e.g.: inside the weak furnace
-					if (Abs(nl) < 1.e-6f)
-						continue;					
+			const float tSq = dSq;
 
-					// light pdf with respect to area and convert to pdf with respect to solid angle
-					float lightArea = PrimitiveArea(lightPrimitive);
-					float lightPdf = ((1.0f/lightArea)*tSq)/nl;
+			const float nl = Abs(Dot(lightNormal, wi));
 
-					// bsdf pdf for light's direction
-					float bsdfPdf = BSDFPdf(surfacePrimitive.material, etaI, etaO, surfacePos, shadingNormal, wo, wi);
-					Vec3 f = BSDFEval(surfacePrimitive.material, etaI, etaO, surfacePos, shadingNormal, wo, wi);
+			// for glancing rays, note we use abs to include cases
+			// where light surface is backfacing, e.g.: inside the weak furnace
+			if (Abs(nl) < 1.e-6f)
+				continue;					
 
-					// this branch is only necessary to exclude specular paths from light sampling (always have zero brdf)
-					// todo: make BSDFEval always return zero for pure specular paths and roll specular eval into BSDFSample()
-					if (bsdfPdf > 0.0f)
-					{
-						// calculate relative weighting of the light and bsdf sampling
-						int N = lightPrimitive.lightSamples+kBsdfSamples;
-						float cbsdf = kBsdfSamples/N;
-						float clight = float(lightPrimitive.lightSamples)/N;
-						float weight = clight*lightPdf/(cbsdf*bsdfPdf + clight*lightPdf);
-						
-						L += weight*f*lightPrimitive.material.emission*(Abs(Dot(wi, shadingNormal))/Max(1.e-3f, lightPdf));
-					}
-				}
+			// light pdf with respect to area and convert to pdf with respect to solid angle
+			float lightArea = PrimitiveArea(lightPrimitive);
+			float lightPdf = ((1.0f/lightArea)*tSq)/nl;
+
+			// bsdf pdf for light's direction
+			float bsdfPdf;
+			Vec3 f = BSDFEvalPdf(surfaceMaterial, etaI, etaO, surfacePos, shadingNormal, wo, wi, bsdfPdf);
+
+			// this branch is only necessary to exclude specular paths from light sampling (always have zero brdf)
+			// todo: make BSDFEval always return zero for pure specular paths and roll specular eval into BSDFSample()
+			if (bsdfPdf > 0.0f)
+			{
+				// calculate relative weighting of the light and bsdf sampling
+				int N = lightPrimitive.lightSamples+kBsdfSamples;
+				float cbsdf = kBsdfSamples/N;
+				float clight = float(lightPrimitive.lightSamples)/N;
+				float weight = clight*selectPdf*lightPdf/(cbsdf*bsdfPdf + clight*selectPdf*lightPdf);
+
+				L += weight*f*scene.materials[lightPrimitive.material].emission*(Abs(Dot(wi, shadingNormal))/(selectPdf*Max(1.e-3f, lightPdf)));
 			}
 		}
 	
@@ -722,8 +867,15 @@ __device__ inline Vec3 SampleLights(const GPUScene& scene, const Primitive& surf
 
 
 // reference, no light sampling, uniform hemisphere sampling
-inline __device__ Vec3 PathTrace(const GPUScene& scene, const Vec3& origin, const Vec3& dir, float time, int maxDepth, Random& rand)
-{	
+inline __device__ Vec3 PathTrace(const GPUScene& scene, const Vec3& origin, const Vec3& dir, float time, int maxDepth, int rouletteDepth, Sampler& rand, RayStats& stats, PathFeatures* features)
+{
+    if (features)
+    {
+        features->albedo = 0.0f;
+        features->normal = 0.0f;
+        features->depth = 0.0f;
+    }
+	
     // path throughput
     Vec3 pathThroughput(1.0f, 1.0f, 1.0f);
     // accumulated radiance
@@ -741,6 +893,11 @@ inline __device__ Vec3 PathTrace(const GPUScene& scene, const Vec3& origin, cons
 
     for (int i=0; i < maxDepth; ++i)
     {
+        if (i == 0)
+            stats.primary++;
+        else
+            stats.secondary++;
+
         // find closest hit
 		float t;
 		Vec3 n, ns;
@@ -748,7 +905,8 @@ inline __device__ Vec3 PathTrace(const GPUScene& scene, const Vec3& origin, cons
 
         if (Trace(scene, rayOrigin, rayDir, rayTime, t, n, hit))
         {	
-			const Primitive prim = scene.primitives[hit];
+			const GPUPrimitive& prim = scene.primitives[hit];
+			const Material& material = scene.materials[prim.material];
 
 			float outEta;
 			Vec3 outAbsorption;
@@ -756,8 +914,8 @@ inline __device__ Vec3 PathTrace(const GPUScene& scene, const Vec3& origin, cons
         	// index of refraction for transmission, 1.0 corresponds to air
 			if (rayEta == 1.0f)
 			{
-        		outEta = prim.material.GetIndexOfRefraction();
-				outAbsorption = prim.material.absorption;
+        		outEta = material.GetIndexOfRefraction();
+				outAbsorption = material.absorption;
 			}
 			else
 			{
@@ -772,12 +930,19 @@ inline __device__ Vec3 PathTrace(const GPUScene& scene, const Vec3& origin, cons
 			// calculate a basis for this hit point
             const Vec3 p = rayOrigin + rayDir*t;
 
+            if (features && i == 0)
+            {
+                features->albedo = material.color;
+                features->normal = n;
+                features->depth = t;
+            }
+
 #if USE_LIGHT_SAMPLING
 			
 			if (i == 0)
 			{
 				// first trace is our only chance to add contribution from directly visible light sources        
-				totalRadiance += prim.material.emission;
+				totalRadiance += material.emission;
 			}			
 			else if (kBsdfSamples > 0)
 			{
@@ -787,7 +952,7 @@ inline __device__ Vec3 PathTrace(const GPUScene& scene, const Vec3& origin, cons
 				if (lightArea > 0.0f)
 				{
 					// convert to pdf with respect to solid angle
-					float lightPdf = ((1.0f/lightArea)*t*t)/Abs(Dot(rayDir, n));
+					float lightPdf = prim.lightSelectPdf*((1.0f/lightArea)*t*t)/Abs(Dot(rayDir, n));
 
 					// calculate weight for bsdf sampling
 					int N = prim.lightSamples+kBsdfSamples;
@@ -802,7 +967,7 @@ inline __device__ Vec3 PathTrace(const GPUScene& scene, const Vec3& origin, cons
 						weight = 1.0f;
 
 					// pathThroughput already includes the bsdf pdf
-					totalRadiance += weight*pathThroughput*prim.material.emission;
+					totalRadiance += weight*pathThroughput*material.emission;
 				}
 			}
 
@@ -811,10 +976,10 @@ inline __device__ Vec3 PathTrace(const GPUScene& scene, const Vec3& origin, cons
 				break;
 
 			// integrate direct light over hemisphere
-			totalRadiance += pathThroughput*SampleLights(scene, prim, rayEta, outEta, p, n, n, -rayDir, rayTime, rand);
+			totalRadiance += pathThroughput*SampleLights(scene, material, rayEta, outEta, p, n, n, -rayDir, rayTime, rand, stats);
 #else
 			
-			totalRadiance += pathThroughput*prim.material.emission;
+			totalRadiance += pathThroughput*material.emission;
 
 #endif
 
@@ -824,17 +989,15 @@ inline __device__ Vec3 PathTrace(const GPUScene& scene, const Vec3& origin, cons
 
 			Vec3 bsdfDir;
 			BSDFType bsdfType;
+			Vec3 f;
 
-			BSDFSample(prim.material, rayEta, outEta, p, u, v, n, -rayDir, bsdfDir, bsdfPdf, bsdfType, rand);
+			BSDFSample(material, rayEta, outEta, p, u, v, n, -rayDir, bsdfDir, f, bsdfPdf, bsdfType, rand);
 			
             if (bsdfPdf <= 0.0f)
             	break;
 
 			Validate(bsdfPdf);
 
-            // reflectance
-            Vec3 f = BSDFEval(prim.material, rayEta, outEta, p, n, -rayDir, bsdfDir);
-
             // update ray medium if we are transmitting through the material
             if (Dot(bsdfDir, n) <= 0.0f)
 			{
@@ -845,6 +1008,15 @@ inline __device__ Vec3 PathTrace(const GPUScene& scene, const Vec3& origin, cons
             // update throughput with primitive reflectance
             pathThroughput *= f * Abs(Dot(n, bsdfDir))/bsdfPdf;
 
+            if (RouletteActive(i+1, rouletteDepth))
+            {
+            	float u;
+            	Sample1D(rand, u);
+
+            	if (!RussianRoulette(pathThroughput, u))
+            		break;
+            }
+
             // update ray direction and type
             rayType = bsdfType;
 			rayDir = bsdfDir;            
@@ -874,7 +1046,14 @@ inline __device__ Vec3 PathTrace(const GPUScene& scene, const Vec3& origin, cons
 
 			Validate(weight);
 		
-       		totalRadiance += weight*scene.sky.Eval(rayDir)*pathThroughput; 
+#if USE_PROBE_MIPS
+			// rough bounces only resolve the probe at the scale of their footprint
+			const float lod = (scene.sky.probe.valid && i > 0 && rayType != eSpecular) ? ProbeLod(scene.sky.probe, bsdfPdf) : 0.0f;
+#else
+			const float lod = 0.0f;
+#endif
+
+       		totalRadiance += weight*scene.sky.Eval(rayDir, lod)*pathThroughput; 
 			break;
         }
     }
@@ -882,51 +1061,158 @@ inline __device__ Vec3 PathTrace(const GPUScene& scene, const Vec3& origin, cons
     return totalRadiance;
 }
 
-__device__ void AddSample(Color* output, int width, int height, float rasterX, float rasterY, float clamp, Filter filter, const Vec3& sample)
+__device__ void AddSample(Color* output, int width, int height, float rasterX, float rasterY, float clamp, const Filter& filter, const Vec3& sample)
 {
-	switch (filter.type)
+	int startX = Max(0, int(rasterX - filter.width));
+	int startY = Max(0, int(rasterY - filter.width));
+	int endX = Min(int(rasterX + filter.width), width-1);
+	int endY = Min(int(rasterY + filter.width), height-1);
+
+	Vec3 c =  ClampLength(sample, clamp);
+
+	// the filter is separable so each axis is only looked up once per sample
+	float weightsX[kMaxFilterFootprint];
+	float weightsY[kMaxFilterFootprint];
+
+	const int countX = Min(endX-startX+1, kMaxFilterFootprint);
+	const int countY = Min(endY-startY+1, kMaxFilterFootprint);
+
+	filter.Weights(rasterX, startX, countX, weightsX);
+	filter.Weights(rasterY, startY, countY, weightsY);
+
+	// other threads may be splatting into the same pixels
+	for (int y=0; y < countY; ++y)
 	{
-		case eFilterBox:
+		for (int x=0; x < countX; ++x)
 		{
-			int x = int(rasterX);
-			int y = int(rasterY);
+			const float w = weightsX[x]*weightsY[y];
 
-			output[y*width+x] += Color(sample.x, sample.y, sample.z, 1.0f);
-			break;
+			const int index = (startY+y)*width + startX+x;
+
+			atomicAdd(&output[index].x, c.x*w);
+			atomicAdd(&output[index].y, c.y*w);
+			atomicAdd(&output[index].z, c.z*w);
+			atomicAdd(&output[index].w, w);
+		}
+	}
+}
+
+// device copies of the renderer's feature buffers, all NULL unless Options::features is set
+struct GPUFeatures
+{
+	Color* albedo;
+	Color* normal;
+	Color* depth;
+};
+
+inline __device__ void AccumulateFeature(Color* buffer, int index, const Vec3& value)
+{
+	atomicAdd(&buffer[index].x, value.x);
+	atomicAdd(&buffer[index].y, value.y);
+	atomicAdd(&buffer[index].z, value.z);
+	atomicAdd(&buffer[index].w, 1.0f);
+}
+
+// primary, secondary and shadow rays traced since Init()
+__device__ unsigned long long g_rayStats[3];
+
+// rays, node visits, box tests and triangle tests of the current eComplexity frame,
+// followed by the most tests taken by a single ray
+__device__ unsigned long long g_complexity[4];
+__device__ unsigned int g_complexityMax;
+
+// takes one sample for pixel (i, j)
+inline __device__ void RenderSample(const GPUScene& scene, const Camera& camera, const CameraSampler& sampler, const Options& options, int i, int j, Sampler& rand, Vec2* moments, const GPUFeatures& features, Color* output)
+{
+	if (options.mode == eNormals)
+	{
+		Vec3 origin, dir;
+		sampler.GenerateRay(i, j, origin, dir);
+
+		int p;
+		float t;
+		Vec3 n;
+
+		atomicAdd(&g_rayStats[0], 1ull);
+
+		if (Trace(scene, origin, dir, 1.0f, t, n, p))
+		{
+			n = n*0.5f+0.5f;
+			output[j*options.width+i] = Color(n.x, n.y, n.z, 1.0f);
 		}
-		case eFilterGaussian:
+		else
 		{
-			int startX = Max(0, int(rasterX - filter.width));
-			int startY = Max(0, int(rasterY - filter.width));
-			int endX = Min(int(rasterX + filter.width), width-1);
-			int endY = Min(int(rasterY + filter.width), height-1);
+			output[j*options.width+i] = Color(0.5f);
+		}
+	}
+	else if (options.mode == eComplexity)
+	{
+		Vec3 origin, dir;
+		sampler.GenerateRay(i, j, origin, dir);
 
-			Vec3 c =  ClampLength(sample, clamp);
+		int p;
+		float t;
+		Vec3 n;
 
-			for (int x=startX; x <= endX; ++x)
-			{
-				for (int y=startY; y <= endY; ++y)
-				{
-					float w = filter.Eval(x-rasterX, y-rasterY);
+		atomicAdd(&g_rayStats[0], 1ull);
 
-					//output[(height-1-y)*width+x] += Vec3(Min(sample.x, clamp), Min(sample.y, clamp), Min(sample.z, clamp), 1.0f)*w;
+		TraversalStats stats;
+		Trace(scene, origin, dir, 1.0f, t, n, p, stats);
 
-					const int index = y*width+x;
+		output[j*options.width+i] = ComplexityColor(stats);
 
-					atomicAdd(&output[index].x, c.x*w);
-					atomicAdd(&output[index].y, c.y*w);
-					atomicAdd(&output[index].z, c.z*w);
-					atomicAdd(&output[index].w, w);
-				}
-			}
-		
-			break;
+		atomicAdd(&g_complexity[0], 1ull);
+		atomicAdd(&g_complexity[1], (unsigned long long)stats.nodes);
+		atomicAdd(&g_complexity[2], (unsigned long long)stats.boxes);
+		atomicAdd(&g_complexity[3], (unsigned long long)stats.triangles);
+		atomicMax(&g_complexityMax, (unsigned int)(stats.boxes + stats.triangles));
+	}
+	else if (options.mode == ePathTrace)
+	{
+		float x, y, t;
+
+		Sample2D(rand, x, y);
+		Sample1D(rand, t);
+
+		const float time = Lerp(camera.shutterStart, camera.shutterEnd, t);
+		const float fx = i + x;
+		const float fy = j + y;
+
+		Vec3 origin, dir;
+		sampler.GenerateRay(fx, fy, origin, dir);
+
+		//output[(height-1-j)*width+i] += PathTrace(*scene, origin, dir);
+		PathFeatures pathFeatures;
+		RayStats stats;
+
+		Vec3 sample = PathTrace(scene, origin, dir, time, options.maxDepth, options.rouletteDepth, rand, stats, features.albedo ? &pathFeatures : NULL);
+
+		atomicAdd(&g_rayStats[0], stats.primary);
+		atomicAdd(&g_rayStats[1], stats.secondary);
+		atomicAdd(&g_rayStats[2], stats.shadow);
+
+		AddSample(output, options.width, options.height, fx, fy, options.clamp, options.filter, sample);
+
+		// samples of the same pixel may be in flight at once
+		if (features.albedo)
+		{
+			AccumulateFeature(features.albedo, j*options.width+i, pathFeatures.albedo);
+			AccumulateFeature(features.normal, j*options.width+i, pathFeatures.normal);
+			AccumulateFeature(features.depth, j*options.width+i, Vec3(pathFeatures.depth));
 		}
-	};
+
+		if (moments)
+		{
+			const float l = Luminance(Color(sample, 0.0f));
+
+			atomicAdd(&moments[j*options.width+i].x, l);
+			atomicAdd(&moments[j*options.width+i].y, l*l);
+		}
+	}
 }
 
 __launch_bounds__(256, 4)
-__global__ void RenderGpu(GPUScene scene, Camera camera, CameraSampler sampler, Options options, int seed, Color* output)
+__global__ void RenderGpu(GPUScene scene, Camera camera, CameraSampler sampler, Options options, int seed, int sampleIndex, const unsigned char* tileActive, Vec2* moments, GPUFeatures features, Color* output)
 {
 	const int tx = blockIdx.x*blockDim.x;
 	const int ty = blockIdx.y*blockDim.y;
@@ -936,145 +1222,761 @@ __global__ void RenderGpu(GPUScene scene, Camera camera, CameraSampler sampler,
 
 	if (i < options.width && j < options.height)
 	{
-		// initialize a per-thread PRNG
-		Random rand(i + j*options.width + seed);
-
-		if (options.mode == eNormals)
+		// tiles stopped by adaptive sampling take no more samples
+		if (tileActive)
 		{
-			Vec3 origin, dir;
-			sampler.GenerateRay(i, j, origin, dir);
-
-			int p;
-			float t;
-			Vec3 n;
+			const int tilesX = (options.width + kAdaptiveTileSize - 1)/kAdaptiveTileSize;
 
-			if (Trace(scene, origin, dir, 1.0f, t, n, p))
-			{
-				n = n*0.5f+0.5f;
-				output[j*options.width+i] = Color(n.x, n.y, n.z, 1.0f);
-			}
-			else
-			{
-				output[j*options.width+i] = Color(0.5f);
-			}
+			if (!tileActive[(j/kAdaptiveTileSize)*tilesX + i/kAdaptiveTileSize])
+				return;
 		}
-		else if (options.mode == ePathTrace)
-		{
-			const float time = rand.Randf(camera.shutterStart, camera.shutterEnd);
-			const float fx = i + rand.Randf(-0.5f, 0.5f) + 0.5f;
-			const float fy = j + rand.Randf(-0.5f, 0.5f) + 0.5f;
-
-			Vec3 origin, dir;
-			sampler.GenerateRay(fx, fy, origin, dir);
 
-			//output[(height-1-j)*width+i] += PathTrace(*scene, origin, dir);
-			Vec3 sample = PathTrace(scene, origin, dir, time, options.maxDepth, rand);
+		// initialize a per-thread sampler
+		Sampler rand(options.sampler, i + j*options.width + seed);
+		rand.Start(i + j*options.width, sampleIndex);
 
-			AddSample(output, options.width, options.height, fx, fy, options.clamp, options.filter, sample);
-		}
+		RenderSample(scene, camera, sampler, options, i, j, rand, moments, features, output);
 	}
 }
 
-struct GpuRenderer : public Renderer
+// tone maps the accumulated samples the same way the viewer presents them
+__global__ void ToneMapGpu(Options options, const Color* samples, Color* image)
 {
-	Color* output = NULL;
-	
-	GPUScene sceneGPU;
-	
-	Random seed;
+	const int i = blockIdx.x*blockDim.x + threadIdx.x;
+
+	if (i < options.width*options.height)
+		image[i] = LinearToSrgb(ToneMap(samples[i]*(options.exposure/samples[i].w), options.limit));
+}
 
-	// map id to geometry struct
-	std::map<int, MeshGeometry> gpuMeshes;
+// one pass of a separable box filter, along rows if dx is 1 or along columns if dy is 1
+__global__ void BoxFilterGpu(const Color* in, Color* out, int width, int height, int radius, int dx, int dy)
+{
+	const int i = blockIdx.x*blockDim.x + threadIdx.x;
 
-	GpuRenderer(const Scene* s)
+	if (i < width*height)
 	{
-		// build GPU primitive and light lists
-		std::vector<Primitive> primitives;		
-		std::vector<Primitive> lights;
+		const int x = i%width;
+		const int y = i/width;
 
-		for (int i=0; i < s->primitives.size(); ++i)
-		{
-			Primitive primitive = s->primitives[i];
+		const int lower = Max(0, dx*(x-radius) + dy*(y-radius));
+		const int upper = Min(dx*(width-1) + dy*(height-1), dx*(x+radius) + dy*(y+radius));
 
-			// if mesh primitive then copy to the GPU
-			if (primitive.type == eMesh)
-			{
-				// see if we have already uploaded the mesh to the GPU
-				if (gpuMeshes.find(primitive.mesh.id) == gpuMeshes.end())
-				{
-					MeshGeometry geo = CreateGPUMesh(primitive.mesh);
-					gpuMeshes[geo.id] = geo;
+		Color sum;
 
-					// replace CPU mesh with GPU copy
-					primitive.mesh = geo;
-				}
-			}
+		for (int k=lower; k <= upper; ++k)
+			sum += in[dx*(y*width + k) + dy*(k*width + x)];
 
-			if (primitive.material.bump > 0.0f)
-			{
-				primitive.material.bumpMap = CreateGPUTexture(primitive.material.bumpMap);
-			}
-			
-			// create explicit list of light primitives
-			if (primitive.lightSamples)
-			{
-				lights.push_back(primitive);
-			}
+		out[i] = sum*(1.0f/(upper-lower+1));
+	}
+}
 
-			primitives.push_back(primitive);
-		}
+// matches NonLocalMeansFilter() on the host, one thread per pixel
+__global__ void NonLocalMeansGpu(const Color* image, const Color* means, Color* out, int width, int height, float falloff, int radius)
+{
+	const int i = blockIdx.x*blockDim.x + threadIdx.x;
 
-		// convert scene BVH
-		CreateVec4Texture((Vec4**)&(sceneGPU.bvh.nodes), (Vec4*)s->bvh.nodes, sizeof(BVHNode)*s->bvh.numNodes);
-		sceneGPU.bvh.numNodes = s->bvh.numNodes;
+	if (i < width*height)
+	{
+		const int x = i%width;
+		const int y = i/width;
 
-		// upload to the GPU
-		sceneGPU.numPrimitives = primitives.size();
-		sceneGPU.numLights = lights.size();
+		const Color mean = means[i];
 
-		if (sceneGPU.numLights > 0)
-		{
-			cudaMalloc(&sceneGPU.lights, sizeof(Primitive)*lights.size());
-			cudaMemcpy(sceneGPU.lights, &lights[0], sizeof(Primitive)*lights.size(), cudaMemcpyHostToDevice);
-		}
+		float totalWeight = 0.0f;
+		Color sum;
 
-		if (sceneGPU.numPrimitives > 0)
+		for (int fy=Max(0, y-radius); fy <= Min(height-1, y+radius); ++fy)
 		{
-			cudaMalloc(&sceneGPU.primitives, sizeof(Primitive)*primitives.size());
-			cudaMemcpy(sceneGPU.primitives, &primitives[0], sizeof(Primitive)*primitives.size(), cudaMemcpyHostToDevice);
+			for (int fx=Max(0, x-radius); fx <= Min(width-1, x+radius); ++fx)
+			{
+				const float weight = NonLocalMeansWeight(mean, means[fy*width + fx], falloff);
+
+				sum += image[fy*width + fx]*weight;
+				totalWeight += weight;
+			}
 		}
 
-		// copy sky and probe texture
-		sceneGPU.sky = CreateGPUSky(s->sky);
+		out[i] = sum*(1.0f/totalWeight);
+	}
+}
 
-		static int frame;
-		++frame;
-		seed = Random(frame);
+// number of tiles still taking samples
+__device__ unsigned int g_numActiveTiles;
+
+// one block of kAdaptiveTileSize^2 threads per tile, tiles whose mean pixel error dropped below
+// the threshold stop while the others are appended to activeTiles for the next pass, which
+// must start with g_numActiveTiles set to zero
+__global__ void UpdateTiles(Options options, int numSamples, unsigned char* tileActive, const Vec2* moments, int* activeTiles)
+{
+	const int tile = blockIdx.x;
+
+	if (!tileActive[tile])
+		return;
+
+	const int tilesX = (options.width + kAdaptiveTileSize - 1)/kAdaptiveTileSize;
+
+	const int x = (tile%tilesX)*kAdaptiveTileSize + threadIdx.x%kAdaptiveTileSize;
+	const int y = (tile/tilesX)*kAdaptiveTileSize + threadIdx.x/kAdaptiveTileSize;
+
+	__shared__ float error;
+	__shared__ int count;
+
+	if (threadIdx.x == 0)
+	{
+		error = 0.0f;
+		count = 0;
 	}
 
-	virtual ~GpuRenderer()
+	__syncthreads();
+
+	if (x < options.width && y < options.height)
 	{
-		cudaFree(output);
-		cudaFree(sceneGPU.primitives);
-		cudaFree(sceneGPU.lights);
-		
-		DestroyTexture(sceneGPU.bvh.nodes);
+		const Vec2 m = moments[y*options.width + x];
 
-		// free meshes
-		for (auto iter=gpuMeshes.begin(); iter != gpuMeshes.end(); ++iter)
-		{
-			DestroyGPUMesh(iter->second);
-		}
+		atomicAdd(&error, PixelError(m.x, m.y, numSamples));
+		atomicAdd(&count, 1);
 	}
-	
-	void Init(int width, int height)
+
+	__syncthreads();
+
+	if (threadIdx.x == 0)
 	{
-		cudaFree(output);
-		cudaMalloc(&output, sizeof(Color)*width*height);
-		cudaMemset(output, 0, sizeof(Color)*width*height);
+		if (numSamples >= Max(2, options.adaptiveMinSamples) && error < options.adaptiveThreshold*count)
+			tileActive[tile] = 0;
+		else
+			activeTiles[atomicAdd(&g_numActiveTiles, 1)] = tile;
+	}
+}
+
+#if USE_PERSISTENT_THREADS
+
+#define kPersistentBlockSize 256
+#define kWarpSize 32
+
+// index of the next work item, reset before each launch
+__device__ unsigned int g_nextWork;
+
+// work item w takes sample w/numPixels of pixel w%numPixels, so a warp fetching 32 consecutive
+// items traces neighbouring pixels, a warp whose paths terminate early fetches more work
+// instead of idling until the longest path of a fixed pixel assignment finishes
+//
+// with adaptive sampling a pass only covers the pixels of activeTiles, the number of which
+// is left on the device by UpdateTiles() so the host never waits for it
+__launch_bounds__(kPersistentBlockSize, 4)
+__global__ void RenderGpuPersistent(GPUScene scene, Camera camera, CameraSampler sampler, Options options, int seed, int sampleIndex, int passSamples, const int* activeTiles, Vec2* moments, GPUFeatures features, Color* output)
+{
+	const int lane = threadIdx.x%kWarpSize;
+	const unsigned int numPixels = options.width*options.height;
+
+	const int kTilePixels = kAdaptiveTileSize*kAdaptiveTileSize;
+	const int tilesX = (options.width + kAdaptiveTileSize - 1)/kAdaptiveTileSize;
+
+	const unsigned int passPixels = activeTiles ? g_numActiveTiles*kTilePixels : numPixels;
+	const unsigned int numWork = passPixels*passSamples;
+
+	for (;;)
+	{
+		unsigned int base;
+		if (lane == 0)
+			base = atomicAdd(&g_nextWork, kWarpSize);
+
+#if __CUDACC_VER_MAJOR__ >= 9
+		base = __shfl_sync(0xffffffff, base, 0);
+#else
+		base = __shfl(base, 0);
+#endif
+
+		// uniform across the warp so all lanes leave together
+		if (base >= numWork)
+			break;
+
+		const unsigned int work = base + lane;
+
+		if (work < numWork)
+		{
+			const unsigned int sample = work/passPixels;
+			const unsigned int index = work%passPixels;
+
+			int x, y;
+
+			if (activeTiles)
+			{
+				const int tile = activeTiles[index/kTilePixels];
+				const int offset = index%kTilePixels;
+
+				x = (tile%tilesX)*kAdaptiveTileSize + offset%kAdaptiveTileSize;
+				y = (tile/tilesX)*kAdaptiveTileSize + offset/kAdaptiveTileSize;
+			}
+			else
+			{
+				x = index%options.width;
+				y = index/options.width;
+			}
+
+			if (x < options.width && y < options.height)
+			{
+				const int pixel = y*options.width + x;
+
+				// unique per pixel sample, the seed changes every launch
+				Sampler rand(options.sampler, pixel + sample*numPixels + seed);
+				rand.Start(pixel, sampleIndex + sample);
+
+				RenderSample(scene, camera, sampler, options, x, y, rand, moments, features, output);
+			}
+		}
+	}
+}
+
+#endif
+
+struct GpuRenderer : public Renderer
+{
+	Color* output = NULL;
+	
+	GPUScene sceneGPU;
+	
+	Random seed;
+
+	// seed of the next launch, processes rendering different sample ranges of a frame
+	// draw from separate streams
+	int LaunchSeed(const Options& options)
+	{
+		return Random(seed.Rand() + options.sampleOffset).Rand();
+	}
+
+	// number of samples each pixel has taken since Init(), the index into the sample sequence
+	int sampleIndex;
+
+	// meshes uploaded so far keyed by mesh id, kept across updates while they are referenced
+	std::map<unsigned long, MeshGeometry> gpuMeshes;
+
+	// device bump maps of the current material table, one per volume however many materials share it
+	std::vector<Texture> bumpMaps;
+
+	// host probe the GPU sky was copied from
+	const Color* hostProbe;
+
+	// number of blocks of the persistent kernel that are resident at once
+	int persistentBlocks;
+
+	cudaStream_t stream;
+
+	// pinned readback buffers, frames alternate between them
+	Color* readback[2];
+	cudaEvent_t readbackDone[2];
+
+	// buffer the most recent frame is read back into, -1 if nothing was rendered since Init()
+	int current;
+	int numPixels;
+
+	// size of the buffers allocated by Init()
+	int frameWidth;
+	int frameHeight;
+
+	// adaptive sampling state, per-pixel luminance moments, per-tile flags and the list of
+	// tiles that are still sampled, see UpdateTiles()
+	Vec2* moments;
+	unsigned char* tileActive;
+	int* activeTiles;
+	int numTiles;
+
+	// number of active tiles read back with each frame, and the value for the frame handed out
+	unsigned int* readbackActive;
+	unsigned int numActive;
+	bool adaptive;
+
+	// feature buffers with the sample count in w, allocated once features are requested
+	GPUFeatures features;
+
+	// tone mapped image, its box filtered means and the filtered result, allocated on first use
+	Color* denoiseImage;
+	Color* denoiseMeans;
+	Color* denoiseOutput;
+
+	GpuRenderer(const Scene* s) : sampleIndex(0), hostProbe(NULL), persistentBlocks(0), current(-1), numPixels(0), frameWidth(0), frameHeight(0), moments(NULL), tileActive(NULL), activeTiles(NULL), numTiles(0), numActive(0), adaptive(false), denoiseImage(NULL), denoiseMeans(NULL), denoiseOutput(NULL)
+	{
+		features.albedo = NULL;
+		features.normal = NULL;
+		features.depth = NULL;
+
+		sceneGPU.primitives = NULL;
+		sceneGPU.lights = NULL;
+		sceneGPU.lightTable = NULL;
+		sceneGPU.materials = NULL;
+		sceneGPU.meshes = NULL;
+
+		cudaStreamCreate(&stream);
+
+		for (int i=0; i < 2; ++i)
+		{
+			readback[i] = NULL;
+			cudaEventCreateWithFlags(&readbackDone[i], cudaEventDisableTiming);
+		}
+
+		cudaMallocHost(&readbackActive, sizeof(unsigned int)*2);
+
+		Upload(s);
+	}
+
+	// copies the scene to the GPU, meshes and the probe of the previous upload are reused
+	void Upload(const Scene* s)
+	{
+		// kernels in flight still read the previous scene
+		cudaStreamSynchronize(stream);
+
+		// release the previous scene's lists
+		cudaFree(sceneGPU.primitives);
+		cudaFree(sceneGPU.lights);
+		cudaFree(sceneGPU.lightTable);
+		cudaFree(sceneGPU.materials);
+		cudaFree(sceneGPU.meshes);
+
+		sceneGPU.primitives = NULL;
+		sceneGPU.lights = NULL;
+		sceneGPU.lightTable = NULL;
+		sceneGPU.materials = NULL;
+		sceneGPU.meshes = NULL;
+
+		for (int i=0; i < bumpMaps.size(); ++i)
+			cudaFree(bumpMaps[i].data);
+
+		bumpMaps.resize(0);
+
+		for (int i=0; i < kMotionSegments; ++i)
+		{
+			if (sceneGPU.bvh[i].nodes)
+				DestroyTexture(sceneGPU.bvh[i].nodes);
+
+			if (sceneGPU.bvh[i].links)
+				DestroyTexture(sceneGPU.bvh[i].links);
+
+			sceneGPU.bvh[i] = BVH();
+		}
+
+		// build GPU primitive and light lists, primitives keep the scene's material indices
+		std::vector<GPUPrimitive> primitives;		
+		std::vector<GPUPrimitive> lights;
+		std::vector<Material> materials(s->materials);
+
+		// device copies of the meshes referenced, and the table entry of each mesh primitive
+		std::vector<MeshGeometry> meshes;
+		std::map<unsigned long, int> meshIndices;
+		std::vector<int> primitiveMeshes;
+
+		// meshes used by this scene
+		std::set<unsigned long> referenced;
+
+		for (int i=0; i < s->primitives.size(); ++i)
+		{
+			const Primitive& primitive = s->primitives[i];
+
+			int meshIndex = -1;
+
+			// if mesh primitive then copy to the GPU
+			if (primitive.type == eMesh)
+			{
+				// see if we have already uploaded the mesh to the GPU
+				std::map<unsigned long, MeshGeometry>::iterator iter = gpuMeshes.find(primitive.mesh->id);
+
+				// meshes rebuilt or refit since they were uploaded are uploaded again
+				if (iter != gpuMeshes.end() && iter->second.generation != primitive.mesh->generation)
+				{
+					DestroyGPUMesh(iter->second);
+					gpuMeshes.erase(iter);
+
+					iter = gpuMeshes.end();
+				}
+
+				if (iter == gpuMeshes.end())
+					iter = gpuMeshes.insert(std::make_pair(primitive.mesh->id, CreateGPUMesh(*primitive.mesh))).first;
+
+				// instances of the same mesh share its table entry
+				std::map<unsigned long, int>::iterator index = meshIndices.find(iter->first);
+
+				if (index == meshIndices.end())
+				{
+					index = meshIndices.insert(std::make_pair(iter->first, int(meshes.size()))).first;
+					meshes.push_back(iter->second);
+				}
+
+				meshIndex = index->second;
+
+				referenced.insert(iter->first);
+			}
+
+			GPUPrimitive gpuPrimitive;
+			static_cast<PrimitiveGeometry&>(gpuPrimitive) = primitive;
+			gpuPrimitive.material = primitive.material;
+			gpuPrimitive.lightSamples = primitive.lightSamples;
+			gpuPrimitive.lightSelectPdf = s->lightSelectPdf[i];
+
+			primitives.push_back(gpuPrimitive);
+			primitiveMeshes.push_back(meshIndex);
+		}
+
+		// bump maps are copied once per volume however many materials share it
+		std::map<const unsigned short*, Texture> gpuTextures;
+
+		for (int i=0; i < materials.size(); ++i)
+		{
+			if (materials[i].bump > 0.0f && materials[i].bumpMap.data)
+			{
+				std::map<const unsigned short*, Texture>::iterator iter = gpuTextures.find(materials[i].bumpMap.data);
+
+				if (iter == gpuTextures.end())
+				{
+					iter = gpuTextures.insert(std::make_pair(materials[i].bumpMap.data, CreateGPUTexture(materials[i].bumpMap))).first;
+					bumpMaps.push_back(iter->second);
+				}
+
+				materials[i].bumpMap = iter->second;
+			}
+		}
+
+		// point mesh primitives at the device mesh table
+		sceneGPU.numMeshes = meshes.size();
+
+		if (sceneGPU.numMeshes > 0)
+		{
+			cudaMalloc(&sceneGPU.meshes, sizeof(MeshGeometry)*meshes.size());
+			cudaMemcpy(sceneGPU.meshes, &meshes[0], sizeof(MeshGeometry)*meshes.size(), cudaMemcpyHostToDevice);
+		}
+
+		for (int i=0; i < primitives.size(); ++i)
+		{
+			if (primitiveMeshes[i] >= 0)
+				primitives[i].mesh = sceneGPU.meshes + primitiveMeshes[i];
+		}
+
+		// light list in the order of the scene's alias table
+		for (int i=0; i < s->lights.size(); ++i)
+			lights.push_back(primitives[s->lights[i]]);
+
+		// free meshes that are no longer used
+		for (std::map<unsigned long, MeshGeometry>::iterator iter=gpuMeshes.begin(); iter != gpuMeshes.end();)
+		{
+			if (referenced.count(iter->first) == 0)
+			{
+				DestroyGPUMesh(iter->second);
+				gpuMeshes.erase(iter++);
+			}
+			else
+			{
+				++iter;
+			}
+		}
+
+		// convert scene BVH
+		for (int i=0; i < s->numMotionSegments; ++i)
+		{
+			CreateVec4Texture((Vec4**)&(sceneGPU.bvh[i].nodes), (Vec4*)s->bvh[i].nodes, sizeof(BVHNode)*s->bvh[i].numNodes);
+			sceneGPU.bvh[i].links = CreateGPULinks(s->bvh[i].nodes, s->bvh[i].numNodes);
+			sceneGPU.bvh[i].numNodes = s->bvh[i].numNodes;
+		}
+
+		sceneGPU.numMotionSegments = s->numMotionSegments;
+
+		// upload to the GPU
+		sceneGPU.numPrimitives = primitives.size();
+		sceneGPU.numLights = lights.size();
+		sceneGPU.numMaterials = materials.size();
+
+		if (sceneGPU.numMaterials > 0)
+		{
+			cudaMalloc(&sceneGPU.materials, sizeof(Material)*materials.size());
+			cudaMemcpy(sceneGPU.materials, &materials[0], sizeof(Material)*materials.size(), cudaMemcpyHostToDevice);
+		}
+
+		if (sceneGPU.numLights > 0)
+		{
+			cudaMalloc(&sceneGPU.lights, sizeof(GPUPrimitive)*lights.size());
+			cudaMemcpy(sceneGPU.lights, &lights[0], sizeof(GPUPrimitive)*lights.size(), cudaMemcpyHostToDevice);
+
+			cudaMalloc(&sceneGPU.lightTable, sizeof(AliasEntry)*lights.size());
+			cudaMemcpy(sceneGPU.lightTable, &s->lightTable[0], sizeof(AliasEntry)*lights.size(), cudaMemcpyHostToDevice);
+		}
+
+		if (sceneGPU.numPrimitives > 0)
+		{
+			cudaMalloc(&sceneGPU.primitives, sizeof(GPUPrimitive)*primitives.size());
+			cudaMemcpy(sceneGPU.primitives, &primitives[0], sizeof(GPUPrimitive)*primitives.size(), cudaMemcpyHostToDevice);
+		}
+
+		// copy sky and probe texture, the probe is only copied again if it changed
+		if (s->sky.probe.valid && s->sky.probe.data == hostProbe)
+		{
+			Probe probe = sceneGPU.sky.probe;
+			probe.offset = s->sky.probe.offset;
+
+			sceneGPU.sky = s->sky;
+			sceneGPU.sky.probe = probe;
+		}
+		else
+		{
+			DestroyGPUSky(sceneGPU.sky);
+
+			sceneGPU.sky = CreateGPUSky(s->sky);
+			hostProbe = s->sky.probe.valid ? s->sky.probe.data : NULL;
+		}
+
+		static int frame;
+		++frame;
+		seed = Random(frame);
+	}
+
+	virtual bool Update(const Scene* s)
+	{
+		Upload(s);
+		return true;
+	}
+
+	virtual ~GpuRenderer()
+	{
+		cudaStreamSynchronize(stream);
+
+		for (int i=0; i < 2; ++i)
+		{
+			cudaFreeHost(readback[i]);
+			cudaEventDestroy(readbackDone[i]);
+		}
+
+		cudaStreamDestroy(stream);
+
+		cudaFreeHost(readbackActive);
+
+		cudaFree(moments);
+		cudaFree(tileActive);
+		cudaFree(activeTiles);
+
+		cudaFree(denoiseImage);
+		cudaFree(denoiseMeans);
+		cudaFree(denoiseOutput);
+
+		cudaFree(features.albedo);
+		cudaFree(features.normal);
+		cudaFree(features.depth);
+
+		cudaFree(output);
+		cudaFree(sceneGPU.primitives);
+		cudaFree(sceneGPU.lights);
+		cudaFree(sceneGPU.lightTable);
+		cudaFree(sceneGPU.materials);
+		cudaFree(sceneGPU.meshes);
+
+		for (int i=0; i < bumpMaps.size(); ++i)
+			cudaFree(bumpMaps[i].data);
+		
+		for (int i=0; i < kMotionSegments; ++i)
+		{
+			if (sceneGPU.bvh[i].nodes)
+				DestroyTexture(sceneGPU.bvh[i].nodes);
+
+			if (sceneGPU.bvh[i].links)
+				DestroyTexture(sceneGPU.bvh[i].links);
+		}
+
+		DestroyGPUSky(sceneGPU.sky);
+
+		// free meshes
+		for (auto iter=gpuMeshes.begin(); iter != gpuMeshes.end(); ++iter)
+		{
+			DestroyGPUMesh(iter->second);
+		}
+	}
+	
+	void Init(int width, int height)
+	{
+		cudaStreamSynchronize(stream);
+
+		// resetting at the same size, e.g.: every time the camera moves, only clears the buffers
+		const bool resize = width != frameWidth || height != frameHeight;
+
+		frameWidth = width;
+		frameHeight = height;
+
+		current = -1;
+		numPixels = width*height;
+
+		sampleIndex = 0;
+
+		// every tile starts active
+		const int tilesX = (width + kAdaptiveTileSize - 1)/kAdaptiveTileSize;
+		const int tilesY = (height + kAdaptiveTileSize - 1)/kAdaptiveTileSize;
+
+		numTiles = tilesX*tilesY;
+		numActive = numTiles;
+		adaptive = false;
+
+		if (resize)
+		{
+			cudaFree(output);
+			cudaMalloc(&output, sizeof(Color)*width*height);
+
+			for (int i=0; i < 2; ++i)
+			{
+				cudaFreeHost(readback[i]);
+				cudaMallocHost(&readback[i], sizeof(Color)*width*height);
+			}
+
+			cudaFree(moments);
+			cudaFree(tileActive);
+			cudaFree(activeTiles);
+
+			cudaMalloc(&moments, sizeof(Vec2)*width*height);
+			cudaMalloc(&tileActive, numTiles);
+			cudaMalloc(&activeTiles, sizeof(int)*numTiles);
+
+			// resized on the next filtered frame
+			cudaFree(denoiseImage);
+			cudaFree(denoiseMeans);
+			cudaFree(denoiseOutput);
+
+			denoiseImage = NULL;
+			denoiseMeans = NULL;
+			denoiseOutput = NULL;
+
+			cudaFree(features.albedo);
+			cudaFree(features.normal);
+			cudaFree(features.depth);
+
+			features.albedo = NULL;
+			features.normal = NULL;
+			features.depth = NULL;
+		}
+		else if (features.albedo)
+		{
+			cudaMemset(features.albedo, 0, sizeof(Color)*numPixels);
+			cudaMemset(features.normal, 0, sizeof(Color)*numPixels);
+			cudaMemset(features.depth, 0, sizeof(Color)*numPixels);
+		}
+
+		cudaMemset(output, 0, sizeof(Color)*width*height);
+		cudaMemset(moments, 0, sizeof(Vec2)*width*height);
+		cudaMemset(tileActive, 1, numTiles);
+
+		std::vector<int> tiles(numTiles);
+		for (int i=0; i < numTiles; ++i)
+			tiles[i] = i;
+
+		cudaMemcpy(activeTiles, &tiles[0], sizeof(int)*numTiles, cudaMemcpyHostToDevice);
+		cudaMemcpyToSymbol(g_numActiveTiles, &numTiles, sizeof(int));
+
+		const unsigned long long zero[3] = { 0, 0, 0 };
+		cudaMemcpyToSymbol(g_rayStats, zero, sizeof(zero));
+	}
+
+	bool GetFeatures(Color* albedo, Color* normal, Color* depth)
+	{
+		if (features.albedo == NULL)
+			return false;
+
+		cudaStreamSynchronize(stream);
+
+		cudaMemcpy(albedo, features.albedo, sizeof(Color)*numPixels, cudaMemcpyDeviceToHost);
+		cudaMemcpy(normal, features.normal, sizeof(Color)*numPixels, cudaMemcpyDeviceToHost);
+		cudaMemcpy(depth, features.depth, sizeof(Color)*numPixels, cudaMemcpyDeviceToHost);
+
+		for (int i=0; i < numPixels; ++i)
+		{
+			const float scale = albedo[i].w > 0.0f ? 1.0f/albedo[i].w : 0.0f;
+
+			albedo[i] *= scale;
+			normal[i] *= scale;
+			depth[i] *= scale;
+		}
+
+		return true;
+	}
+
+	virtual bool Converged() const
+	{
+		return adaptive && numActive == 0;
+	}
+
+	virtual bool GetRayStats(RayStats& stats)
+	{
+		// counters are only read between frames
+		cudaDeviceSynchronize();
+
+		unsigned long long counts[3];
+		cudaMemcpyFromSymbol(counts, g_rayStats, sizeof(counts));
+
+		stats.primary = counts[0];
+		stats.secondary = counts[1];
+		stats.shadow = counts[2];
+
+		return true;
+	}
+
+	virtual bool GetComplexity(ComplexityStats& stats)
+	{
+		cudaDeviceSynchronize();
+
+		unsigned long long counts[4];
+		cudaMemcpyFromSymbol(counts, g_complexity, sizeof(counts));
+		cudaMemcpyFromSymbol(&stats.maxCost, g_complexityMax, sizeof(unsigned int));
+
+		stats.rays = counts[0];
+		stats.nodes = counts[1];
+		stats.boxes = counts[2];
+		stats.triangles = counts[3];
+
+		return true;
+	}
+
+	// waits for the most recent frame and copies it to outputHost
+	void Flush(Color* outputHost)
+	{
+		if (current != -1)
+		{
+			cudaEventSynchronize(readbackDone[current]);
+			memcpy(outputHost, readback[current], sizeof(Color)*numPixels);
+
+			numActive = readbackActive[current];
+		}
+	}
+
+	// frames add to the device accumulation so the restored samples only need uploading
+	bool Resume(const Color* accum)
+	{
+		cudaMemcpy(output, accum, sizeof(Color)*numPixels, cudaMemcpyHostToDevice);
+		return true;
+	}
+
+	// filters the samples on the device so only the final image is read back, with asynchronous
+	// readback this includes the frame still in flight so may be one frame ahead of the samples
+	bool FilterNonLocalMeans(const Options& options, float falloff, int radius, Color* outputHost)
+	{
+		if (denoiseImage == NULL)
+		{
+			cudaMalloc(&denoiseImage, sizeof(Color)*numPixels);
+			cudaMalloc(&denoiseMeans, sizeof(Color)*numPixels);
+			cudaMalloc(&denoiseOutput, sizeof(Color)*numPixels);
+		}
+
+		const int kNumThreadsPerBlock = 256;
+		const int numBlocks = (numPixels + kNumThreadsPerBlock - 1)/kNumThreadsPerBlock;
+
+		ToneMapGpu<<<numBlocks, kNumThreadsPerBlock, 0, stream>>>(options, output, denoiseImage);
+
+		// the filtered result doubles as scratch for the first box filter pass
+		BoxFilterGpu<<<numBlocks, kNumThreadsPerBlock, 0, stream>>>(denoiseImage, denoiseOutput, options.width, options.height, radius, 1, 0);
+		BoxFilterGpu<<<numBlocks, kNumThreadsPerBlock, 0, stream>>>(denoiseOutput, denoiseMeans, options.width, options.height, radius, 0, 1);
+
+		NonLocalMeansGpu<<<numBlocks, kNumThreadsPerBlock, 0, stream>>>(denoiseImage, denoiseMeans, denoiseOutput, options.width, options.height, falloff, radius);
+
+		cudaMemcpyAsync(outputHost, denoiseOutput, sizeof(Color)*numPixels, cudaMemcpyDeviceToHost, stream);
+		cudaStreamSynchronize(stream);
+
+		return true;
 	}
 
 	void Render(const Camera& camera, const Options& options, Color* outputHost)
+	{
+		RenderSamples(camera, options, outputHost, 1);
+	}
+
+	void RenderSamples(const Camera& camera, const Options& options, Color* outputHost, int numSamples)
 	{
 		// create a sampler for the camera
 		CameraSampler sampler(
@@ -1085,6 +1987,61 @@ struct GpuRenderer : public Renderer
 			options.width,
 			options.height);
 
+		// tiles stop sampling once converged, pixels then accumulate their luminance moments
+		adaptive = options.adaptiveThreshold > 0.0f && options.mode == ePathTrace;
+
+		Vec2* adaptiveMoments = adaptive ? moments : NULL;
+
+		if (options.features && options.mode == ePathTrace && features.albedo == NULL)
+		{
+			cudaMalloc(&features.albedo, sizeof(Color)*numPixels);
+			cudaMalloc(&features.normal, sizeof(Color)*numPixels);
+			cudaMalloc(&features.depth, sizeof(Color)*numPixels);
+
+			cudaMemsetAsync(features.albedo, 0, sizeof(Color)*numPixels, stream);
+			cudaMemsetAsync(features.normal, 0, sizeof(Color)*numPixels, stream);
+			cudaMemsetAsync(features.depth, 0, sizeof(Color)*numPixels, stream);
+		}
+
+		GPUFeatures pathFeatures = features;
+
+		if (!options.features || options.mode != ePathTrace)
+			pathFeatures.albedo = NULL;
+
+		// normals and complexity overwrite their pixel so one sample is enough
+		const int passSamples = options.mode == ePathTrace ? numSamples : 1;
+
+		if (options.mode == eComplexity)
+		{
+			const unsigned long long counts[4] = { 0, 0, 0, 0 };
+			const unsigned int maxCost = 0;
+
+			cudaMemcpyToSymbolAsync(g_complexity, counts, sizeof(counts), 0, cudaMemcpyHostToDevice, stream);
+			cudaMemcpyToSymbolAsync(g_complexityMax, &maxCost, sizeof(maxCost), 0, cudaMemcpyHostToDevice, stream);
+		}
+
+#if USE_PERSISTENT_THREADS
+
+		if (persistentBlocks == 0)
+		{
+			int device;
+			cudaGetDevice(&device);
+
+			cudaDeviceProp props;
+			cudaGetDeviceProperties(&props, device);
+
+			int blocksPerSM = 0;
+			cudaOccupancyMaxActiveBlocksPerMultiprocessor(&blocksPerSM, RenderGpuPersistent, kPersistentBlockSize, 0);
+
+			persistentBlocks = Max(1, blocksPerSM)*props.multiProcessorCount;
+		}
+
+		const unsigned int zero = 0;
+		cudaMemcpyToSymbolAsync(g_nextWork, &zero, sizeof(zero), 0, cudaMemcpyHostToDevice, stream);
+
+		RenderGpuPersistent<<<persistentBlocks, kPersistentBlockSize, 0, stream>>>(sceneGPU, camera, sampler, options, LaunchSeed(options), options.sampleOffset + sampleIndex, passSamples, adaptive ? activeTiles : NULL, adaptiveMoments, pathFeatures, output);
+
+#else
 
 		// assign threads in 2d tile layout
 		const int blockWidth = 16;
@@ -1096,10 +2053,55 @@ struct GpuRenderer : public Renderer
 		dim3 blockDim(blockWidth, blockHeight);
 		dim3 gridDim(gridWidth, gridHeight);
 
-		RenderGpu<<<gridDim, blockDim>>>(sceneGPU, camera, sampler, options, seed.Rand(), output);
+		for (int i=0; i < passSamples; ++i)
+			RenderGpu<<<gridDim, blockDim, 0, stream>>>(sceneGPU, camera, sampler, options, LaunchSeed(options), options.sampleOffset + sampleIndex+i, adaptive ? tileActive : NULL, adaptiveMoments, pathFeatures, output);
+
+#endif
+
+		sampleIndex += numSamples;
+
+		if (adaptive)
+		{
+			// rebuild the active list from the tiles that are still above the threshold
+			const unsigned int zero = 0;
+			cudaMemcpyToSymbolAsync(g_numActiveTiles, &zero, sizeof(zero), 0, cudaMemcpyHostToDevice, stream);
+
+			UpdateTiles<<<numTiles, kAdaptiveTileSize*kAdaptiveTileSize, 0, stream>>>(options, sampleIndex, tileActive, moments, activeTiles);
+		}
+
+#if USE_ASYNC_READBACK
+
+		const int previous = current;
+
+		// queue the readback of this frame behind its kernel
+		current = (current+1)%2;
+
+		cudaMemcpyAsync(readback[current], output, sizeof(Color)*numPixels, cudaMemcpyDeviceToHost, stream);
+		cudaMemcpyFromSymbolAsync(&readbackActive[current], g_numActiveTiles, sizeof(unsigned int), 0, cudaMemcpyDeviceToHost, stream);
+		cudaEventRecord(readbackDone[current], stream);
+
+		// hand out the previous frame which finished before this one's kernel started,
+		// the first frame after Init() has nothing older so waits for itself
+		if (previous != -1)
+		{
+			cudaEventSynchronize(readbackDone[previous]);
+			memcpy(outputHost, readback[previous], sizeof(Color)*numPixels);
+
+			numActive = readbackActive[previous];
+		}
+		else
+		{
+			Flush(outputHost);
+		}
+
+#else
 
 		// copy back to output
+		cudaStreamSynchronize(stream);
 		cudaMemcpy(outputHost, output, sizeof(Color)*options.width*options.height, cudaMemcpyDeviceToHost);
+		cudaMemcpyFromSymbol(&numActive, g_numActiveTiles, sizeof(unsigned int));
+
+#endif
 	}
 };
 
@@ -1108,3 +2110,219 @@ Renderer* CreateGpuRenderer(const Scene* s)
 {
 	return new GpuRenderer(s);
 }
+
+// renders on every visible device, each device holds its own copy of the scene and accumulates
+// whole frames, samples are handed out in batches to whichever device is free so faster devices
+// take more of them, the frames are summed on readback
+struct MultiGpuRenderer : public Renderer
+{
+	std::vector<GpuRenderer*> renderers;
+
+	// each device's accumulated frame as of its last readback
+	std::vector<Color*> frames;
+
+	// samples each device has taken since Init(), and the samples taken over all devices
+	std::vector<int> deviceSamples;
+	int sampleIndex;
+
+	int numPixels;
+
+	MultiGpuRenderer(const Scene* s) : sampleIndex(0), numPixels(0)
+	{
+		int numDevices = 0;
+		cudaGetDeviceCount(&numDevices);
+
+		for (int i=0; i < numDevices; ++i)
+		{
+			cudaSetDevice(i);
+			renderers.push_back(new GpuRenderer(s));
+		}
+
+		frames.resize(renderers.size(), NULL);
+		deviceSamples.resize(renderers.size(), 0);
+
+		cudaSetDevice(0);
+
+		printf("Rendering on %d devices\n", numDevices);
+	}
+
+	virtual ~MultiGpuRenderer()
+	{
+		for (int i=0; i < renderers.size(); ++i)
+		{
+			cudaSetDevice(i);
+			delete renderers[i];
+
+			delete[] frames[i];
+		}
+
+		cudaSetDevice(0);
+	}
+
+	virtual bool Update(const Scene* s)
+	{
+		bool updated = true;
+
+		for (int i=0; i < renderers.size(); ++i)
+		{
+			cudaSetDevice(i);
+			updated &= renderers[i]->Update(s);
+		}
+
+		cudaSetDevice(0);
+
+		return updated;
+	}
+
+	void Init(int width, int height)
+	{
+		numPixels = width*height;
+
+		for (int i=0; i < renderers.size(); ++i)
+		{
+			cudaSetDevice(i);
+			renderers[i]->Init(width, height);
+
+			delete[] frames[i];
+			frames[i] = new Color[numPixels];
+
+			memset(frames[i], 0, sizeof(Color)*numPixels);
+
+			deviceSamples[i] = 0;
+		}
+
+		cudaSetDevice(0);
+
+		sampleIndex = 0;
+	}
+
+	// the restored samples go to the first device only, the merge sums every device's frame
+	bool Resume(const Color* accum)
+	{
+		if (!renderers[0]->Resume(accum))
+			return false;
+
+		// kept in case the first device is never handed a batch before its next readback
+		memcpy(frames[0], accum, sizeof(Color)*numPixels);
+
+		return true;
+	}
+
+	void Render(const Camera& camera, const Options& options, Color* outputHost)
+	{
+		RenderSamples(camera, options, outputHost, 1);
+	}
+
+	void RenderSamples(const Camera& camera, const Options& options, Color* outputHost, int numSamples)
+	{
+		// normals and complexity overwrite their pixel so are left to the first device
+		const int numDevices = options.mode == ePathTrace ? int(renderers.size()) : 1;
+
+		// a few batches per device so that the last ones even out differences in speed
+		const int kBatchesPerDevice = 4;
+		const int batchSize = Max(1, numSamples/(numDevices*kBatchesPerDevice));
+
+		std::atomic<int> nextSample(0);
+
+		std::vector<std::thread> workers;
+
+		for (int d=0; d < numDevices; ++d)
+		{
+			workers.push_back(std::thread([&, d]()
+			{
+				cudaSetDevice(d);
+
+				for (;;)
+				{
+					const int first = nextSample.fetch_add(batchSize);
+					if (first >= numSamples)
+						break;
+
+					const int count = Min(batchSize, numSamples-first);
+
+					// the device adds its own sample count, offset so the batch lands on its
+					// range of the frame's sample sequence and no two devices repeat a sample
+					Options batchOptions = options;
+					batchOptions.sampleOffset = options.sampleOffset + sampleIndex + first - deviceSamples[d];
+
+					renderers[d]->RenderSamples(camera, batchOptions, frames[d], count);
+
+					deviceSamples[d] += count;
+				}
+
+				renderers[d]->Flush(frames[d]);
+			}));
+		}
+
+		for (int d=0; d < numDevices; ++d)
+			workers[d].join();
+
+		sampleIndex += numSamples;
+
+		// merge the accumulation buffers, every device weights its samples so a plain sum will do
+		memcpy(outputHost, frames[0], sizeof(Color)*numPixels);
+
+		for (int d=1; d < numDevices; ++d)
+		{
+			for (int i=0; i < numPixels; ++i)
+				outputHost[i] += frames[d][i];
+		}
+	}
+
+	virtual bool Converged() const
+	{
+		for (int i=0; i < renderers.size(); ++i)
+		{
+			if (!renderers[i]->Converged())
+				return false;
+		}
+
+		return !renderers.empty();
+	}
+
+	virtual bool GetRayStats(RayStats& stats)
+	{
+		stats = RayStats();
+
+		for (int i=0; i < renderers.size(); ++i)
+		{
+			cudaSetDevice(i);
+
+			RayStats deviceStats;
+			renderers[i]->GetRayStats(deviceStats);
+
+			stats += deviceStats;
+		}
+
+		cudaSetDevice(0);
+
+		return true;
+	}
+
+	virtual bool GetComplexity(ComplexityStats& stats)
+	{
+		return !renderers.empty() && renderers[0]->GetComplexity(stats);
+	}
+
+	// every device covers the whole frame so the features of any one of them will do
+	bool GetFeatures(Color* albedo, Color* normal, Color* depth)
+	{
+		bool found = false;
+
+		for (int i=0; i < renderers.size() && !found; ++i)
+		{
+			cudaSetDevice(i);
+			found = renderers[i]->GetFeatures(albedo, normal, depth);
+		}
+
+		cudaSetDevice(0);
+
+		return found;
+	}
+};
+
+
+Renderer* CreateMultiGpuRenderer(const Scene* s)
+{
+	return new MultiGpuRenderer(s);
+}
@@ -10,20 +10,51 @@ enum FilterType
 	eFilterGaussian
 };
 
+// the gaussian is tabulated over [0, width] so splatting a sample only takes table lookups
+const int kFilterTableSize = 32;
+
+// largest number of pixels a sample splats to along one axis
+const int kMaxFilterFootprint = 32;
+
 struct Filter
 {
-	CUDA_CALLABLE Filter(FilterType type=eFilterGaussian, float width=1.0f, float falloff=2.0f) : type(type), width(width), falloff(falloff)
+	CUDA_CALLABLE Filter(FilterType type=eFilterGaussian, float width=1.0f, float falloff=2.0f) : type(type), width(width), falloff(falloff), offset(0.0f)
 	{
 		if (type == eFilterGaussian)
 			offset = expf(-falloff*width*width);
+
+		invStep = width > 0.0f ? (kFilterTableSize-1)/width : 0.0f;
+
+		for (int i=0; i < kFilterTableSize; ++i)
+			table[i] = Gaussian(i*width/(kFilterTableSize-1));
 	}
 
+	// the filter is separable, this is the product of the weights along x and y
 	CUDA_CALLABLE float Eval(float x, float y) const
 	{
-		if (type == eFilterGaussian)
-			return Gaussian(x)*Gaussian(y);
-		else
+		return Weight(x)*Weight(y);
+	}
+
+	// weight of an offset along one axis, interpolated from the table
+	CUDA_CALLABLE float Weight(float x) const
+	{
+		if (type != eFilterGaussian)
 			return 1.0f;
+
+		const float f = Abs(x)*invStep;
+		const int i = int(f);
+
+		if (i >= kFilterTableSize-1)
+			return 0.0f;
+
+		return Lerp(table[i], table[i+1], f-i);
+	}
+
+	// weights of count pixels along one axis starting at pixel start for a sample at raster coordinate r
+	CUDA_CALLABLE void Weights(float r, int start, int count, float* weights) const
+	{
+		for (int i=0; i < count; ++i)
+			weights[i] = Weight(start+i-r);
 	}
 
 	CUDA_CALLABLE float Gaussian(float x) const
@@ -36,6 +67,9 @@ struct Filter
 	float width;
 	float falloff;
 	float offset;
+
+	float invStep;
+	float table[kFilterTableSize];
 };
 
 
@@ -60,8 +94,231 @@ struct Options
 	
 	int maxDepth;
 	int maxSamples;
+
+	// paths with at least this many bounces may be terminated by russian roulette, negative disables it
+	int rouletteDepth;
+
+	// source of the numbers driving each path
+	SamplerType sampler;
+
+	// adaptive sampling, once a tile has taken adaptiveMinSamples samples per-pixel it stops
+	// when the mean relative standard error of its pixels drops below adaptiveThreshold,
+	// a threshold of zero samples every pixel uniformly
+	float adaptiveThreshold;
+	int adaptiveMinSamples;
+
+	// also accumulate the first hit albedo, normal and depth of every camera path, see GetFeatures()
+	bool features;
+
+	// wavefront renderers sort paths by PathSortKey() before shading them
+	bool reorderPaths;
+
+	// index of the first sample this process takes, frames draw from the sample sequence from
+	// here on so that processes given disjoint ranges can have their results summed
+	int sampleOffset;
+
+	// meshes loaded from here on are stored compressed, see Mesh::Compress()
+	bool compressMeshes;
+};
+
+// rays traced since Init(), primary rays leave the camera, secondary rays extend a path
+// and shadow rays test the visibility of light samples
+struct RayStats
+{
+	CUDA_CALLABLE RayStats() : primary(0), secondary(0), shadow(0) {}
+
+	CUDA_CALLABLE RayStats& operator+=(const RayStats& s)
+	{
+		primary += s.primary;
+		secondary += s.secondary;
+		shadow += s.shadow;
+		return *this;
+	}
+
+	unsigned long long primary;
+	unsigned long long secondary;
+	unsigned long long shadow;
+};
+
+// rays reaching this many box and triangle tests show up red in eComplexity mode
+const float kComplexityScale = 1024.0f;
+
+// false colour for the traversal cost of a ray, ramps from blue through green and yellow
+// to red on a log scale so cheap and pathological regions can both be told apart
+CUDA_CALLABLE inline Color ComplexityColor(const TraversalStats& stats)
+{
+	const float cost = float(stats.boxes + stats.triangles);
+	const float t = Clamp(logf(1.0f + cost)/logf(1.0f + kComplexityScale), 0.0f, 1.0f)*3.0f;
+
+	const Vec3 blue(0.0f, 0.0f, 1.0f);
+	const Vec3 green(0.0f, 1.0f, 0.0f);
+	const Vec3 yellow(1.0f, 1.0f, 0.0f);
+	const Vec3 red(1.0f, 0.0f, 0.0f);
+
+	Vec3 c;
+
+	if (t < 1.0f)
+		c = Lerp(blue, green, t);
+	else if (t < 2.0f)
+		c = Lerp(green, yellow, t-1.0f);
+	else
+		c = Lerp(yellow, red, t-2.0f);
+
+	return Color(c, 1.0f);
+}
+
+// traversal work summed over the camera rays of the last eComplexity frame
+struct ComplexityStats
+{
+	CUDA_CALLABLE ComplexityStats() : rays(0), nodes(0), boxes(0), triangles(0), maxCost(0) {}
+
+	CUDA_CALLABLE void Add(const TraversalStats& s)
+	{
+		rays++;
+		nodes += s.nodes;
+		boxes += s.boxes;
+		triangles += s.triangles;
+		maxCost = Max(maxCost, (unsigned int)(s.boxes + s.triangles));
+	}
+
+	CUDA_CALLABLE ComplexityStats& operator+=(const ComplexityStats& s)
+	{
+		rays += s.rays;
+		nodes += s.nodes;
+		boxes += s.boxes;
+		triangles += s.triangles;
+		maxCost = Max(maxCost, s.maxCost);
+		return *this;
+	}
+
+	unsigned long long rays;
+	unsigned long long nodes;
+	unsigned long long boxes;
+	unsigned long long triangles;
+
+	// most box and triangle tests taken by a single ray
+	unsigned int maxCost;
+};
+
+// stages of the wavefront renderers in the order they run on a wave of paths
+enum WavefrontStage
+{
+	eStageGenerate,
+	eStageAdvance,
+	eStageReorder,
+	eStageLights,
+	eStageBsdfs,
+	eStageTerminate,
+	eNumWavefrontStages
+};
+
+// bounces past the last one are counted in the last entry of WavefrontStats::activePaths
+const int kMaxWavefrontBounces = 16;
+
+// per-stage cost of the last frame rendered by a wavefront renderer, summed over its waves
+struct WavefrontStats
+{
+	WavefrontStats() : numWaves(0), pathsPerWave(0), numBounces(0)
+	{
+		for (int i=0; i < eNumWavefrontStages; ++i)
+		{
+			time[i] = 0.0;
+			paths[i] = 0;
+			rays[i] = 0;
+		}
+
+		for (int i=0; i < kMaxWavefrontBounces; ++i)
+			activePaths[i] = 0;
+	}
+
+	// wall time in milliseconds
+	double time[eNumWavefrontStages];
+
+	// paths each stage ran on and the rays it traced
+	unsigned long long paths[eNumWavefrontStages];
+	unsigned long long rays[eNumWavefrontStages];
+
+	// paths still alive at the start of each bounce
+	unsigned long long activePaths[kMaxWavefrontBounces];
+
+	int numWaves;
+	int pathsPerWave;
+	int numBounces;
+};
+
+// scene bounds that hit points are quantized to by PathSortKey(), planes are left out as they
+// have no extent
+inline Bounds PathSortBounds(const Scene& scene)
+{
+	Bounds bounds;
+
+	for (size_t i=0; i < scene.primitives.size(); ++i)
+	{
+		if (scene.primitives[i].type != ePlane)
+			bounds = Union(bounds, PrimitiveBounds(scene.primitives[i]));
+	}
+
+	// nothing but planes
+	if (bounds.lower.x > bounds.upper.x)
+		bounds = Bounds(Vec3(-1.0f), Vec3(1.0f));
+
+	return bounds;
+}
+
+// paths sharing a key hit the same primitive (and so material) heading into the same
+// octant, within that they are ordered along a Morton curve over the hit positions,
+// the primitive is in the top 8 bits, the octant in the next 3 and 7 bits per axis below
+CUDA_CALLABLE inline unsigned int PathSortKey(int primitive, const Vec3& pos, const Vec3& dir, const Bounds& bounds)
+{
+	// flat scenes have no extent along some axis
+	const Vec3 extent = Max(bounds.upper-bounds.lower, Vec3(1.e-6f));
+	const Vec3 p = pos-bounds.lower;
+
+	const unsigned int cell = unsigned(Morton3(p.x/extent.x, p.y/extent.y, p.z/extent.z)) >> 9;
+	const unsigned int octant = (dir.x < 0.0f ? 1 : 0) | (dir.y < 0.0f ? 2 : 0) | (dir.z < 0.0f ? 4 : 0);
+
+	return (unsigned(Min(primitive, 255)) << 24) | (octant << 21) | cell;
+}
+
+// first hit attributes of a camera path, cleared to zero if the path escapes
+struct PathFeatures
+{
+	Vec3 albedo;
+	Vec3 normal;
+	float depth;
 };
 
+// relative standard error of a pixel's mean given the sum and sum of squares of the luminance
+// of its n samples, dark pixels are measured against a floor so they don't sample forever
+CUDA_CALLABLE inline float PixelError(float sum, float sumSq, int n)
+{
+	const float mean = sum/n;
+	const float variance = Max(0.0f, (sumSq - sum*mean)/(n-1));
+
+	return sqrtf(variance/n)/Max(mean, 0.01f);
+}
+
+// whether a path that has scattered off bounces surfaces, counting the one just sampled, is subject
+// to russian roulette, every renderer counts bounces this way so a setting terminates paths alike
+CUDA_CALLABLE inline bool RouletteActive(int bounces, int rouletteDepth)
+{
+	return rouletteDepth >= 0 && bounces >= rouletteDepth;
+}
+
+// russian roulette, a path survives with probability given by its throughput's luminance and is
+// reweighted so the estimate stays unbiased, returns false if the path should terminate
+CUDA_CALLABLE inline bool RussianRoulette(Vec3& throughput, float u)
+{
+	// dim paths still survive often enough that their weight stays bounded
+	const float survival = Clamp(Luminance(Color(throughput, 0.0f)), 0.05f, 1.0f);
+
+	if (u >= survival)
+		return false;
+
+	throughput /= survival;
+	return true;
+}
+
 
 struct Renderer
 {
@@ -70,10 +327,50 @@ struct Renderer
 	virtual void Init(int width, int height) {}
 	virtual void Render(const Camera& c, const Options& options, Color* output) = 0;
 
+	// takes numSamples samples per-pixel, renderers that can cover several samples with
+	// a single dispatch override this, the default renders them one at a time
+	virtual void RenderSamples(const Camera& c, const Options& options, Color* output, int numSamples)
+	{
+		for (int i=0; i < numSamples; ++i)
+			Render(c, options, output);
+	}
+
+	// renderers that read back asynchronously may write output one frame behind,
+	// waits until output holds every sample rendered so far
+	virtual void Flush(Color* output) {}
+
+	// continues the accumulation restored from a checkpoint, called after Init() with the samples the
+	// next frame should add to, returns false if the renderer can't carry them over
+	virtual bool Resume(const Color* accum) { return false; }
+
+	// true once adaptive sampling has stopped every tile, further samples add nothing
+	virtual bool Converged() const { return false; }
+
+	// number of rays traced since Init(), returns false if the renderer doesn't count them
+	virtual bool GetRayStats(RayStats& stats) { return false; }
+
+	// traversal totals of the last frame rendered in eComplexity mode
+	virtual bool GetComplexity(ComplexityStats& stats) { return false; }
+
+	// per-stage timings and counters of the last frame, only wavefront renderers have stages
+	virtual bool GetWavefrontStats(WavefrontStats& stats) { return false; }
+
+	// copies the feature buffers normalized to unit weight, returns false if they weren't written
+	virtual bool GetFeatures(Color* albedo, Color* normal, Color* depth) { return false; }
+
+	// writes the tone mapped frame filtered by NonLocalMeansFilter() if the renderer can filter
+	// its samples before they are read back, returns false to leave filtering to the caller
+	virtual bool FilterNonLocalMeans(const Options& options, float falloff, int radius, Color* output) { return false; }
+
+	// called after the scene has been reloaded (e.g.: the next frame of a batch) so the renderer
+	// can keep whatever is still referenced, returns false if it has to be recreated instead
+	virtual bool Update(const Scene* s) { return false; }
+
 };
 
 Renderer* CreateNullRenderer(const Scene* s);
 Renderer* CreateCpuRenderer(const Scene* s);
 Renderer* CreateCpuWavefrontRenderer(const Scene* s);
-Renderer* CreateGpuWavefrontRenderer(const Scene* s);
+Renderer* CreateGpuWavefrontRenderer(const Scene* s, size_t meshBudget=0);
 Renderer* CreateGpuRenderer(const Scene* s);
+Renderer* CreateMultiGpuRenderer(const Scene* s);
@@ -2,6 +2,8 @@
 
 #include "maths.h"
 
+#include <vector>
+
 // sample [0,1] with x strata
 CUDA_CALLABLE inline void StratifiedSample1D(int c, int dx, Random& rand, float& r1)
 {
@@ -288,5 +290,254 @@ CUDA_CALLABLE inline void Sample2D(Random& rand, float& u1, float& u2)
 
 }
 
+// integer hash with good avalanche, see https://nullprogram.com/blog/2018/07/31/
+CUDA_CALLABLE inline unsigned int HashUint(unsigned int x)
+{
+	x ^= x >> 16;
+	x *= 0x7feb352du;
+	x ^= x >> 15;
+	x *= 0x846ca68bu;
+	x ^= x >> 16;
+
+	return x;
+}
+
+CUDA_CALLABLE inline unsigned int HashCombine(unsigned int seed, unsigned int v)
+{
+	return seed ^ (v + 0x9e3779b9u + (seed << 6) + (seed >> 2));
+}
+
+CUDA_CALLABLE inline unsigned int ReverseBits(unsigned int x)
+{
+	x = (x << 16) | (x >> 16);
+	x = ((x & 0x00ff00ffu) << 8) | ((x & 0xff00ff00u) >> 8);
+	x = ((x & 0x0f0f0f0fu) << 4) | ((x & 0xf0f0f0f0u) >> 4);
+	x = ((x & 0x33333333u) << 2) | ((x & 0xccccccccu) >> 2);
+	x = ((x & 0x55555555u) << 1) | ((x & 0xaaaaaaaau) >> 1);
+
+	return x;
+}
+
+// Owen scrambling of a 32 bit fixed point value in [0, 1), each bit is flipped based on a hash
+// of the bits above it, "Practical Hash-based Owen Scrambling", Burley 2020
+CUDA_CALLABLE inline unsigned int OwenScramble(unsigned int x, unsigned int seed)
+{
+	// Laine-Karras permutation on the reversed bits only propagates from low to high bits
+	x = ReverseBits(x);
+
+	x += seed;
+	x ^= x*0x6c50b47cu;
+	x ^= x*0xb82f1e52u;
+	x ^= x*0xc7afe638u;
+	x ^= x*0x8d22f6e6u;
+
+	return ReverseBits(x);
+}
+
+// the first two dimensions of the Sobol sequence, neither needs a table of direction numbers
+CUDA_CALLABLE inline unsigned int Sobol0(unsigned int index)
+{
+	return ReverseBits(index);
+}
+
+CUDA_CALLABLE inline unsigned int Sobol1(unsigned int index)
+{
+	unsigned int result = 0;
+
+	// direction numbers of the primitive polynomial x + 1
+	for (unsigned int v = 1u << 31; index; index >>= 1, v ^= v >> 1)
+	{
+		if (index & 1)
+			result ^= v;
+	}
+
+	return result;
+}
+
+// maps 32 bit fixed point to a float strictly less than one
+CUDA_CALLABLE inline float FixedToUnitFloat(unsigned int x)
+{
+	return float(x >> 8)*(1.0f/16777216.0f);
+}
+
+enum SamplerType
+{
+	eSamplerRandom,
+	eSamplerSobol
+};
+
+// the source of every number a path consumes, dimensions are handed out in the order
+// they are drawn so the same decision along a path always lands on the same dimension
+//
+// eSamplerRandom draws from one pseudo-random stream and ignores the pixel and sample index
+//
+// eSamplerSobol is a scrambled (0,2) sequence over the samples of a pixel, each 1D or 2D draw
+// is a new padded pattern: the sample index is shuffled and both dimensions are Owen scrambled
+// with a hash of the pixel and the draw so patterns are decorrelated from each other
+struct Sampler
+{
+	CUDA_CALLABLE inline Sampler(SamplerType type=eSamplerRandom, int seed=0) : rand(seed), type(type), seed(HashUint(seed)), index(0), dimension(0) {}
+
+	// begins the sampleIndex'th sample of a pixel
+	CUDA_CALLABLE inline void Start(unsigned int pixel, unsigned int sampleIndex)
+	{
+		seed = HashUint(pixel ^ 0x5bd1e995u);
+		index = sampleIndex;
+		dimension = 0;
+	}
+
+	// returns a number in [0, 1) from the next dimension
+	CUDA_CALLABLE inline float Randf()
+	{
+		if (type == eSamplerSobol)
+		{
+			const unsigned int pattern = HashCombine(seed, dimension++);
+
+			return FixedToUnitFloat(OwenScramble(Sobol0(OwenScramble(index, pattern)), HashUint(pattern)));
+		}
+
+		return rand.Randf();
+	}
 
+	CUDA_CALLABLE inline float Randf(float min, float max)
+	{
+		return min + (max-min)*Randf();
+	}
+
+	// returns a point in [0, 1)^2 from the next pair of dimensions
+	CUDA_CALLABLE inline void Randf2(float& u1, float& u2)
+	{
+		if (type == eSamplerSobol)
+		{
+			const unsigned int pattern = HashCombine(seed, dimension++);
+			const unsigned int shuffled = OwenScramble(index, pattern);
+
+			u1 = FixedToUnitFloat(OwenScramble(Sobol0(shuffled), HashUint(pattern)));
+			u2 = FixedToUnitFloat(OwenScramble(Sobol1(shuffled), HashUint(pattern+1)));
+		}
+		else
+		{
+			u1 = rand.Randf();
+			u2 = rand.Randf();
+		}
+	}
 
+	Random rand;
+
+	SamplerType type;
+
+	unsigned int seed;
+	unsigned int index;
+	unsigned int dimension;
+};
+
+CUDA_CALLABLE inline void Sample1D(Sampler& sampler, float& u1)
+{
+	u1 = sampler.Randf();
+}
+
+CUDA_CALLABLE inline void Sample2D(Sampler& sampler, float& u1, float& u2)
+{
+	sampler.Randf2(u1, u2);
+}
+
+
+// alias table entry for sampling a discrete distribution in constant time, a uniformly
+// chosen entry i is kept with probability keep and replaced by alias otherwise
+struct AliasEntry
+{
+	float keep;
+	int alias;
+
+	// normalized weight of entry i
+	float pdf;
+};
+
+// builds an alias table for n weights using Vose's method, entries with zero weight are
+// never sampled, returns false (and a uniform table) if all weights are zero
+inline bool BuildAliasTable(const float* weights, int n, AliasEntry* table)
+{
+	double sum = 0.0;
+	for (int i=0; i < n; ++i)
+		sum += weights[i];
+
+	if (sum <= 0.0)
+	{
+		for (int i=0; i < n; ++i)
+		{
+			table[i].keep = 1.0f;
+			table[i].alias = i;
+			table[i].pdf = 1.0f/n;
+		}
+
+		return false;
+	}
+
+	// scaled probabilities, entries below one are filled up by entries above one, every
+	// entry is on at most one of the two stacks so they share storage growing from either end
+	std::vector<double> scaled(n);
+	std::vector<int> stacks(n);
+
+	int* small = &stacks[0];
+	int* large = &stacks[0] + n;
+
+	int numSmall = 0;
+	int numLarge = 0;
+
+	for (int i=0; i < n; ++i)
+	{
+		table[i].pdf = float(weights[i]/sum);
+		table[i].alias = i;
+
+		scaled[i] = weights[i]*n/sum;
+
+		if (scaled[i] < 1.0)
+			small[numSmall++] = i;
+		else
+			large[-++numLarge] = i;
+	}
+
+	while (numSmall > 0 && numLarge > 0)
+	{
+		const int s = small[--numSmall];
+		const int l = large[-numLarge];
+
+		table[s].keep = float(scaled[s]);
+		table[s].alias = l;
+
+		scaled[l] -= 1.0 - scaled[s];
+
+		if (scaled[l] < 1.0)
+		{
+			--numLarge;
+			small[numSmall++] = l;
+		}
+	}
+
+	// whatever remains is one up to round off
+	for (int i=0; i < numLarge; ++i)
+		table[large[-1-i]].keep = 1.0f;
+
+	for (int i=0; i < numSmall; ++i)
+		table[small[i]].keep = 1.0f;
+
+	return true;
+}
+
+// maps a uniform number in [0, 1) to an entry of the table
+CUDA_CALLABLE inline int SampleAlias(const AliasEntry* table, int n, float u)
+{
+	const float x = u*n;
+	const int i = Min(int(x), n-1);
+
+	return (x - i) < table[i].keep ? i : table[i].alias;
+}
+
+// as above but with a separate number for the keep test, large tables leave too few
+// bits of a single float for it once the index has been taken out
+CUDA_CALLABLE inline int SampleAlias(const AliasEntry* table, int n, float u1, float u2)
+{
+	const int i = Min(int(u1*n), n-1);
+
+	return u2 < table[i].keep ? i : table[i].alias;
+}
@@ -1,16 +1,371 @@
 #include "scene.h"
 #include "intersection.h"
+#include "util.h"
+#include "perlin.h"
+#include "parallel.h"
+
+#include <set>
+
+namespace
+{
+
+// bump when the generator or the layout of cached textures changes
+const int kTextureCacheVersion = 1;
+
+struct TextureCacheHeader
+{
+	int version;
+	int width;
+	int height;
+	int depth;
+
+	float lower;
+	float scale;
+};
+
+bool ReadTextureCache(const char* path, Texture& texture)
+{
+	FILE* file = fopen(path, "rb");
+
+	if (!file)
+		return false;
+
+	TextureCacheHeader header;
+
+	bool valid = fread(&header, sizeof(header), 1, file) == 1 &&
+				 header.version == kTextureCacheVersion &&
+				 header.width == texture.width &&
+				 header.height == texture.height &&
+				 header.depth == texture.depth;
+
+	if (valid)
+	{
+		const size_t numTexels = size_t(texture.width)*texture.height*texture.depth;
+
+		texture.data = new unsigned short[numTexels];
+		texture.lower = header.lower;
+		texture.scale = header.scale;
+
+		if (fread(texture.data, sizeof(unsigned short), numTexels, file) != numTexels)
+		{
+			delete[] texture.data;
+			texture.data = NULL;
+
+			valid = false;
+		}
+	}
+
+	fclose(file);
+
+	return valid;
+}
+
+void WriteTextureCache(const char* path, const Texture& texture)
+{
+	// written to a temporary file and moved into place like the mesh cache, so concurrent
+	// renders of the same scene never read a partial texture, the suffix keeps writers apart
+	char suffix[64];
+	sprintf(suffix, ".%llx.tmp", (unsigned long long)(uint64_t(GetSeconds()*1.0e9) ^ uint64_t(uintptr_t(&texture))));
+
+	const std::string tempPath = std::string(path) + suffix;
+
+	FILE* file = fopen(tempPath.c_str(), "wb");
+
+	if (!file)
+	{
+		printf("Couldn't open %s for writing.\n", tempPath.c_str());
+		return;
+	}
+
+	TextureCacheHeader header;
+	header.version = kTextureCacheVersion;
+	header.width = texture.width;
+	header.height = texture.height;
+	header.depth = texture.depth;
+	header.lower = texture.lower;
+	header.scale = texture.scale;
+
+	fwrite(&header, sizeof(header), 1, file);
+	fwrite(texture.data, sizeof(unsigned short), size_t(texture.width)*texture.height*texture.depth, file);
+
+	fclose(file);
+
+#if _WIN32
+	remove(path);
+#endif
+	if (rename(tempPath.c_str(), path) != 0)
+	{
+		printf("Could not write texture cache %s\n", path);
+		remove(tempPath.c_str());
+	}
+}
+
+// bitwise comparison, any change at all causes a rebuild
+bool SameBounds(const std::vector<Bounds>& a, const std::vector<Bounds>& b)
+{
+	if (a.size() != b.size())
+		return false;
+
+	return a.empty() || memcmp(&a[0], &b[0], sizeof(Bounds)*a.size()) == 0;
+}
+
+} // anonymous namespace
+
+const MeshGeometry* Scene::GetMeshGeometry(const Mesh* mesh)
+{
+	MeshGeometryMap::iterator iter = meshGeometry.find(mesh->id);
+
+	if (iter == meshGeometry.end())
+	{
+		MeshGeometryEntry entry;
+		entry.mesh = mesh;
+		entry.geometry = GeometryFromMesh(mesh);
+
+		iter = meshGeometry.insert(std::make_pair(mesh->id, entry)).first;
+	}
+
+	return &iter->second.geometry;
+}
 
 void Scene::Build()
 {
-	// build scene bvh
+	// release resident assets the primitives no longer reference
+	std::set<unsigned long> referenced;
+
+	for (size_t i=0; i < primitives.size(); ++i)
+	{
+		if (primitives[i].type == eMesh)
+			referenced.insert(primitives[i].mesh->id);
+	}
+
+	for (MeshGeometryMap::iterator iter=meshGeometry.begin(); iter != meshGeometry.end();)
+	{
+		if (referenced.count(iter->first) == 0)
+		{
+			meshGeometry.erase(iter++);
+		}
+		else
+		{
+			// rebuilt or refit trees may have reallocated the mesh's arrays, the entry stays
+			// put so the primitives' pointers to it remain valid
+			iter->second.geometry = GeometryFromMesh(iter->second.mesh);
+			++iter;
+		}
+	}
+
+	for (MeshCache::iterator iter=residentMeshes.begin(); iter != residentMeshes.end();)
+	{
+		if (referenced.count(iter->second->id) == 0)
+		{
+			delete iter->second;
+
+			residentDeformations.erase(iter->first);
+			residentMeshes.erase(iter++);
+		}
+		else
+		{
+			++iter;
+		}
+	}
+
+	for (ProbeCache::iterator iter=residentProbes.begin(); iter != residentProbes.end();)
+	{
+		if (iter->second.data != sky.probe.data)
+		{
+			ProbeDestroy(iter->second);
+			residentProbes.erase(iter++);
+		}
+		else
+		{
+			++iter;
+		}
+	}
+
+	std::set<const unsigned short*> textures;
+
+	for (size_t i=0; i < materials.size(); ++i)
+		textures.insert(materials[i].bumpMap.data);
+
+	for (TextureCache::iterator iter=residentTextures.begin(); iter != residentTextures.end();)
+	{
+		if (textures.count(iter->second.data) == 0)
+		{
+			TextureDestroy(iter->second);
+			residentTextures.erase(iter++);
+		}
+		else
+		{
+			++iter;
+		}
+	}
+
+	// materials only evaluate the lobes they have weight in
+	for (size_t i=0; i < materials.size(); ++i)
+		materials[i].lobes = materials[i].GetLobes();
+
+	// light list, rebuilt every time as emission may change without anything moving
+	lights.resize(0);
+	lightSelectPdf.assign(primitives.size(), 0.0f);
+
+	std::vector<float> power;
+
+	for (size_t i=0; i < primitives.size(); ++i)
+	{
+		const Primitive& p = primitives[i];
+
+		// planes have no area to sample
+		const float area = PrimitiveArea(p);
+
+		if (p.lightSamples && area > 0.0f)
+		{
+			lights.push_back(int(i));
+			power.push_back(Luminance(Color(materials[p.material].emission, 0.0f))*area);
+		}
+	}
+
+	lightTable.resize(lights.size());
+
+	if (!lights.empty())
+	{
+		BuildAliasTable(&power[0], int(lights.size()), &lightTable[0]);
+
+		for (size_t i=0; i < lights.size(); ++i)
+			lightSelectPdf[lights[i]] = lightTable[i].pdf;
+	}
+
+	// flag moving primitives, static ones are intersected through a precomputed inverse
+	bool anyMoving = false;
+
+	for (size_t i=0; i < primitives.size(); ++i)
+	{
+		Primitive& p = primitives[i];
+
+		p.moving = memcmp(&p.startTransform, &p.endTransform, sizeof(Transform)) != 0;
+		p.inverseTransform = Inverse(p.startTransform);
+
+		anyMoving |= p.moving;
+	}
+
+	const int numSegments = anyMoving ? kMotionSegments : 1;
+
+	// build scene bvh, one per motion segment bounding only that part of the shutter
 	std::vector<Bounds> primitiveBounds;
-	for (int i=0; i < primitives.size(); ++i)
+	for (int s=0; s < numSegments; ++s)
 	{
-		Bounds r = PrimitiveBounds(primitives[i]);
-		primitiveBounds.push_back(r);
+		const float time0 = float(s)/numSegments;
+		const float time1 = float(s+1)/numSegments;
+
+		for (size_t i=0; i < primitives.size(); ++i)
+		{
+			Bounds r = PrimitiveBounds(primitives[i], time0, time1);
+			primitiveBounds.push_back(r);
+		}
 	}
 
-	BVHBuilder builder;
-	bvh = builder.Build(&primitiveBounds[0], primitiveBounds.size());
-}
\ No newline at end of file
+	// leaves only refer to primitive indices, so if nothing moved the previous trees still apply
+	if (bvh[0].nodes && SameBounds(primitiveBounds, bvhBounds))
+		return;
+
+	for (int s=0; s < kMotionSegments; ++s)
+	{
+		delete[] bvh[s].nodes;
+		bvh[s] = BVH();
+
+		delete[] wideBvh[s].nodes;
+		wideBvh[s] = WideBVH();
+	}
+
+	numMotionSegments = numSegments;
+
+	bvhBounds = primitiveBounds;
+
+	if (primitives.empty())
+		return;
+
+	for (int s=0; s < numSegments; ++s)
+	{
+		BVHBuilder builder;
+		bvh[s] = builder.Build(&primitiveBounds[s*primitives.size()], primitives.size());
+
+#if USE_WIDE_BVH
+		wideBvh[s] = CollapseBVH<WideBVHNode>(bvh[s]);
+#endif
+	}
+}
+
+Texture CreatePerlinTexture(int width, int height, int depth, float freq, int octaves, float persistence, const char* cachePath)
+{
+	double start = GetSeconds();
+
+	Texture texture;
+	texture.width = width;
+	texture.height = height;
+	texture.depth = depth;
+
+	if (cachePath && ReadTextureCache(cachePath, texture))
+		return texture;
+
+	const int sliceSize = width*height;
+
+	// evaluated at full precision first as the range is needed for quantization
+	std::vector<float> values(size_t(sliceSize)*depth);
+	std::vector<float> sliceMin(depth);
+	std::vector<float> sliceMax(depth);
+
+	ParallelFor(depth, [&](int z, int worker)
+	{
+		float* slice = &values[size_t(z)*sliceSize];
+
+		float lower = FLT_MAX;
+		float upper = -FLT_MAX;
+
+		for (int y=0; y < height; ++y)
+		{
+			for (int x=0; x < width; ++x)
+			{
+				const float v = Perlin3DPeriodic(x*freq, y*freq, z*freq, width, height, depth, octaves, persistence);
+
+				slice[y*width + x] = v;
+
+				lower = Min(lower, v);
+				upper = Max(upper, v);
+			}
+		}
+
+		sliceMin[z] = lower;
+		sliceMax[z] = upper;
+	});
+
+	float lower = FLT_MAX;
+	float upper = -FLT_MAX;
+
+	for (int z=0; z < depth; ++z)
+	{
+		lower = Min(lower, sliceMin[z]);
+		upper = Max(upper, sliceMax[z]);
+	}
+
+	texture.lower = lower;
+	texture.scale = (upper-lower)/65535.0f;
+
+	const float rcpScale = texture.scale > 0.0f ? 1.0f/texture.scale : 0.0f;
+
+	texture.data = new unsigned short[values.size()];
+
+	ParallelFor(depth, [&](int z, int worker)
+	{
+		const size_t begin = size_t(z)*sliceSize;
+
+		for (size_t i=begin; i < begin + sliceSize; ++i)
+			texture.data[i] = (unsigned short)Clamp(int((values[i]-lower)*rcpScale + 0.5f), 0, 65535);
+	});
+
+	if (cachePath)
+		WriteTextureCache(cachePath, texture);
+
+	double end = GetSeconds();
+
+	printf("Created %dx%dx%d noise texture in %fms\n", width, height, depth, (end-start)*1000.0f);
+
+	return texture;
+}
@@ -5,7 +5,10 @@
 #include "bvh.h"
 #include "skylight.h"
 #include "probe.h"
+#include "sampler.h"
 
+#include <map>
+#include <string>
 #include <vector>
 
 struct Camera
@@ -30,17 +33,50 @@ struct Camera
 };
 
 
+// 3D texture with texels quantized to 16 bits over the range of the texture, see TexelValue()
 struct Texture
 {
-	Texture() : data(NULL), width(0), height(0), depth(0) {}
+	Texture() : data(NULL), width(0), height(0), depth(0), lower(0.0f), scale(0.0f) {}
 
-	float* data;
+	unsigned short* data;
 
 	int width;
 	int height;
 	int depth;
+
+	// texel values are lower + scale*data[i]
+	float lower;
+	float scale;
 };
 
+CUDA_CALLABLE inline float TexelValue(const Texture& texture, int index)
+{
+	return texture.lower + texture.scale*float(texture.data[index]);
+}
+
+inline void TextureDestroy(Texture& texture)
+{
+	delete[] texture.data;
+	texture = Texture();
+}
+
+// periodic Perlin noise volume sampled over a grid of the given size, slices are generated in
+// parallel, the volume is read from and written to cachePath when that isn't NULL
+Texture CreatePerlinTexture(int width, int height, int depth, float freq, int octaves, float persistence, const char* cachePath);
+
+
+// lobes of the BSDF a material gives weight to, shading is specialized on
+// the common combinations so that it skips the lobes a material doesn't have
+enum BSDFLobes
+{
+	eLobeReflection = 1<<0,		// transmission < 1
+	eLobeDiffuse = 1<<1,		// metallic < 1, subsurface < 1 and transmission < 1
+	eLobeSubsurface = 1<<2,		// subsurface > 0
+	eLobeClearcoat = 1<<3,		// clearcoat != 0
+	eLobeTransmission = 1<<4,	// transmission > 0
+
+	eLobeAll = 0x1f
+};
 
 struct Material
 {
@@ -67,6 +103,26 @@ struct Material
 		bump = 0.0f;
 		bumpTile = 10.0f;
 
+		lobes = eLobeAll;
+	}
+
+	// lobes with any weight, stored in lobes by Scene::Build()
+	CUDA_CALLABLE inline int GetLobes() const
+	{
+		int l = 0;
+
+		if (transmission < 1.0f)
+			l |= eLobeReflection;
+		if (metallic < 1.0f && subsurface < 1.0f && transmission < 1.0f)
+			l |= eLobeDiffuse;
+		if (subsurface > 0.0f)
+			l |= eLobeSubsurface;
+		if (clearcoat != 0.0f)
+			l |= eLobeClearcoat;
+		if (transmission > 0.0f)
+			l |= eLobeTransmission;
+
+		return l;
 	}
 
 	CUDA_CALLABLE inline float GetIndexOfRefraction() const
@@ -97,6 +153,9 @@ struct Material
 	Texture bumpMap;
 	float bump;
 	Vec3 bumpTile;
+
+	// BSDFLobes, eLobeAll until the scene is built
+	int lobes;
 };
 
 enum GeometryType
@@ -123,25 +182,89 @@ struct MeshGeometry
 	const Vec3* normals;
 	const int* indices;
 	const BVHNode* nodes;
-	const float* cdf;
+	const AliasEntry* triangleTable;
+
+	// parent links for stackless traversal, only built for the GPU copy
+	const BVHLink* links;
+
+	// optional wide tree and its triangle packets for CPU traversal, NULL on the GPU
+	const MeshWideBVHNode* wideNodes;
+	const TriPacket* packets;
 
 	int numVertices;
 	int numIndices;
 	int numNodes;
+	int numWideNodes;
+	int numPackets;
 
 	float area;
 
+	// compressed meshes leave positions, normals and indices NULL, use the accessors below
+	CompressedVertices compressed;
+
 	unsigned long id;
+	unsigned long generation;
 };
 
+// vertex data of a mesh, compressed attributes are decoded on the fly
+CUDA_CALLABLE inline void MeshTriangle(const MeshGeometry& mesh, int tri, int& i0, int& i1, int& i2)
+{
+	if (mesh.compressed.positions)
+	{
+		const int base = mesh.compressed.clusterBases[tri>>kIndexClusterShift];
 
-struct Primitive
+		if (base >= 0)
+		{
+			i0 = base + mesh.compressed.indices[tri*3+0];
+			i1 = base + mesh.compressed.indices[tri*3+1];
+			i2 = base + mesh.compressed.indices[tri*3+2];
+		}
+		else
+		{
+			const int offset = -1 - base + (tri&(kIndexClusterSize-1))*3;
+
+			i0 = mesh.compressed.wideIndices[offset+0];
+			i1 = mesh.compressed.wideIndices[offset+1];
+			i2 = mesh.compressed.wideIndices[offset+2];
+		}
+	}
+	else
+	{
+		i0 = fetchInt(mesh.indices, tri*3+0);
+		i1 = fetchInt(mesh.indices, tri*3+1);
+		i2 = fetchInt(mesh.indices, tri*3+2);
+	}
+}
+
+CUDA_CALLABLE inline Vec3 MeshPosition(const MeshGeometry& mesh, int i)
 {
-	Primitive() : lightSamples(0) {}
+	if (mesh.compressed.positions)
+		return DecodePosition(mesh.compressed, mesh.compressed.positions[i]);
+	else
+		return fetchVec3(mesh.positions, i);
+}
 
+CUDA_CALLABLE inline Vec3 MeshNormal(const MeshGeometry& mesh, int i)
+{
+	if (mesh.compressed.positions)
+		return DecodeNormal(mesh.compressed.normals[i]);
+	else
+		return fetchVec3(mesh.normals, i);
+}
+
+
+// the part of a primitive intersection needs, meshes are referenced rather than
+// copied so that any number of instances share one mesh and its BVH
+struct PrimitiveGeometry
+{
 	// begin end transforms for the primitive
 	Transform startTransform;	
 	Transform endTransform;
+
+	// set by Scene::Build(), primitives that don't move are intersected using
+	// startTransform and its precomputed inverse whatever the ray's time
+	bool moving;
+	Transform inverseTransform;
 	
 	GeometryType type;
 
@@ -149,10 +272,19 @@ struct Primitive
 	{
 		SphereGeometry sphere;
 		PlaneGeometry plane;
-		MeshGeometry mesh;
+
+		// owned by Scene::meshGeometry, or by the renderer for device copies
+		const MeshGeometry* mesh;
 	};
+};
+
+// an instance of a shape, holds only its transforms, geometry and material index
+struct Primitive : public PrimitiveGeometry
+{
+	Primitive() : material(-1), lightSamples(0) { moving = true; }
 
-	Material material;
+	// index into Scene::materials, AddPrimitive() gives -1 a default material
+	int material;
 
 	// if > 0 then primitive will be explicitly sampled
 	int lightSamples;
@@ -177,11 +309,32 @@ struct Sky
 		}
 	}
 
+	// reads the probe at the mip level given by ProbeLod(), the gradient is unaffected
+	CUDA_CALLABLE Vec3 Eval(const Vec3& dir, float lod) const
+	{
+		if (probe.valid)
+			return ProbeEvalLod(probe, ProbeDirToUV(dir), lod);
+		else
+			return Eval(dir);
+	}
+
 	// map
 };
 
+// the scene BVH is split into equal intervals of the shutter when anything moves so that
+// fast moving primitives are only bounded over the part of their motion a ray could see
+const int kMotionSegments = 4;
+
+// index of the interval a ray time in [0, 1] falls into
+CUDA_CALLABLE inline int MotionSegment(float time, int numSegments)
+{
+	return Clamp(int(time*numSegments), 0, numSegments-1);
+}
+
 struct Scene
 {
+	Scene() : numMotionSegments(1) {}
+
 	// contiguous buffer for the data
 	typedef std::vector<Primitive> PrimitiveArray;
 	PrimitiveArray primitives;
@@ -189,11 +342,58 @@ struct Scene
 	typedef std::vector<Mesh*> MeshArray;
 	MeshArray meshes;
 
+	// materials referenced by index from the primitives
+	std::vector<Material> materials;
+
+	// geometry of each mesh referenced by the primitives keyed by mesh id, shared by all instances,
+	// the mesh is kept so that Build() can refresh its geometry after a rebuild or refit
+	struct MeshGeometryEntry
+	{
+		const Mesh* mesh;
+		MeshGeometry geometry;
+	};
+
+	typedef std::map<unsigned long, MeshGeometryEntry> MeshGeometryMap;
+	MeshGeometryMap meshGeometry;
+
 	Sky sky;
 	Camera camera;	
 
-	BVH bvh;
+	// meshes and probes loaded from files keyed by path, these stay resident across
+	// Clear() so that consecutive batch frames referencing the same files don't reload
+	// them, Build() releases the ones the new frame no longer uses
+	typedef std::map<std::string, Mesh*> MeshCache;
+	MeshCache residentMeshes;
+
+	// file each deformed resident mesh last took its vertices from, see Mesh::Deform()
+	std::map<std::string, std::string> residentDeformations;
+
+	typedef std::map<std::string, Probe> ProbeCache;
+	ProbeCache residentProbes;
+
+	// procedural textures keyed by their parameters, shared by every material using the same ones
+	typedef std::map<std::string, Texture> TextureCache;
+	TextureCache residentTextures;
+
+	// one tree per motion segment, only the first is built if nothing moves
+	BVH bvh[kMotionSegments];
+	WideBVH wideBvh[kMotionSegments];
+
+	int numMotionSegments;
+
+	// primitive bounds of every segment the trees were built from
+	std::vector<Bounds> bvhBounds;
 
+	// indices of the primitives sampled by next event estimation, lights are
+	// picked with a probability proportional to their emitted power
+	std::vector<int> lights;
+	std::vector<AliasEntry> lightTable;
+
+	// probability of each primitive being picked as a light, zero if it never is
+	std::vector<float> lightSelectPdf;
+
+	// releases the primitives and the meshes owned by the frame, the top level trees
+	// are kept so that Build() can reuse them if the primitives haven't moved
 	void Clear()
 	{
 		for (int i=0; i < meshes.size(); ++i)
@@ -201,16 +401,60 @@ struct Scene
 
 		meshes.resize(0);
 		primitives.resize(0);
+		materials.resize(0);
+		meshGeometry.clear();
+	}
+
+	// releases everything, including resident assets
+	void Destroy()
+	{
+		Clear();
 
-		delete bvh.nodes;
-		bvh.nodes = NULL;
+		for (MeshCache::iterator iter=residentMeshes.begin(); iter != residentMeshes.end(); ++iter)
+			delete iter->second;
+
+		for (ProbeCache::iterator iter=residentProbes.begin(); iter != residentProbes.end(); ++iter)
+			ProbeDestroy(iter->second);
+
+		for (TextureCache::iterator iter=residentTextures.begin(); iter != residentTextures.end(); ++iter)
+			TextureDestroy(iter->second);
+
+		residentMeshes.clear();
+		residentDeformations.clear();
+		residentProbes.clear();
+		residentTextures.clear();
+
+		for (int i=0; i < kMotionSegments; ++i)
+		{
+			delete[] bvh[i].nodes;
+			bvh[i] = BVH();
+
+			delete[] wideBvh[i].nodes;
+			wideBvh[i] = WideBVH();
+		}
+
+		numMotionSegments = 1;
+
+		bvhBounds.resize(0);
+	}
+
+	int AddMaterial(const Material& m)
+	{
+		materials.push_back(m);
+		return int(materials.size())-1;
 	}
 
 	void AddPrimitive(const Primitive& p)
 	{
 		primitives.push_back(p);
+
+		if (p.material < 0)
+			primitives.back().material = AddMaterial(Material());
 	}
 
+	// returns the geometry instances of the mesh should reference, the mesh must outlive the frame
+	const MeshGeometry* GetMeshGeometry(const Mesh* mesh);
+
 	void Build();
 };
 
@@ -18,13 +18,16 @@ void TestMaterials(Scene* scene, Camera* camera, Options* options)
     for (int i=0; i < rowSize; ++i)
     {
         Primitive sphere;
+        Material material;
         sphere.type = eSphere;
         sphere.sphere.radius = r;
         sphere.startTransform = Transform(Vec3(-x + i*dx, y, 0.0f));
         sphere.endTransform = Transform(Vec3(-x + i*dx, y, 0.0f));
-        sphere.material.color = Vec3(.82f, .67f, .16f);
-        sphere.material.metallic = float(i)/(rowSize-1);
-        sphere.material.roughness = 0.25f;
+        material.color = Vec3(.82f, .67f, .16f);
+        material.metallic = float(i)/(rowSize-1);
+        material.roughness = 0.25f;
+
+        sphere.material = scene->AddMaterial(material);
 
         scene->AddPrimitive(sphere);
     }
@@ -34,16 +37,19 @@ void TestMaterials(Scene* scene, Camera* camera, Options* options)
 	for (int i=0; i < rowSize; ++i)
     {
         Primitive sphere;
+        Material material;
         sphere.type = eSphere;
         sphere.sphere.radius = r;
         sphere.startTransform = Transform(Vec3(-x + i*dx, y, 0.0f));
         sphere.endTransform = Transform(Vec3(-x + i*dx, y, 0.0f));
-        sphere.material.color = Vec3(SrgbToLinear(Color(.05f, .57f, .36f)));
-        sphere.material.metallic = 0.0f;
+        material.color = Vec3(SrgbToLinear(Color(.05f, .57f, .36f)));
+        material.metallic = 0.0f;
 
         float shiny = Max(0.0f, Sqr(1.0f-float(i)/(rowSize-1)));
-		sphere.material.specular = 0.75f;
-		sphere.material.roughness = shiny;
+		material.specular = 0.75f;
+		material.roughness = shiny;
+        
+        sphere.material = scene->AddMaterial(material);
         
         scene->AddPrimitive(sphere);
     }
@@ -53,14 +59,17 @@ void TestMaterials(Scene* scene, Camera* camera, Options* options)
 	for (int i=0; i < rowSize; ++i)
     {
         Primitive sphere;
+        Material material;
         sphere.type = eSphere;
         sphere.sphere.radius = r;
         sphere.startTransform = Transform(Vec3(-x + i*dx, y, 0.0f));
         sphere.endTransform = Transform(Vec3(-x + i*dx, y, 0.0f));
-        sphere.material.color = Vec3(SrgbToLinear(Color(0.9)));
-        sphere.material.metallic = 0.0f;
-		sphere.material.transmission = float(i)/(rowSize-1);		
-		sphere.material.roughness = 0.01f;
+        material.color = Vec3(SrgbToLinear(Color(0.9)));
+        material.metallic = 0.0f;
+		material.transmission = float(i)/(rowSize-1);		
+		material.roughness = 0.01f;
+        
+        sphere.material = scene->AddMaterial(material);
         
         scene->AddPrimitive(sphere);
     }
@@ -71,13 +80,16 @@ void TestMaterials(Scene* scene, Camera* camera, Options* options)
     for (int i=0; i < rowSize; ++i)
     {
         Primitive sphere;
+        Material material;
         sphere.type = eSphere;
         sphere.sphere.radius = r;
         sphere.startTransform = Transform(Vec3(-x + i*dx, y, 0.0f));
         sphere.endTransform = Transform(Vec3(-x + i*dx, y, 0.0f));
-        sphere.material.subsurface = float(i)/(rowSize-1);
-		sphere.material.color = SrgbToLinear(Color(0.7f));
-		sphere.material.specular = 0.0f;
+        material.subsurface = float(i)/(rowSize-1);
+		material.color = SrgbToLinear(Color(0.7f));
+		material.specular = 0.0f;
+
+        sphere.material = scene->AddMaterial(material);
 
         scene->AddPrimitive(sphere);
     }
@@ -115,7 +127,7 @@ void TestMaterials(Scene* scene, Camera* camera, Options* options)
 	plaster.roughness = 0.5;
 	plaster.specular = 0.1;
 
-	Material mats[6] = { gold, silver, copper, iron, aluminum, plaster };
+	int mats[6] = { scene->AddMaterial(gold), scene->AddMaterial(silver), scene->AddMaterial(copper), scene->AddMaterial(iron), scene->AddMaterial(aluminum), scene->AddMaterial(plaster) };
 
 	for (int i=0; i < 6; ++i)
     {
@@ -136,7 +148,10 @@ void TestMaterials(Scene* scene, Camera* camera, Options* options)
     plane.plane.plane[1] = 1.0f;
     plane.plane.plane[2] = 0.0f;
     plane.plane.plane[3] = 0.0f;
-    plane.material.color = Vec3(0.5);
+
+    Material planeMaterial;
+    planeMaterial.color = Vec3(0.5);
+    plane.material = scene->AddMaterial(planeMaterial);
 
     Primitive back;
     back.type = ePlane;
@@ -144,15 +159,21 @@ void TestMaterials(Scene* scene, Camera* camera, Options* options)
     back.plane.plane[1] = 0.0f;
     back.plane.plane[2] = 1.0f;
     back.plane.plane[3] = 5.0f;
-    back.material.color = Vec3(0.1);
+
+    Material backMaterial;
+    backMaterial.color = Vec3(0.1);
+    back.material = scene->AddMaterial(backMaterial);
 
     Primitive light;
     light.type = eSphere;
     light.sphere.radius = 1.0f;
     light.startTransform = Transform(Vec3(0.0f, 6.0f, 6.0f));
 	light.endTransform = light.startTransform;
-    light.material.color = Vec3(0.0f);
-    light.material.emission = Vec3(15.0f);
+
+    Material lightMaterial;
+    lightMaterial.color = Vec3(0.0f);
+    lightMaterial.emission = Vec3(15.0f);
+    light.material = scene->AddMaterial(lightMaterial);
     light.lightSamples = 1;
 
     
@@ -203,25 +224,28 @@ void TestPaniq(Scene* scene, Camera* camera, Options* options)
 
 	Mesh* obj = ImportMeshFromObj("data/brain.obj");
 	obj->Normalize(1.f);
-	MeshGeometry mesh = GeometryFromMesh(obj);
+	const MeshGeometry* mesh = scene->GetMeshGeometry(obj);
 
 	for (int y=0; y < 4; ++y)
 	{
 		for (int x=0; x < 4; ++x)
 		{
 			Primitive sphere;
+			Material material;
 			//sphere.type = eSphere;
 			//sphere.sphere.radius = radius;
 			sphere.type = eMesh;
 			sphere.mesh = mesh;
 			sphere.startTransform = Transform(Vec3(x*spacing, y*spacing, 0.0f));
 			sphere.endTransform = Transform(Vec3(x*spacing, y*spacing, 0.0f));
-			sphere.material.color = colors[y*4 + x];
-			sphere.material.metallic = 0.0f;
-			sphere.material.roughness = 0.01f;
-			//sphere.material.clearcoat = 1.0f;
-			//sphere.material.transmission = 0.0f;
-			//sphere.material.absorption = Max(0.0f, Vec3(0.75f)-sphere.material.color);//Vec3(sqrtf(sphere.material.color.x), sqrtf(sphere.material.color.y), sqrtf(sphere.material.color.z))*0.5f;
+			material.color = colors[y*4 + x];
+			material.metallic = 0.0f;
+			material.roughness = 0.01f;
+			//material.clearcoat = 1.0f;
+			//material.transmission = 0.0f;
+			//material.absorption = Max(0.0f, Vec3(0.75f)-material.color);//Vec3(sqrtf(material.color.x), sqrtf(material.color.y), sqrtf(material.color.z))*0.5f;
+
+			sphere.material = scene->AddMaterial(material);
 
 			scene->AddPrimitive(sphere);
 		}
@@ -242,18 +266,19 @@ void TestPaniq(Scene* scene, Camera* camera, Options* options)
 	obj->Normalize(2.f);
 	obj->Transform(TranslationMatrix(Vec3(-1.0f)));
 	obj->RebuildBVH();
-	//MeshGeometry mesh = GeometryFromMesh(obj);
+	//const MeshGeometry* mesh = scene->GetMeshGeometry(obj);
 
 	for (int y=0; y < img.m_height; ++y)
 	{
 		for (int x=0; x < img.m_width; ++x)
 		{
 			Primitive sphere;
+			Material material;
 			//sphere.type = eSphere;
 			//sphere.sphere.radius = radius;
 
 			sphere.type = eMesh;
-			sphere.mesh = GeometryFromMesh(obj);
+			sphere.mesh = scene->GetMeshGeometry(obj);
 
 			sphere.startTransform = Transform(Vec3(x*spacing, y*spacing, 0.0f));
 			sphere.endTransform = Transform(Vec3(x*spacing, y*spacing, 0.0f));
@@ -269,16 +294,18 @@ void TestPaniq(Scene* scene, Camera* camera, Options* options)
 			Color col(r/255.0f, g/255.0f, b/255.0f);
 			col = SrgbToLinear(col);
 
-			sphere.material.color = Vec3(col);
-			//sphere.material.specular = 0.0f;
-			//sphere.material.emission = Vec3(col)*0.25f;
-			sphere.material.metallic = 0.0f;
-			sphere.material.roughness = 0.01f;
-			sphere.material.clearcoat = 0.0f;
-			sphere.material.clearcoatGloss = 1.0f;		
-			sphere.material.subsurface = 0.0f;
-			//sphere.material.transmission = 1.0f;
-			//sphere.material.absorption = Max(0.0f, Vec3(0.75f)-sphere.material.color);//Vec3(sqrtf(sphere.material.color.x), sqrtf(sphere.material.color.y), sqrtf(sphere.material.color.z))*0.5f;
+			material.color = Vec3(col);
+			//material.specular = 0.0f;
+			//material.emission = Vec3(col)*0.25f;
+			material.metallic = 0.0f;
+			material.roughness = 0.01f;
+			material.clearcoat = 0.0f;
+			material.clearcoatGloss = 1.0f;		
+			material.subsurface = 0.0f;
+			//material.transmission = 1.0f;
+			//material.absorption = Max(0.0f, Vec3(0.75f)-material.color);//Vec3(sqrtf(material.color.x), sqrtf(material.color.y), sqrtf(material.color.z))*0.5f;
+
+			sphere.material = scene->AddMaterial(material);
 
 			scene->AddPrimitive(sphere);
 		}
@@ -300,7 +327,10 @@ void TestPaniq(Scene* scene, Camera* camera, Options* options)
     plane.plane.plane[1] = 1.0f;
     plane.plane.plane[2] = 0.0f;
     plane.plane.plane[3] = 1.0f;
-    plane.material.color = Vec3(0.8);
+
+    Material planeMaterial;
+    planeMaterial.color = Vec3(0.8);
+    plane.material = scene->AddMaterial(planeMaterial);
 
     Primitive back;
     back.type = ePlane;
@@ -308,15 +338,21 @@ void TestPaniq(Scene* scene, Camera* camera, Options* options)
     back.plane.plane[1] = 0.0f;
     back.plane.plane[2] = 1.0f;
     back.plane.plane[3] = 1.5f;
-    back.material.color = Vec3(0.8);
+
+    Material backMaterial;
+    backMaterial.color = Vec3(0.8);
+    back.material = scene->AddMaterial(backMaterial);
 
     Primitive light;
     light.type = eSphere;
     light.sphere.radius = 1.0f;
     light.startTransform = Transform(Vec3(10.f, 15.0f, 15.0f));
 	light.endTransform = light.startTransform;
-    light.material.color = Vec3(0.0f);
-    light.material.emission = Vec3(150.0f);
+
+    Material lightMaterial;
+    lightMaterial.color = Vec3(0.0f);
+    lightMaterial.emission = Vec3(150.0f);
+    light.material = scene->AddMaterial(lightMaterial);
     light.lightSamples = 1;
 
     
@@ -64,8 +64,8 @@ void TestMesh(Scene* scene, Camera* camera, Options* options)
 
 	Primitive mesh;
 	mesh.type = eMesh;
-	mesh.mesh = GeometryFromMesh(buddha);
-    mesh.material = gold;
+	mesh.mesh = scene->GetMeshGeometry(buddha);
+    mesh.material = scene->AddMaterial(gold);
 	mesh.startTransform = Transform(Vec3(0.0f, 1.0f, 0.0f), Quat(Vec3(0.0f, 1.0f, 0.0f), 0.0f), 1.0f);//*RotationMatrix(DegToRad(90.0f), Vec3(0.0f, 0.0f, 1.0f))*ScaleMatrix(Vec3(3.0f));
 	mesh.endTransform = Transform(Vec3(4.0f, 1.0f, 0.0f), Quat(Vec3(0.0f, 1.0f, 0.0f), DegToRad(0.0f)), 1.0f);
 	
@@ -76,15 +76,21 @@ void TestMesh(Scene* scene, Camera* camera, Options* options)
     plane.plane.plane[1] = 1.0f;
     plane.plane.plane[2] = 0.0f;
     plane.plane.plane[3] = 0.0f;
-    plane.material.color = Vec3(0.1);
+
+    Material planeMaterial;
+    planeMaterial.color = Vec3(0.1);
+    plane.material = scene->AddMaterial(planeMaterial);
 
     Primitive light;
     light.type = eSphere;
     light.sphere.radius = 1.0f;
     light.startTransform = Transform(Vec3(0.0f, 6.0f, 0.0f));
 	light.endTransform = light.startTransform;
-    light.material.color = Vec3(0.0f);
-    light.material.emission = Vec3(10.0f);
+
+    Material lightMaterial;
+    lightMaterial.color = Vec3(0.0f);
+    lightMaterial.emission = Vec3(10.0f);
+    light.material = scene->AddMaterial(lightMaterial);
     light.lightSamples = 1;
 
     
@@ -13,13 +13,15 @@ void TestVeach(Scene* scene, Camera* camera, Options* options)
 	gloss.specular = 0.75f;
     gloss.metallic = 1.0f;
 
+    const int backgroundMaterial = scene->AddMaterial(background);
+
     Primitive ground;
     ground.type = ePlane;
     ground.plane.plane[0] = 0.0f;
     ground.plane.plane[1] = 1.0f;
     ground.plane.plane[2] = 0.0f;
     ground.plane.plane[3] = 0.0f;
-    ground.material = background;
+    ground.material = backgroundMaterial;
 
     Primitive back;
     back.type = ePlane;
@@ -27,7 +29,7 @@ void TestVeach(Scene* scene, Camera* camera, Options* options)
     back.plane.plane[1] = 0.0f;
     back.plane.plane[2] = 1.0f;
     back.plane.plane[3] = 3.0f;
-    back.material = background;
+    back.material = backgroundMaterial;
 
 	Vec3 verts[4] = 
 	{ 
@@ -74,10 +76,12 @@ void TestVeach(Scene* scene, Camera* camera, Options* options)
 		plate.startTransform = Transform(pos, Quat(Vec3(1.0f, 0.0f, 0.0f), angle));
 		plate.endTransform = plate.startTransform;
 
-		plate.material = gloss;
-		plate.material.roughness = Sqr(Lerp(0.3f, 0.01f, i/3.0f));
+		Material material = gloss;
+		material.roughness = Sqr(Lerp(0.3f, 0.01f, i/3.0f));
+
+		plate.material = scene->AddMaterial(material);
 		plate.type = eMesh;
-		plate.mesh = GeometryFromMesh(plateMesh);
+		plate.mesh = scene->GetMeshGeometry(plateMesh);
 		
 		scene->AddPrimitive(plate);
 	}
@@ -112,7 +116,7 @@ void TestVeach(Scene* scene, Camera* camera, Options* options)
 		light.sphere.radius = radii[i];
 		light.startTransform = Transform(lightsCenter + Vec3(-1.0f + 2.0f*i/3.0f, 0.0f, 0.0f));
 		light.endTransform = light.startTransform;
-		light.material = mat;
+		light.material = scene->AddMaterial(mat);
 		light.lightSamples = 1;
 
 		scene->AddPrimitive(light);
@@ -123,7 +127,10 @@ void TestVeach(Scene* scene, Camera* camera, Options* options)
 	light.sphere.radius = 0.1f;
 	light.startTransform = Transform(Vec3(3.0f, 7.0f, 7.0f));
 	light.endTransform = light.startTransform;
-	light.material.emission = Vec3(10.0f, 10.0f, 10.0f)*200.0f;
+
+	Material lightMaterial;
+	lightMaterial.emission = Vec3(10.0f, 10.0f, 10.0f)*200.0f;
+	light.material = scene->AddMaterial(lightMaterial);
 	light.lightSamples = 1;
 	
 	scene->AddPrimitive(light);
@@ -136,9 +143,7 @@ void TestVeach(Scene* scene, Camera* camera, Options* options)
 	options->exposure = 0.5f;
 	options->limit = 1.5f;
 
-	options->filter.type = eFilterGaussian;
-	options->filter.width = 1.0f;
-	options->filter.falloff = 1.0f;
+	options->filter = Filter(eFilterGaussian, 1.0f, 1.0f);
 
 }
 
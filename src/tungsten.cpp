@@ -5,10 +5,12 @@
 #include "render.h"
 #include "util.h"
 #include "pfm.h"
+#include "parallel.h"
 
 #include "cjson/cjson.h"
 
 #include <map>
+#include <vector>
 
 void ReadParam(cJSON* object, const char* name, std::string& out)
 {
@@ -205,6 +207,14 @@ bool LoadTungsten(const char* filename, Scene* scene, Camera* camera, Options* o
 	std::map<std::string, Mesh*> meshes;
 	std::map<std::string, Material> materials;
 
+	// mesh files are imported concurrently once the whole scene has been parsed,
+	// by path along with whether the first primitive using them wants new normals
+	std::map<std::string, bool> meshImports;
+	std::vector<std::pair<int, std::string> > meshPrimitives;
+
+	// scene material index of each bsdf, only added once a primitive uses it unmodified
+	std::map<std::string, int> materialIndices;
+
 	root = root->child;
 
 	while (root)
@@ -245,21 +255,38 @@ bool LoadTungsten(const char* filename, Scene* scene, Camera* camera, Options* o
 				ReadParam(node, "transform", primitive.startTransform, scale);
 				ReadParam(node, "transform", primitive.endTransform, scale);
 
-				primitive.material = materials[bsdf];
+				Material material = materials[bsdf];
 
 				// apply emission to primitive's copy of the material
-				ReadParam(node, "emission", primitive.material.emission);
-				if (LengthSq(primitive.material.emission) > 0.0f)
+				ReadParam(node, "emission", material.emission);
+				if (LengthSq(material.emission) > 0.0f)
 					primitive.lightSamples = 1;
 
 				// inline bsdf
 				cJSON* bsdfNode = cJSON_GetObjectItem(node, "bsdf");
-				if (bsdf == "" && bsdfNode && bsdfNode->child)
+				const bool inlineBsdf = bsdf == "" && bsdfNode && bsdfNode->child;
+
+				if (inlineBsdf)
 				{
 					std::string name;
 					std::string type;
 
-					ReadMaterial(bsdfNode, primitive.material, name, type);
+					ReadMaterial(bsdfNode, material, name, type);
+				}
+
+				// primitives that change their bsdf get their own material
+				if (inlineBsdf || primitive.lightSamples)
+				{
+					primitive.material = scene->AddMaterial(material);
+				}
+				else
+				{
+					std::map<std::string, int>::iterator iter = materialIndices.find(bsdf);
+
+					if (iter == materialIndices.end())
+						iter = materialIndices.insert(std::make_pair(bsdf, scene->AddMaterial(material))).first;
+
+					primitive.material = iter->second;
 				}
 
 				if (type == "infinite_sphere")
@@ -286,7 +313,7 @@ bool LoadTungsten(const char* filename, Scene* scene, Camera* camera, Options* o
 					quad->RebuildBVH();
 
 					primitive.type = eMesh;			
-					primitive.mesh = GeometryFromMesh(quad);
+					primitive.mesh = scene->GetMeshGeometry(quad);
 
 					scene->primitives.push_back(primitive);
 
@@ -295,40 +322,22 @@ bool LoadTungsten(const char* filename, Scene* scene, Camera* camera, Options* o
 				{
 					primitive.type = eMesh;
 
-					// look up in the mesh array
-					if (meshes.find(path) != meshes.end())
-					{
-						primitive.mesh = GeometryFromMesh(meshes[path]);
-					}
-					else
-					{
-						char relativePath[2048];
-
-						// make relative path to .tin
-						MakeRelativePath(filename, path.c_str(), relativePath);
+					char relativePath[2048];
 
-						// import mesh
-						Mesh* mesh = ImportMesh(relativePath);
+					// make relative path to .tin
+					MakeRelativePath(filename, path.c_str(), relativePath);
 
-						if (mesh)
-						{
-							bool recomputeNormals = false;
-							ReadParam(node, "recompute_normals", recomputeNormals);
-
-							if (recomputeNormals)
-								mesh->CalculateNormals();
-
-							primitive.mesh = GeometryFromMesh(mesh);							
+					// queue an import the first time a file is used
+					if (meshImports.find(relativePath) == meshImports.end())
+					{
+						bool recomputeNormals = false;
+						ReadParam(node, "recompute_normals", recomputeNormals);
 
-							meshes[path] = mesh;
-						}
-						else
-						{
-							printf("Failed to import mesh %s\n", relativePath);//.c_str());
-							fflush(stdout);
-						}
+						meshImports[relativePath] = recomputeNormals;
 					}
 
+					meshPrimitives.push_back(std::make_pair(int(scene->primitives.size()), std::string(relativePath)));
+
 					scene->primitives.push_back(primitive);
 				}
 
@@ -378,6 +387,43 @@ bool LoadTungsten(const char* filename, Scene* scene, Camera* camera, Options* o
 		root = root->next;
 	}
 
+	std::vector<std::pair<std::string, bool> > imports(meshImports.begin(), meshImports.end());
+	std::vector<Mesh*> imported(imports.size());
+
+	ParallelFor(int(imports.size()), [&](int index, int worker)
+	{
+		Mesh* mesh = ImportMesh(imports[index].first.c_str());
+
+		if (mesh && imports[index].second)
+			mesh->CalculateNormals();
+
+		imported[index] = mesh;
+	});
+
+	for (size_t i=0; i < imports.size(); ++i)
+	{
+		if (imported[i])
+		{
+			meshes[imports[i].first] = imported[i];
+		}
+		else
+		{
+			printf("Failed to import mesh %s\n", imports[i].first.c_str());
+			fflush(stdout);
+		}
+	}
+
+	// resolve mesh primitives, removing those whose mesh failed to import
+	for (size_t i=meshPrimitives.size(); i > 0; --i)
+	{
+		const int index = meshPrimitives[i-1].first;
+
+		if (meshes.find(meshPrimitives[i-1].second) != meshes.end())
+			scene->primitives[index].mesh = scene->GetMeshGeometry(meshes[meshPrimitives[i-1].second]);
+		else
+			scene->primitives.erase(scene->primitives.begin() + index);
+	}
+
 	/*
 	Primitive light;
 	light.type = eSphere;
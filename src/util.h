@@ -5,19 +5,37 @@
 
 inline MeshGeometry GeometryFromMesh(const Mesh* mesh)
 {
+    const MeshData data = mesh->GetData();
+
     MeshGeometry geo;
-    geo.positions = &mesh->positions[0];
-    geo.normals = &mesh->normals[0];
-    geo.indices = &mesh->indices[0];
-    geo.nodes = &mesh->bvh.nodes[0];
-    geo.cdf = &mesh->cdf[0];
-    geo.area = mesh->area;
+    geo.positions = data.positions;
+    geo.normals = data.normals;
+    geo.indices = data.indices;
+    geo.nodes = data.nodes;
+    geo.links = NULL;
+    geo.triangleTable = data.triangleTable;
+    geo.wideNodes = data.wideNodes;
+    geo.packets = data.packets;
+    geo.area = data.area;
     
-    geo.numNodes = mesh->bvh.numNodes;
-    geo.numIndices = mesh->indices.size();
-    geo.numVertices = mesh->positions.size();
+    geo.numNodes = data.numNodes;
+    geo.numWideNodes = data.numWideNodes;
+    geo.numPackets = data.numPackets;
+    geo.numIndices = data.numIndices;
+    geo.numVertices = data.numVertices;
+
+    // compressed meshes are only read through their compressed attributes
+    geo.compressed = data.compressed;
+
+    if (geo.compressed.positions)
+    {
+        geo.positions = NULL;
+        geo.normals = NULL;
+        geo.indices = NULL;
+    }
 
-	geo.id = (unsigned long)mesh;
+	geo.id = mesh->id;
+	geo.generation = mesh->generation;
 
     return geo;
 }
@@ -107,3 +125,10 @@ inline void MakeRelativePath(const char* filePath, const char* fileRelativePath,
 }
 
 double GetSeconds();
+
+// maps a file read-only into memory, returns NULL on failure
+void* MapFile(const char* path, size_t* size);
+void UnmapFile(void* data, size_t size);
+
+// largest resident set size of the process so far in bytes
+size_t GetPeakMemory();
@@ -3,13 +3,23 @@
 #include "util.h"
 #include "sampler.h"
 #include "disney.h"
+#include "parallel.h"
 //#include "lambert.h"
 
+#include <stdlib.h>
+#include <string.h>
+
+#if _WIN32
+#include <malloc.h>
+#endif
+
 
 #define kBsdfSamples 1.0f
 #define kProbeSamples 1.0f
 #define kRayEpsilon 0.0001f
 
+#define USE_SCENE_BVH 1
+
 
 namespace
 {
@@ -18,7 +28,7 @@ namespace
 inline bool Trace(const Scene& scene, const Ray& ray, float& outT, Vec3& outNormal, const Primitive** outPrimitive)
 {
 
-#if 0
+#if USE_SCENE_BVH
 
 	struct Callback
 	{
@@ -41,7 +51,7 @@ inline bool Trace(const Scene& scene, const Ray& ray, float& outT, Vec3& outNorm
 
 			const Primitive& primitive = scene.primitives[index];
 
-			if (PrimitiveIntersect(primitive, ray, t, &n))
+			if (PrimitiveIntersect(primitive, ray, t, &n, minT))
 			{
 				if (t < minT && t > 0.0f)
 				{
@@ -54,7 +64,16 @@ inline bool Trace(const Scene& scene, const Ray& ray, float& outT, Vec3& outNorm
 	};
 
 	Callback callback(scene, ray);
-	QueryBVH(callback, scene.bvh.nodes, ray.origin, ray.dir);
+
+	// the scene trees are split over the shutter when anything moves
+	const int segment = MotionSegment(ray.time, scene.numMotionSegments);
+
+	// cull nodes beyond the closest hit found so far
+#if USE_WIDE_BVH
+	QueryWideBVH(callback, scene.wideBvh[segment].nodes, ray.origin, ray.dir, callback.minT);
+#else
+	QueryBVH(callback, scene.bvh[segment].nodes, ray.origin, ray.dir, callback.minT);
+#endif
 
 	outT = callback.minT;		
 	outNormal = FaceForward(callback.closestNormal, -ray.dir);
@@ -100,7 +119,52 @@ inline bool Trace(const Scene& scene, const Ray& ray, float& outT, Vec3& outNorm
 }
 
 
-inline Vec3 SampleLights(const Scene& scene, const Primitive& surfacePrimitive, float etaI, float etaO, const Vec3& surfacePos, const Vec3& surfaceNormal, const Vec3& shadingNormal, const Vec3& wo, float time, Random& rand)
+// returns true if anything is hit closer than tmax, exits on the first hit so is
+// cheaper than Trace() for shadow rays which don't need the closest intersection
+inline bool Occluded(const Scene& scene, const Ray& ray, float tmax)
+{
+#if USE_SCENE_BVH
+
+	struct Callback
+	{
+		const Scene& scene;
+		const Ray& ray;
+		float tmax;
+
+		Callback(const Scene& s, const Ray& r, float t) : scene(s), ray(r), tmax(t) {}
+
+		bool operator()(int index)
+		{
+			return PrimitiveOcclude(scene.primitives[index], ray, tmax);
+		}
+	};
+
+	Callback callback(scene, ray, tmax);
+
+	// the scene trees are split over the shutter when anything moves
+	const int segment = MotionSegment(ray.time, scene.numMotionSegments);
+
+#if USE_WIDE_BVH
+	return QueryWideBVHAny(callback, scene.wideBvh[segment].nodes, ray.origin, ray.dir, tmax);
+#else
+	return QueryBVHAny(callback, scene.bvh[segment].nodes, ray.origin, ray.dir, tmax);
+#endif
+
+#else
+
+	for (int i=0; i < scene.primitives.size(); ++i)
+	{
+		if (PrimitiveOcclude(scene.primitives[i], ray, tmax))
+			return true;
+	}
+
+	return false;
+
+#endif
+}
+
+
+inline Vec3 SampleLights(const Scene& scene, const Primitive& surfacePrimitive, float etaI, float etaO, const Vec3& surfacePos, const Vec3& surfaceNormal, const Vec3& shadingNormal, const Vec3& wo, float time, Sampler& rand, RayStats& stats)
 {	
 	Vec3 sum(0.0f);
 
@@ -126,13 +190,12 @@ inline Vec3 SampleLights(const Scene& scene, const Primitive& surfacePrimitive,
 //				continue;
 
 			// check if occluded
-			float t;
-			Vec3 n;
-			const Primitive* hit;
-			if (Trace(scene, Ray(surfacePos + FaceForward(surfaceNormal, wi)*kRayEpsilon, wi, time), t, n, &hit) == false)
+			stats.shadow++;
+
+			if (!Occluded(scene, Ray(surfacePos + FaceForward(surfaceNormal, wi)*kRayEpsilon, wi, time), FLT_MAX))
 			{
-				float bsdfPdf = BSDFPdf(surfacePrimitive.material, etaI, etaO, surfacePos, surfaceNormal, wo, wi);
-				Vec3 f = BSDFEval(surfacePrimitive.material, etaI, etaO, surfacePos, surfaceNormal, wo, wi);
+				float bsdfPdf;
+				Vec3 f = BSDFEvalPdf(scene.materials[surfacePrimitive.material], etaI, etaO, surfacePos, surfaceNormal, wo, wi, bsdfPdf);
 				
 				if (bsdfPdf > 0.0f)
 				{
@@ -153,18 +216,22 @@ inline Vec3 SampleLights(const Scene& scene, const Primitive& surfacePrimitive,
 			sum /= float(kProbeSamples);
 	}
 
-	for (int i=0; i < scene.primitives.size(); ++i)
+	if (!scene.lights.empty())
 	{
+		// pick one light in proportion to its power rather than visiting every light
+		float u;
+		Sample1D(rand, u);
+
+		const int light = SampleAlias(&scene.lightTable[0], int(scene.lights.size()), u);
+		const float selectPdf = scene.lightTable[light].pdf;
+
 		// assume all lights are area lights for now
-		const Primitive& lightPrimitive = scene.primitives[i];
+		const Primitive& lightPrimitive = scene.primitives[scene.lights[light]];
 
 		Vec3 L(0.0f);
 
 		int numSamples = lightPrimitive.lightSamples;
 
-		if (numSamples == 0)
-			continue;
-
 		for (int s=0; s < numSamples; ++s)
 		{
 			// sample light source
@@ -187,44 +254,39 @@ inline Vec3 SampleLights(const Scene& scene, const Primitive& surfacePrimitive,
 			if (Dot(wi, lightNormal) >= 0.0f)
 				continue;
 
-			// check visibility
-			float t;
-			Vec3 n;
-			const Primitive* hit;
-			if (Trace(scene, Ray(surfacePos + FaceForward(surfaceNormal, wi)*kRayEpsilon, wi, time), t, n, &hit))			
-			{
-				float tSq = t*t;
+			// check visibility, nothing may be hit before the light sample less a tolerance
+			// for the light's own surface, this works for portal sampling where you have
+			// a large light that you sample through a small window
+			const float kTolerance = 1.e-2f;
 
-				// if our next hit was further than distance to light then accept
-				// sample, this works for portal sampling where you have a large light
-				// that you sample through a small window
-				const float kTolerance = 1.e-2f;
+			stats.shadow++;
 
-				if (fabsf(t - sqrtf(dSq)) <= kTolerance)
-				{				
-					const float nl = Abs(Dot(lightNormal, wi));
+			if (Occluded(scene, Ray(surfacePos + FaceForward(surfaceNormal, wi)*kRayEpsilon, wi, time), sqrtf(dSq) - kTolerance))
+				continue;
 
-					// light pdf with respect to area and convert to pdf with respect to solid angle
-					float lightArea = PrimitiveArea(lightPrimitive);
-					float lightPdf = ((1.0f/lightArea)*tSq)/nl;
+			const float tSq = dSq;
 
-					// bsdf pdf for light's direction
-					float bsdfPdf = BSDFPdf(surfacePrimitive.material, etaI, etaO, surfacePos, shadingNormal, wo, wi);
-					Vec3 f = BSDFEval(surfacePrimitive.material, etaI, etaO, surfacePos, shadingNormal, wo, wi);
+			const float nl = Abs(Dot(lightNormal, wi));
 
-					// this branch is only necessary to exclude specular paths from light sampling
-					// todo: make BSDFEval alwasy return zero for pure specular paths and roll specular eval into BSDFSample()
-					if (bsdfPdf > 0.0f)
-					{
-						// calculate relative weighting of the light and bsdf sampling
-						int N = lightPrimitive.lightSamples+kBsdfSamples;
-						float cbsdf = kBsdfSamples/N;
-						float clight = float(lightPrimitive.lightSamples)/N;
-						float weight = clight*lightPdf/(cbsdf*bsdfPdf + clight*lightPdf);
-						
-						L += weight*f*hit->material.emission*(Abs(Dot(wi, shadingNormal))/Max(1.e-3f, lightPdf));
-					}
-				}
+			// light pdf with respect to area and convert to pdf with respect to solid angle
+			float lightArea = PrimitiveArea(lightPrimitive);
+			float lightPdf = ((1.0f/lightArea)*tSq)/nl;
+
+			// bsdf pdf for light's direction
+			float bsdfPdf;
+			Vec3 f = BSDFEvalPdf(scene.materials[surfacePrimitive.material], etaI, etaO, surfacePos, shadingNormal, wo, wi, bsdfPdf);
+
+			// this branch is only necessary to exclude specular paths from light sampling
+			// todo: make BSDFEval alwasy return zero for pure specular paths and roll specular eval into BSDFSample()
+			if (bsdfPdf > 0.0f)
+			{
+				// calculate relative weighting of the light and bsdf sampling
+				int N = lightPrimitive.lightSamples+kBsdfSamples;
+				float cbsdf = kBsdfSamples/N;
+				float clight = float(lightPrimitive.lightSamples)/N;
+				float weight = clight*selectPdf*lightPdf/(cbsdf*bsdfPdf + clight*selectPdf*lightPdf);
+
+				L += weight*f*scene.materials[lightPrimitive.material].emission*(Abs(Dot(wi, shadingNormal))/(selectPdf*Max(1.e-3f, lightPdf)));
 			}
 		}
 	
@@ -254,148 +316,236 @@ enum PathMode
 	ePathDisabled,
 };
 
+// paths are stored as structure-of-arrays so that each stage only
+// streams the fields it actually reads, matching the GPU layout
 struct PathState
 {		
-	Vec3 rayOrigin;
-	Vec3 rayDir;
-	float rayTime;
+	Vec3* rayOrigin;
+	Vec3* rayDir;
+	float* rayTime;
 
-	Vec3 pos;
-	Vec3 normal;
+	Vec3* pos;
+	Vec3* normal;
 
-	int depth;
+	int* depth;
 
-	Vec3 pathThroughput;
-	Vec3 absorption;
-	const Primitive* primitive;
+	Vec3* pathThroughput;
+	Vec3* absorption;
+	const Primitive** primitive;
 
-	Vec3 totalRadiance;
+	Vec3* totalRadiance;
 
-	float etaI;
-	float etaO;
+	float* etaI;
+	float* etaO;
 
-	PathMode mode;
+	PathMode* mode;
 
 	// pdf from last brdf sampling
-	float bsdfPdf;
-	BSDFType bsdfType;
+	float* bsdfPdf;
+	BSDFType* bsdfType;
 
 	// sample coordinate
-	float rasterX;
-	float rasterY;
+	float* rasterX;
+	float* rasterY;
 
-	Random rand;
+	Sampler* rand;
 };
 
+// each stream starts on its own cache line
+const int kPathStreamAlignment = 64;
 
+template <typename T>
+void Alloc(T** ptr, int num)
+{
+	const size_t size = sizeof(T)*num;
+
+#if _WIN32
+	*ptr = (T*)_aligned_malloc(size, kPathStreamAlignment);
+#else
+	void* mem = NULL;
+	posix_memalign(&mem, kPathStreamAlignment, size);
+	*ptr = (T*)mem;
+#endif
 
-void TerminatePaths(Color* output, Options options, PathState* paths, int numPaths)
+	memset((void*)*ptr, 0, size);
+}
+
+template <typename T>
+void Free(T* ptr)
+{
+#if _WIN32
+	_aligned_free((void*)ptr);
+#else
+	free((void*)ptr);
+#endif
+}
+
+PathState AllocatePaths(int num)
+{
+	PathState state;
+
+	Alloc(&state.rayOrigin, num);
+	Alloc(&state.rayDir, num);
+	Alloc(&state.rayTime, num);
+
+	Alloc(&state.pos, num);
+	Alloc(&state.normal, num);
+
+	Alloc(&state.depth, num);
+
+	Alloc(&state.pathThroughput, num);
+	Alloc(&state.absorption, num);
+	Alloc(&state.primitive, num);
+	Alloc(&state.totalRadiance, num);
+
+	Alloc(&state.etaI, num);
+	Alloc(&state.etaO, num);
+
+	Alloc(&state.mode, num);
+
+	Alloc(&state.bsdfPdf, num);
+	Alloc(&state.bsdfType, num);
+
+	Alloc(&state.rasterX, num);
+	Alloc(&state.rasterY, num);
+
+	Alloc(&state.rand, num);
+
+	return state;
+}
+
+void FreePaths(PathState state)
+{
+	Free(state.rayOrigin);
+	Free(state.rayDir);
+	Free(state.rayTime);
+
+	Free(state.pos);
+	Free(state.normal);
+
+	Free(state.depth);
+
+	Free(state.pathThroughput);
+	Free(state.absorption);
+	Free(state.primitive);
+	Free(state.totalRadiance);
+
+	Free(state.etaI);
+	Free(state.etaO);
+
+	Free(state.mode);
+
+	Free(state.bsdfPdf);
+	Free(state.bsdfType);
+
+	Free(state.rasterX);
+	Free(state.rasterY);
+
+	Free(state.rand);
+}
+
+
+void TerminatePaths(Color* output, Options options, PathState paths, int numPaths)
 {
 	for (int i=0; i < numPaths; ++i)
 	{
-		if (paths[i].mode != ePathDisabled)
+		if (paths.mode[i] != ePathDisabled)
 		{
-			float rasterX = paths[i].rasterX;
-			float rasterY = paths[i].rasterY;
+			float rasterX = paths.rasterX[i];
+			float rasterY = paths.rasterY[i];
 
-			Vec3 sample = paths[i].totalRadiance;
+			Vec3 sample = paths.totalRadiance[i];
 
-			// sample = paths[i].normal*0.5f + 0.5f;
+			// sample = paths.normal[i]*0.5f + 0.5f;
 
 			int width = options.width;
 			int height = options.height;
 
-			switch (options.filter.type)		
-			{
-				case eFilterBox:
-				{		
-					int startX = Max(0, int(rasterX - options.filter.width));
-					int startY = Max(0, int(rasterY - options.filter.width));
-					int endX = Min(int(rasterX + options.filter.width), width-1);
-					int endY = Min(int(rasterY + options.filter.width), height-1);
+			int startX = Max(0, int(rasterX - options.filter.width));
+			int startY = Max(0, int(rasterY - options.filter.width));
+			int endX = Min(int(rasterX + options.filter.width), width-1);
+			int endY = Min(int(rasterY + options.filter.width), height-1);
 
-					Vec3 c =  ClampLength(sample, options.clamp);
+			Vec3 c =  ClampLength(sample, options.clamp);
 
-					for (int x=startX; x <= endX; ++x)
-					{
-						for (int y=startY; y <= endY; ++y)
-						{
-							output[y*width+x] += Color(c, 1.0f);
-						}
-					}
+			// the filter is separable so each axis is only looked up once per sample
+			float weightsX[kMaxFilterFootprint];
+			float weightsY[kMaxFilterFootprint];
 
-					break;
-				}
-				case eFilterGaussian:
-				{
-					int startX = Max(0, int(rasterX - options.filter.width));
-					int startY = Max(0, int(rasterY - options.filter.width));
-					int endX = Min(int(rasterX + options.filter.width), width-1);
-					int endY = Min(int(rasterY + options.filter.width), height-1);
+			const int countX = Min(endX-startX+1, kMaxFilterFootprint);
+			const int countY = Min(endY-startY+1, kMaxFilterFootprint);
 
-					Vec3 c =  ClampLength(sample, options.clamp);
+			options.filter.Weights(rasterX, startX, countX, weightsX);
+			options.filter.Weights(rasterY, startY, countY, weightsY);
 
-					for (int x=startX; x <= endX; ++x)
-					{
-						for (int y=startY; y <= endY; ++y)
-						{
-							float w = options.filter.Eval(x-rasterX, y-rasterY);
+			for (int y=0; y < countY; ++y)
+			{
+				Color* row = output + (startY+y)*width + startX;
 
-							output[y*width+x] += Color(c*w, w);
-						}
-					}
-					break;
+				for (int x=0; x < countX; ++x)
+				{
+					const float w = weightsX[x]*weightsY[y];
+
+					row[x] += Color(c*w, w);
 				}
-			};
+			}
 		}
 
-		paths[i].mode = ePathGenerate;
+		paths.mode[i] = ePathGenerate;
 	}
 }
 
-void SampleLights(const Scene& scene, PathState* paths, int numPaths)
+// stages below operate on a compacted queue of path indices so that
+// each bounce only touches the paths that are waiting on that stage
+
+void SampleLights(const Scene& scene, PathState paths, const int* queue, int count, RayStats& stats)
 {
-	for (int i=0; i < numPaths; ++i)
+	for (int q=0; q < count; ++q)
 	{
-		if (paths[i].mode == ePathLightSample)
+		const int i = queue[q];
+
+		if (paths.mode[i] == ePathLightSample)
 		{
         	// calculate a basis for this hit point
-        	const Primitive* hit = paths[i].primitive;        	
+        	const Primitive* hit = paths.primitive[i];        	
         	
-        	float etaI = paths[i].etaI;
-        	float etaO = paths[i].etaO;
+        	float etaI = paths.etaI[i];
+        	float etaO = paths.etaO[i];
 
-			const Vec3 rayDir = paths[i].rayDir;
-            float rayTime = paths[i].rayTime;
+			const Vec3 rayDir = paths.rayDir[i];
+            float rayTime = paths.rayTime[i];
 
-            const Vec3 p = paths[i].pos;
-            const Vec3 n = paths[i].normal;
+            const Vec3 p = paths.pos[i];
+            const Vec3 n = paths.normal[i];
 
 			// integrate direct light over hemisphere
-			paths[i].totalRadiance += paths[i].pathThroughput*SampleLights(scene, *hit, etaI, etaO, p, n, n, -rayDir, rayTime, paths[i].rand);			
+			paths.totalRadiance[i] += paths.pathThroughput[i]*SampleLights(scene, *hit, etaI, etaO, p, n, n, -rayDir, rayTime, paths.rand[i], stats);			
 
-			paths[i].mode = ePathBsdfSample;		
+			paths.mode[i] = ePathBsdfSample;		
 		}
 	}
 }
 
-void SampleBsdfs(PathState* paths, int numPaths)
+void SampleBsdfs(const Scene& scene, PathState paths, const int* queue, int count, int rouletteDepth)
 {
-	for (int i=0; i < numPaths; ++i)
+	for (int q=0; q < count; ++q)
 	{
-		if (paths[i].mode == ePathBsdfSample)
+		const int i = queue[q];
+
+		if (paths.mode[i] == ePathBsdfSample)
 		{	
-			const Vec3 p = paths[i].pos;
-			const Vec3 n = paths[i].normal;
+			const Vec3 p = paths.pos[i];
+			const Vec3 n = paths.normal[i];
 
-			const Vec3 rayDir = paths[i].rayDir;
+			const Vec3 rayDir = paths.rayDir[i];
 
-			const Primitive* hit = paths[i].primitive;
+			const Primitive* hit = paths.primitive[i];
+			const Material& material = scene.materials[hit->material];
 
-			Random& rand = paths[i].rand;
+			Sampler& rand = paths.rand[i];
 
-			float etaI = paths[i].etaI;
-			float etaO = paths[i].etaO;
+			float etaI = paths.etaI[i];
+			float etaO = paths.etaO[i];
 
 			// integrate indirect light by sampling BRDF
             Vec3 u, v;
@@ -404,74 +554,90 @@ void SampleBsdfs(PathState* paths, int numPaths)
 			Vec3 bsdfDir;
 			BSDFType bsdfType;
 			float bsdfPdf;
+			Vec3 f;
 
-			BSDFSample(hit->material, etaI, etaO, p, u, v, n, -rayDir, bsdfDir, bsdfPdf, bsdfType, rand);
+			BSDFSample(material, etaI, etaO, p, u, v, n, -rayDir, bsdfDir, f, bsdfPdf, bsdfType, rand);
 
             if (bsdfPdf <= 0.0f)
            	{
-           		paths[i].mode = ePathTerminate;
+           		paths.mode[i] = ePathTerminate;
            	}
            	else
            	{
-	            // reflectance
-	            Vec3 f = BSDFEval(hit->material, etaI, etaO, p, n, -rayDir, bsdfDir);
-
 	            // update ray medium if we are transmitting through the material
 	            if (Dot(bsdfDir, n) <= 0.0f)
 	            {
-	            	paths[i].etaI = etaO;
-	            	paths[i].bsdfType = eTransmitted;
+	            	paths.etaI[i] = etaO;
+	            	paths.bsdfType[i] = eTransmitted;
 					
 	            	if (etaI != 1.0f)
 	            	{
 	            		// entering a medium, update the aborption (assume zero in air)
-						paths[i].absorption = hit->material.absorption;
+						paths.absorption[i] = material.absorption;
 					}
 	            }
 	            else
 	            {
-	            	paths[i].bsdfType = eReflected;
+	            	paths.bsdfType[i] = eReflected;
 	            }
 
 	            // update throughput with primitive reflectance
-	            paths[i].pathThroughput *= f * Abs(Dot(n, bsdfDir))/bsdfPdf;
-	            paths[i].bsdfPdf = bsdfPdf;
-	            paths[i].bsdfType = bsdfType;
-	            paths[i].rayDir = bsdfDir;
-	            paths[i].rayOrigin = p + FaceForward(n, bsdfDir)*kRayEpsilon;
-	            paths[i].mode = ePathAdvance;
+	            paths.pathThroughput[i] *= f * Abs(Dot(n, bsdfDir))/bsdfPdf;
+	            paths.bsdfPdf[i] = bsdfPdf;
+	            paths.bsdfType[i] = bsdfType;
+	            paths.rayDir[i] = bsdfDir;
+	            paths.rayOrigin[i] = p + FaceForward(n, bsdfDir)*kRayEpsilon;
+	            paths.mode[i] = ePathAdvance;
+
+	            if (RouletteActive(paths.depth[i], rouletteDepth))
+	            {
+	            	float r;
+	            	Sample1D(rand, r);
+
+	            	if (!RussianRoulette(paths.pathThroughput[i], r))
+	            		paths.mode[i] = ePathTerminate;
+	            }
 
 	        }
         }
     }
 }
 
-void AdvancePaths(const Scene& scene, PathState* paths, int numPaths)
+void AdvancePaths(const Scene& scene, PathState paths, const int* queue, int count, RayStats& stats)
 {
-	for (int i=0; i < numPaths; ++i)
+	for (int q=0; q < count; ++q)
 	{
-		if (paths[i].mode == ePathAdvance)
+		const int i = queue[q];
+
+		if (paths.mode[i] == ePathAdvance)
 		{
-			Vec3 rayOrigin = paths[i].rayOrigin;
-			Vec3 rayDir = paths[i].rayDir;
-			float rayTime = paths[i].rayTime;
-			float etaI = paths[i].etaI;
+			Vec3 rayOrigin = paths.rayOrigin[i];
+			Vec3 rayDir = paths.rayDir[i];
+			float rayTime = paths.rayTime[i];
+			float etaI = paths.etaI[i];
 
-			Vec3 pathThroughput = paths[i].pathThroughput;
+			Vec3 pathThroughput = paths.pathThroughput[i];
 
 			Vec3 n;
 			float t;
 			const Primitive* hit;
 
+			if (paths.depth[i] == 0)
+				stats.primary++;
+			else
+				stats.secondary++;
+
 	        // find closest hit
 	        if (Trace(scene, Ray(rayOrigin, rayDir, rayTime), t, n, &hit))
 	        {	
+				const Material& material = scene.materials[hit->material];
+
 				float etaO;
 
 	        	// index of refraction for transmission, 1.0 corresponds to air
 				if (etaI == 1.0f)
 				{
-	        		etaO = hit->material.GetIndexOfRefraction();
+	        		etaO = material.GetIndexOfRefraction();
 				}
 				else
 				{
@@ -479,12 +645,12 @@ void AdvancePaths(const Scene& scene, PathState* paths, int numPaths)
 					etaO = 1.0f;
 				}
 
-				pathThroughput *= Exp(-paths[i].absorption*t);
+				pathThroughput *= Exp(-paths.absorption[i]*t);
 
-				if (paths[i].depth == 0)
+				if (paths.depth[i] == 0)
 				{
 					// first trace is our only chance to add contribution from directly visible light sources        
-					paths[i].totalRadiance += hit->material.emission;
+					paths.totalRadiance[i] += material.emission;
 				}			
 				else if (kBsdfSamples > 0)
 				{
@@ -493,40 +659,40 @@ void AdvancePaths(const Scene& scene, PathState* paths, int numPaths)
 
 					if (lightArea > 0.0f)
 					{
-						// convert to pdf with respect to solid angle
-						float lightPdf = ((1.0f/lightArea)*t*t)/Clamp(Dot(-rayDir, n), 1.e-3f, 1.0f);
+						// convert to pdf with respect to solid angle, including the chance of picking this light
+						float lightPdf = scene.lightSelectPdf[hit-&scene.primitives[0]]*((1.0f/lightArea)*t*t)/Clamp(Dot(-rayDir, n), 1.e-3f, 1.0f);
 
 						// calculate weight for bsdf sampling
 						int N = hit->lightSamples+kBsdfSamples;
 						float cbsdf = kBsdfSamples/N;
 						float clight = float(hit->lightSamples)/N;
-						float weight = cbsdf*paths[i].bsdfPdf/(cbsdf*paths[i].bsdfPdf + clight*lightPdf);
+						float weight = cbsdf*paths.bsdfPdf[i]/(cbsdf*paths.bsdfPdf[i] + clight*lightPdf);
 						
 						// specular paths have zero chance of being included by direct light sampling (zero pdf)
-						if (paths[i].bsdfType == eSpecular)
+						if (paths.bsdfType[i] == eSpecular)
 							weight = 1.0f;
 
 						// pathThroughput already includes the bsdf pdf
-						paths[i].totalRadiance += weight*pathThroughput*hit->material.emission;
+						paths.totalRadiance[i] += weight*pathThroughput*material.emission;
 					}
 				}
 
 				// terminate ray if we hit a light source
 				if (hit->lightSamples)
 				{
-					paths[i].mode = ePathTerminate;
+					paths.mode[i] = ePathTerminate;
 				}
 				else
 				{
 					// update throughput based on absorption through the medium
-					paths[i].pos = rayOrigin + rayDir*t;
-					paths[i].normal = n;
-					paths[i].primitive = hit;
-					paths[i].etaO = etaO;
-					paths[i].pathThroughput = pathThroughput;
-					paths[i].depth += 1;
-
-					paths[i].mode = ePathLightSample;
+					paths.pos[i] = rayOrigin + rayDir*t;
+					paths.normal[i] = n;
+					paths.primitive[i] = hit;
+					paths.etaO[i] = etaO;
+					paths.pathThroughput[i] = pathThroughput;
+					paths.depth[i] += 1;
+
+					paths.mode[i] = ePathLightSample;
 				}
 			}
 			else
@@ -534,61 +700,124 @@ void AdvancePaths(const Scene& scene, PathState* paths, int numPaths)
 				// todo: sky 
 
 				// no hit, terminate path
-				paths[i].mode = ePathTerminate;
+				paths.mode[i] = ePathTerminate;
 			}
 		}
 	}
 }
 
-void GeneratePaths(Camera camera, CameraSampler sampler, Tile tile, int seed, PathState* paths, int numPaths)
+void GeneratePaths(Camera camera, CameraSampler sampler, Tile tile, const Options& options, int seed, int sampleIndex, PathState paths, int begin, int end)
 {
-	for (int i=0; i < numPaths; ++i)
+	for (int i=begin; i < end; ++i)
 	{
-		if (paths[i].mode == ePathGenerate || paths[i].mode == ePathDisabled || paths[i].mode == ePathTerminate)
+		if (paths.mode[i] == ePathGenerate || paths.mode[i] == ePathDisabled || paths.mode[i] == ePathTerminate)
 		{
 			// if we're inside the tile
 			if (i < tile.width*tile.height)
 			{
-				Random rand(i + tile.y*tile.width + tile.x + seed);
+				Sampler rand(options.sampler, i + tile.y*tile.width + tile.x + seed);
+
+				// path i covers one pixel of the tile
+				const int ix = tile.x + i%tile.width;
+				const int iy = tile.y + i/tile.width;
+
+				rand.Start(iy*options.width + ix, sampleIndex);
 
 				// offset
 				float x, y, t;
-				StratifiedSample2D(i, tile.width, tile.height, rand, x, y);
-				StratifiedSample1D(i, 64, rand, t);
+				Sample2D(rand, x, y);
+				Sample1D(rand, t);
 
 				// shutter time
 				float time = Lerp(camera.shutterStart, camera.shutterEnd, t);
 				
-				float px = tile.x + x*tile.width;
-				float py = tile.y + y*tile.height;
+				float px = ix + x;
+				float py = iy + y;
 
 				Vec3 origin, dir;
 				sampler.GenerateRay(px, py, origin, dir);
 
 				// advance paths
-				paths[i].depth = 0;
-				paths[i].rayOrigin = origin;
-				paths[i].rayDir = dir;
-				paths[i].rayTime = time;
-				paths[i].mode = ePathAdvance;
-				paths[i].rand = rand;
-				paths[i].totalRadiance = 0.0f;
-				paths[i].pathThroughput = 1.0f;
-				paths[i].etaI = 1.0f;
-				paths[i].bsdfType = eReflected;
-				paths[i].bsdfPdf = 1.0f;
-				paths[i].rasterX = px;
-				paths[i].rasterY = py;
+				paths.depth[i] = 0;
+				paths.rayOrigin[i] = origin;
+				paths.rayDir[i] = dir;
+				paths.rayTime[i] = time;
+				paths.mode[i] = ePathAdvance;
+				paths.rand[i] = rand;
+				paths.totalRadiance[i] = 0.0f;
+				paths.pathThroughput[i] = 1.0f;
+				paths.absorption[i] = 0.0f;
+				paths.etaI[i] = 1.0f;
+				paths.bsdfType[i] = eReflected;
+				paths.bsdfPdf[i] = 1.0f;
+				paths.rasterX[i] = px;
+				paths.rasterY[i] = py;
 
 			}
 			else
 			{
-				paths[i].mode = ePathDisabled;
+				paths.mode[i] = ePathDisabled;
 			}
 		}
 	}
 }
 
+// list of path indices waiting on a stage
+typedef std::vector<int> PathQueue;
+
+// sorts a queue by its keys with a stable counting sort per byte, least significant first,
+// bytes that every key shares are skipped as most keys only differ in their lower bits
+void SortQueue(PathQueue& queue, std::vector<unsigned int>& keys, PathQueue& tempQueue, std::vector<unsigned int>& tempKeys)
+{
+	const int count = int(queue.size());
+
+	tempQueue.resize(count);
+	tempKeys.resize(count);
+
+	unsigned int common = ~0u;
+	unsigned int any = 0;
+
+	for (int i=0; i < count; ++i)
+	{
+		common &= keys[i];
+		any |= keys[i];
+	}
+
+	const unsigned int varying = common^any;
+
+	for (int shift=0; shift < 32; shift += 8)
+	{
+		if (((varying >> shift) & 0xff) == 0)
+			continue;
+
+		// bucket offsets
+		int offsets[256] = { 0 };
+
+		for (int i=0; i < count; ++i)
+			offsets[(keys[i] >> shift) & 0xff]++;
+
+		int sum = 0;
+
+		for (int b=0; b < 256; ++b)
+		{
+			const int n = offsets[b];
+			offsets[b] = sum;
+			sum += n;
+		}
+
+		for (int i=0; i < count; ++i)
+		{
+			const int o = offsets[(keys[i] >> shift) & 0xff]++;
+
+			tempKeys[o] = keys[i];
+			tempQueue[o] = queue[i];
+		}
+
+		queue.swap(tempQueue);
+		keys.swap(tempKeys);
+	}
+}
+
 } // anonymous namespace
 
 struct CpuWaveFrontRenderer : public Renderer
@@ -596,31 +825,202 @@ struct CpuWaveFrontRenderer : public Renderer
 	int tileWidth;
 	int tileHeight;
 
-	PathState* paths;
+	PathState paths;
+
+	// compacted stage queues, light sampling always continues with a bsdf
+	// sample so both stages share the light queue
+	PathQueue advanceQueue;
+	PathQueue lightQueue;
+
+	// per-chunk output of the stage being executed, concatenated in chunk
+	// order so the queue contents do not depend on scheduling
+	std::vector<PathQueue> chunkQueues;
+
+	// scratch for sorting the shading queue when options.reorderPaths is set
+	std::vector<unsigned int> sortKeys;
+	std::vector<unsigned int> tempKeys;
+	PathQueue tempQueue;
+
+	// rays traced by each worker since Init()
+	std::vector<RayStats> workerStats;
+
+	// stage timings and counters of the last frame
+	WavefrontStats frameStats;
 
 	const Scene* scene;
 
-	Random rand;
+	// number of samples each pixel has taken, the index into the sample sequence
+	int frame;
 
-	CpuWaveFrontRenderer(const Scene* s) : scene(s) 
+	// number of paths processed by a single task
+	enum { kChunkSize = 256 };
+
+	CpuWaveFrontRenderer(const Scene* s) : scene(s), frame(0)
 	{
-		tileWidth = 32;
-		tileHeight = 32;
+		// a wave covers enough paths to keep all workers busy on every stage
+		tileWidth = 128;
+		tileHeight = 128;
 
 		const int numPaths = tileWidth*tileHeight;
 
 		// allocate paths
-		paths = new PathState[numPaths];
+		paths = AllocatePaths(numPaths);
 
 		for (int i=0; i < numPaths; ++i)
-			paths[i].mode = ePathGenerate;
+			paths.mode[i] = ePathGenerate;
+
+		advanceQueue.reserve(numPaths);
+		lightQueue.reserve(numPaths);
+	}
+
+	virtual void Init(int width, int height)
+	{
+		workerStats.assign(GetNumWorkers(), RayStats());
+	}
+
+	RayStats TotalRays() const
+	{
+		RayStats stats;
+
+		for (size_t i=0; i < workerStats.size(); ++i)
+			stats += workerStats[i];
+
+		return stats;
+	}
+
+	virtual bool GetRayStats(RayStats& stats)
+	{
+		stats = TotalRays();
+		return true;
+	}
+
+	virtual bool GetWavefrontStats(WavefrontStats& stats)
+	{
+		stats = frameStats;
+		return true;
 	}
 
 	virtual ~CpuWaveFrontRenderer()
 	{
-		delete[] paths;
+		FreePaths(paths);
+	}
+
+	virtual bool Update(const Scene* s)
+	{
+		scene = s;
+
+		// paths in flight refer to the old primitives, start over with fresh random streams
+		const int numPaths = tileWidth*tileHeight;
+
+		FreePaths(paths);
+		paths = AllocatePaths(numPaths);
+
+		for (int i=0; i < numPaths; ++i)
+			paths.mode[i] = ePathGenerate;
+
+		frame = 0;
+
+		return true;
+	}
+
+	// runs a stage over the queue in parallel chunks
+	template <typename Stage>
+	void Execute(const PathQueue& input, const Stage& stage)
+	{
+		const int count = int(input.size());
+		const int numChunks = (count + kChunkSize - 1)/kChunkSize;
+
+		const int* queue = count?&input[0]:NULL;
+
+		if (int(workerStats.size()) < GetNumWorkers())
+			workerStats.resize(GetNumWorkers());
+
+		ParallelFor(numChunks, [&](int chunk, int worker)
+		{
+			const int begin = chunk*kChunkSize;
+			const int end = Min(begin + int(kChunkSize), count);
+
+			stage(queue + begin, end-begin, workerStats[worker]);
+		});
+	}
+
+	// runs a stage over the input queue in parallel chunks, paths
+	// left in the next mode are gathered into the output queue
+	template <typename Stage>
+	void Dispatch(const PathQueue& input, PathQueue& output, PathMode next, const Stage& stage)
+	{
+		const int count = int(input.size());
+		const int numChunks = (count + kChunkSize - 1)/kChunkSize;
+
+		if (int(chunkQueues.size()) < numChunks)
+			chunkQueues.resize(numChunks);
+
+		const int* queue = count?&input[0]:NULL;
+
+		if (int(workerStats.size()) < GetNumWorkers())
+			workerStats.resize(GetNumWorkers());
+
+		ParallelFor(numChunks, [&](int chunk, int worker)
+		{
+			const int begin = chunk*kChunkSize;
+			const int end = Min(begin + int(kChunkSize), count);
+
+			stage(queue + begin, end-begin, workerStats[worker]);
+
+			PathQueue& local = chunkQueues[chunk];
+			local.resize(0);
+
+			for (int q=begin; q < end; ++q)
+			{
+				if (paths.mode[queue[q]] == next)
+					local.push_back(queue[q]);
+			}
+		});
+
+		output.resize(0);
+
+		for (int c=0; c < numChunks; ++c)
+			output.insert(output.end(), chunkQueues[c].begin(), chunkQueues[c].end());
 	}
 
+	// sorts the paths in a queue by PathSortKey(), paths don't depend on each other so
+	// this only changes which paths are shaded and traced next to each other
+	void Reorder(PathQueue& queue, const Bounds& bounds)
+	{
+		const Scene& scene = *this->scene;
+
+		sortKeys.resize(queue.size());
+
+		const int* first = queue.empty()?NULL:&queue[0];
+
+		Execute(queue, [&](const int* q, int count, RayStats& stats)
+		{
+			unsigned int* keys = &sortKeys[q-first];
+
+			for (int k=0; k < count; ++k)
+			{
+				const int i = q[k];
+				keys[k] = PathSortKey(int(paths.primitive[i]-&scene.primitives[0]), paths.pos[i], paths.rayDir[i], bounds);
+			}
+		});
+
+		SortQueue(queue, sortKeys, tempQueue, tempKeys);
+	}
+
+	// terminated paths splat into the caller's output so it already holds the restored samples
+	virtual bool Resume(const Color* accum) { return true; }
+
+	// adds the time since start and the work of a stage to the frame's stats, returns the end time
+	double EndStage(WavefrontStage stage, double start, unsigned long long numPaths, unsigned long long numRays)
+	{
+		const double end = GetSeconds();
+
+		frameStats.time[stage] += (end-start)*1000.0;
+		frameStats.paths[stage] += numPaths;
+		frameStats.rays[stage] += numRays;
+
+		return end;
+	}
 
 	void Render(const Camera& camera, const Options& options, Color* output)
 	{
@@ -644,8 +1044,6 @@ struct CpuWaveFrontRenderer : public Renderer
 			}
 		}
 
-		const int numPaths = tileWidth*tileHeight;
-
 		// create a sampler for the camera
 		CameraSampler sampler(
 			Transform(camera.position, camera.rotation),
@@ -655,20 +1053,92 @@ struct CpuWaveFrontRenderer : public Renderer
 			options.width,
 			options.height);
 
+		const Scene& scene = *this->scene;
+
+		frameStats = WavefrontStats();
+		frameStats.pathsPerWave = tileWidth*tileHeight;
+
+		const Bounds sortBounds = options.reorderPaths?PathSortBounds(scene):Bounds();
+
+		// the wave seeds only depend on the sample index, so a frame renders the same
+		// whichever process takes it
+		const int sampleIndex = options.sampleOffset + frame;
+
+		Random rand(sampleIndex);
+
 		for (int tileIndex=0; tileIndex < tiles.size(); ++tileIndex)
 		{
-			GeneratePaths(camera, sampler, tiles[tileIndex], rand.Rand(), paths, numPaths);
+			const Tile& tile = tiles[tileIndex];
+
+			const int numPaths = tile.width*tile.height;
+			const int numChunks = (numPaths + kChunkSize - 1)/kChunkSize;
+			const int seed = rand.Rand();
+
+			double start = GetSeconds();
+
+			ParallelFor(numChunks, [&](int chunk, int worker)
+			{
+				GeneratePaths(camera, sampler, tile, options, seed, sampleIndex, paths, chunk*kChunkSize, Min((chunk+1)*int(kChunkSize), numPaths));
+			});
+
+			advanceQueue.resize(numPaths);
+			for (int i=0; i < numPaths; ++i)
+				advanceQueue[i] = i;
+
+			start = EndStage(eStageGenerate, start, numPaths, 0);
 	
-			for (int i=0; i < options.maxDepth; ++i)
+			for (int i=0; i < options.maxDepth && advanceQueue.size(); ++i)
 			{
-				AdvancePaths(*scene, paths, numPaths);
-				SampleLights(*scene, paths, numPaths);
-				SampleBsdfs(paths, numPaths);
+				frameStats.activePaths[Min(i, kMaxWavefrontBounces-1)] += advanceQueue.size();
+				frameStats.numBounces = Max(frameStats.numBounces, i+1);
+
+				const int numAdvance = int(advanceQueue.size());
+				RayStats before = TotalRays();
+
+				Dispatch(advanceQueue, lightQueue, ePathLightSample, [&](const int* queue, int count, RayStats& stats)
+				{
+					AdvancePaths(scene, paths, queue, count, stats);
+				});
+
+				RayStats after = TotalRays();
+				start = EndStage(eStageAdvance, start, numAdvance, (after.primary-before.primary) + (after.secondary-before.secondary));
+
+				// group hits by primitive and position, bsdf sampling keeps the order so the next
+				// bounce's rays also leave from neighbouring points
+				if (options.reorderPaths)
+				{
+					Reorder(lightQueue, sortBounds);
+					start = EndStage(eStageReorder, start, lightQueue.size(), 0);
+				}
+
+				// lights and bsdfs could share a dispatch, they are kept apart so each can be timed
+				Execute(lightQueue, [&](const int* queue, int count, RayStats& stats)
+				{
+					SampleLights(scene, paths, queue, count, stats);
+				});
+
+				before = after;
+				after = TotalRays();
+				start = EndStage(eStageLights, start, lightQueue.size(), after.shadow-before.shadow);
+
+				const int numBsdfs = int(lightQueue.size());
+
+				Dispatch(lightQueue, advanceQueue, ePathAdvance, [&](const int* queue, int count, RayStats& stats)
+				{
+					SampleBsdfs(scene, paths, queue, count, options.rouletteDepth);
+				});
+
+				start = EndStage(eStageBsdfs, start, numBsdfs, 0);
 			}
-			
 
 			TerminatePaths(output, options, paths, numPaths);
+
+			EndStage(eStageTerminate, start, numPaths, 0);
+
+			frameStats.numWaves++;
 		}
+
+		frame++;
 	}
 };
 
@@ -5,6 +5,8 @@
 #include "bvh.h"
 
 #include <map>
+#include <set>
+#include <algorithm>
 
 struct GPUScene
 {
@@ -14,9 +16,26 @@ struct GPUScene
 	Primitive* lights;
 	int numLights;
 
+	// indexed by the primitives' material
+	Material* materials;
+	int numMaterials;
+
+	// one entry per mesh referenced, the primitives point into this
+	MeshGeometry* meshes;
+	int numMeshes;
+
 	Sky sky;
 
-	BVH bvh;
+	// trees split over the shutter, see Scene
+	BVH bvh[kMotionSegments];
+	int numMotionSegments;
+
+	// per mesh table entry when meshes are streamed, NULL otherwise, a mesh that isn't
+	// resident has NULL nodes in the table and paths that need it flag it as requested,
+	// resident meshes are flagged as used so the least recently used can be evicted
+	int* meshRequests;
+	int* meshUses;
+	Bounds* meshBounds;
 };
 
 #define kBsdfSamples 1.0f
@@ -25,11 +44,28 @@ struct GPUScene
 
 #define LAUNCH_BOUNDS __launch_bounds__(256, 4)
 
-__device__ inline int getGlobalIndex()
+// paths processed and rays traced by each stage over the current frame,
+// followed by the paths still alive at the start of each bounce
+__device__ unsigned long long g_stagePaths[eNumWavefrontStages];
+__device__ unsigned long long g_stageRays[eNumWavefrontStages];
+__device__ unsigned long long g_activePaths[kMaxWavefrontBounces];
+
+// adds value summed over the warp to counter with a single atomic, must be reached by the whole warp
+__device__ inline void CountWarp(unsigned long long* counter, int value)
 {
-	int blockId = blockIdx.x + blockIdx.y * gridDim.x; 
-	int threadId = blockId * (blockDim.x * blockDim.y) + (threadIdx.y * blockDim.x) + threadIdx.x;
-	return threadId;
+	for (int offset=16; offset > 0; offset /= 2)
+	{
+#if __CUDACC_VER_MAJOR__ >= 9
+		value += __shfl_down_sync(0xffffffff, value, offset);
+#else
+		value += __shfl_down(value, offset);
+#endif
+	}
+
+	const int lane = (threadIdx.y*blockDim.x + threadIdx.x)&31;
+
+	if (lane == 0 && value)
+		atomicAdd(counter, (unsigned long long)value);
 }
 
 // create a texture object from memory and store it in a 64-bit pointer
@@ -140,6 +176,49 @@ void CreateVec4Texture(Vec4** deviceBuffer, const Vec4* hostBuffer, int sizeInBy
 
 }
 
+void DestroyTexture(const void* texture)
+{
+	cudaFree((void*)texture);
+
+#if USE_TEXTURES
+#error todo
+#endif
+
+}
+
+// plain device copy of an array, NULL if it is empty
+template <typename T>
+const T* CreateDeviceArray(const T* hostBuffer, int count)
+{
+	if (!hostBuffer || count == 0)
+		return NULL;
+
+	T* buffer;
+	cudaMalloc(&buffer, sizeof(T)*count);
+	cudaMemcpy(buffer, hostBuffer, sizeof(T)*count, cudaMemcpyHostToDevice);
+
+	return buffer;
+}
+
+// links for stackless traversal are derived from the nodes on upload
+BVHLink* CreateGPULinks(const BVHNode* nodes, int numNodes)
+{
+#if USE_STACKLESS_BVH
+
+	if (numNodes == 0)
+		return NULL;
+
+	std::vector<BVHLink> links(numNodes);
+	BuildBVHLinks(nodes, numNodes, &links[0]);
+
+	BVHLink* gpuLinks;
+	CreateIntTexture((int**)&gpuLinks, (int*)&links[0], sizeof(BVHLink)*numNodes);
+
+	return gpuLinks;
+#else
+	return NULL;
+#endif
+}
 
 MeshGeometry CreateGPUMesh(const MeshGeometry& hostMesh)
 {
@@ -150,28 +229,48 @@ MeshGeometry CreateGPUMesh(const MeshGeometry& hostMesh)
 	
 	MeshGeometry gpuMesh;
 
-#if USE_TEXTURES
-	
-	// expand positions out to vec4
-	std::vector<Vec4> positions;
-	std::vector<Vec4> normals;
+	// compressed meshes upload their compressed attributes only
+	gpuMesh.compressed = hostMesh.compressed;
 
-	for (int i=0; i < numVertices; ++i)
+	if (hostMesh.compressed.positions)
 	{
-		positions.push_back(Vec4(hostMesh.positions[i], 1.0f));
-		normals.push_back(Vec4(hostMesh.normals[i], 0.0f));
+		const CompressedVertices& c = hostMesh.compressed;
+
+		gpuMesh.compressed.positions = CreateDeviceArray(c.positions, numVertices);
+		gpuMesh.compressed.normals = CreateDeviceArray(c.normals, numVertices);
+		gpuMesh.compressed.indices = CreateDeviceArray(c.indices, numIndices);
+		gpuMesh.compressed.clusterBases = CreateDeviceArray(c.clusterBases, c.numClusters);
+		gpuMesh.compressed.wideIndices = CreateDeviceArray(c.wideIndices, c.numWideIndices);
+
+		gpuMesh.positions = NULL;
+		gpuMesh.normals = NULL;
+		gpuMesh.indices = NULL;
 	}
+	else
+	{
+#if USE_TEXTURES
+	
+		// expand positions out to vec4
+		std::vector<Vec4> positions;
+		std::vector<Vec4> normals;
+
+		for (int i=0; i < numVertices; ++i)
+		{
+			positions.push_back(Vec4(hostMesh.positions[i], 1.0f));
+			normals.push_back(Vec4(hostMesh.normals[i], 0.0f));
+		}
 
-	CreateVec4Texture((Vec4**)&gpuMesh.positions, (Vec4*)&positions[0], sizeof(Vec4)*numVertices);
-	CreateVec4Texture((Vec4**)&gpuMesh.normals, (Vec4*)&normals[0], sizeof(Vec4)*numVertices);
+		CreateVec4Texture((Vec4**)&gpuMesh.positions, (Vec4*)&positions[0], sizeof(Vec4)*numVertices);
+		CreateVec4Texture((Vec4**)&gpuMesh.normals, (Vec4*)&normals[0], sizeof(Vec4)*numVertices);
 
 #else
-	CreateFloatTexture((float**)&gpuMesh.positions, (float*)&hostMesh.positions[0], sizeof(Vec3)*numVertices);
-	CreateFloatTexture((float**)&gpuMesh.normals, (float*)&hostMesh.normals[0], sizeof(Vec3)*numVertices);
+		CreateFloatTexture((float**)&gpuMesh.positions, (float*)&hostMesh.positions[0], sizeof(Vec3)*numVertices);
+		CreateFloatTexture((float**)&gpuMesh.normals, (float*)&hostMesh.normals[0], sizeof(Vec3)*numVertices);
 
 #endif
 
-	CreateIntTexture((int**)&gpuMesh.indices, (int*)&hostMesh.indices[0], sizeof(int)*numIndices);
+		CreateIntTexture((int**)&gpuMesh.indices, (int*)&hostMesh.indices[0], sizeof(int)*numIndices);
+	}
 	
 
 	/*
@@ -188,14 +287,24 @@ MeshGeometry CreateGPUMesh(const MeshGeometry& hostMesh)
 	//cudaMemcpy((BVHNode*)gpuMesh.nodes, &hostMesh.nodes[0], sizeof(BVHNode)*numNodes, cudaMemcpyHostToDevice);
 
 	CreateVec4Texture((Vec4**)&gpuMesh.nodes, (Vec4*)&hostMesh.nodes[0], sizeof(BVHNode)*numNodes);
+
+	gpuMesh.links = CreateGPULinks(hostMesh.nodes, numNodes);
 	
-	cudaMalloc((float**)&gpuMesh.cdf, sizeof(float)*numIndices/3);
-	cudaMemcpy((float*)gpuMesh.cdf, &hostMesh.cdf[0], sizeof(float)*numIndices/3, cudaMemcpyHostToDevice);
+	cudaMalloc((AliasEntry**)&gpuMesh.triangleTable, sizeof(AliasEntry)*numIndices/3);
+	cudaMemcpy((AliasEntry*)gpuMesh.triangleTable, &hostMesh.triangleTable[0], sizeof(AliasEntry)*numIndices/3, cudaMemcpyHostToDevice);
 	
 	gpuMesh.numIndices = numIndices;
 	gpuMesh.numVertices = numVertices;
 	gpuMesh.numNodes = numNodes;
+
+	// wide trees are only traversed on the CPU
+	gpuMesh.wideNodes = NULL;
+	gpuMesh.packets = NULL;
+	gpuMesh.numWideNodes = 0;
+	gpuMesh.numPackets = 0;
 	gpuMesh.area = hostMesh.area;
+	gpuMesh.id = hostMesh.id;
+	gpuMesh.generation = hostMesh.generation;
 
 	return gpuMesh;
 
@@ -203,7 +312,66 @@ MeshGeometry CreateGPUMesh(const MeshGeometry& hostMesh)
 
 void DestroyGPUMesh(const MeshGeometry& m)
 {
+	DestroyTexture(m.positions);
+	DestroyTexture(m.normals);
+	DestroyTexture(m.indices);
+	DestroyTexture(m.nodes);
+
+	if (m.links)
+		DestroyTexture(m.links);
+
+	cudaFree((void*)m.compressed.positions);
+	cudaFree((void*)m.compressed.normals);
+	cudaFree((void*)m.compressed.indices);
+	cudaFree((void*)m.compressed.clusterBases);
+	cudaFree((void*)m.compressed.wideIndices);
+
+	cudaFree((void*)m.triangleTable);
+}
+
+// device memory taken by CreateGPUMesh()
+size_t GPUMeshBytes(const MeshGeometry& hostMesh)
+{
+	const CompressedVertices& c = hostMesh.compressed;
+
+	size_t bytes = sizeof(BVHNode)*hostMesh.numNodes + sizeof(AliasEntry)*(hostMesh.numIndices/3);
+
+#if USE_STACKLESS_BVH
+	bytes += sizeof(BVHLink)*hostMesh.numNodes;
+#endif
+
+	if (c.positions)
+	{
+		bytes += (sizeof(*c.positions) + sizeof(*c.normals))*hostMesh.numVertices + sizeof(*c.indices)*hostMesh.numIndices;
+		bytes += sizeof(*c.clusterBases)*c.numClusters + sizeof(*c.wideIndices)*c.numWideIndices;
+	}
+	else
+	{
+#if USE_TEXTURES
+		bytes += sizeof(Vec4)*2*hostMesh.numVertices;
+#else
+		bytes += sizeof(Vec3)*2*hostMesh.numVertices;
+#endif
+		bytes += sizeof(int)*hostMesh.numIndices;
+	}
+
+	return bytes;
+}
+
+// mesh table entry of a mesh that isn't on the device, only its counts and area are kept
+MeshGeometry NonResidentMesh(const MeshGeometry& hostMesh)
+{
+	MeshGeometry gpuMesh;
+	memset(&gpuMesh, 0, sizeof(MeshGeometry));
 
+	gpuMesh.numIndices = hostMesh.numIndices;
+	gpuMesh.numVertices = hostMesh.numVertices;
+	gpuMesh.numNodes = hostMesh.numNodes;
+	gpuMesh.area = hostMesh.area;
+	gpuMesh.id = hostMesh.id;
+	gpuMesh.generation = hostMesh.generation;
+
+	return gpuMesh;
 }
 
 Texture CreateGPUTexture(const Texture& tex)
@@ -212,8 +380,8 @@ Texture CreateGPUTexture(const Texture& tex)
 	
 	Texture gpuTex = tex;
 
-	cudaMalloc((void**)&gpuTex.data, sizeof(float)*numTexels);
-	cudaMemcpy(gpuTex.data, tex.data, sizeof(float)*numTexels, cudaMemcpyHostToDevice);
+	cudaMalloc((void**)&gpuTex.data, sizeof(*tex.data)*numTexels);
+	cudaMemcpy(gpuTex.data, tex.data, sizeof(*tex.data)*numTexels, cudaMemcpyHostToDevice);
 
 	return gpuTex;
 }
@@ -230,12 +398,13 @@ Sky CreateGPUSky(const Sky& sky)
 		// copy pixel data
 		CreateVec4Texture((Vec4**)&gpuSky.probe.data, sky.probe.data, numPixels*sizeof(float)*4);
 
-		// copy cdf tables
-		CreateFloatTexture((float**)&gpuSky.probe.cdfValuesX, sky.probe.cdfValuesX, numPixels*sizeof(float));
-		CreateFloatTexture((float**)&gpuSky.probe.pdfValuesX, sky.probe.pdfValuesX, numPixels*sizeof(float));
+		// copy sampling table
+		cudaMalloc((AliasEntry**)&gpuSky.probe.table, numPixels*sizeof(AliasEntry));
+		cudaMemcpy(gpuSky.probe.table, sky.probe.table, numPixels*sizeof(AliasEntry), cudaMemcpyHostToDevice);
 
-		CreateFloatTexture((float**)&gpuSky.probe.cdfValuesY, sky.probe.cdfValuesY, sky.probe.height*sizeof(float));
-		CreateFloatTexture((float**)&gpuSky.probe.pdfValuesY, sky.probe.pdfValuesY, sky.probe.height*sizeof(float));
+		// copy prefiltered levels
+		if (sky.probe.mips)
+			CreateVec4Texture((Vec4**)&gpuSky.probe.mips, sky.probe.mips, sky.probe.mipOffsets[sky.probe.numLevels]*sizeof(float)*4);
 	}
 
 	return gpuSky;
@@ -245,15 +414,51 @@ void DestroyGPUSky(const Sky& gpuSky)
 {
 	if (gpuSky.probe.valid)
 	{
-		// todo
+		DestroyTexture(gpuSky.probe.data);
+
+		if (gpuSky.probe.mips)
+			DestroyTexture(gpuSky.probe.mips);
+
+		cudaFree(gpuSky.probe.table);
 	}
 }
 
 
-#if 1
+// for streamed scenes returns whether the mesh of a primitive is resident, a mesh that isn't is
+// requested if the ray enters its bounds closer than tmax, missingT is lowered to the entry distance
+inline __device__ bool MeshResident(const GPUScene& scene, const Primitive& p, const Ray& ray, float tmax, float& missingT)
+{
+	if (p.type != eMesh || !scene.meshRequests)
+		return true;
+
+	const int m = p.mesh - scene.meshes;
+
+	if (p.mesh->nodes)
+	{
+		scene.meshUses[m] = 1;
+		return true;
+	}
+
+	const Transform transform = PrimitiveTransform(p, ray.time);
+
+	// distances are the same in mesh space
+	Vec3 localOrigin, localDir;
+	PrimitiveLocalRay(p, transform, ray.origin, ray.dir, localOrigin, localDir);
+
+	float t;
+	if (IntersectRayAABB(localOrigin, localDir, scene.meshBounds[m].lower, scene.meshBounds[m].upper, t, NULL) && t < tmax)
+	{
+		scene.meshRequests[m] = 1;
+		missingT = Min(missingT, t);
+	}
+
+	return false;
+}
 
+#if !USE_STACKLESS_BVH
 
-inline __device__ bool Trace(const GPUScene& scene, const Vec3& rayOrigin, const Vec3& rayDir, float rayTime, float& outT, Vec3& outNormal, const Primitive** RESTRICT outPrimitive)
+// complete is cleared if geometry that isn't resident could hold a closer hit
+inline __device__ bool Trace(const GPUScene& scene, const Vec3& rayOrigin, const Vec3& rayDir, float rayTime, float& outT, Vec3& outNormal, const Primitive** RESTRICT outPrimitive, bool& complete)
 {
 	int stack[64];
 	stack[0] = 0;
@@ -269,9 +474,11 @@ inline __device__ bool Trace(const GPUScene& scene, const Vec3& rayOrigin, const
 	origin = rayOrigin;
 	dir = rayDir;
 
-	const BVHNode* RESTRICT root = scene.bvh.nodes;
+	// scene tree covering the part of the shutter the ray is in
+	const BVHNode* RESTRICT sceneRoot = scene.bvh[MotionSegment(rayTime, scene.numMotionSegments)].nodes;
+	const BVHNode* RESTRICT root = sceneRoot;
 
-	MeshGeometry mesh;
+	const MeshGeometry* mesh = NULL;
 	int primitiveIndex = -1;
 
 	float closestT = FLT_MAX;
@@ -283,6 +490,9 @@ inline __device__ bool Trace(const GPUScene& scene, const Vec3& rayOrigin, const
 	int closestPrimitive = -1;
 	int closestTri;
 
+	// nearest entry into a mesh that isn't resident
+	float missingT = FLT_MAX;
+
 	while(count)
 	{
 		const int nodeIndex = stack[--count];
@@ -295,7 +505,7 @@ inline __device__ bool Trace(const GPUScene& scene, const Vec3& rayOrigin, const
 			rcpDir.z = 1.0f/rayDir.z;
 			origin = rayOrigin;
 			dir = rayDir;
-			root = scene.bvh.nodes;
+			root = sceneRoot;
 			primitiveIndex = -1;
 
 			continue;
@@ -312,7 +522,7 @@ inline __device__ bool Trace(const GPUScene& scene, const Vec3& rayOrigin, const
 			{
 				const Primitive& p = scene.primitives[leftIndex];
 
-				Transform transform = InterpolateTransform(p.startTransform, p.endTransform, rayTime);
+				const Transform transform = PrimitiveTransform(p, rayTime);
 
 				switch (p.type)
 				{
@@ -347,6 +557,9 @@ inline __device__ bool Trace(const GPUScene& scene, const Vec3& rayOrigin, const
 					}
 					case eMesh:
 					{
+						if (!MeshResident(scene, p, Ray(rayOrigin, rayDir, rayTime), closestT, missingT))
+							break;
+
 						// push a back-tracking marker in the stack
 						stack[count++] = -1;
 
@@ -354,15 +567,14 @@ inline __device__ bool Trace(const GPUScene& scene, const Vec3& rayOrigin, const
 						stack[count++] = 0;
 
 						// transform ray to primitive local space
-						origin = InverseTransformPoint(transform, rayOrigin);					
-						dir = InverseTransformVector(transform, rayDir);
+						PrimitiveLocalRay(p, transform, rayOrigin, rayDir, origin, dir);
 
 						rcpDir.x = 1.0f/dir.x;
 						rcpDir.y = 1.0f/dir.y;
 						rcpDir.z = 1.0f/dir.z;				
 				
 						// set bvh and mesh sources
-						root = p.mesh.nodes;
+						root = p.mesh->nodes;
 						mesh = p.mesh;
 
 						primitiveIndex = leftIndex;
@@ -373,13 +585,12 @@ inline __device__ bool Trace(const GPUScene& scene, const Vec3& rayOrigin, const
 			else
 			{
 				// mesh mode
-				int i0 = fetchInt(mesh.indices, leftIndex*3+0);
-				int i1 = fetchInt(mesh.indices, leftIndex*3+1);
-				int i2 = fetchInt(mesh.indices, leftIndex*3+2);
+				int i0, i1, i2;
+				MeshTriangle(*mesh, leftIndex, i0, i1, i2);
 
-				const Vec3 a = fetchVec3(mesh.positions, i0);
-				const Vec3 b = fetchVec3(mesh.positions, i1);
-				const Vec3 c = fetchVec3(mesh.positions, i2);
+				const Vec3 a = MeshPosition(*mesh, i0);
+				const Vec3 b = MeshPosition(*mesh, i1);
+				const Vec3 c = MeshPosition(*mesh, i2);
 
 				float t, u, v, w;
 				float sign;
@@ -427,6 +638,7 @@ inline __device__ bool Trace(const GPUScene& scene, const Vec3& rayOrigin, const
 		}
 	}
 
+	complete = missingT >= closestT;
 	
 	if (closestPrimitive >= 0)
 	{
@@ -434,16 +646,15 @@ inline __device__ bool Trace(const GPUScene& scene, const Vec3& rayOrigin, const
 
 		if (p.type == eMesh)
 		{
-			Transform transform = InterpolateTransform(p.startTransform, p.endTransform, rayTime);
+			const Transform transform = PrimitiveTransform(p, rayTime);
 
 			// interpolate vertex normals
-			int i0 = fetchInt(p.mesh.indices, closestTri*3+0);
-			int i1 = fetchInt(p.mesh.indices, closestTri*3+1);
-			int i2 = fetchInt(p.mesh.indices, closestTri*3+2);
+			int i0, i1, i2;
+			MeshTriangle(*p.mesh, closestTri, i0, i1, i2);
 
-			const Vec3 n1 = fetchVec3(p.mesh.normals, i0);
-			const Vec3 n2 = fetchVec3(p.mesh.normals, i1);
-			const Vec3 n3 = fetchVec3(p.mesh.normals, i2);
+			const Vec3 n1 = MeshNormal(*p.mesh, i0);
+			const Vec3 n2 = MeshNormal(*p.mesh, i1);
+			const Vec3 n3 = MeshNormal(*p.mesh, i2);
 
 			Vec3 smoothNormal = (1.0f-closestV-closestW)*n1 + closestV*n2 + closestW*n3;
 
@@ -471,22 +682,22 @@ inline __device__ bool Trace(const GPUScene& scene, const Vec3& rayOrigin, const
 
 #else
 
-// trace a ray against the scene returning the closest intersection
-inline __device__ bool Trace(const GPUScene& scene, const Vec3& rayOrigin, const Vec3& rayDir, float rayTime, float& outT, Vec3& outNormal, const Primitive** outPrimitive)
+// trace a ray against the scene returning the closest intersection, the scene and mesh trees
+// are walked through their links so no traversal stack is kept, complete is cleared if
+// geometry that isn't resident could hold a closer hit
+inline __device__ bool Trace(const GPUScene& scene, const Vec3& rayOrigin, const Vec3& rayDir, float rayTime, float& outT, Vec3& outNormal, const Primitive** outPrimitive, bool& complete)
 {
-
-#if 0
-
 	struct Callback
 	{
 		float minT;
+		float missingT;
 		Vec3 closestNormal;
 		const Primitive* closestPrimitive;
 
-		const Ray& ray;
+		const Ray ray;
 		const GPUScene& scene;
 
-		CUDA_CALLABLE inline Callback(const GPUScene& s, const Ray& r) : minT(REAL_MAX), closestPrimitive(NULL), ray(r), scene(s)
+		CUDA_CALLABLE inline Callback(const GPUScene& s, const Ray& r) : minT(REAL_MAX), missingT(REAL_MAX), closestPrimitive(NULL), ray(r), scene(s)
 		{
 
 		}
@@ -494,11 +705,14 @@ inline __device__ bool Trace(const GPUScene& scene, const Vec3& rayOrigin, const
 		CUDA_CALLABLE inline void operator()(int index)
 		{
 			float t;
-			Vec3 n, ns;
+			Vec3 n;
 
 			const Primitive& primitive = scene.primitives[index];
 
-			if (PrimitiveIntersect(primitive, ray, t, &n))
+			if (!MeshResident(scene, primitive, ray, minT, missingT))
+				return;
+
+			if (PrimitiveIntersect(primitive, ray, t, &n, minT))
 			{
 				if (t < minT && t > 0.0f)
 				{
@@ -510,54 +724,72 @@ inline __device__ bool Trace(const GPUScene& scene, const Vec3& rayOrigin, const
 		}
 	};
 
-	Callback callback(scene, ray);
-	QueryBVH(callback, scene.bvh.nodes, ray.origin, ray.dir);
+	const BVH& bvh = scene.bvh[MotionSegment(rayTime, scene.numMotionSegments)];
 
-	outT = callback.minT;		
-	outNormal = FaceForward(callback.closestNormal, -ray.dir);
-	
-	if (outPrimitive)
-		*outPrimitive = callback.closestPrimitive;
+	Callback callback(scene, Ray(rayOrigin, rayDir, rayTime));
+	QueryBVHStackless(callback, bvh.nodes, bvh.links, rayOrigin, rayDir, callback.minT);
 
-	return callback.closestPrimitive != NULL;
-	
-#else
+	complete = callback.missingT >= callback.minT;
 
-	float minT = REAL_MAX;
-	const Primitive* closestPrimitive = NULL;
-	Vec3 closestNormal(0.0f);
+	if (callback.closestPrimitive)
+	{
+		outT = callback.minT;		
+		outNormal = FaceForward(callback.closestNormal, -rayDir);
+		
+		if (outPrimitive)
+			*outPrimitive = callback.closestPrimitive;
 
-	for (int i=0; i < scene.numPrimitives; ++i)
+		return true;
+	}
+	else
 	{
-		const Primitive& primitive = scene.primitives[i];
+		// no hit
+		return false;
+	}
+}
 
-		float t;
-		Vec3 n;
+#endif
+
+
+// returns true if anything is hit closer than tmax, exits on the first hit so is
+// cheaper than Trace() for shadow rays which don't need the closest intersection,
+// complete is cleared if nothing was hit but geometry that isn't resident could be
+inline __device__ bool Occluded(const GPUScene& scene, const Vec3& rayOrigin, const Vec3& rayDir, float rayTime, float tmax, bool& complete)
+{
+	struct Callback
+	{
+		const GPUScene& scene;
+		const Ray ray;
+		float tmax;
+		float missingT;
+
+		CUDA_CALLABLE inline Callback(const GPUScene& s, const Ray& r, float t) : scene(s), ray(r), tmax(t), missingT(FLT_MAX) {}
 
-		if (PrimitiveIntersect(primitive, Ray(rayOrigin, rayDir, rayTime), t, &n))
+		CUDA_CALLABLE inline bool operator()(int index)
 		{
-			if (t < minT && t > 0.0f)
-			{
-				minT = t;
-				closestPrimitive = &primitive;
-				closestNormal = n;
-			}
+			const Primitive& primitive = scene.primitives[index];
+
+			if (!MeshResident(scene, primitive, ray, tmax, missingT))
+				return false;
+
+			return PrimitiveOcclude(primitive, ray, tmax);
 		}
-	}
-	
-	outT = minT;		
-	outNormal = FaceForward(closestNormal, -rayDir);
-	
-	if (outPrimitive)
-		*outPrimitive = closestPrimitive;
+	};
+
+	Callback callback(scene, Ray(rayOrigin, rayDir, rayTime), tmax);
 
-	return closestPrimitive != NULL;
+	const BVH& bvh = scene.bvh[MotionSegment(rayTime, scene.numMotionSegments)];
 
+#if USE_STACKLESS_BVH
+	const bool occluded = QueryBVHAnyStackless(callback, bvh.nodes, bvh.links, rayOrigin, rayDir, tmax);
+#else
+	const bool occluded = QueryBVHAny(callback, bvh.nodes, rayOrigin, rayDir, tmax);
 #endif
 
-}
+	complete = occluded || callback.missingT >= tmax;
 
-#endif
+	return occluded;
+}
 
 
 __device__ inline float SampleTexture(const Texture& map, int i, int j, int k)
@@ -566,7 +798,7 @@ __device__ inline float SampleTexture(const Texture& map, int i, int j, int k)
 	int y = int(Abs(j))%map.height;
 	int z = int(Abs(k))%map.depth;
 	
-	return map.data[z*map.width*map.height + y*map.width + x];
+	return TexelValue(map, z*map.width*map.height + y*map.width + x);
 }
 
 
@@ -594,7 +826,7 @@ __device__ inline float LinearInterp(const Texture& map, const Vec3& pos)
 	return g;
 }
 
-__device__ inline Vec3 EvaluateBumpNormal(const Vec3& surfaceNormal, const Vec3& surfacePos, const Texture& bumpMap, const Vec3& bumpTile, float bumpStrength, Random& rand)
+__device__ inline Vec3 EvaluateBumpNormal(const Vec3& surfaceNormal, const Vec3& surfacePos, const Texture& bumpMap, const Vec3& bumpTile, float bumpStrength, Sampler& rand)
 {
 	Vec3 u, v;
 	BasisFromVector(surfaceNormal, &u, &v);
@@ -609,9 +841,12 @@ __device__ inline Vec3 EvaluateBumpNormal(const Vec3& surfaceNormal, const Vec3&
 
 
 
-__device__ inline Vec3 SampleLights(const GPUScene& scene, const Primitive& surfacePrimitive, float etaI, float etaO, const Vec3& surfacePos, const Vec3& surfaceNormal, const Vec3& shadingNormal, const Vec3& wo, float time, Random& rand)
+// complete is cleared if any shadow ray could be blocked by geometry that isn't resident
+__device__ inline Vec3 SampleLights(const GPUScene& scene, const Primitive& surfacePrimitive, float etaI, float etaO, const Vec3& surfacePos, const Vec3& surfaceNormal, const Vec3& shadingNormal, const Vec3& wo, float time, Sampler& rand, int& numShadowRays, bool& complete)
 {	
 	Vec3 sum(0.0f);
+
+	complete = true;
 	
 	if (scene.sky.probe.valid)
 	{
@@ -634,13 +869,17 @@ __device__ inline Vec3 SampleLights(const GPUScene& scene, const Primitive& surf
 //				continue;
 
 			// check if occluded
-			float t;
-			Vec3 n;
-			
-			if (Trace(scene, surfacePos + FaceForward(surfaceNormal, wi)*kRayEpsilon, wi, time, t, n, NULL) == false)
+			numShadowRays++;
+
+			bool resolved;
+			const bool occluded = Occluded(scene, surfacePos + FaceForward(surfaceNormal, wi)*kRayEpsilon, wi, time, FLT_MAX, resolved);
+
+			complete &= resolved;
+
+			if (!occluded)
 			{
-				float bsdfPdf = BSDFPdf(surfacePrimitive.material, etaI, etaO, surfacePos, surfaceNormal, wo, wi);
-				Vec3 f = BSDFEval(surfacePrimitive.material, etaI, etaO, surfacePos, surfaceNormal, wo, wi);
+				float bsdfPdf;
+				Vec3 f = BSDFEvalPdf(scene.materials[surfacePrimitive.material], etaI, etaO, surfacePos, surfaceNormal, wo, wi, bsdfPdf);
 				
 				if (bsdfPdf > 0.0f)
 				{
@@ -695,43 +934,44 @@ __device__ inline Vec3 SampleLights(const GPUScene& scene, const Primitive& surf
 			if (Dot(wi, lightNormal) >= 0.0f)
 				continue;
 
-			// check visibility
-			float t;
-			Vec3 n;			
-			if (Trace(scene, surfacePos + FaceForward(surfaceNormal, wi)*kRayEpsilon, wi, time, t, n, NULL))			
-			{
-				float tSq = t*t;
+			// check visibility, nothing may be hit before the light sample less a tolerance
+			// for the light's own surface, this works for portal sampling where you have
+			// a large light that you sample through a small window
+			const float kTolerance = 1.e-2f;
 
-				// if our next hit was further than distance to light then accept
-				// sample, this works for portal sampling where you have a large light
-				// that you sample through a small window
-				const float kTolerance = 1.e-2f;
+			numShadowRays++;
 
-				if (fabsf(t - sqrtf(dSq)) <= kTolerance)
-				{				
-					const float nl = Abs(Dot(lightNormal, wi));
+			bool resolved;
+			const bool occluded = Occluded(scene, surfacePos + FaceForward(surfaceNormal, wi)*kRayEpsilon, wi, time, sqrtf(dSq) - kTolerance, resolved);
 
-					// light pdf with respect to area and convert to pdf with respect to solid angle
-					float lightArea = PrimitiveArea(lightPrimitive);
-					float lightPdf = ((1.0f/lightArea)*tSq)/nl;
+			complete &= resolved;
 
-					// bsdf pdf for light's direction
-					float bsdfPdf = BSDFPdf(surfacePrimitive.material, etaI, etaO, surfacePos, shadingNormal, wo, wi);
-					Vec3 f = BSDFEval(surfacePrimitive.material, etaI, etaO, surfacePos, shadingNormal, wo, wi);
+			if (occluded)
+				continue;
 
-					// this branch is only necessary to exclude specular paths from light sampling (always have zero brdf)
-					// todo: make BSDFEval alwasy return zero for pure specular paths and roll specular eval into BSDFSample()
-					if (bsdfPdf > 0.0f)
-					{
-						// calculate relative weighting of the light and bsdf sampling
-						int N = lightPrimitive.lightSamples+kBsdfSamples;
-						float cbsdf = kBsdfSamples/N;
-						float clight = float(lightPrimitive.lightSamples)/N;
-						float weight = clight*lightPdf/(cbsdf*bsdfPdf + clight*lightPdf);
-						
-						L += weight*f*lightPrimitive.material.emission*(Abs(Dot(wi, shadingNormal))/Max(1.e-3f, lightPdf));
-					}
-				}
+			const float tSq = dSq;
+
+			const float nl = Abs(Dot(lightNormal, wi));
+
+			// light pdf with respect to area and convert to pdf with respect to solid angle
+			float lightArea = PrimitiveArea(lightPrimitive);
+			float lightPdf = ((1.0f/lightArea)*tSq)/nl;
+
+			// bsdf pdf for light's direction
+			float bsdfPdf;
+			Vec3 f = BSDFEvalPdf(scene.materials[surfacePrimitive.material], etaI, etaO, surfacePos, shadingNormal, wo, wi, bsdfPdf);
+
+			// this branch is only necessary to exclude specular paths from light sampling (always have zero brdf)
+			// todo: make BSDFEval alwasy return zero for pure specular paths and roll specular eval into BSDFSample()
+			if (bsdfPdf > 0.0f)
+			{
+				// calculate relative weighting of the light and bsdf sampling
+				int N = lightPrimitive.lightSamples+kBsdfSamples;
+				float cbsdf = kBsdfSamples/N;
+				float clight = float(lightPrimitive.lightSamples)/N;
+				float weight = clight*lightPdf/(cbsdf*bsdfPdf + clight*lightPdf);
+
+				L += weight*f*scene.materials[lightPrimitive.material].emission*(Abs(Dot(wi, shadingNormal))/Max(1.e-3f, lightPdf));
 			}
 		}
 	
@@ -742,12 +982,17 @@ __device__ inline Vec3 SampleLights(const GPUScene& scene, const Primitive& surf
 }
 
 
-struct Tile
+// queues of path indices the stages read and append to, the advance queue is double
+// buffered as bsdf sampling and regeneration fill the next one while the current is read
+enum WaveQueue
 {
-	int x;
-	int y;
-	int width;
-	int height;
+	eQueueAdvance,
+	eQueueAdvanceNext,
+	eQueueLight,
+	eQueueTerminate,
+	eQueueStream,			// paths waiting on meshes to be streamed in, double buffered
+	eQueueStreamNext,		// as the stage they rerun can defer them again
+	eNumWaveQueues
 };
 
 enum PathMode
@@ -759,6 +1004,7 @@ enum PathMode
 	ePathBsdfSample,
 	ePathTerminate,
 	ePathDisabled,
+	ePathStream,
 };
 
 
@@ -792,7 +1038,7 @@ struct PathState
 	float* __restrict__ rasterX;
 	float* __restrict__ rasterY;
 
-	Random* __restrict__ rand;
+	Sampler* __restrict__ rand;
 };
 
 template <typename T>
@@ -844,166 +1090,252 @@ void FreePaths(PathState state)
 
 
 
+// stage kernels are launched over a queue of path indices in 1D blocks, threads past the
+// end of the queue still run so that every lane of a warp reaches the warp wide appends
+const int kWaveBlockSize = 256;
+
+// returns a slot in the counter for each lane where take is set, -1 elsewhere, the warp
+// takes consecutive slots with a single atomic, must be reached by the whole warp
+__device__ inline int TakeWarp(int* counter, bool take)
+{
+	const int lane = threadIdx.x&31;
+
+#if __CUDACC_VER_MAJOR__ >= 9
+	const unsigned int mask = __ballot_sync(0xffffffff, take);
+#else
+	const unsigned int mask = __ballot(take);
+#endif
+
+	int base = 0;
+
+	if (lane == 0 && mask)
+		base = atomicAdd(counter, __popc(mask));
+
+#if __CUDACC_VER_MAJOR__ >= 9
+	base = __shfl_sync(0xffffffff, base, 0);
+#else
+	base = __shfl(base, 0);
+#endif
+
+	return take ? base + __popc(mask & ((1u << lane) - 1)) : -1;
+}
+
+// appends index to the queue for each lane where append is set, see TakeWarp()
+__device__ inline void AppendWarp(int* queue, int* count, int index, bool append)
+{
+	const int slot = TakeWarp(count, append);
+
+	if (append)
+		queue[slot] = index;
+}
+
+// fills a queue with every path slot, the first regeneration starts from it
+__global__ void FillQueue(int* queue, int* count, int numPaths)
+{
+	const int i = blockIdx.x*blockDim.x + threadIdx.x;
+
+	if (i < numPaths)
+		queue[i] = i;
+
+	if (i == 0)
+		*count = numPaths;
+}
+
+// splats the queued paths, which have all terminated
 LAUNCH_BOUNDS
-__global__ void TerminatePaths(Color* output, Options options, PathState paths, int numPaths)
+__global__ void TerminatePaths(Color* output, Options options, PathState paths, const int* queue, const int* queueCount)
 {
-	const int i = getGlobalIndex();
+	const int q = blockIdx.x*blockDim.x + threadIdx.x;
 
+	if (q < *queueCount)
 	{
-		if (paths.mode[i] != ePathDisabled)
-		{
-			float rasterX = paths.rasterX[i];
-			float rasterY = paths.rasterY[i];
+		const int i = queue[q];
 
-			Vec3 sample = paths.totalRadiance[i];
+		float rasterX = paths.rasterX[i];
+		float rasterY = paths.rasterY[i];
 
-			// sample = paths[i].normal*0.5f + 0.5f;
+		Vec3 sample = paths.totalRadiance[i];
 
-			int width = options.width;
-			int height = options.height;
+		// sample = paths[i].normal*0.5f + 0.5f;
 
-			Filter filter = options.filter;
+		int width = options.width;
+		int height = options.height;
 
-			switch (filter.type)
-			{
-				case eFilterBox:
-				{
-					int x = Clamp(int(rasterX), 0, width-1);
-					int y = Clamp(int(rasterY), 0, height-1);
+		const Filter& filter = options.filter;
 
-					output[y*width+x] += Color(sample.x, sample.y, sample.z, 1.0f);
-					break;
-				}
-				case eFilterGaussian:
-				{
-					int startX = Max(0, int(rasterX - filter.width));
-					int startY = Max(0, int(rasterY - filter.width));
-					int endX = Min(int(rasterX + filter.width), width-1);
-					int endY = Min(int(rasterY + filter.width), height-1);
+		int startX = Max(0, int(rasterX - filter.width));
+		int startY = Max(0, int(rasterY - filter.width));
+		int endX = Min(int(rasterX + filter.width), width-1);
+		int endY = Min(int(rasterY + filter.width), height-1);
 
-					Vec3 c =  ClampLength(sample, options.clamp);
+		Vec3 c =  ClampLength(sample, options.clamp);
 
-					for (int x=startX; x <= endX; ++x)
-					{
-						for (int y=startY; y <= endY; ++y)
-						{
-							float w = filter.Eval(x-rasterX, y-rasterY);
+		// the filter is separable so each axis is only looked up once per sample
+		float weightsX[kMaxFilterFootprint];
+		float weightsY[kMaxFilterFootprint];
 
-							//output[(height-1-y)*width+x] += Vec3(Min(sample.x, clamp), Min(sample.y, clamp), Min(sample.z, clamp), 1.0f)*w;
+		const int countX = Min(endX-startX+1, kMaxFilterFootprint);
+		const int countY = Min(endY-startY+1, kMaxFilterFootprint);
 
-							const int index = y*width+x;
+		filter.Weights(rasterX, startX, countX, weightsX);
+		filter.Weights(rasterY, startY, countY, weightsY);
 
-							atomicAdd(&output[index].x, c.x*w);
-							atomicAdd(&output[index].y, c.y*w);
-							atomicAdd(&output[index].z, c.z*w);
-							atomicAdd(&output[index].w, w);
-						}
-					}
-		
-					break;
-				}
-			};
+		// paths of other threads may be splatting into the same pixels
+		for (int y=0; y < countY; ++y)
+		{
+			for (int x=0; x < countX; ++x)
+			{
+				const float w = weightsX[x]*weightsY[y];
+
+				const int index = (startY+y)*width + startX+x;
+
+				atomicAdd(&output[index].x, c.x*w);
+				atomicAdd(&output[index].y, c.y*w);
+				atomicAdd(&output[index].z, c.z*w);
+				atomicAdd(&output[index].w, w);
+			}
 		}
 
 		paths.mode[i] = ePathGenerate;
 	}
 }
 
+// paths with a shadow ray that needs a mesh that isn't resident go to the stream queue unchanged,
+// so that they draw the same light samples when they are run again
 LAUNCH_BOUNDS
-__global__ void SampleLights(GPUScene scene, PathState paths, int numPaths)
+__global__ void SampleLights(GPUScene scene, PathState paths, const int* queue, const int* queueCount, int* streamQueue, int* streamCount)
 {
-	const int i = getGlobalIndex();
+	const int q = blockIdx.x*blockDim.x + threadIdx.x;
 
+	const bool active = q < *queueCount;
+	const int i = active ? queue[q] : 0;
+
+	int numShadowRays = 0;
+	bool complete = true;
+
+	if (active)
 	{
-		if (paths.mode[i] == ePathLightSample)
-		{
-        	// calculate a basis for this hit point
-        	const Primitive* hit = paths.primitive[i];        	
-        	
-        	float etaI = paths.etaI[i];
-        	float etaO = paths.etaO[i];
+		// calculate a basis for this hit point
+		const Primitive* hit = paths.primitive[i];        	
+		
+		float etaI = paths.etaI[i];
+		float etaO = paths.etaO[i];
 
-			const Vec3 rayDir = paths.rayDir[i];
-            float rayTime = paths.rayTime[i];
+		const Vec3 rayDir = paths.rayDir[i];
+		float rayTime = paths.rayTime[i];
+
+		const Vec3 p = paths.pos[i];
+		const Vec3 n = paths.normal[i];
 
-            const Vec3 p = paths.pos[i];
-            const Vec3 n = paths.normal[i];
+		Sampler rand = paths.rand[i];
 
-			// integrate direct light over hemisphere
-			paths.totalRadiance[i] += paths.pathThroughput[i]*SampleLights(scene, *hit, etaI, etaO, p, n, n, -rayDir, rayTime, paths.rand[i]);			
+		// integrate direct light over hemisphere
+		const Vec3 L = SampleLights(scene, *hit, etaI, etaO, p, n, n, -rayDir, rayTime, rand, numShadowRays, complete);
+
+		if (complete)
+		{
+			paths.totalRadiance[i] += paths.pathThroughput[i]*L;
+			paths.rand[i] = rand;
 
-			paths.mode[i] = ePathBsdfSample;		
+			paths.mode[i] = ePathBsdfSample;
 		}
 	}
+
+	CountWarp(&g_stagePaths[eStageLights], active);
+	CountWarp(&g_stageRays[eStageLights], numShadowRays);
+
+	AppendWarp(streamQueue, streamCount, i, active && !complete);
 }
 
+// continues the queued paths, those that stay alive go to the next bounce's advance queue
 LAUNCH_BOUNDS
-__global__ void SampleBsdfs(PathState paths, int numPaths)
+__global__ void SampleBsdfs(GPUScene scene, PathState paths, const int* queue, const int* queueCount, int maxDepth, int rouletteDepth, int* advanceQueue, int* advanceCount, int* terminateQueue, int* terminateCount)
 {
-	const int i = getGlobalIndex();
+	const int q = blockIdx.x*blockDim.x + threadIdx.x;
+
+	const bool active = q < *queueCount;
+	const int i = active ? queue[q] : 0;
+
+	CountWarp(&g_stagePaths[eStageBsdfs], active);
 
+	if (active)
 	{
-		if (paths.mode[i] == ePathBsdfSample)
-		{	
+		// paths that reached the depth limit still had their direct light sampled
+		if (paths.depth[i] >= maxDepth)
+		{
+			paths.mode[i] = ePathTerminate;
+		}
+		else
+		{
 			const Vec3 p = paths.pos[i];
 			const Vec3 n = paths.normal[i];
 
 			const Vec3 rayDir = paths.rayDir[i];
 
 			const Primitive* hit = paths.primitive[i];
+			const Material& material = scene.materials[hit->material];
 
-			Random& rand = paths.rand[i];
+			Sampler& rand = paths.rand[i];
 
 			float etaI = paths.etaI[i];
 			float etaO = paths.etaO[i];
 
 			// integrate indirect light by sampling BRDF
-            Vec3 u, v;
-            BasisFromVector(n, &u, &v);
+			Vec3 u, v;
+			BasisFromVector(n, &u, &v);
 
 			Vec3 bsdfDir;
 			BSDFType bsdfType;
 			float bsdfPdf;
+			Vec3 f;
+
+			BSDFSample(material, etaI, etaO, p, u, v, n, -rayDir, bsdfDir, f, bsdfPdf, bsdfType, rand);
 
-			BSDFSample(hit->material, etaI, etaO, p, u, v, n, -rayDir, bsdfDir, bsdfPdf, bsdfType, rand);
-
-            if (bsdfPdf <= 0.0f)
-           	{
-           		paths.mode[i] = ePathTerminate;
-           	}
-           	else
-           	{
-	            // reflectance
-	            Vec3 f = BSDFEval(hit->material, etaI, etaO, p, n, -rayDir, bsdfDir);
-
-	            // update ray medium if we are transmitting through the material
-	            if (Dot(bsdfDir, n) <= 0.0f)
-	            {
-	            	paths.etaI[i] = etaO;
-	            	paths.bsdfType[i] = eTransmitted;
+			if (bsdfPdf <= 0.0f)
+			{
+				paths.mode[i] = ePathTerminate;
+			}
+			else
+			{
+				// update ray medium if we are transmitting through the material
+				if (Dot(bsdfDir, n) <= 0.0f)
+				{
+					paths.etaI[i] = etaO;
+					paths.bsdfType[i] = eTransmitted;
 					
-	            	if (etaI != 1.0f)
-	            	{
-	            		// entering a medium, update the aborption (assume zero in air)
-						paths.absorption[i] = hit->material.absorption;
+					if (etaI != 1.0f)
+					{
+						// entering a medium, update the aborption (assume zero in air)
+						paths.absorption[i] = material.absorption;
 					}
-	            }
-	            else
-	            {
-	            	paths.bsdfType[i] = eReflected;
-	            }
-
-	            // update throughput with primitive reflectance
-	            paths.pathThroughput[i] *= f * Abs(Dot(n, bsdfDir))/bsdfPdf;
-	            paths.bsdfPdf[i] = bsdfPdf;
-	            paths.bsdfType[i] = bsdfType;
-	            paths.rayDir[i] = bsdfDir;
-	            paths.rayOrigin[i] = p + FaceForward(n, bsdfDir)*kRayEpsilon;
-	            paths.mode[i] = ePathAdvance;
-
-	        }
-        }
-    }
+				}
+				else
+				{
+					paths.bsdfType[i] = eReflected;
+				}
+
+				// update throughput with primitive reflectance
+				paths.pathThroughput[i] *= f * Abs(Dot(n, bsdfDir))/bsdfPdf;
+				paths.bsdfPdf[i] = bsdfPdf;
+				paths.bsdfType[i] = bsdfType;
+				paths.rayDir[i] = bsdfDir;
+				paths.rayOrigin[i] = p + FaceForward(n, bsdfDir)*kRayEpsilon;
+				paths.mode[i] = ePathAdvance;
+
+				if (RouletteActive(paths.depth[i], rouletteDepth))
+				{
+					float r;
+					Sample1D(rand, r);
+
+					if (!RussianRoulette(paths.pathThroughput[i], r))
+						paths.mode[i] = ePathTerminate;
+				}
+			}
+		}
+	}
+
+	AppendWarp(advanceQueue, advanceCount, i, active && paths.mode[i] == ePathAdvance);
+	AppendWarp(terminateQueue, terminateCount, i, active && paths.mode[i] == ePathTerminate);
 }
 
 LAUNCH_BOUNDS
@@ -1012,248 +1344,657 @@ __global__ void SampleProbes(PathState paths, int numPaths)
 
 }
 
+// traces the queued paths, hits go on to light sampling and the rest are terminated, paths
+// whose closest hit could be in a mesh that isn't resident go to the stream queue unchanged
 LAUNCH_BOUNDS
-__global__ void AdvancePaths(GPUScene scene, PathState paths, int numPaths)
+__global__ void AdvancePaths(GPUScene scene, PathState paths, const int* queue, const int* queueCount, int* lightQueue, int* lightCount, int* terminateQueue, int* terminateCount, int* streamQueue, int* streamCount)
 {
-	const int i = getGlobalIndex();
+	const int q = blockIdx.x*blockDim.x + threadIdx.x;
 
-	{
-		if (paths.mode[i] == ePathAdvance)
-		{
-			Vec3 rayOrigin = paths.rayOrigin[i];
-			Vec3 rayDir = paths.rayDir[i];
-			float rayTime = paths.rayTime[i];
-			float etaI = paths.etaI[i];
+	// every active path traces one ray
+	const bool active = q < *queueCount;
+	const int i = active ? queue[q] : 0;
 
-			Vec3 pathThroughput = paths.pathThroughput[i];
+	CountWarp(&g_stagePaths[eStageAdvance], active);
+	CountWarp(&g_stageRays[eStageAdvance], active);
 
-			Vec3 n;
-			float t;
-			const Primitive* hit;
+	// paths of different depths share a launch once they are regenerated
+	for (int d=0; d < kMaxWavefrontBounces; ++d)
+		CountWarp(&g_activePaths[d], active && Min(paths.depth[i], kMaxWavefrontBounces-1) == d);
 
-	        // find closest hit
-	        if (Trace(scene, rayOrigin, rayDir, rayTime, t, n, &hit))
-	        {	
-				float etaO;
+	if (active)
+	{
+		Vec3 rayOrigin = paths.rayOrigin[i];
+		Vec3 rayDir = paths.rayDir[i];
+		float rayTime = paths.rayTime[i];
+		float etaI = paths.etaI[i];
 
-	        	// index of refraction for transmission, 1.0 corresponds to air
-				if (etaI == 1.0f)
-				{
-	        		etaO = hit->material.GetIndexOfRefraction();
-				}
-				else
-				{
-					// returning to free space
-					etaO = 1.0f;
-				}
+		Vec3 pathThroughput = paths.pathThroughput[i];
 
-				pathThroughput *= Exp(-paths.absorption[i]*t);
+		Vec3 n;
+		float t;
+		const Primitive* hit;
 
-				if (paths.depth[i] == 0)
-				{
-					// first trace is our only chance to add contribution from directly visible light sources        
-					paths.totalRadiance[i] += hit->material.emission;
-				}			
-				else if (kBsdfSamples > 0)
-				{
-					// area pdf that this dir was already included by the light sampling from previous step
-					float lightArea = PrimitiveArea(*hit);
+		bool complete;
+		const bool found = Trace(scene, rayOrigin, rayDir, rayTime, t, n, &hit, complete);
 
-					if (lightArea > 0.0f)
-					{
-						// convert to pdf with respect to solid angle
-						float lightPdf = ((1.0f/lightArea)*t*t)/Clamp(Dot(-rayDir, n), 1.e-3f, 1.0f);
-
-						// calculate weight for bsdf sampling
-						int N = hit->lightSamples+kBsdfSamples;
-						float cbsdf = kBsdfSamples/N;
-						float clight = float(hit->lightSamples)/N;
-						float weight = cbsdf*paths.bsdfPdf[i]/(cbsdf*paths.bsdfPdf[i] + clight*lightPdf);
-						
-						// specular paths have zero chance of being included by direct light sampling (zero pdf)
-						if (paths.bsdfType[i] == eSpecular)
-							weight = 1.0f;
+		// find closest hit
+		if (!complete)
+		{
+			paths.mode[i] = ePathStream;
+		}
+		else if (found)
+		{	
+			const Material& material = scene.materials[hit->material];
 
-						// pathThroughput already includes the bsdf pdf
-						paths.totalRadiance[i] += weight*pathThroughput*hit->material.emission;
-					}
-				}
+			float etaO;
 
-				// terminate ray if we hit a light source
-				if (hit->lightSamples)
-				{
-					paths.mode[i] = ePathTerminate;
-				}
-				else
-				{
-					// update throughput based on absorption through the medium
-					paths.pos[i] = rayOrigin + rayDir*t;
-					paths.normal[i] = n;
-					paths.primitive[i] = hit;
-					paths.etaO[i] = etaO;
-					paths.pathThroughput[i] = pathThroughput;
-					paths.depth[i] += 1;
-
-					paths.mode[i] = ePathLightSample;
-				}
+			// index of refraction for transmission, 1.0 corresponds to air
+			if (etaI == 1.0f)
+			{
+				etaO = material.GetIndexOfRefraction();
 			}
 			else
 			{
-				// todo: sky 
+				// returning to free space
+				etaO = 1.0f;
+			}
+
+			pathThroughput *= Exp(-paths.absorption[i]*t);
+
+			if (paths.depth[i] == 0)
+			{
+				// first trace is our only chance to add contribution from directly visible light sources        
+				paths.totalRadiance[i] += material.emission;
+			}			
+			else if (kBsdfSamples > 0)
+			{
+				// area pdf that this dir was already included by the light sampling from previous step
+				float lightArea = PrimitiveArea(*hit);
 
-				// no hit, terminate path
+				if (lightArea > 0.0f)
+				{
+					// convert to pdf with respect to solid angle
+					float lightPdf = ((1.0f/lightArea)*t*t)/Clamp(Dot(-rayDir, n), 1.e-3f, 1.0f);
+
+					// calculate weight for bsdf sampling
+					int N = hit->lightSamples+kBsdfSamples;
+					float cbsdf = kBsdfSamples/N;
+					float clight = float(hit->lightSamples)/N;
+					float weight = cbsdf*paths.bsdfPdf[i]/(cbsdf*paths.bsdfPdf[i] + clight*lightPdf);
+					
+					// specular paths have zero chance of being included by direct light sampling (zero pdf)
+					if (paths.bsdfType[i] == eSpecular)
+						weight = 1.0f;
+
+					// pathThroughput already includes the bsdf pdf
+					paths.totalRadiance[i] += weight*pathThroughput*material.emission;
+				}
+			}
+
+			// terminate ray if we hit a light source
+			if (hit->lightSamples)
+			{
 				paths.mode[i] = ePathTerminate;
 			}
+			else
+			{
+				// update throughput based on absorption through the medium
+				paths.pos[i] = rayOrigin + rayDir*t;
+				paths.normal[i] = n;
+				paths.primitive[i] = hit;
+				paths.etaO[i] = etaO;
+				paths.pathThroughput[i] = pathThroughput;
+				paths.depth[i] += 1;
+
+				paths.mode[i] = ePathLightSample;
+			}
+		}
+		else
+		{
+			// todo: sky 
+
+			// no hit, terminate path
+			paths.mode[i] = ePathTerminate;
 		}
 	}
+
+	AppendWarp(lightQueue, lightCount, i, active && paths.mode[i] == ePathLightSample);
+	AppendWarp(terminateQueue, terminateCount, i, active && paths.mode[i] == ePathTerminate);
+	AppendWarp(streamQueue, streamCount, i, active && paths.mode[i] == ePathStream);
 }
 
+// starts a new camera path in each queued slot while the frame has samples left, samples
+// are taken in raster order so that a warp's paths start from neighbouring pixels
 LAUNCH_BOUNDS
-__global__ void GeneratePaths(Camera camera, CameraSampler sampler, Tile tile, int seed, PathState paths, int numPaths)
+__global__ void GeneratePaths(Camera camera, CameraSampler sampler, int width, int numSamples, int seed, PathState paths, const int* queue, const int* queueCount, int* nextSample, int* advanceQueue, int* advanceCount)
 {
-	const int tx = blockIdx.x*blockDim.x;
-	const int ty = blockIdx.y*blockDim.y;
+	const int q = blockIdx.x*blockDim.x + threadIdx.x;
 
-	const int x = tx + threadIdx.x + tile.x;
-	const int y = ty + threadIdx.y + tile.y;
+	const bool active = q < *queueCount;
+	const int i = active ? queue[q] : 0;
 
-	const int i = getGlobalIndex();
+	const int s = TakeWarp(nextSample, active);
+	const bool generate = active && s < numSamples;
 
+	if (generate)
 	{
-		if (paths.mode[i] == ePathGenerate || paths.mode[i] == ePathDisabled || paths.mode[i] == ePathTerminate)
-		{
-			// if we're inside the tile
-			if (threadIdx.x < tile.width && threadIdx.y < tile.height)
-			{
-				Random rand(i + tile.y*tile.width + tile.x + seed);
-
-				// offset
-				//float x, y, t;
-				//StratifiedSample2D(i, tile.width, tile.height, rand, x, y);
+		const int x = s%width;
+		const int y = s/width;
 
-				float t;
-				StratifiedSample1D(i, 64, rand, t);
+		// the wavefront kernels keep drawing from a pseudo-random stream
+		Sampler rand(eSamplerRandom, s + seed);
 
-				// shutter time
-				float time = Lerp(camera.shutterStart, camera.shutterEnd, t);
-				
-				//float px = tile.x + x*tile.width;
-				//float py = tile.y + y*tile.height;
-				float px = x + rand.Randf(-0.5f, 0.5f);
-				float py = y + rand.Randf(-0.5f, 0.5f);
-
-				Vec3 origin, dir;
-				sampler.GenerateRay(px, py, origin, dir);
-
-				// advance paths
-				paths.depth[i] = 0;
-				paths.rayOrigin[i] = origin;
-				paths.rayDir[i] = dir;
-				paths.rayTime[i] = time;
-				paths.mode[i] = ePathAdvance;
-				paths.rand[i] = rand;
-				paths.totalRadiance[i] = 0.0f;
-				paths.pathThroughput[i] = 1.0f;
-				paths.etaI[i] = 1.0f;
-				paths.bsdfType[i] = eReflected;
-				paths.bsdfPdf[i] = 1.0f;
-				paths.rasterX[i] = px;
-				paths.rasterY[i] = py;
+		float t;
+		StratifiedSample1D(s, 64, rand.rand, t);
 
-			}
-			else
-			{
-				paths.mode[i] = ePathDisabled;
-			}
-		}
+		// shutter time
+		float time = Lerp(camera.shutterStart, camera.shutterEnd, t);
+		
+		float px = x + rand.Randf(-0.5f, 0.5f);
+		float py = y + rand.Randf(-0.5f, 0.5f);
+
+		Vec3 origin, dir;
+		sampler.GenerateRay(px, py, origin, dir);
+
+		// advance paths
+		paths.depth[i] = 0;
+		paths.rayOrigin[i] = origin;
+		paths.rayDir[i] = dir;
+		paths.rayTime[i] = time;
+		paths.mode[i] = ePathAdvance;
+		paths.rand[i] = rand;
+		paths.totalRadiance[i] = 0.0f;
+		paths.pathThroughput[i] = 1.0f;
+		paths.absorption[i] = 0.0f;
+		paths.etaI[i] = 1.0f;
+		paths.bsdfType[i] = eReflected;
+		paths.bsdfPdf[i] = 1.0f;
+		paths.rasterX[i] = px;
+		paths.rasterY[i] = py;
 	}
+	else if (active)
+	{
+		// out of samples, the slot stays empty for the rest of the frame
+		paths.mode[i] = ePathDisabled;
+	}
+
+	AppendWarp(advanceQueue, advanceCount, i, generate);
 }
 
 //LAUNCH_BOUNDS
-__global__ void VisualizeNormals(GPUScene scene, PathState paths, int numPaths)
+__global__ void VisualizeNormals(GPUScene scene, PathState paths, const int* queue, const int* queueCount, int* terminateQueue, int* terminateCount)
 {
-	const int i = getGlobalIndex();
+	const int q = blockIdx.x*blockDim.x + threadIdx.x;
 
-	if (i < numPaths)
+	const bool active = q < *queueCount;
+	const int i = active ? queue[q] : 0;
+
+	if (active)
 	{
 		Vec3 rayOrigin = paths.rayOrigin[i];
 		Vec3 rayDir = paths.rayDir[i];
 
 		Vec3 n;
 		float t;
+
+		// previews show whatever is resident
+		bool complete;
 		
 	    // find closest hit
-	    if (Trace(scene, rayOrigin, rayDir, 0.0f, t, n, NULL))
+	    if (Trace(scene, rayOrigin, rayDir, 0.0f, t, n, NULL, complete))
 	    {	
 			paths.totalRadiance[i] = n;
 		}
 
 		paths.mode[i] = ePathTerminate;
 	}
+
+	AppendWarp(terminateQueue, terminateCount, i, active);
+}
+
+// paths are reordered with a least significant digit first radix sort on PathSortKey(),
+// each pass counts the digits of every block, scans the counts and scatters stably
+const int kSortBlockSize = 256;
+const int kSortRadixBits = 4;
+const int kSortRadix = 1<<kSortRadixBits;
+
+__global__ void PathKeys(PathState paths, const int* queue, const int* queueCount, int n, const Primitive* primitives, Bounds bounds, unsigned int* keys, int* values)
+{
+	const int q = blockIdx.x*blockDim.x + threadIdx.x;
+
+	if (q < n)
+	{
+		// the sort covers the queue's upper bound, entries past its end stay at the end
+		if (q < *queueCount)
+		{
+			const int i = queue[q];
+
+			keys[q] = PathSortKey(int(paths.primitive[i]-primitives), paths.pos[i], paths.rayDir[i], bounds);
+			values[q] = i;
+		}
+		else
+		{
+			keys[q] = 0xffffffff;
+			values[q] = -1;
+		}
+	}
+}
+
+__global__ void RadixCount(const unsigned int* keys, int n, int shift, int* counts)
+{
+	__shared__ int histogram[kSortRadix];
+
+	if (threadIdx.x < kSortRadix)
+		histogram[threadIdx.x] = 0;
+
+	__syncthreads();
+
+	const int i = blockIdx.x*blockDim.x + threadIdx.x;
+
+	if (i < n)
+		atomicAdd(&histogram[(keys[i] >> shift) & (kSortRadix-1)], 1);
+
+	__syncthreads();
+
+	// digit major so that a scan over all counts gives each block's offset for each digit
+	if (threadIdx.x < kSortRadix)
+		counts[threadIdx.x*gridDim.x + blockIdx.x] = histogram[threadIdx.x];
+}
+
+// exclusive scan in place, launched as a single block
+__global__ void RadixScan(int* counts, int n)
+{
+	__shared__ int totals[kSortBlockSize];
+
+	const int perThread = (n + blockDim.x - 1)/blockDim.x;
+	const int begin = threadIdx.x*perThread;
+	const int end = Min(begin + perThread, n);
+
+	int sum = 0;
+
+	for (int i=begin; i < end; ++i)
+		sum += counts[i];
+
+	totals[threadIdx.x] = sum;
+
+	__syncthreads();
+
+	// inclusive scan of the per-thread sums
+	for (int offset=1; offset < blockDim.x; offset *= 2)
+	{
+		const int value = threadIdx.x >= offset ? totals[threadIdx.x-offset] : 0;
+
+		__syncthreads();
+
+		totals[threadIdx.x] += value;
+
+		__syncthreads();
+	}
+
+	int prefix = threadIdx.x > 0 ? totals[threadIdx.x-1] : 0;
+
+	for (int i=begin; i < end; ++i)
+	{
+		const int count = counts[i];
+		counts[i] = prefix;
+		prefix += count;
+	}
+}
+
+__global__ void RadixScatter(const unsigned int* keysIn, const int* valuesIn, unsigned int* keysOut, int* valuesOut, int n, int shift, const int* offsets)
+{
+	__shared__ int warpCounts[kSortRadix][kSortBlockSize/32];
+
+	const int i = blockIdx.x*blockDim.x + threadIdx.x;
+	const bool valid = i < n;
+
+	const unsigned int key = valid ? keysIn[i] : 0;
+	const int digit = (key >> shift) & (kSortRadix-1);
+
+	const int lane = threadIdx.x&31;
+	const int warp = threadIdx.x/32;
+
+	// rank among the lanes of the warp with the same digit
+	int rank = 0;
+
+	for (int d=0; d < kSortRadix; ++d)
+	{
+#if __CUDACC_VER_MAJOR__ >= 9
+		const unsigned int mask = __ballot_sync(0xffffffff, valid && digit == d);
+#else
+		const unsigned int mask = __ballot(valid && digit == d);
+#endif
+		if (lane == 0)
+			warpCounts[d][warp] = __popc(mask);
+
+		if (digit == d)
+			rank = __popc(mask & ((1u << lane) - 1));
+	}
+
+	__syncthreads();
+
+	if (valid)
+	{
+		// earlier blocks then earlier warps of this block come first, which keeps the sort stable
+		int offset = offsets[digit*gridDim.x + blockIdx.x] + rank;
+
+		for (int w=0; w < warp; ++w)
+			offset += warpCounts[digit][w];
+
+		keysOut[offset] = key;
+		valuesOut[offset] = valuesIn[i];
+	}
 }
 
 
 struct GpuWaveFrontRenderer : public Renderer
 {
 	Color* output = NULL;
+	int numPixels = 0;
 	
 	GPUScene sceneGPU;
 	
 	Random rand;
 
-	int tileWidth;
-	int tileHeight;
+	// paths in flight, slots freed by terminated paths are refilled with new camera
+	// paths until the frame's samples run out so that every launch covers live paths only
+	int numPaths;
 
 	PathState paths;
 
-	// map id to geometry struct
-	std::map<int, MeshGeometry> gpuMeshes;
+	// path indices of each queue, followed on the device by each queue's length and the
+	// index of the frame's next camera sample, the lengths are read back every bounce
+	int* queues[eNumWaveQueues];
+	int* queueCounts;
+	int* hostCounts;
+
+	// meshes uploaded so far keyed by mesh id, kept across updates while they are referenced
+	std::map<unsigned long, MeshGeometry> gpuMeshes;
+
+	// device bump maps of the current material table, one per volume however many materials share it
+	std::vector<Texture> bumpMaps;
 
-	GpuWaveFrontRenderer(const Scene* s)
+	// host probe the GPU sky was copied from
+	const Color* hostProbe;
+
+	// an event is recorded after every launch, tagged with the launch's stage, stage
+	// times are the gaps between consecutive events once the frame has finished
+	std::vector<cudaEvent_t> events;
+	std::vector<int> eventStages;
+	int numEvents;
+
+	WavefrontStats frameStats;
+
+	// double buffered keys and path indices for Reorder(), and the per-block digit counts
+	unsigned int* sortKeys[2];
+	int* sortValues[2];
+	int* sortCounts;
+
+	// bounds of the scene last uploaded, see PathSortKey()
+	Bounds sortBounds;
+
+	// bytes of mesh geometry kept on the device when streaming, zero uploads every mesh up front,
+	// meshes are otherwise uploaded when a path first needs them and the least recently used evicted
+	size_t meshBudget;
+	size_t residentBytes;
+
+	// host mesh of each table entry, light meshes are pinned as every path may sample them
+	std::vector<const MeshGeometry*> tableMeshes;
+	std::vector<bool> pinned;
+	std::vector<int> lastUsed;
+	int streamRound;
+
+	// host copies of the device request and use flags
+	std::vector<int> hostRequests;
+	std::vector<int> hostUses;
+
+	GpuWaveFrontRenderer(const Scene* s, size_t budget) : hostProbe(NULL), numEvents(0), meshBudget(budget), residentBytes(0), streamRound(0)
 	{
-		// build GPU primitive and light lists
+		sceneGPU.primitives = NULL;
+		sceneGPU.lights = NULL;
+		sceneGPU.materials = NULL;
+		sceneGPU.meshes = NULL;
+		sceneGPU.meshRequests = NULL;
+		sceneGPU.meshUses = NULL;
+		sceneGPU.meshBounds = NULL;
+
+		Upload(s);
+
+		numPaths = 1024*1024;
+
+		// allocate paths
+		//cudaMalloc(&paths, sizeof(PathState)*numPaths);
+		//cudaMemset(paths, 0, sizeof(PathState)*numPaths);
+
+		paths = AllocatePaths(numPaths);
+
+		const int numSortBlocks = (numPaths + kSortBlockSize - 1)/kSortBlockSize;
+
+		for (int i=0; i < 2; ++i)
+		{
+			Alloc(&sortKeys[i], numPaths);
+			Alloc(&sortValues[i], numPaths);
+		}
+
+		Alloc(&sortCounts, numSortBlocks*kSortRadix);
+
+		for (int i=0; i < eNumWaveQueues; ++i)
+			Alloc(&queues[i], numPaths);
+
+		Alloc(&queueCounts, eNumWaveQueues+1);
+		cudaMallocHost(&hostCounts, sizeof(int)*(eNumWaveQueues+1));
+	}
+
+	// copies the scene to the GPU, meshes and the probe of the previous upload are reused
+	void Upload(const Scene* s)
+	{
+		// release the previous scene's lists
+		cudaFree(sceneGPU.primitives);
+		cudaFree(sceneGPU.lights);
+		cudaFree(sceneGPU.materials);
+		cudaFree(sceneGPU.meshes);
+		cudaFree(sceneGPU.meshRequests);
+		cudaFree(sceneGPU.meshUses);
+		cudaFree(sceneGPU.meshBounds);
+
+		sceneGPU.primitives = NULL;
+		sceneGPU.lights = NULL;
+		sceneGPU.materials = NULL;
+		sceneGPU.meshes = NULL;
+		sceneGPU.meshRequests = NULL;
+		sceneGPU.meshUses = NULL;
+		sceneGPU.meshBounds = NULL;
+
+		for (int i=0; i < bumpMaps.size(); ++i)
+			cudaFree(bumpMaps[i].data);
+
+		bumpMaps.resize(0);
+
+		for (int i=0; i < kMotionSegments; ++i)
+		{
+			if (sceneGPU.bvh[i].nodes)
+				DestroyTexture(sceneGPU.bvh[i].nodes);
+
+			if (sceneGPU.bvh[i].links)
+				DestroyTexture(sceneGPU.bvh[i].links);
+
+			sceneGPU.bvh[i] = BVH();
+		}
+
+		// build GPU primitive and light lists, primitives keep the scene's material indices
 		std::vector<Primitive> primitives;		
 		std::vector<Primitive> lights;
+		std::vector<Material> materials(s->materials);
+
+		// device copies of the meshes referenced, and the table entry of each mesh primitive
+		std::vector<MeshGeometry> meshes;
+		std::map<unsigned long, int> meshIndices;
+		std::vector<int> primitiveMeshes;
+
+		// meshes used by this scene, and those of lights which are never streamed out
+		std::set<unsigned long> referenced;
+		std::set<unsigned long> lightMeshes;
+
+		for (int i=0; i < s->primitives.size(); ++i)
+		{
+			if (s->primitives[i].type == eMesh && s->primitives[i].lightSamples)
+				lightMeshes.insert(s->primitives[i].mesh->id);
+		}
+
+		tableMeshes.resize(0);
+		pinned.resize(0);
 
 		for (int i=0; i < s->primitives.size(); ++i)
 		{
-			Primitive primitive = s->primitives[i];
+			const Primitive& primitive = s->primitives[i];
+
+			int meshIndex = -1;
 
 			// if mesh primitive then copy to the GPU
 			if (primitive.type == eMesh)
 			{
-				// see if we have already uploaded the mesh to the GPU
-				if (gpuMeshes.find(primitive.mesh.id) == gpuMeshes.end())
+				const unsigned long id = primitive.mesh->id;
+
+				// instances of the same mesh share its table entry
+				std::map<unsigned long, int>::iterator index = meshIndices.find(id);
+
+				if (index == meshIndices.end())
 				{
-					MeshGeometry geo = CreateGPUMesh(primitive.mesh);
-					gpuMeshes[geo.id] = geo;
+					const bool pin = lightMeshes.count(id) > 0;
+
+					// see if we have already uploaded the mesh to the GPU, when streaming only lights are uploaded up front
+					std::map<unsigned long, MeshGeometry>::iterator iter = gpuMeshes.find(id);
+
+					// meshes rebuilt or refit since they were uploaded are uploaded, or streamed, again
+					if (iter != gpuMeshes.end() && iter->second.generation != primitive.mesh->generation)
+					{
+						residentBytes -= GPUMeshBytes(iter->second);
+						DestroyGPUMesh(iter->second);
+						gpuMeshes.erase(iter);
+
+						iter = gpuMeshes.end();
+					}
 
-					// replace CPU mesh with GPU copy
-					primitive.mesh = geo;
+					if (iter == gpuMeshes.end() && (meshBudget == 0 || pin))
+					{
+						iter = gpuMeshes.insert(std::make_pair(id, CreateGPUMesh(*primitive.mesh))).first;
+						residentBytes += GPUMeshBytes(*primitive.mesh);
+					}
+
+					index = meshIndices.insert(std::make_pair(id, int(meshes.size()))).first;
+					meshes.push_back(iter != gpuMeshes.end() ? iter->second : NonResidentMesh(*primitive.mesh));
+
+					tableMeshes.push_back(primitive.mesh);
+					pinned.push_back(pin);
 				}
+
+				meshIndex = index->second;
+
+				referenced.insert(id);
 			}
 
-			if (primitive.material.bump > 0.0f)
+			primitives.push_back(primitive);
+			primitiveMeshes.push_back(meshIndex);
+		}
+
+		// bump maps are copied once per volume however many materials share it
+		std::map<const unsigned short*, Texture> gpuTextures;
+
+		for (int i=0; i < materials.size(); ++i)
+		{
+			if (materials[i].bump > 0.0f && materials[i].bumpMap.data)
 			{
-				primitive.material.bumpMap = CreateGPUTexture(primitive.material.bumpMap);
+				std::map<const unsigned short*, Texture>::iterator iter = gpuTextures.find(materials[i].bumpMap.data);
+
+				if (iter == gpuTextures.end())
+				{
+					iter = gpuTextures.insert(std::make_pair(materials[i].bumpMap.data, CreateGPUTexture(materials[i].bumpMap))).first;
+					bumpMaps.push_back(iter->second);
+				}
+
+				materials[i].bumpMap = iter->second;
 			}
-			
+		}
+
+		// point mesh primitives at the device mesh table
+		sceneGPU.numMeshes = meshes.size();
+
+		if (sceneGPU.numMeshes > 0)
+		{
+			cudaMalloc(&sceneGPU.meshes, sizeof(MeshGeometry)*meshes.size());
+			cudaMemcpy(sceneGPU.meshes, &meshes[0], sizeof(MeshGeometry)*meshes.size(), cudaMemcpyHostToDevice);
+		}
+
+		for (int i=0; i < primitives.size(); ++i)
+		{
+			if (primitiveMeshes[i] >= 0)
+				primitives[i].mesh = sceneGPU.meshes + primitiveMeshes[i];
+
 			// create explicit list of light primitives
-			if (primitive.lightSamples)
+			if (primitives[i].lightSamples)
+				lights.push_back(primitives[i]);
+		}
+
+		// free meshes that are no longer used
+		for (std::map<unsigned long, MeshGeometry>::iterator iter=gpuMeshes.begin(); iter != gpuMeshes.end();)
+		{
+			if (referenced.count(iter->first) == 0)
+			{
+				residentBytes -= GPUMeshBytes(iter->second);
+				DestroyGPUMesh(iter->second);
+				gpuMeshes.erase(iter++);
+			}
+			else
 			{
-				lights.push_back(primitive);
+				++iter;
 			}
+		}
 
-			primitives.push_back(primitive);
+		// streamed scenes request meshes by the bounds of their roots
+		if (meshBudget > 0 && sceneGPU.numMeshes > 0)
+		{
+			std::vector<Bounds> bounds(sceneGPU.numMeshes);
+
+			for (int i=0; i < sceneGPU.numMeshes; ++i)
+			{
+				if (tableMeshes[i]->numNodes > 0)
+					bounds[i] = tableMeshes[i]->nodes[0].bounds;
+			}
+
+			cudaMalloc(&sceneGPU.meshBounds, sizeof(Bounds)*bounds.size());
+			cudaMemcpy(sceneGPU.meshBounds, &bounds[0], sizeof(Bounds)*bounds.size(), cudaMemcpyHostToDevice);
+
+			Alloc(&sceneGPU.meshRequests, sceneGPU.numMeshes);
+			Alloc(&sceneGPU.meshUses, sceneGPU.numMeshes);
+
+			hostRequests.resize(sceneGPU.numMeshes);
+			hostUses.resize(sceneGPU.numMeshes);
+			lastUsed.assign(sceneGPU.numMeshes, streamRound);
 		}
 
 		// convert scene BVH
-		CreateVec4Texture((Vec4**)&(sceneGPU.bvh.nodes), (Vec4*)s->bvh.nodes, sizeof(BVHNode)*s->bvh.numNodes);
-		sceneGPU.bvh.numNodes = s->bvh.numNodes;
+		for (int i=0; i < s->numMotionSegments; ++i)
+		{
+			CreateVec4Texture((Vec4**)&(sceneGPU.bvh[i].nodes), (Vec4*)s->bvh[i].nodes, sizeof(BVHNode)*s->bvh[i].numNodes);
+			sceneGPU.bvh[i].links = CreateGPULinks(s->bvh[i].nodes, s->bvh[i].numNodes);
+			sceneGPU.bvh[i].numNodes = s->bvh[i].numNodes;
+		}
+
+		sceneGPU.numMotionSegments = s->numMotionSegments;
+
+		sortBounds = PathSortBounds(*s);
 
 		// upload to the GPU
 		sceneGPU.numPrimitives = primitives.size();
 		sceneGPU.numLights = lights.size();
+		sceneGPU.numMaterials = materials.size();
+
+		if (sceneGPU.numMaterials > 0)
+		{
+			cudaMalloc(&sceneGPU.materials, sizeof(Material)*materials.size());
+			cudaMemcpy(sceneGPU.materials, &materials[0], sizeof(Material)*materials.size(), cudaMemcpyHostToDevice);
+		}
 
 		if (sceneGPU.numLights > 0)
 		{
@@ -1267,19 +2008,28 @@ struct GpuWaveFrontRenderer : public Renderer
 			cudaMemcpy(sceneGPU.primitives, &primitives[0], sizeof(Primitive)*primitives.size(), cudaMemcpyHostToDevice);
 		}
 
-		// copy sky and probe texture
-		sceneGPU.sky = CreateGPUSky(s->sky);
-
-		tileWidth = 1024;
-		tileHeight = 1024;
+		// copy sky and probe texture, the probe is only copied again if it changed
+		if (s->sky.probe.valid && s->sky.probe.data == hostProbe)
+		{
+			Probe probe = sceneGPU.sky.probe;
+			probe.offset = s->sky.probe.offset;
 
-		const int numPaths = tileWidth*tileHeight;
+			sceneGPU.sky = s->sky;
+			sceneGPU.sky.probe = probe;
+		}
+		else
+		{
+			DestroyGPUSky(sceneGPU.sky);
 
-		// allocate paths
-		//cudaMalloc(&paths, sizeof(PathState)*numPaths);
-		//cudaMemset(paths, 0, sizeof(PathState)*numPaths);
+			sceneGPU.sky = CreateGPUSky(s->sky);
+			hostProbe = s->sky.probe.valid ? s->sky.probe.data : NULL;
+		}
+	}
 
-		paths = AllocatePaths(numPaths);
+	virtual bool Update(const Scene* s)
+	{
+		Upload(s);
+		return true;
 	}
 
 	virtual ~GpuWaveFrontRenderer()
@@ -1287,40 +2037,246 @@ struct GpuWaveFrontRenderer : public Renderer
 		cudaFree(output);
 		cudaFree(sceneGPU.primitives);
 		cudaFree(sceneGPU.lights);
+		cudaFree(sceneGPU.materials);
+		cudaFree(sceneGPU.meshes);
+		cudaFree(sceneGPU.meshRequests);
+		cudaFree(sceneGPU.meshUses);
+		cudaFree(sceneGPU.meshBounds);
+
+		for (int i=0; i < bumpMaps.size(); ++i)
+			cudaFree(bumpMaps[i].data);
+
+		for (int i=0; i < kMotionSegments; ++i)
+		{
+			if (sceneGPU.bvh[i].nodes)
+				DestroyTexture(sceneGPU.bvh[i].nodes);
+
+			if (sceneGPU.bvh[i].links)
+				DestroyTexture(sceneGPU.bvh[i].links);
+		}
+
+		DestroyGPUSky(sceneGPU.sky);
+
+		for (std::map<unsigned long, MeshGeometry>::iterator iter=gpuMeshes.begin(); iter != gpuMeshes.end(); ++iter)
+			DestroyGPUMesh(iter->second);
 		
 		FreePaths(paths);
+
+		for (int i=0; i < 2; ++i)
+		{
+			cudaFree(sortKeys[i]);
+			cudaFree(sortValues[i]);
+		}
+
+		cudaFree(sortCounts);
+
+		for (int i=0; i < eNumWaveQueues; ++i)
+			cudaFree(queues[i]);
+
+		cudaFree(queueCounts);
+		cudaFreeHost(hostCounts);
+
+		for (size_t i=0; i < events.size(); ++i)
+			cudaEventDestroy(events[i]);
 	}
-	
-	void Init(int width, int height)
+
+	// the stage is -1 for the event that starts the frame
+	void RecordEvent(int stage)
 	{
-		cudaFree(output);
-		cudaMalloc(&output, sizeof(Color)*width*height);
-		cudaMemset(output, 0, sizeof(Color)*width*height);
+		if (numEvents == int(events.size()))
+		{
+			cudaEvent_t event;
+			cudaEventCreate(&event);
+
+			events.push_back(event);
+			eventStages.push_back(stage);
+		}
+
+		eventStages[numEvents] = stage;
+		cudaEventRecord(events[numEvents++]);
 	}
 
-	void Render(const Camera& camera, const Options& options, Color* outputHost)
+	virtual bool GetWavefrontStats(WavefrontStats& stats)
+	{
+		stats = frameStats;
+		return true;
+	}
+
+	// replaces a mesh table entry on the device
+	void SetTableEntry(int m, const MeshGeometry& mesh)
+	{
+		cudaMemcpy(sceneGPU.meshes + m, &mesh, sizeof(MeshGeometry), cudaMemcpyHostToDevice);
+	}
+
+	// uploads the meshes requested since the last call, making room by evicting the least recently
+	// used meshes that weren't needed since, the budget is soft in that at least one mesh is uploaded
+	// per call, and as nothing needed by the paths waiting is evicted every call brings them closer
+	// to having all of their meshes resident
+	void FetchMeshes()
 	{
-		std::vector<Tile> tiles;
+		const int numMeshes = sceneGPU.numMeshes;
 
-		const int tilesx = (options.width + tileWidth - 1)/tileWidth;
-		const int tilesy = (options.height + tileHeight - 1)/tileHeight;
+		cudaMemcpy(&hostRequests[0], sceneGPU.meshRequests, sizeof(int)*numMeshes, cudaMemcpyDeviceToHost);
+		cudaMemcpy(&hostUses[0], sceneGPU.meshUses, sizeof(int)*numMeshes, cudaMemcpyDeviceToHost);
 
-		for (int y=0; y < tilesy; ++y)
+		cudaMemset(sceneGPU.meshRequests, 0, sizeof(int)*numMeshes);
+		cudaMemset(sceneGPU.meshUses, 0, sizeof(int)*numMeshes);
+
+		streamRound++;
+
+		for (int m=0; m < numMeshes; ++m)
+		{
+			if (hostUses[m] || hostRequests[m])
+				lastUsed[m] = streamRound;
+		}
+
+		int numUploaded = 0;
+
+		for (int m=0; m < numMeshes; ++m)
 		{
-			for (int x=0; x < tilesx; ++x)
+			const MeshGeometry& mesh = *tableMeshes[m];
+
+			if (!hostRequests[m] || gpuMeshes.count(mesh.id))
+				continue;
+
+			const size_t bytes = GPUMeshBytes(mesh);
+
+			while (residentBytes + bytes > meshBudget)
 			{
-				Tile tile;
-				tile.x = x*tileWidth;
-				tile.y = y*tileHeight;
+				int victim = -1;
 
-				tile.width = Min(tileWidth, options.width-tile.x);
-				tile.height = Min(tileHeight, options.height-tile.y);
+				for (int e=0; e < numMeshes; ++e)
+				{
+					if (pinned[e] || lastUsed[e] == streamRound || gpuMeshes.count(tableMeshes[e]->id) == 0)
+						continue;
+
+					if (victim < 0 || lastUsed[e] < lastUsed[victim])
+						victim = e;
+				}
+
+				if (victim < 0)
+					break;
+
+				std::map<unsigned long, MeshGeometry>::iterator iter = gpuMeshes.find(tableMeshes[victim]->id);
 
-				tiles.push_back(tile);
+				residentBytes -= GPUMeshBytes(iter->second);
+				DestroyGPUMesh(iter->second);
+				gpuMeshes.erase(iter);
+
+				SetTableEntry(victim, NonResidentMesh(*tableMeshes[victim]));
 			}
+
+			if (residentBytes + bytes > meshBudget && numUploaded > 0)
+				continue;
+
+			const MeshGeometry gpuMesh = CreateGPUMesh(mesh);
+
+			gpuMeshes.insert(std::make_pair(mesh.id, gpuMesh));
+			residentBytes += bytes;
+
+			SetTableEntry(m, gpuMesh);
+
+			numUploaded++;
+		}
+	}
+
+	// runs a stage again over the paths it deferred until the meshes they wait on are resident,
+	// deferred paths are left as they were so they trace the same rays once run again
+	void StreamPaths(int stage)
+	{
+		for (;;)
+		{
+			cudaMemcpy(hostCounts+eQueueStream, queueCounts+eQueueStream, sizeof(int), cudaMemcpyDeviceToHost);
+
+			const int count = hostCounts[eQueueStream];
+
+			if (count == 0)
+				break;
+
+			FetchMeshes();
+
+			// the waiting paths are rerun from the next queue, those still missing a mesh wait again
+			std::swap(queues[eQueueStream], queues[eQueueStreamNext]);
+
+			cudaMemcpy(queueCounts+eQueueStreamNext, queueCounts+eQueueStream, sizeof(int), cudaMemcpyDeviceToDevice);
+			cudaMemset(queueCounts+eQueueStream, 0, sizeof(int));
+
+			const int numBlocks = (count + kWaveBlockSize - 1)/kWaveBlockSize;
+
+			if (stage == eStageAdvance)
+				AdvancePaths<<<numBlocks, kWaveBlockSize>>>(sceneGPU, paths, queues[eQueueStreamNext], queueCounts+eQueueStreamNext, queues[eQueueLight], queueCounts+eQueueLight, queues[eQueueTerminate], queueCounts+eQueueTerminate, queues[eQueueStream], queueCounts+eQueueStream);
+			else
+				SampleLights<<<numBlocks, kWaveBlockSize>>>(sceneGPU, paths, queues[eQueueStreamNext], queueCounts+eQueueStreamNext, queues[eQueueStream], queueCounts+eQueueStream);
+
+			RecordEvent(stage);
+		}
+	}
+
+	// sorts the light queue, of at most n paths, by PathSortKey() so that paths are shaded
+	// next to paths that hit close by, returns the sorted queue
+	const int* Reorder(int n)
+	{
+		const int numBlocks = (n + kSortBlockSize - 1)/kSortBlockSize;
+
+		PathKeys<<<numBlocks, kSortBlockSize>>>(paths, queues[eQueueLight], queueCounts+eQueueLight, n, sceneGPU.primitives, sortBounds, sortKeys[0], sortValues[0]);
+
+		int current = 0;
+
+		for (int shift=0; shift < 32; shift += kSortRadixBits)
+		{
+			RadixCount<<<numBlocks, kSortBlockSize>>>(sortKeys[current], n, shift, sortCounts);
+			RadixScan<<<1, kSortBlockSize>>>(sortCounts, numBlocks*kSortRadix);
+			RadixScatter<<<numBlocks, kSortBlockSize>>>(sortKeys[current], sortValues[current], sortKeys[1-current], sortValues[1-current], n, shift, sortCounts);
+
+			current = 1-current;
+		}
+
+		return sortValues[current];
+	}
+
+	// regenerates the terminated paths then swaps the advance queues, the light and
+	// terminate queues start empty again, returns the length of the new advance queue
+	int NextBounce(const Camera& camera, const CameraSampler& sampler, const Options& options, int seed, int maxCount)
+	{
+		const int numBlocks = (maxCount + kWaveBlockSize - 1)/kWaveBlockSize;
+
+		if (numBlocks)
+		{
+			GeneratePaths<<<numBlocks, kWaveBlockSize>>>(camera, sampler, options.width, options.width*options.height, seed, paths, queues[eQueueTerminate], queueCounts+eQueueTerminate, queueCounts+eNumWaveQueues, queues[eQueueAdvanceNext], queueCounts+eQueueAdvanceNext);
+			RecordEvent(eStageGenerate);
 		}
 
-		const int numPaths = tileWidth*tileHeight;
+		std::swap(queues[eQueueAdvance], queues[eQueueAdvanceNext]);
+
+		cudaMemcpy(queueCounts+eQueueAdvance, queueCounts+eQueueAdvanceNext, sizeof(int), cudaMemcpyDeviceToDevice);
+
+		// the next advance, light, terminate and stream counts are contiguous
+		cudaMemset(queueCounts+eQueueAdvanceNext, 0, sizeof(int)*(eNumWaveQueues-eQueueAdvanceNext));
+
+		cudaMemcpy(hostCounts, queueCounts, sizeof(int)*(eNumWaveQueues+1), cudaMemcpyDeviceToHost);
+
+		return hostCounts[eQueueAdvance];
+	}
+	
+	void Init(int width, int height)
+	{
+		numPixels = width*height;
+
+		cudaFree(output);
+		cudaMalloc(&output, sizeof(Color)*width*height);
+		cudaMemset(output, 0, sizeof(Color)*width*height);
+	}
+
+	// frames add to the device accumulation so the restored samples only need uploading
+	bool Resume(const Color* accum)
+	{
+		cudaMemcpy(output, accum, sizeof(Color)*numPixels, cudaMemcpyHostToDevice);
+		return true;
+	}
+
+	void Render(const Camera& camera, const Options& options, Color* outputHost)
+	{
+		const int numSamples = options.width*options.height;
 
 		// create a sampler for the camera
 		CameraSampler sampler(
@@ -1331,57 +2287,103 @@ struct GpuWaveFrontRenderer : public Renderer
 			options.width,
 			options.height);
 
-		
-		for (int tileIndex=0; tileIndex < tiles.size(); ++tileIndex)
-		{
-			Tile tile = tiles[tileIndex];
+		const unsigned long long zero[kMaxWavefrontBounces] = { 0 };
 
-			// a tile consists of many thread blocks
-			const int blockWidth = 16;
-			const int blockHeight = 16;
+		cudaMemcpyToSymbol(g_stagePaths, zero, sizeof(g_stagePaths));
+		cudaMemcpyToSymbol(g_stageRays, zero, sizeof(g_stageRays));
+		cudaMemcpyToSymbol(g_activePaths, zero, sizeof(g_activePaths));
 
-			const int gridWidth = (tile.width + blockWidth - 1)/blockWidth;
-			const int gridHeight = (tile.height + blockHeight - 1)/blockHeight;
+		numEvents = 0;
+		RecordEvent(-1);
 
-			dim3 blockDim(blockWidth, blockHeight);
-			dim3 gridDim(gridWidth, gridHeight);
+		// processes rendering different sample ranges of a frame draw from separate streams
+		const int seed = Random(rand.Rand() + options.sampleOffset).Rand();
 
-			/*
-			const int kNumThreadsPerBlock = 256;
-			const int kNumBlocks = (numPaths + kNumThreadsPerBlock - 1)/kNumThreadsPerBlock;
-			
-			dim3 gridDim(kNumBlocks);
-			dim3 blockDim(kNumThreadsPerBlock);
-			*/
+		// the first regeneration fills every slot
+		cudaMemset(queueCounts, 0, sizeof(int)*(eNumWaveQueues+1));
+		FillQueue<<<(numPaths + kWaveBlockSize - 1)/kWaveBlockSize, kWaveBlockSize>>>(queues[eQueueTerminate], queueCounts+eQueueTerminate, numPaths);
+
+		int count = NextBounce(camera, sampler, options, seed, numPaths);
+		int numWaves = 0;
+
+		// each pass advances every live path by a bounce, paths that terminate are splatted
+		// and their slots regenerated, so passes only run short at the end of the frame
+		while (count > 0)
+		{
+			const int numBlocks = (count + kWaveBlockSize - 1)/kWaveBlockSize;
 
-			GeneratePaths<<<gridDim, blockDim>>>(camera, sampler, tile, rand.Rand(), paths, numPaths);
-	
 			if (options.mode == eNormals)
 			{
-				VisualizeNormals<<<gridDim, blockDim>>>(sceneGPU, paths, numPaths);
+				VisualizeNormals<<<numBlocks, kWaveBlockSize>>>(sceneGPU, paths, queues[eQueueAdvance], queueCounts+eQueueAdvance, queues[eQueueTerminate], queueCounts+eQueueTerminate);
+				RecordEvent(eStageAdvance);
 			}
 			else
 			{
-				for (int i=0; i < options.maxDepth; ++i)
+				AdvancePaths<<<numBlocks, kWaveBlockSize>>>(sceneGPU, paths, queues[eQueueAdvance], queueCounts+eQueueAdvance, queues[eQueueLight], queueCounts+eQueueLight, queues[eQueueTerminate], queueCounts+eQueueTerminate, queues[eQueueStream], queueCounts+eQueueStream);
+				RecordEvent(eStageAdvance);
+
+				if (meshBudget > 0)
+					StreamPaths(eStageAdvance);
+
+				// every path with a hit is in the light queue, at most all that advanced
+				const int* lightQueue = queues[eQueueLight];
+
+				if (options.reorderPaths)
 				{
-					AdvancePaths<<<gridDim, blockDim>>>(sceneGPU, paths, numPaths);
-					SampleLights<<<gridDim, blockDim>>>(sceneGPU, paths, numPaths);
-					//SampleProbes();
-					SampleBsdfs<<<gridDim, blockDim>>>(paths, numPaths);
+					lightQueue = Reorder(count);
+					RecordEvent(eStageReorder);
 				}
+
+				SampleLights<<<numBlocks, kWaveBlockSize>>>(sceneGPU, paths, lightQueue, queueCounts+eQueueLight, queues[eQueueStream], queueCounts+eQueueStream);
+				RecordEvent(eStageLights);
+
+				if (meshBudget > 0)
+					StreamPaths(eStageLights);
+
+				//SampleProbes();
+				SampleBsdfs<<<numBlocks, kWaveBlockSize>>>(sceneGPU, paths, lightQueue, queueCounts+eQueueLight, options.maxDepth, options.rouletteDepth, queues[eQueueAdvanceNext], queueCounts+eQueueAdvanceNext, queues[eQueueTerminate], queueCounts+eQueueTerminate);
+				RecordEvent(eStageBsdfs);
 			}
-			
 
-			TerminatePaths<<<gridDim, blockDim>>>(output, options, paths, numPaths);
+			// every path that terminated this pass was advanced by it
+			TerminatePaths<<<numBlocks, kWaveBlockSize>>>(output, options, paths, queues[eQueueTerminate], queueCounts+eQueueTerminate);
+			RecordEvent(eStageTerminate);
+
+			count = NextBounce(camera, sampler, options, seed, count);
+			numWaves++;
 		}
 
 		// copy back to output
 		cudaMemcpy(outputHost, output, sizeof(Color)*options.width*options.height, cudaMemcpyDeviceToHost);
+
+		// the copy waited for the frame so every event has completed
+		frameStats = WavefrontStats();
+		frameStats.numWaves = numWaves;
+		frameStats.pathsPerWave = numPaths;
+		frameStats.numBounces = options.mode == eNormals ? 0 : Min(options.maxDepth, kMaxWavefrontBounces);
+
+		for (int i=1; i < numEvents; ++i)
+		{
+			float ms;
+			cudaEventElapsedTime(&ms, events[i-1], events[i]);
+
+			frameStats.time[eventStages[i]] += ms;
+		}
+
+		cudaMemcpyFromSymbol(frameStats.paths, g_stagePaths, sizeof(g_stagePaths));
+		cudaMemcpyFromSymbol(frameStats.rays, g_stageRays, sizeof(g_stageRays));
+		cudaMemcpyFromSymbol(frameStats.activePaths, g_activePaths, sizeof(g_activePaths));
+
+		// every sample of the frame is generated and terminated once
+		frameStats.paths[eStageGenerate] = (unsigned long long)numSamples;
+		frameStats.paths[eStageTerminate] = (unsigned long long)numSamples;
+		frameStats.rays[eStageGenerate] = 0;
+		frameStats.rays[eStageTerminate] = 0;
 	}
 };
 
 
-Renderer* CreateGpuWavefrontRenderer(const Scene* s)
+Renderer* CreateGpuWavefrontRenderer(const Scene* s, size_t meshBudget)
 {
-	return new GpuWaveFrontRenderer(s);
+	return new GpuWaveFrontRenderer(s, meshBudget);
 }